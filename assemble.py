@@ -2,14 +2,41 @@
 """
 LC-3 Assembler
 Converts LC-3 assembly code to object files compatible with the LC-3 VM.
+
+It goes through the source once. Every line is tokenized one time and assembled straight away, and an operand
+naming a label further down gets a fixup: the word goes in with the offset left at 0, and once the whole file has
+been read the fixups are patched from the symbol table (and range checked, against the line that used the label).
+
+With --cache=DIR the result is kept in DIR under a hash of the source and of this file, and assembling the same
+source again reads it back from there instead.
+
+--relocatable writes a module for link.py instead of an image: no address of its own (a .ORIG is ignored), cut into
+sections where the labels named by .GLOBAL start, and with .EXTERNAL labels it expects another module to define.
+References inside a section are PC-relative and get assembled as usual, every other one (and every .FILL of a
+label) is left for the linker in the relocation table. The module is JSON:
+
+    format, version         "lc3-relocatable", 1
+    sections                [{name, words, open}], words as hex, 4 digits a word. open is true if the section ends
+                            in an instruction that carries on into the next section, the linker keeps the two together
+    symbols                 {label: [section, offset]}, every label of the module
+    globals, externals      the labels .GLOBAL and .EXTERNAL named
+    relocations             [[section, offset, kind, label]], kind is pc9 (BR, LD, ST, LDI, STI, LEA), pc11 (JSR) or
+                            abs16 (.FILL), and the field in the word is 0 until the linker fills it in
 """
 
 import sys
+import os
 import re
+import bisect
+import json
+import hashlib
 import struct
 from typing import Dict, List, Tuple, Optional, Union
 from enum import Enum
 
+SEPARATORS = re.compile(r'[\s,]+')
+NATIVE_SEGMENT_DATA = 1  # a native image segment of data words, not instructions (see lc3_image.c)
+
 class TokenType(Enum):
     DIRECTIVE = "directive"
     INSTRUCTION = "instruction"
@@ -20,6 +47,18 @@ class TokenType(Enum):
     COMMENT = "comment"
     NEWLINE = "newline"
 
+class Fixup:
+    """An operand naming a label that was not defined yet: the word it goes into and how to work it out"""
+    __slots__ = ('memory', 'index', 'pc', 'line_number', 'token', 'bits', 'what', 'undefined')
+    
+    def __init__(self, memory: List[int], index: int, pc: int, line_number: int, token: str, bits: int,
+                 what: str, undefined: str):
+        self.memory, self.index, self.pc = memory, index, pc
+        self.line_number, self.token = line_number, token
+        self.bits = bits            # width of the PCoffset, 16 for a .FILL (the address itself)
+        self.what = what            # the instruction, for the range error
+        self.undefined = undefined  # the error if it never gets defined
+
 class LC3Assembler:
     def __init__(self):
         # Instruction opcodes
@@ -66,12 +105,36 @@ class LC3Assembler:
         # Origin address
         self.origin = 0x3000
         
-        # Memory for assembled code
+        # Memory for assembled code, the words of the segment being assembled
         self.memory: List[int] = []
         
+        # Every .ORIG starts a segment: (origin, words)
+        self.segments: List[Tuple[int, List[int]]] = []
+        
         # Current line number for error reporting
         self.line_number = 0
         
+        # Operands that named a label nobody had defined yet, patched by resolve_fixups()
+        self.fixups: List[Fixup] = []
+        
+        # --relocatable: the module for link.py instead of an image
+        self.relocatable = False
+        self.module_name = ''
+        self.globals: Dict[str, int] = {}       # label -> line of its .GLOBAL
+        self.externals: Dict[str, int] = {}     # label -> line of its .EXTERNAL
+        self.code_words: set = set()            # addresses of the words that are instructions (offsets in a module)
+        self.section_starts: List[int] = [0]
+        self.relocations: List[Tuple[int, int, str, str]] = []
+        self.module: Optional[dict] = None
+        
+        self.handlers = {
+            'ADD': self.assemble_add, 'AND': self.assemble_and, 'NOT': self.assemble_not,
+            'LD': self.assemble_ld, 'ST': self.assemble_st, 'JSR': self.assemble_jsr, 'JSRR': self.assemble_jsr,
+            'JMP': self.assemble_jmp, 'RET': self.assemble_jmp, 'LDR': self.assemble_ldr, 'STR': self.assemble_str,
+            'LDI': self.assemble_ldi, 'STI': self.assemble_sti, 'LEA': self.assemble_lea,
+            'TRAP': self.assemble_trap, 'RTI': self.assemble_rti
+        }
+        
     def error(self, message: str) -> None:
         """Print error message and exit"""
         print(f"Error on line {self.line_number}: {message}", file=sys.stderr)
@@ -123,7 +186,7 @@ class LC3Assembler:
             line = line[:line.index(';')]
         
         # Split by whitespace and commas
-        tokens = re.split(r'[\s,]+', line.strip())
+        tokens = SEPARATORS.split(line.strip())
         return [token for token in tokens if token]
         
     def is_register(self, token: str) -> bool:
@@ -148,6 +211,115 @@ class LC3Assembler:
         except ValueError:
             self.error(f"Invalid immediate value: {token}")
             
+    def pc_offset(self, token: str, bits: int, what: str, undefined: str = '') -> int:
+        """The PCoffset field for a label or a number. A label that is not defined yet gets a fixup, and 0 until then"""
+        if token in self.symbol_table and not self.relocatable:
+            offset = self.symbol_table[token] - (self.pc + 1)
+        elif token.isidentifier():
+            # a label further down, or a number like x10 if no label of that name turns up. In a relocatable module
+            # every label waits, which section it is in is only known at the end
+            self.fixups.append(Fixup(self.memory, len(self.memory), self.pc, self.line_number, token, bits, what,
+                                     undefined or f"Invalid immediate value: {token}"))
+            return 0
+        elif undefined:
+            try:
+                offset = self.parse_number(token)
+            except ValueError:
+                self.error(undefined)
+        else:
+            offset = self.parse_immediate(token)
+            
+        if not self.check_range(offset, bits):
+            self.error(f"{what} offset out of range: {offset}")
+            
+        return offset & ((1 << bits) - 1)
+        
+    def resolve_fixups(self) -> None:
+        """Patches the operands that named labels, now that all of them are defined"""
+        if self.relocatable:
+            self.find_sections()
+        for fixup in self.fixups:
+            self.line_number = fixup.line_number
+            if self.relocatable and self.relocate(fixup):
+                continue
+            if fixup.token in self.symbol_table:
+                value = self.symbol_table[fixup.token]
+                offset = value if fixup.bits == 16 else value - (fixup.pc + 1)
+            else:
+                try:
+                    offset = self.parse_number(fixup.token)
+                except ValueError:
+                    self.error(fixup.undefined)
+            if fixup.bits == 16:
+                offset &= 0xFFFF  # .FILL
+            elif not self.check_range(offset, fixup.bits):
+                self.error(f"{fixup.what} offset out of range: {offset}")
+            fixup.memory[fixup.index] |= offset & ((1 << fixup.bits) - 1)
+        self.fixups = []
+        
+    def find_sections(self) -> None:
+        """Where the sections of a relocatable module start: at 0, and at every .GLOBAL label"""
+        for label, line_number in self.globals.items():
+            if label not in self.symbol_table:
+                self.line_number = line_number
+                self.error(f".GLOBAL label is not defined: {label}")
+        for label, line_number in self.externals.items():
+            if label in self.symbol_table:
+                self.line_number = line_number
+                self.error(f".EXTERNAL label is defined in this module: {label}")
+        self.section_starts = sorted({0} | {self.symbol_table[label] for label in self.globals})
+        
+    def section_of(self, offset: int) -> int:
+        return bisect.bisect_right(self.section_starts, offset) - 1
+        
+    def relocate(self, fixup: Fixup) -> bool:
+        """A reference in a relocatable module: assembled if it stays inside its section, else a relocation"""
+        if fixup.token in self.externals:
+            target_section = -1
+        elif fixup.token in self.symbol_table:
+            target_section = self.section_of(self.symbol_table[fixup.token])
+        else:
+            return False  # a number after all
+        section = self.section_of(fixup.index)
+        if fixup.bits == 16 or target_section != section:
+            kind = {9: 'pc9', 11: 'pc11', 16: 'abs16'}[fixup.bits]
+            self.relocations.append((section, fixup.index - self.section_starts[section], kind, fixup.token))
+            return True
+        offset = self.symbol_table[fixup.token] - (fixup.pc + 1)
+        if not self.check_range(offset, fixup.bits):
+            self.error(f"{fixup.what} offset out of range: {offset}")
+        fixup.memory[fixup.index] |= offset & ((1 << fixup.bits) - 1)
+        return True
+        
+    def ends_open(self, end: int) -> bool:
+        """Whether the section ending at end carries on into the next: its last word is an instruction that can"""
+        if end - 1 not in self.code_words:
+            return False  # data, nothing runs into the next section from here without running the data first
+        word = self.memory[end - 1]
+        op = word >> 12
+        always_taken = (op == 0 and word & 0x0E00 == 0x0E00) or op == 12 or op == 8 or word == 0xF025
+        return not always_taken  # BRnzp, JMP/RET, RTI and HALT do not
+        
+    def relocatable_module(self) -> dict:
+        """The module --relocatable writes (see the top of this file)"""
+        names = {}
+        for label in self.globals:
+            names.setdefault(self.symbol_table[label], label)
+        sections = []
+        starts = self.section_starts + [len(self.memory)]
+        for i in range(len(self.section_starts)):
+            start, end = starts[i], starts[i + 1]
+            words = struct.pack(f'>{end - start}H', *[word & 0xFFFF for word in self.memory[start:end]])
+            sections.append({'name': names.get(start, self.module_name), 'words': words.hex(),
+                             'open': self.ends_open(end) if end > start else False})
+        symbols = {}
+        for label, offset in self.symbol_table.items():
+            section = self.section_of(offset)
+            symbols[label] = [section, offset - self.section_starts[section]]
+        return {'format': 'lc3-relocatable', 'version': 1, 'sections': sections, 'symbols': symbols,
+                'globals': list(self.globals), 'externals': list(self.externals),
+                'relocations': [list(r) for r in self.relocations]}
+        
     def assemble_br(self, tokens: List[str]) -> int:
         """Assemble branch instruction"""
         if len(tokens) != 2:
@@ -169,18 +341,7 @@ class LC3Assembler:
             n = z = p = 1
             
         # Parse offset
-        if tokens[1] in self.symbol_table:
-            offset = self.symbol_table[tokens[1]] - (self.pc + 1)
-        else:
-            try:
-                offset = self.parse_immediate(tokens[1])
-            except:
-                self.error(f"Undefined label or invalid offset: {tokens[1]}")
-                
-        if not self.check_range(offset, 9):
-            self.error(f"Branch offset out of range: {offset}")
-            
-        offset = offset & 0x1FF  # 9 bits
+        offset = self.pc_offset(tokens[1], 9, "Branch", f"Undefined label or invalid offset: {tokens[1]}")
         
         return (0 << 12) | (n << 11) | (z << 10) | (p << 9) | offset
         
@@ -244,15 +405,7 @@ class LC3Assembler:
         dr = self.parse_register(tokens[1])
         
         # Parse offset
-        if tokens[2] in self.symbol_table:
-            offset = self.symbol_table[tokens[2]] - (self.pc + 1)
-        else:
-            offset = self.parse_immediate(tokens[2])
-            
-        if not self.check_range(offset, 9):
-            self.error(f"LD offset out of range: {offset}")
-            
-        offset = offset & 0x1FF  # 9 bits
+        offset = self.pc_offset(tokens[2], 9, "LD")
         
         return (2 << 12) | (dr << 9) | offset
         
@@ -264,15 +417,7 @@ class LC3Assembler:
         sr = self.parse_register(tokens[1])
         
         # Parse offset
-        if tokens[2] in self.symbol_table:
-            offset = self.symbol_table[tokens[2]] - (self.pc + 1)
-        else:
-            offset = self.parse_immediate(tokens[2])
-            
-        if not self.check_range(offset, 9):
-            self.error(f"ST offset out of range: {offset}")
-            
-        offset = offset & 0x1FF  # 9 bits
+        offset = self.pc_offset(tokens[2], 9, "ST")
         
         return (3 << 12) | (sr << 9) | offset
         
@@ -287,15 +432,7 @@ class LC3Assembler:
             return (4 << 12) | (base_r << 6)
         else:
             # JSR - PC-relative mode
-            if tokens[1] in self.symbol_table:
-                offset = self.symbol_table[tokens[1]] - (self.pc + 1)
-            else:
-                offset = self.parse_immediate(tokens[1])
-                
-            if not self.check_range(offset, 11):
-                self.error(f"JSR offset out of range: {offset}")
-                
-            offset = offset & 0x7FF  # 11 bits
+            offset = self.pc_offset(tokens[1], 11, "JSR")
             
             return (4 << 12) | (1 << 11) | offset
             
@@ -350,15 +487,7 @@ class LC3Assembler:
         dr = self.parse_register(tokens[1])
         
         # Parse offset
-        if tokens[2] in self.symbol_table:
-            offset = self.symbol_table[tokens[2]] - (self.pc + 1)
-        else:
-            offset = self.parse_immediate(tokens[2])
-            
-        if not self.check_range(offset, 9):
-            self.error(f"LDI offset out of range: {offset}")
-            
-        offset = offset & 0x1FF  # 9 bits
+        offset = self.pc_offset(tokens[2], 9, "LDI")
         
         return (10 << 12) | (dr << 9) | offset
         
@@ -370,15 +499,7 @@ class LC3Assembler:
         sr = self.parse_register(tokens[1])
         
         # Parse offset
-        if tokens[2] in self.symbol_table:
-            offset = self.symbol_table[tokens[2]] - (self.pc + 1)
-        else:
-            offset = self.parse_immediate(tokens[2])
-            
-        if not self.check_range(offset, 9):
-            self.error(f"STI offset out of range: {offset}")
-            
-        offset = offset & 0x1FF  # 9 bits
+        offset = self.pc_offset(tokens[2], 9, "STI")
         
         return (11 << 12) | (sr << 9) | offset
         
@@ -390,15 +511,7 @@ class LC3Assembler:
         dr = self.parse_register(tokens[1])
         
         # Parse offset
-        if tokens[2] in self.symbol_table:
-            offset = self.symbol_table[tokens[2]] - (self.pc + 1)
-        else:
-            offset = self.parse_immediate(tokens[2])
-            
-        if not self.check_range(offset, 9):
-            self.error(f"LEA offset out of range: {offset}")
-            
-        offset = offset & 0x1FF  # 9 bits
+        offset = self.pc_offset(tokens[2], 9, "LEA")
         
         return (14 << 12) | (dr << 9) | offset
         
@@ -429,40 +542,14 @@ class LC3Assembler:
         """Assemble a single instruction"""
         opcode = tokens[0].upper()
         
-        if opcode.startswith('BR'):
+        handler = self.handlers.get(opcode)
+        if handler:
+            return handler(tokens)
+        elif opcode.startswith('BR'):
             return self.assemble_br(tokens)
-        elif opcode == 'ADD':
-            return self.assemble_add(tokens)
-        elif opcode == 'AND':
-            return self.assemble_and(tokens)
-        elif opcode == 'NOT':
-            return self.assemble_not(tokens)
-        elif opcode == 'LD':
-            return self.assemble_ld(tokens)
-        elif opcode == 'ST':
-            return self.assemble_st(tokens)
-        elif opcode in ['JSR', 'JSRR']:
-            return self.assemble_jsr(tokens)
-        elif opcode in ['JMP', 'RET']:
-            return self.assemble_jmp(tokens)
-        elif opcode == 'LDR':
-            return self.assemble_ldr(tokens)
-        elif opcode == 'STR':
-            return self.assemble_str(tokens)
-        elif opcode == 'LDI':
-            return self.assemble_ldi(tokens)
-        elif opcode == 'STI':
-            return self.assemble_sti(tokens)
-        elif opcode == 'LEA':
-            return self.assemble_lea(tokens)
-        elif opcode == 'TRAP' or opcode in self.trap_vectors:
-            if opcode in self.trap_vectors:
-                # Handle named traps like HALT, GETC, etc.
-                return self.assemble_trap(['TRAP', opcode])
-            else:
-                return self.assemble_trap(tokens)
-        elif opcode == 'RTI':
-            return self.assemble_rti(tokens)
+        elif opcode in self.trap_vectors:
+            # Handle named traps like HALT, GETC, etc.
+            return self.assemble_trap(['TRAP', opcode])
         else:
             self.error(f"Unknown instruction: {opcode}")
             
@@ -473,6 +560,11 @@ class LC3Assembler:
         if directive == '.ORIG':
             if len(tokens) != 2:
                 self.error(".ORIG directive requires exactly 1 operand")
+            if self.relocatable:
+                # the linker decides where the module goes
+                if self.memory:
+                    self.error("a relocatable module is one segment, .ORIG can only come before the first word")
+                return None
             self.origin = self.parse_immediate(tokens[1])
             self.pc = self.origin
             return None
@@ -480,8 +572,13 @@ class LC3Assembler:
         elif directive == '.FILL':
             if len(tokens) != 2:
                 self.error(".FILL directive requires exactly 1 operand")
-            if tokens[1] in self.symbol_table:
+            if tokens[1] in self.symbol_table and not self.relocatable:
                 return self.symbol_table[tokens[1]]
+            elif tokens[1].isidentifier():
+                # a label further down
+                self.fixups.append(Fixup(self.memory, len(self.memory), self.pc, self.line_number, tokens[1], 16,
+                                         ".FILL", f"Invalid immediate value: {tokens[1]}"))
+                return 0
             else:
                 return self.parse_immediate(tokens[1]) & 0xFFFF
                 
@@ -531,24 +628,34 @@ class LC3Assembler:
         elif directive == '.END':
             return None
             
+        elif directive in ('.GLOBAL', '.EXTERNAL'):
+            # labels other modules can use, and ones this module uses from others (--relocatable)
+            if len(tokens) < 2:
+                self.error(f"{directive} directive requires at least one label")
+            if directive == '.EXTERNAL' and not self.relocatable:
+                self.error(".EXTERNAL labels are for the linker, assemble with --relocatable")
+            for label in tokens[1:]:
+                (self.globals if directive == '.GLOBAL' else self.externals).setdefault(label, self.line_number)
+            return None
+            
         else:
             self.error(f"Unknown directive: {directive}")
             
-    def first_pass(self, lines: List[str]) -> None:
-        """First pass: build symbol table"""
+    def assemble_lines(self, lines: List[str]) -> None:
+        """Assembles the source in one pass, the labels used before their line are patched in at the end"""
+        if self.relocatable:
+            self.origin = 0  # offsets in the module
         self.pc = self.origin
+        self.memory = []
+        self.segments = [(self.origin, self.memory)]
+        self.fixups = []
         
         for line_num, line in enumerate(lines):
             self.line_number = line_num + 1
             
-            # Skip empty lines and comments
-            line = line.strip()
-            if not line or line.startswith(';'):
-                continue
-                
             tokens = self.tokenize_line(line)
             if not tokens:
-                continue
+                continue  # empty lines and comments
                 
             # Check for label
             if tokens[0].endswith(':'):
@@ -561,66 +668,11 @@ class LC3Assembler:
             if not tokens:
                 continue
                 
-            # Check if it's a directive
-            if tokens[0].startswith('.'):
-                if tokens[0].upper() == '.ORIG':
-                    self.origin = self.parse_immediate(tokens[1])
-                    self.pc = self.origin
-                elif tokens[0].upper() == '.BLKW':
-                    count = self.parse_immediate(tokens[1])
-                    self.pc += count
-                elif tokens[0].upper() == '.STRINGZ':
-                    string_content = ' '.join(tokens[1:])
-                    if string_content.startswith('"') and string_content.endswith('"'):
-                        string_content = string_content[1:-1]
-                        # Count characters (including escape sequences)
-                        char_count = 0
-                        i = 0
-                        while i < len(string_content):
-                            if string_content[i] == '\\' and i + 1 < len(string_content):
-                                i += 2
-                            else:
-                                i += 1
-                            char_count += 1
-                        self.pc += char_count + 1  # +1 for null terminator
-                    else:
-                        self.pc += 1  # Assume single word for error recovery
-                elif tokens[0].upper() in ['.FILL', '.END']:
-                    if tokens[0].upper() == '.FILL':
-                        self.pc += 1
-                else:
-                    self.error(f"Unknown directive: {tokens[0]}")
-            else:
-                # It's an instruction
-                self.pc += 1
-                
-    def second_pass(self, lines: List[str]) -> None:
-        """Second pass: generate machine code"""
-        self.pc = self.origin
-        self.memory = []
-        
-        for line_num, line in enumerate(lines):
-            self.line_number = line_num + 1
-            
-            # Skip empty lines and comments
-            line = line.strip()
-            if not line or line.startswith(';'):
-                continue
-                
-            tokens = self.tokenize_line(line)
-            if not tokens:
-                continue
-                
-            # Skip label
-            if tokens[0].endswith(':'):
-                tokens = tokens[1:]
-                
-            if not tokens:
-                continue
-                
             # Process directive or instruction
             if tokens[0].startswith('.'):
                 result = self.process_directive(tokens)
+                if tokens[0].upper() == '.ORIG' and not self.relocatable:
+                    self.start_segment()
                 if result is not None:
                     if isinstance(result, list):
                         self.memory.extend(result)
@@ -631,60 +683,177 @@ class LC3Assembler:
             else:
                 # Assemble instruction
                 machine_code = self.assemble_instruction(tokens)
+                self.code_words.add(self.pc)
                 self.memory.append(machine_code)
                 self.pc += 1
                 
-    def assemble_file(self, input_file: str, output_file: str) -> None:
+        self.resolve_fixups()
+        
+    def start_segment(self) -> None:
+        """Start a new segment at the current origin"""
+        if not self.segments[-1][1]:
+            self.segments.pop()  # nothing was assembled into the last one
+        self.memory = []
+        self.segments.append((self.origin, self.memory))
+        
+    def assemble_file(self, input_file: str, output_file: str, native: bool = False,
+                      cache_dir: Optional[str] = None, relocatable: bool = False) -> None:
         """Assemble a file"""
+        self.relocatable = relocatable
+        self.module_name = os.path.splitext(os.path.basename(input_file))[0]
         try:
-            with open(input_file, 'r') as f:
-                lines = f.readlines()
+            with open(input_file, 'rb') as f:
+                source = f.read()
         except IOError as e:
             print(f"Error reading input file: {e}", file=sys.stderr)
             sys.exit(1)
             
-        # First pass: build symbol table
-        self.first_pass(lines)
-        
-        # Second pass: generate machine code
-        self.second_pass(lines)
+        key = cache_key(source + (b'\0relocatable ' + self.module_name.encode() if relocatable else b'')) \
+            if cache_dir else None
+        if not (key and self.load_cached(cache_dir, key)):
+            # the line breaks reading in text mode would have given
+            self.assemble_lines(source.decode().replace('\r\n', '\n').replace('\r', '\n').split('\n'))
+            if relocatable:
+                self.module = self.relocatable_module()
+            if key:
+                self.save_cached(cache_dir, key)
         
         # Write output file
-        self.write_obj_file(output_file)
+        if relocatable:
+            self.write_relocatable_file(output_file)
+        elif native:
+            self.write_native_file(output_file)
+        else:
+            self.write_obj_file(output_file)
         
     def write_obj_file(self, filename: str) -> None:
         """Write object file in LC-3 format"""
+        segments = [segment for segment in self.segments if segment[1]]
+        if len(segments) > 1:
+            print("Error: a .obj file holds one .ORIG segment, use --native for more", file=sys.stderr)
+            sys.exit(1)
+        origin, memory = segments[0] if segments else (self.origin, [])
         try:
             with open(filename, 'wb') as f:
                 # Write origin (big-endian)
-                f.write(struct.pack('>H', self.origin))
+                f.write(struct.pack('>H', origin))
                 
                 # Write machine code (big-endian)
-                for word in self.memory:
-                    f.write(struct.pack('>H', word & 0xFFFF))
+                f.write(struct.pack(f'>{len(memory)}H', *[word & 0xFFFF for word in memory]))
                     
         except IOError as e:
             print(f"Error writing output file: {e}", file=sys.stderr)
             sys.exit(1)
             
+    def native_segments(self) -> List[Tuple[int, int, List[int]]]:
+        """The segments cut where instructions and data meet, as (origin, flags, words)"""
+        segments = []
+        for origin, memory in self.segments:
+            start = 0
+            for i in range(1, len(memory) + 1):
+                if i == len(memory) or ((origin + i) in self.code_words) != ((origin + start) in self.code_words):
+                    data = (origin + start) not in self.code_words
+                    segments.append((origin + start, NATIVE_SEGMENT_DATA if data else 0, memory[start:i]))
+                    start = i
+        return segments
+        
+    def write_native_file(self, filename: str) -> None:
+        """Write a native image: every segment, in this machine's byte order (see lc3_image.c). The words of
+        .FILL, .BLKW and .STRINGZ go in segments of their own marked as data, for the VM's analysis"""
+        segments = self.native_segments()
+        try:
+            with open(filename, 'wb') as f:
+                f.write(struct.pack('=4sHH', b'LC3N', 0x0102, len(segments)))
+                for origin, flags, memory in segments:
+                    f.write(struct.pack('=HHI', origin, flags, len(memory)))
+                    f.write(struct.pack(f'={len(memory)}H', *[word & 0xFFFF for word in memory]))
+                    
+        except IOError as e:
+            print(f"Error writing output file: {e}", file=sys.stderr)
+            sys.exit(1)
+            
+    def load_cached(self, cache_dir: str, key: str) -> bool:
+        """Takes the segments and symbols from the cache, if it has this source"""
+        try:
+            with open(os.path.join(cache_dir, key + '.json')) as f:
+                cached = json.load(f)
+            self.origin = cached['origin']
+            self.segments = [(origin, list(struct.unpack(f'<{len(words) // 4}H', bytes.fromhex(words))))
+                             for origin, words in cached['segments']]
+            self.symbol_table = cached['symbols']
+            self.code_words = set(cached['code'])
+            self.module = cached.get('module')
+            if self.relocatable and not self.module:
+                return False
+        except (OSError, ValueError, KeyError, TypeError, struct.error):
+            return False  # not there, or not readable, it gets assembled
+        return True
+        
+    def save_cached(self, cache_dir: str, key: str) -> None:
+        """Keeps the segments and symbols for next time, a cache that cannot be written only costs the time"""
+        cached = {
+            'origin': self.origin,
+            'segments': [(origin, struct.pack(f'<{len(memory)}H', *[word & 0xFFFF for word in memory]).hex())
+                         for origin, memory in self.segments],
+            'symbols': self.symbol_table,
+            'code': sorted(self.code_words),
+            'module': self.module
+        }
+        try:
+            os.makedirs(cache_dir, exist_ok=True)
+            temp = os.path.join(cache_dir, f'{key}.{os.getpid()}.tmp')
+            with open(temp, 'w') as f:
+                json.dump(cached, f)
+            os.replace(temp, os.path.join(cache_dir, key + '.json'))  # a build running next to this one never sees half of it
+        except OSError:
+            pass
+            
+    def write_relocatable_file(self, filename: str) -> None:
+        """Write the module for link.py"""
+        try:
+            with open(filename, 'w') as f:
+                json.dump(self.module, f)
+                f.write('\n')
+        except IOError as e:
+            print(f"Error writing output file: {e}", file=sys.stderr)
+            sys.exit(1)
+            
     def print_symbol_table(self) -> None:
         """Print symbol table for debugging"""
         print("Symbol Table:")
         for symbol, address in sorted(self.symbol_table.items()):
             print(f"  {symbol}: x{address:04X}")
             
+def cache_key(source: bytes) -> str:
+    """What the cache keeps an assembled source under: its hash, and this file's, so a changed assembler starts over"""
+    with open(os.path.abspath(__file__), 'rb') as f:
+        assembler = f.read()
+    return hashlib.sha256(assembler + b'\0' + source).hexdigest()
+    
 def main():
-    if len(sys.argv) != 3:
-        print("Usage: python lc3_assembler.py <input.asm> <output.obj>", file=sys.stderr)
+    args = sys.argv[1:]
+    native = '--native' in args  # write a native image instead of a .obj file
+    if native:
+        args.remove('--native')
+    relocatable = '--relocatable' in args  # a module for link.py
+    if relocatable:
+        args.remove('--relocatable')
+    cache_dir = None  # --cache=DIR keeps what it assembled in DIR
+    for arg in [arg for arg in args if arg.startswith('--cache=')]:
+        cache_dir = arg[8:]
+        args.remove(arg)
+    if len(args) != 2:
+        print("Usage: python lc3_assembler.py [--native | --relocatable] [--cache=DIR] <input.asm> <output.obj>",
+              file=sys.stderr)
         sys.exit(1)
         
-    input_file = sys.argv[1]
-    output_file = sys.argv[2]
+    input_file = args[0]
+    output_file = args[1]
     
     assembler = LC3Assembler()
     
     try:
-        assembler.assemble_file(input_file, output_file)
+        assembler.assemble_file(input_file, output_file, native, cache_dir, relocatable)
         print(f"Assembly successful: {input_file} -> {output_file}")
         
         # Optionally print symbol table
@@ -0,0 +1,240 @@
+#!/usr/bin/env python3
+"""
+Throughput benchmarks for the LC-3 engines.
+
+Assembles the kernels in this directory with assemble.py and runs every one of them on every engine: the switch
+interpreter, the threaded interpreter and the JIT of the C VM (built with its --stats option, which reports the
+instructions it executed and the processor time they took), and the Python core the debugger falls back to without
+liblc3. For each run it reports millions of instructions per second, host cycles per LC-3 instruction and peak RSS,
+and checks that all the engines printed the same thing.
+
+    gcc -O2 -o lc3_vm lc3_vm.c lc3_io.c ... -lpthread   (see README.md)
+    python3 bench/bench.py                            all kernels, all engines, best of 3 runs
+    python3 bench/bench.py --save=base.json           ... and keep the numbers
+    python3 bench/bench.py --baseline=base.json       exits 1 if an engine got more than 10% slower on a kernel
+
+The Python core is too slow to run the kernels to the end, it runs the first --python-steps instructions of each.
+CPI is worked out from the clock rate in /proc/cpuinfo (or --ghz), which frequency scaling makes approximate.
+"""
+
+import argparse
+import json
+import os
+import re
+import subprocess
+import sys
+import tempfile
+import time
+import hashlib
+from typing import Dict, List, Optional
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+REPO_DIR = os.path.dirname(BENCH_DIR)
+
+KERNELS = ['sieve', 'bubble', 'memcpy', 'fib', 'puts']
+ENGINES = ['switch', 'threaded', 'jit', 'python']
+
+STATS = re.compile(r'(\d+) instructions in ([0-9.]+) s')
+
+
+class Result:
+    """One kernel on one engine, the best of the runs"""
+
+    def __init__(self, kernel: str, engine: str):
+        self.kernel, self.engine = kernel, engine
+        self.instructions = 0
+        self.seconds: Optional[float] = None
+        self.peak_rss = 0           # bytes, 0 if the platform does not tell
+        self.output_hash = ''
+        self.complete = True        # False if it stopped before the program halted (the Python core)
+        self.error = ''
+
+    def mips(self) -> float:
+        return self.instructions / self.seconds / 1e6 if self.seconds else 0.0
+
+    def cpi(self, hz: float) -> Optional[float]:
+        return self.seconds * hz / self.instructions if self.seconds and hz and self.instructions else None
+
+
+def assemble(kernel: str, out_dir: str) -> str:
+    """Assembles bench/<kernel>.asm, returns the path of the .obj file"""
+    source = os.path.join(BENCH_DIR, kernel + '.asm')
+    image = os.path.join(out_dir, kernel + '.obj')
+    done = subprocess.run([sys.executable, os.path.join(REPO_DIR, 'assemble.py'), source, image],
+                          stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    if done.returncode != 0 or not os.path.exists(image):
+        sys.exit(f"failed to assemble {source}: {done.stderr.decode(errors='replace').strip()}")
+    return image
+
+
+def run_once(command: List[str], result: Result) -> None:
+    """Runs command with no input, and folds its --stats line, peak RSS and output into result"""
+    with tempfile.TemporaryFile() as out, tempfile.TemporaryFile() as err:
+        process = subprocess.Popen(command, stdin=subprocess.DEVNULL, stdout=out, stderr=err)
+        if hasattr(os, 'wait4'):
+            _, status, usage = os.wait4(process.pid, 0)
+            process.returncode = os.waitstatus_to_exitcode(status)
+            # kilobytes on Linux, bytes on macOS
+            rss = usage.ru_maxrss * (1 if sys.platform == 'darwin' else 1024)
+            result.peak_rss = max(result.peak_rss, rss)
+        else:
+            process.wait()
+        out.seek(0)
+        err.seek(0)
+        output, errors = out.read(), err.read().decode(errors='replace')
+
+    stats = STATS.search(errors)
+    # 3 is a run that --steps ended before the program halted
+    if process.returncode not in (0, 3) or not stats:
+        result.error = errors.strip().splitlines()[-1] if errors.strip() else f"exit code {process.returncode}"
+        return
+    result.instructions = int(stats.group(1))
+    seconds = float(stats.group(2))
+    if result.seconds is None or seconds < result.seconds:
+        result.seconds = seconds
+    result.output_hash = hashlib.sha1(output).hexdigest()
+    result.complete = process.returncode == 0
+
+
+def run_kernel(kernel: str, image: str, engine: str, args: argparse.Namespace) -> Result:
+    result = Result(kernel, engine)
+    if engine == 'python':
+        command = [sys.executable, os.path.abspath(__file__), '--python-child', image, str(args.python_steps)]
+    else:
+        command = [args.vm, f'--engine={engine}', '--stats', image]
+    for _ in range(args.runs):
+        run_once(command, result)
+        if result.error:
+            break
+    return result
+
+
+def python_child(image: str, max_steps: int) -> int:
+    """--python-child: runs image on the debugger's Python core and reports like lc3_vm --stats"""
+    sys.path.insert(0, REPO_DIR)
+    sys.dont_write_bytecode = True  # no __pycache__ left in the repo
+    try:
+        from lc3_debugger import LC3VirtualMachine  # the debugger module needs tkinter to import
+    except ImportError as e:
+        print(f"cannot load the Python core: {e}", file=sys.stderr)
+        return 2
+    vm = LC3VirtualMachine()
+    with open(image, 'rb') as f:
+        if not vm.load_program(f.read()):
+            print(f"failed to load image: {image}", file=sys.stderr)
+            return 2
+
+    steps = 0
+    started = time.process_time()
+    while steps < max_steps and vm.step():
+        steps += 1
+    seconds = time.process_time() - started
+    steps += vm.halted  # the HALT that stopped it ran too
+
+    sys.stdout.write(''.join(vm.output_buffer))
+    mips = steps / seconds / 1e6 if seconds > 0 else 0.0
+    print(f"{steps} instructions in {seconds:.3f} s, {mips:.1f} MIPS", file=sys.stderr)
+    return 0 if vm.halted else 3
+
+
+def clock_hz(args: argparse.Namespace) -> float:
+    """The host's clock rate, 0 if it is not known"""
+    if args.ghz:
+        return args.ghz * 1e9
+    try:
+        with open('/proc/cpuinfo') as f:
+            for line in f:
+                if line.startswith('cpu MHz'):
+                    return float(line.split(':')[1]) * 1e6
+    except (OSError, ValueError):
+        pass
+    return 0.0
+
+
+def report(results: List[Result], hz: float) -> None:
+    print(f"{'kernel':<8} {'engine':<9} {'instructions':>13} {'seconds':>8} {'MIPS':>8} {'CPI':>6} {'peak RSS':>9}")
+    for r in results:
+        if r.error:
+            print(f"{r.kernel:<8} {r.engine:<9} failed: {r.error}")
+            continue
+        cpi = r.cpi(hz)
+        cpi_text = f"{cpi:6.1f}" if cpi is not None else f"{'-':>6}"
+        rss_text = f"{r.peak_rss / (1 << 20):7.1f}MB" if r.peak_rss else f"{'-':>9}"
+        partial = '' if r.complete else '  (first instructions only)'
+        print(f"{r.kernel:<8} {r.engine:<9} {r.instructions:>13} {r.seconds:>8.3f} {r.mips():>8.1f} {cpi_text} {rss_text}{partial}")
+
+
+def check_outputs(results: List[Result]) -> int:
+    """Prints the kernels some engine printed something different for, returns how many"""
+    mismatches = 0
+    for kernel in dict.fromkeys(r.kernel for r in results):
+        done = [r for r in results if r.kernel == kernel and r.complete and not r.error]
+        for r in done[1:]:
+            if r.output_hash != done[0].output_hash or r.instructions != done[0].instructions:
+                print(f"{kernel}: {r.engine} does not do what {done[0].engine} does (output or instruction count differs)")
+                mismatches += 1
+    return mismatches
+
+
+def compare(results: List[Result], baseline_path: str, threshold: float) -> int:
+    """Prints every kernel/engine more than threshold percent slower than in the baseline, returns how many"""
+    try:
+        with open(baseline_path) as f:
+            baseline: Dict[str, float] = json.load(f)['mips']
+    except (OSError, ValueError, KeyError) as e:
+        sys.exit(f"failed to read baseline {baseline_path}: {e}")
+    regressions = 0
+    for r in results:
+        key = f"{r.kernel}/{r.engine}"
+        if r.error or key not in baseline or not baseline[key]:
+            continue
+        change = (r.mips() / baseline[key] - 1) * 100
+        if change < -threshold:
+            print(f"{key}: {r.mips():.1f} MIPS, {-change:.0f}% slower than the baseline's {baseline[key]:.1f}")
+            regressions += 1
+    return regressions
+
+
+def main() -> int:
+    if len(sys.argv) == 4 and sys.argv[1] == '--python-child':
+        return python_child(sys.argv[2], int(sys.argv[3]))
+
+    parser = argparse.ArgumentParser(description="Throughput of the LC-3 engines on the kernels in bench/")
+    parser.add_argument('kernels', nargs='*', default=KERNELS, help=f"default: {' '.join(KERNELS)}")
+    parser.add_argument('--vm', default=os.path.join(REPO_DIR, 'lc3_vm'), help="the C VM (default: ./lc3_vm)")
+    parser.add_argument('--engines', default=','.join(ENGINES), help="default: " + ','.join(ENGINES))
+    parser.add_argument('--runs', type=int, default=3, help="runs per kernel and engine, the fastest counts")
+    parser.add_argument('--python-steps', type=int, default=500000, help="instructions the Python core runs")
+    parser.add_argument('--ghz', type=float, default=0.0, help="host clock rate for CPI")
+    parser.add_argument('--save', metavar='FILE', help="write the MIPS figures to FILE, for --baseline")
+    parser.add_argument('--baseline', metavar='FILE', help="compare with the figures --save wrote")
+    parser.add_argument('--threshold', type=float, default=10.0, help="percent slower that counts as a regression")
+    args = parser.parse_args()
+
+    engines = [e for e in args.engines.split(',') if e]
+    for name in [k for k in args.kernels if k not in KERNELS] + [e for e in engines if e not in ENGINES]:
+        parser.error(f"unknown kernel or engine: {name}")
+    if any(e != 'python' for e in engines) and not os.access(args.vm, os.X_OK):
+        parser.error(f"no VM at {args.vm} (build it as README.md says, or pass --vm=PATH)")
+
+    results = []
+    with tempfile.TemporaryDirectory() as out_dir:
+        for kernel in args.kernels:
+            image = assemble(kernel, out_dir)
+            for engine in engines:
+                results.append(run_kernel(kernel, image, engine, args))
+
+    report(results, clock_hz(args))
+    failed = check_outputs(results) + sum(1 for r in results if r.error)
+    if args.baseline:
+        failed += compare(results, args.baseline, args.threshold)
+    if args.save:
+        mips = {f"{r.kernel}/{r.engine}": round(r.mips(), 1) for r in results if not r.error}
+        with open(args.save, 'w') as f:
+            json.dump({'vm': args.vm, 'mips': mips}, f, indent=2)
+            f.write('\n')
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
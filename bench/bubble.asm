@@ -0,0 +1,97 @@
+;; Benchmark: bubble sort of 200 pseudo-random numbers, refilled and sorted again REPS times
+;; A compare-and-swap inner loop of loads, stores and data dependent branches. Prints the first and the last number
+
+.ORIG x3000
+
+        LD R6, REPS             ; runs left
+AGAIN:
+        LD R1, ARRAYP           ; fill with x = 5x + 1, the sign bit cleared so a - b never overflows
+        LD R2, COUNT
+        LD R3, SEED
+        LD R5, MASK
+FILL:   ADD R4, R3, R3
+        ADD R4, R4, R4
+        ADD R3, R3, R4
+        ADD R3, R3, #1
+        AND R4, R3, R5
+        STR R4, R1, #0
+        ADD R1, R1, #1
+        ADD R2, R2, #-1
+        BRp FILL
+
+        LD R2, COUNT
+        ADD R2, R2, #-1         ; compares in this pass, one less every pass
+PASS:   LD R1, ARRAYP
+        AND R5, R5, #0          ; swaps in this pass
+        ADD R3, R2, #0
+INNER:  LDR R4, R1, #0          ; a
+        LDR R0, R1, #1          ; b
+        NOT R7, R0
+        ADD R7, R7, #1
+        ADD R7, R4, R7          ; a - b
+        BRnz NOSWAP
+        STR R0, R1, #0
+        STR R4, R1, #1
+        ADD R5, R5, #1
+NOSWAP: ADD R1, R1, #1
+        ADD R3, R3, #-1
+        BRp INNER
+        ADD R5, R5, #0
+        BRz SORTED              ; nothing moved, done early
+        ADD R2, R2, #-1
+        BRp PASS
+
+SORTED: ADD R6, R6, #-1
+        BRp AGAIN
+        LD R1, ARRAYP
+        LDR R0, R1, #0
+        JSR PRINTHEX
+        LD R1, LASTP
+        LDR R0, R1, #0
+        JSR PRINTHEX
+        HALT
+
+;; prints R0 as four hex digits and a newline, changes R0-R4
+PRINTHEX:
+        ST R7, SAVE7
+        ADD R1, R0, #0
+        AND R2, R2, #0
+        ADD R2, R2, #4          ; digits left
+HEXDIG: AND R0, R0, #0
+        AND R3, R3, #0
+        ADD R3, R3, #4          ; bits left in this digit
+HEXBIT: ADD R0, R0, R0          ; shift the top bit of R1 into R0
+        ADD R1, R1, #0
+        BRzp HEXZERO
+        ADD R0, R0, #1
+HEXZERO: ADD R1, R1, R1
+        ADD R3, R3, #-1
+        BRp HEXBIT
+        ADD R4, R0, #-10
+        BRn HEXNUM
+        LD R4, LETTER
+        BR HEXOUT
+HEXNUM: LD R4, DIGIT
+HEXOUT: ADD R0, R0, R4
+        OUT
+        ADD R2, R2, #-1
+        BRp HEXDIG
+        LD R0, NEWLINE
+        OUT
+        LD R7, SAVE7
+        RET
+
+REPS:   .FILL #300
+COUNT:  .FILL #200
+SEED:   .FILL #12345
+MASK:   .FILL x7FFF
+ARRAYP: .FILL ARRAY
+LASTP:  .FILL LAST
+SAVE7:  .FILL #0
+LETTER: .FILL #55               ; 'A' - 10
+DIGIT:  .FILL #48               ; '0'
+NEWLINE: .FILL #10
+ARRAY:  .BLKW #199
+LAST:   .BLKW #1
+
+.END
@@ -0,0 +1,73 @@
+;; Benchmark: recursive fib(24), REPS times. Every call is a JSR and a RET and saves three words on the R6 stack,
+;; so it is all calls, returns, and loads and stores close to the stack pointer. Prints fib(24)
+
+.ORIG x3000
+
+        LD R6, STACKP           ; the stack grows down from below the device registers
+        LD R5, REPS             ; runs left
+AGAIN:  LD R0, N
+        JSR FIB
+        ADD R5, R5, #-1
+        BRp AGAIN
+        JSR PRINTHEX            ; fib(24) = 46368: xB520
+        HALT
+
+;; R0 = fib(R0), everything else but R7 is kept
+FIB:    ADD R6, R6, #-3
+        STR R7, R6, #0
+        STR R1, R6, #1
+        STR R2, R6, #2
+        ADD R1, R0, #-2
+        BRn FIBDONE             ; fib(0) = 0 and fib(1) = 1
+        ADD R2, R0, #0          ; n
+        ADD R0, R2, #-1
+        JSR FIB
+        ADD R1, R0, #0          ; fib(n - 1)
+        ADD R0, R2, #-2
+        JSR FIB
+        ADD R0, R0, R1          ; + fib(n - 2)
+FIBDONE: LDR R7, R6, #0
+        LDR R1, R6, #1
+        LDR R2, R6, #2
+        ADD R6, R6, #3
+        RET
+
+;; prints R0 as four hex digits and a newline, changes R0-R4
+PRINTHEX:
+        ST R7, SAVE7
+        ADD R1, R0, #0
+        AND R2, R2, #0
+        ADD R2, R2, #4          ; digits left
+HEXDIG: AND R0, R0, #0
+        AND R3, R3, #0
+        ADD R3, R3, #4          ; bits left in this digit
+HEXBIT: ADD R0, R0, R0          ; shift the top bit of R1 into R0
+        ADD R1, R1, #0
+        BRzp HEXZERO
+        ADD R0, R0, #1
+HEXZERO: ADD R1, R1, R1
+        ADD R3, R3, #-1
+        BRp HEXBIT
+        ADD R4, R0, #-10
+        BRn HEXNUM
+        LD R4, LETTER
+        BR HEXOUT
+HEXNUM: LD R4, DIGIT
+HEXOUT: ADD R0, R0, R4
+        OUT
+        ADD R2, R2, #-1
+        BRp HEXDIG
+        LD R0, NEWLINE
+        OUT
+        LD R7, SAVE7
+        RET
+
+REPS:   .FILL #30
+N:      .FILL #24
+STACKP: .FILL xFE00
+SAVE7:  .FILL #0
+LETTER: .FILL #55               ; 'A' - 10
+DIGIT:  .FILL #48               ; '0'
+NEWLINE: .FILL #10
+
+.END
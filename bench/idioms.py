@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+"""
+Static frequency of instruction pairs in LC-3 images, the analysis the threaded engine's superinstructions were
+picked with (see "superinstructions" in lc3_vm.c).
+
+Follows the control flow from the entry point of each image (branch targets, fall through, JSR targets), so data
+that happens to decode as instructions is not counted, and counts every pair of adjacent reachable instructions
+that the engine could run as one: the first one does not jump or store, and both are in the same 512-word page.
+Pairs inside a loop (between a backward branch and its target) are counted again in a column of their own, those
+are the ones that run often.
+
+    python3 bench/idioms.py games/*.asm bench/*.asm         .asm files get assembled first
+    python3 bench/idioms.py --top=30 program.obj
+"""
+
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+from collections import Counter
+from typing import Dict, List, Set, Tuple
+
+REPO_DIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+NAMES = ['BR', 'ADD', 'LD', 'ST', 'JSR', 'AND', 'LDR', 'STR', 'RTI', 'NOT', 'LDI', 'STI', 'JMP', 'RES', 'LEA', 'TRAP']
+BR, JSR, RTI, JMP, RES, TRAP = 0, 4, 8, 12, 13, 15
+STORES = {3, 7, 11}         # ST, STR, STI
+PAGE_WORDS = 512
+HALT = 0xF025
+
+
+def sign_extend(value: int, bits: int) -> int:
+    return value - (1 << bits) if value & (1 << (bits - 1)) else value
+
+
+def load_obj(path: str) -> Tuple[int, Dict[int, int]]:
+    """The entry point and the words of a .obj file"""
+    with open(path, 'rb') as f:
+        data = f.read()
+    origin = int.from_bytes(data[:2], 'big')
+    words = {}
+    for i in range(2, len(data) - 1, 2):
+        words[(origin + i // 2 - 1) & 0xFFFF] = int.from_bytes(data[i:i + 2], 'big')
+    return origin, words
+
+
+def reachable(entry: int, words: Dict[int, int]) -> Set[int]:
+    """The addresses execution can get to from entry, as far as the instructions show"""
+    seen: Set[int] = set()
+    todo = [entry]
+    while todo:
+        pc = todo.pop()
+        while pc in words and pc not in seen:
+            seen.add(pc)
+            instr = words[pc]
+            op = instr >> 12
+            nxt = (pc + 1) & 0xFFFF
+            if op == BR:
+                if instr & 0x0E00:
+                    todo.append((nxt + sign_extend(instr & 0x1FF, 9)) & 0xFFFF)
+                if (instr & 0x0E00) == 0x0E00:
+                    break  # always taken
+            elif op == JSR and instr & 0x0800:
+                todo.append((nxt + sign_extend(instr & 0x7FF, 11)) & 0xFFFF)
+            elif op == JMP or op == RTI or op == RES or instr == HALT:
+                break  # RET and the other jumps go somewhere only a run knows
+            pc = nxt
+    return seen
+
+
+def in_loops(code: Set[int], words: Dict[int, int]) -> Set[int]:
+    """Addresses between a backward branch and its target"""
+    inside: Set[int] = set()
+    for pc in code:
+        instr = words[pc]
+        if instr >> 12 == BR and instr & 0x0E00:
+            target = (pc + 1 + sign_extend(instr & 0x1FF, 9)) & 0xFFFF
+            if target <= pc:
+                inside.update(range(target, pc + 1))
+    return inside
+
+
+def fusable(first: int) -> bool:
+    """Whether the engine could run first and the instruction after it as one: first has to carry on to pc + 1"""
+    op = first >> 12
+    return op not in (BR, JSR, JMP, TRAP, RTI, RES) and op not in STORES
+
+
+def assemble(path: str, out_dir: str) -> str:
+    image = os.path.join(out_dir, os.path.basename(path) + '.obj')
+    done = subprocess.run([sys.executable, os.path.join(REPO_DIR, 'assemble.py'), path, image],
+                          stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    if done.returncode != 0 or not os.path.exists(image):
+        sys.exit(f"failed to assemble {path}: {done.stderr.decode(errors='replace').strip()}")
+    return image
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description="Static frequency of fusable instruction pairs in LC-3 images")
+    parser.add_argument('images', nargs='+', help=".obj files, or .asm files to assemble first")
+    parser.add_argument('--top', type=int, default=20, help="pairs to list")
+    args = parser.parse_args()
+
+    pairs: Counter = Counter()
+    loop_pairs: Counter = Counter()
+    instructions = loop_instructions = 0
+    with tempfile.TemporaryDirectory() as out_dir:
+        for path in args.images:
+            image = assemble(path, out_dir) if path.endswith('.asm') else path
+            entry, words = load_obj(image)
+            code = reachable(entry, words)
+            loops = in_loops(code, words)
+            instructions += len(code)
+            loop_instructions += len(code & loops)
+            for pc in code:
+                nxt = pc + 1
+                if nxt not in code or nxt % PAGE_WORDS == 0 or not fusable(words[pc]):
+                    continue
+                pair = (words[pc] >> 12, words[nxt] >> 12)
+                pairs[pair] += 1
+                if pc in loops and nxt in loops:
+                    loop_pairs[pair] += 1
+
+    print(f"{instructions} reachable instructions, {loop_instructions} of them in loops")
+    print(f"{'pair':<12} {'count':>6} {'in loops':>9}")
+    for (first, second), count in sorted(pairs.items(), key=lambda p: (-loop_pairs[p[0]], -p[1]))[:args.top]:
+        print(f"{NAMES[first] + '+' + NAMES[second]:<12} {count:>6} {loop_pairs[(first, second)]:>9}")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
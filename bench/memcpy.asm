@@ -0,0 +1,98 @@
+;; Benchmark: copies a 4096 word block back and forth REPS times, one way a word per iteration, the other way
+;; unrolled four times. Loads and stores through pointers over eight pages. Prints the sum of the block
+
+.ORIG x3000
+
+        LD R1, SRCP             ; SRC[i] = i
+        LD R3, COUNT
+        AND R4, R4, #0
+INIT:   STR R4, R1, #0
+        ADD R1, R1, #1
+        ADD R4, R4, #1
+        ADD R3, R3, #-1
+        BRp INIT
+
+        LD R6, REPS             ; runs left
+AGAIN:  LD R1, SRCP
+        LD R2, DSTP
+        LD R3, COUNT
+COPY1:  LDR R4, R1, #0          ; SRC to DST
+        STR R4, R2, #0
+        ADD R1, R1, #1
+        ADD R2, R2, #1
+        ADD R3, R3, #-1
+        BRp COPY1
+
+        LD R1, DSTP
+        LD R2, SRCP
+        LD R3, QUADS
+COPY4:  LDR R4, R1, #0          ; DST back to SRC
+        STR R4, R2, #0
+        LDR R4, R1, #1
+        STR R4, R2, #1
+        LDR R4, R1, #2
+        STR R4, R2, #2
+        LDR R4, R1, #3
+        STR R4, R2, #3
+        ADD R1, R1, #4
+        ADD R2, R2, #4
+        ADD R3, R3, #-1
+        BRp COPY4
+
+        ADD R6, R6, #-1
+        BRp AGAIN
+
+        LD R1, DSTP
+        LD R3, COUNT
+        AND R0, R0, #0
+SUM:    LDR R4, R1, #0
+        ADD R0, R0, R4
+        ADD R1, R1, #1
+        ADD R3, R3, #-1
+        BRp SUM
+        JSR PRINTHEX            ; 0 + 1 + ... + 4095 = 8386560, xF800 in 16 bits
+        HALT
+
+;; prints R0 as four hex digits and a newline, changes R0-R4
+PRINTHEX:
+        ST R7, SAVE7
+        ADD R1, R0, #0
+        AND R2, R2, #0
+        ADD R2, R2, #4          ; digits left
+HEXDIG: AND R0, R0, #0
+        AND R3, R3, #0
+        ADD R3, R3, #4          ; bits left in this digit
+HEXBIT: ADD R0, R0, R0          ; shift the top bit of R1 into R0
+        ADD R1, R1, #0
+        BRzp HEXZERO
+        ADD R0, R0, #1
+HEXZERO: ADD R1, R1, R1
+        ADD R3, R3, #-1
+        BRp HEXBIT
+        ADD R4, R0, #-10
+        BRn HEXNUM
+        LD R4, LETTER
+        BR HEXOUT
+HEXNUM: LD R4, DIGIT
+HEXOUT: ADD R0, R0, R4
+        OUT
+        ADD R2, R2, #-1
+        BRp HEXDIG
+        LD R0, NEWLINE
+        OUT
+        LD R7, SAVE7
+        RET
+
+REPS:   .FILL #1500
+COUNT:  .FILL #4096
+QUADS:  .FILL #1024
+SRCP:   .FILL SRC
+DSTP:   .FILL DST
+SAVE7:  .FILL #0
+LETTER: .FILL #55               ; 'A' - 10
+DIGIT:  .FILL #48               ; '0'
+NEWLINE: .FILL #10
+SRC:    .BLKW #4096
+DST:    .BLKW #4096
+
+.END
@@ -0,0 +1,22 @@
+;; Benchmark: output. Prints the same 64 character line REPS times with PUTS and then again a character at a time
+;; with OUT, so it is the trap handlers and the output buffering that get measured more than the instructions
+
+.ORIG x3000
+
+        LD R6, REPS             ; runs left
+AGAIN:  LEA R0, LINE
+        PUTS
+        LEA R1, LINE
+CHAR:   LDR R0, R1, #0
+        BRz NEXT
+        OUT
+        ADD R1, R1, #1
+        BR CHAR
+NEXT:   ADD R6, R6, #-1
+        BRp AGAIN
+        HALT
+
+REPS:   .FILL #20000
+LINE:   .STRINGZ "The quick brown fox jumps over the lazy dog. 0123456789 ABCDEF\n"
+
+.END
@@ -0,0 +1,82 @@
+;; Benchmark: sieve of Eratosthenes over the numbers below 8000, run REPS times
+;; Mostly LDR/STR with a register offset and short compare-and-branch loops. Prints the number of primes in hex
+
+.ORIG x3000
+
+        LD R6, REPS             ; runs left
+AGAIN:
+        LD R1, FLAGSP           ; R1 = flags[0], nonzero for a number that is not prime
+        LD R5, NEGN             ; R5 = -N, for the compares
+        NOT R3, R5
+        ADD R3, R3, #1          ; N words to clear
+        AND R4, R4, #0
+        ADD R2, R1, #0
+CLEAR:  STR R4, R2, #0
+        ADD R2, R2, #1
+        ADD R3, R3, #-1
+        BRp CLEAR
+
+        AND R0, R0, #0          ; primes found
+        AND R2, R2, #0
+        ADD R2, R2, #2          ; p = 2
+NEXTP:  ADD R4, R2, R5          ; p - N
+        BRzp DONE
+        ADD R4, R1, R2
+        LDR R4, R4, #0
+        BRnp SKIP               ; crossed out already
+        ADD R0, R0, #1
+        ADD R3, R2, R2          ; m = 2p
+MARK:   ADD R4, R3, R5          ; m - N
+        BRzp SKIP
+        ADD R4, R1, R3
+        STR R2, R4, #0          ; any nonzero value will do, p is one
+        ADD R3, R3, R2
+        BR MARK
+SKIP:   ADD R2, R2, #1
+        BR NEXTP
+
+DONE:   ADD R6, R6, #-1
+        BRp AGAIN
+        JSR PRINTHEX            ; 1007 primes below 8000: x03EF
+        HALT
+
+;; prints R0 as four hex digits and a newline, changes R0-R4
+PRINTHEX:
+        ST R7, SAVE7
+        ADD R1, R0, #0
+        AND R2, R2, #0
+        ADD R2, R2, #4          ; digits left
+HEXDIG: AND R0, R0, #0
+        AND R3, R3, #0
+        ADD R3, R3, #4          ; bits left in this digit
+HEXBIT: ADD R0, R0, R0          ; shift the top bit of R1 into R0
+        ADD R1, R1, #0
+        BRzp HEXZERO
+        ADD R0, R0, #1
+HEXZERO: ADD R1, R1, R1
+        ADD R3, R3, #-1
+        BRp HEXBIT
+        ADD R4, R0, #-10
+        BRn HEXNUM
+        LD R4, LETTER
+        BR HEXOUT
+HEXNUM: LD R4, DIGIT
+HEXOUT: ADD R0, R0, R4
+        OUT
+        ADD R2, R2, #-1
+        BRp HEXDIG
+        LD R0, NEWLINE
+        OUT
+        LD R7, SAVE7
+        RET
+
+REPS:   .FILL #400
+NEGN:   .FILL #-8000
+FLAGSP: .FILL FLAGS
+SAVE7:  .FILL #0
+LETTER: .FILL #55               ; 'A' - 10
+DIGIT:  .FILL #48               ; '0'
+NEWLINE: .FILL #10
+FLAGS:  .BLKW #8000
+
+.END
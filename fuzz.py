@@ -0,0 +1,195 @@
+#!/usr/bin/env python3
+"""
+LC-3 differential fuzzer for the Python core
+Runs the random cases of lc3 --fuzz (fuzz_case() in lc3_fuzz.c) on LC3VirtualMachine from lc3_debugger.py and on
+the C core in liblc3 side by side, and checks they agree. lc3 --fuzz compares the C engines with each other, this
+compares the debugger's own machine with them.
+
+    python fuzz.py [--cases=N] [--seed=N] [--jobs=N] [--steps=N]
+
+It needs liblc3 built next to lc3_debugger.py with lc3_fuzz.c in it (see the README). Both machines start from the
+state fuzz_case() writes and run in slices of 1 to 64 instructions, and after every slice they have to agree on
+whether the program halted or is waiting for input, how many instructions ran, the registers, what it printed and
+the pages either of them wrote to. A case ends at its first difference, with a line saying what it was and the seed,
+which --cases=1 --seed=SEED runs again (and lc3 --fuzz=1 --fuzz-seed=SEED --snapshot=FILE saves for the debugger).
+
+The Python machine is a few hundred times slower than the C one, so the cases are shared out over --jobs processes
+(one per CPU by default) and the default run is a thousand of them.
+"""
+
+import sys
+import os
+import ctypes
+import random
+import time
+from multiprocessing import Pool
+from typing import List, Optional, Tuple
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from lc3_debugger import LC3VirtualMachine, NativeLC3VirtualMachine
+
+FUZZ_INPUT_MAX = 8  # the same as lc3_vm.h
+SLICE_MAX = 64
+REGISTER_NAMES = ['R0', 'R1', 'R2', 'R3', 'R4', 'R5', 'R6', 'R7', 'PC', 'COND']
+
+lib: Optional[ctypes.CDLL] = None
+
+
+def load_library() -> ctypes.CDLL:
+    lib = NativeLC3VirtualMachine.load_library()
+    if lib is None or not hasattr(lib, 'fuzz_case'):
+        print("Error: fuzz.py needs liblc3 next to lc3_debugger.py, built with lc3_fuzz.c (see the README)",
+              file=sys.stderr)
+        sys.exit(1)
+    lib.fuzz_case.argtypes = [ctypes.c_void_p, ctypes.c_uint32, ctypes.c_char_p, ctypes.POINTER(ctypes.c_size_t)]
+    lib.lc3_steps.restype = ctypes.c_uint64
+    lib.lc3_steps.argtypes = [ctypes.c_void_p]
+    return lib
+
+
+def start_worker() -> None:
+    global lib
+    lib = load_library()
+
+
+def take_output(vm) -> bytes:
+    out = ctypes.create_string_buffer(4096)
+    chunks = []
+    while True:
+        n = lib.lc3_take_output(vm, out, len(out))
+        if not n:
+            return b''.join(chunks)
+        chunks.append(out.raw[:n])
+
+
+def step_python(py: LC3VirtualMachine, n: int) -> int:
+    """Up to n instructions on the Python machine, the number that ran. HALT counts, a read that has to wait for
+    input does not, the same as in C"""
+    ran = 0
+    while ran < n:
+        going = py.step()
+        if py.halted:
+            return ran + 1
+        if not going:
+            return ran
+        ran += 1
+    return ran
+
+
+def difference(vm, py: LC3VirtualMachine, py_steps: int, c_output: bytes, py_output: bytes) -> Optional[str]:
+    """What the two machines disagree on after a slice, None if nothing"""
+    status = lib.lc3_status(vm)
+    c_state = ('halted' if status == NativeLC3VirtualMachine.VM_HALTED else
+               'waiting for input' if status == NativeLC3VirtualMachine.VM_WAITING_INPUT else 'running')
+    py_state = 'halted' if py.halted else 'waiting for input' if py.wait_for_input else 'running'
+    c_steps = lib.lc3_steps(vm)
+    if c_state != py_state or c_steps != py_steps:
+        return f"C is {c_state} after {c_steps} instructions, Python is {py_state} after {py_steps}"
+
+    regs = (ctypes.c_uint16 * py.R_COUNT)()
+    lib.lc3_read_regs(vm, regs)
+    for r in range(py.R_COUNT):
+        if regs[r] != py.reg[r]:
+            return f"{REGISTER_NAMES[r]} = x{regs[r]:04X} in C, x{py.reg[r]:04X} in Python"
+
+    if c_output != py_output:
+        return f"C printed {c_output!r}, Python {py_output!r}"
+
+    dirty = (ctypes.c_uint8 * py.PAGE_COUNT)()
+    lib.lc3_take_dirty_pages(vm, dirty)
+    pages = py.take_dirty_pages() | {page for page in range(py.PAGE_COUNT) if dirty[page]}
+    words = (ctypes.c_uint16 * py.PAGE_WORDS)()
+    for page in sorted(pages):
+        start = page << py.PAGE_SHIFT
+        lib.lc3_read_memory(vm, start, words, py.PAGE_WORDS)
+        mine = py.memory[start:start + py.PAGE_WORDS]
+        if list(words) != mine:
+            i = next(i for i in range(py.PAGE_WORDS) if words[i] != mine[i])
+            return f"x{start + i:04X} = x{words[i]:04X} in C, x{mine[i]:04X} in Python"
+    return None
+
+
+def run_case(seed: int, max_steps: int) -> Tuple[int, Optional[str]]:
+    """Instructions the case ran, and the report of its first difference or None"""
+    vm = lib.lc3_create()
+    try:
+        text = ctypes.create_string_buffer(FUZZ_INPUT_MAX)
+        length = ctypes.c_size_t()
+        lib.fuzz_case(vm, seed, text, ctypes.byref(length))
+        text = text.raw[:length.value]
+        lib.vm_add_input(vm, text, len(text))
+
+        py = LC3VirtualMachine()
+        memory = (ctypes.c_uint16 * py.MAX_MEMORY)()
+        lib.lc3_read_memory(vm, 0, memory, py.MAX_MEMORY)
+        py.memory = list(memory)
+        regs = (ctypes.c_uint16 * py.R_COUNT)()
+        lib.lc3_read_regs(vm, regs)
+        py.reg = list(regs)
+        py.input_buffer = list(text.decode('latin-1'))
+        lib.lc3_take_dirty_pages(vm, (ctypes.c_uint8 * py.PAGE_COUNT)())  # they start out alike
+        py.take_dirty_pages()
+
+        rng = random.Random(seed)
+        steps = 0
+        c_output, py_output = b'', b''
+        while steps < max_steps:
+            n = min(rng.randint(1, SLICE_MAX), max_steps - steps)
+            first, pc = steps + 1, py.reg[py.R_PC]
+            lib.lc3_run_until(vm, None, 0, n)
+            steps += step_python(py, n)
+            c_output += take_output(vm)
+            py_output += ''.join(py.output_buffer).encode('latin-1', 'replace')
+            py.output_buffer = []
+            what = difference(vm, py, steps, c_output, py_output)
+            if what:
+                where = f"in instructions {first} to {steps}" if steps >= first else f"after instruction {steps}"
+                return steps, f"seed {seed}: Python differs from C {where}, from PC x{pc:04X}: {what}"
+            if py.halted or py.wait_for_input:
+                break
+        return steps, None
+    finally:
+        lib.vm_destroy(vm)
+
+
+def run_cases(job: Tuple[List[int], int]) -> Tuple[int, List[str]]:
+    seeds, max_steps = job
+    steps, failures = 0, []
+    for seed in seeds:
+        ran, failure = run_case(seed, max_steps)
+        steps += ran
+        if failure:
+            failures.append(failure)
+    return steps, failures
+
+
+def main() -> None:
+    options = {'cases': 1000, 'seed': 1, 'jobs': os.cpu_count() or 1, 'steps': 4096}
+    for arg in sys.argv[1:]:
+        name, _, value = arg[2:].partition('=')
+        if not arg.startswith('--') or name not in options or not value.isdigit():
+            print("Usage: python fuzz.py [--cases=N] [--seed=N] [--jobs=N] [--steps=N]", file=sys.stderr)
+            sys.exit(2)
+        options[name] = int(value)
+    load_library()  # says so here if it is not there, not once in every worker
+
+    cases, seed, jobs = options['cases'], options['seed'], max(1, options['jobs'])
+    chunk = max(1, min(50, cases // (jobs * 4)))  # small enough to keep every process busy to the end
+    work = [(list(range(seed + i, seed + min(i + chunk, cases))), options['steps']) for i in range(0, cases, chunk)]
+    started = time.time()
+    steps, failures = 0, []
+    with Pool(jobs, initializer=start_worker) as pool:
+        for ran, failed in pool.imap(run_cases, work):
+            steps += ran
+            failures.extend(failed)
+    seconds = time.time() - started
+
+    for failure in failures[:10]:
+        print(failure)
+    print(f"{cases} cases, {steps} instructions in {seconds:.1f} s on {jobs} processes: " +
+          (f"{len(failures)} cases differ" if failures else "no differences"))
+    sys.exit(4 if failures else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,393 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lc3_vm.h"
+
+/*
+Proving stores safe. Everything that keeps a copy of code, the decoded slots and the JIT's blocks, needs mem_write()
+to find out whether the word it writes is code: it resets the word's slot, looks the word up in jit_code_map[], and
+the threaded engine looks up the page of the next instruction again in case the store copied it. Most stores write
+variables, never code, and vm_analyze() proves as much for as many of them as it can before the program runs, so
+their slots get OP_ST_DATA or OP_STR_DATA, which write the word and nothing else (and compiled code for them leaves
+out the check too).
+
+The analysis follows the control flow from PC with the registers the VM has then, the way the engines go: both ways
+at a conditional branch, into subroutines and on after the JSR, on after every TRAP but HALT. Whatever it gets to is
+code (vm->data_words keeps it out of words an image said are data, see NATIVE_SEGMENT_DATA in lc3_image.c). On the
+way it works out which registers hold a known value at every instruction, from LEA, ADD, AND and NOT of known values.
+After a JSR or a TRAP nothing is known, the subroutine or trap can change any register, and whatever loads from
+memory is not known either. Then
+
+    ST      always writes the same word, it is proved once that word is not code and not in the device page
+    STR     is proved the same way when its base register is known. Only if the analysis knows every way into every
+            instruction though: a JMP or JSRR through a register it has no value for could come in anywhere with any
+            registers, and so could a RET if anything but JSR and TRAP writes R7 (it can be a saved return address
+            put back, or a jump table). Programs with either get their ST proved and no STR
+    STI     is never proved, its pointer is in memory and stores the analysis proved nothing about can change it
+
+A program can still get to words the analysis did not count as code, through a jump it could not follow, or by
+writing code and jumping to it. A proved store may have written such a word and left its old slot behind, so neither
+engine may run it from a slot that was decoded before. The words that are not code keep their slots at OP_DECODE
+(vm_analyze() makes them so, and so does vm_own_page() for the pages the VM copies afterwards), and decode_slot() and
+jit_compile() check every word they get to: the first one that is not code stops the analysis, vm_analysis_stop()
+turns the proved stores back into ordinary ones and throws the compiled blocks away. From then on every store pays
+for the check again, and the program runs on the way it would have without any of this.
+
+Writing over code stops the analysis as well, whatever does it (a store that was not proved, a trap, a block
+transfer): the proof was worked out from the old words, and the new ones can give the proved stores registers it
+never saw, a rewritten LEA say, and make one of them write code after all.
+
+Loading an image, restoring a snapshot or resetting the VM stops the analysis too, the memory it was about is gone.
+The switch engine does not use the decoded slots and never runs the proved versions.
+*/
+
+enum { UNKNOWN = 0x10000 };  // a register whose value the analysis does not know
+
+typedef struct {
+    uint32_t reg[8];    // R0-R7, a value or UNKNOWN
+} reg_state;
+
+struct vm_analysis {
+    uint64_t code[MAX_MEMORY / 64];     // the words execution gets to
+    uint16_t* stores;                   // the proved stores, their slots hold OP_ST_DATA or OP_STR_DATA
+    int store_count;
+};
+
+static inline int is_code(const vm_analysis* a, uint32_t address){
+    return (a->code[address >> 6] >> (address & 63)) & 1;
+}
+
+static inline int is_data(const VM* vm, uint32_t address){
+    return vm->data_words && (vm->data_words[address >> 6] >> (address & 63)) & 1;
+}
+
+// the dataflow over all of memory. Every address holds the registers on the way into it, merged over the ways in
+typedef struct {
+    VM* vm;
+    vm_analysis* a;
+    reg_state* in;
+    uint64_t reached[MAX_MEMORY / 64];
+    uint16_t* todo;
+    uint8_t* queued;
+    int todo_count;
+    int unresolved;     // JMP and JSRR through registers with no known value
+    int returns;        // RETs
+    int r7_written;     // something but JSR and TRAP writes R7
+} flow;
+
+static const reg_state nothing_known = { { UNKNOWN, UNKNOWN, UNKNOWN, UNKNOWN, UNKNOWN, UNKNOWN, UNKNOWN, UNKNOWN } };
+
+// execution goes on to address with the registers in s
+static void flow_to(flow* f, uint32_t address, const reg_state* s){
+
+    address &= 0xFFFF;
+    if (address >= DEVICE_PAGE || is_data(f->vm, address)){
+        return;  // not code as far as the analysis goes, getting there stops it (see the top)
+    }
+    reg_state* in = &f->in[address];
+    int changed = 0;
+    if (!((f->reached[address >> 6] >> (address & 63)) & 1)){
+        f->reached[address >> 6] |= (uint64_t)1 << (address & 63);
+        *in = *s;
+        changed = 1;
+    } else {
+        for (int r = 0; r < 8; r++){
+            if (in->reg[r] != UNKNOWN && in->reg[r] != s->reg[r]){
+                in->reg[r] = UNKNOWN;
+                changed = 1;
+            }
+        }
+    }
+    if (changed && !f->queued[address]){
+        f->queued[address] = 1;
+        f->todo[f->todo_count++] = (uint16_t)address;
+    }
+}
+
+static uint32_t alu(int op, uint32_t a, uint32_t b){
+    if (a == UNKNOWN || b == UNKNOWN){
+        return UNKNOWN;
+    }
+    return (op == ADD ? a + b : a & b) & 0xFFFF;
+}
+
+// what the instruction at address does to the registers, and where execution goes on from it
+static void flow_step(flow* f, uint16_t address){
+
+    reg_state s = f->in[address];
+    uint16_t instr = vm_peek(f->vm, address);
+    decoded_instr d;
+    decode_instr(instr, &d);
+    uint16_t next = address + 1;
+    f->a->code[address >> 6] |= (uint64_t)1 << (address & 63);
+
+    switch (d.op){
+        case BR:
+            if (d.r0){
+                flow_to(f, (uint16_t)(next + d.imm), &s);
+            }
+            if (d.r0 != 7){
+                flow_to(f, next, &s);
+            }
+            return;
+        case ADD:
+        case AND:
+            s.reg[d.r0] = alu(d.op, s.reg[d.r1], d.flag ? (uint16_t)d.imm : s.reg[d.r2]);
+            break;
+        case NOT:
+            s.reg[d.r0] = s.reg[d.r1] == UNKNOWN ? UNKNOWN : ~s.reg[d.r1] & 0xFFFF;
+            break;
+        case LEA:
+            s.reg[d.r0] = (uint16_t)(next + d.imm);
+            break;
+        case LD:
+        case LDR:
+        case LDI:
+            s.reg[d.r0] = UNKNOWN;
+            break;
+        case JSR:
+        {
+            uint32_t target = d.flag ? (uint16_t)(next + d.imm) : d.r1 == R_R7 ? next : s.reg[d.r1];  // R7 is written first
+            s.reg[R_R7] = next;
+            if (target == UNKNOWN){
+                f->unresolved++;
+            } else {
+                flow_to(f, target, &s);
+            }
+            flow_to(f, next, &nothing_known);  // back from the subroutine, which can have changed anything
+            return;
+        }
+        case JMP:
+            if (d.r1 == R_R7){
+                f->returns++;  // back to after a JSR or TRAP, flow_step() went on from there already
+            } else if (s.reg[d.r1] == UNKNOWN){
+                f->unresolved++;
+            } else {
+                flow_to(f, s.reg[d.r1], &s);
+            }
+            return;
+        case TRAP:
+        {
+            trap_handler handler = (f->vm->traps ? f->vm->traps : standard_traps)[d.imm];
+            if (handler != standard_traps[TRAP_HALT]){
+                flow_to(f, next, &nothing_known);  // a trap can do anything to the registers, and R7 is a return address
+            }
+            return;
+        }
+        default:
+            break;  // ST, STR and STI change no register, RTI and the reserved opcode do nothing without --interrupts, which runs no analysis
+    }
+    if (d.r0 == R_R7 && (d.op == ADD || d.op == AND || d.op == NOT || d.op == LEA || d.op == LD || d.op == LDR ||
+                         d.op == LDI)){
+        f->r7_written = 1;
+    }
+    flow_to(f, next, &s);
+}
+
+// the word a store at address writes, or UNKNOWN if the analysis cannot tell
+static uint32_t store_target(const flow* f, uint16_t address, int registers_known){
+
+    decoded_instr d;
+    decode_instr(vm_peek(f->vm, address), &d);
+    uint16_t next = address + 1;
+    if (d.op == ST){
+        return (uint16_t)(next + d.imm);
+    }
+    if (d.op == STR && registers_known && f->in[address].reg[d.r1] != UNKNOWN){
+        return (f->in[address].reg[d.r1] + d.imm) & 0xFFFF;
+    }
+    return UNKNOWN;
+}
+
+/*
+While the proof holds every word of code counts one more in jit_code_map[] (delta 1 when it starts, -1 when it
+stops), so a compiled store that would write one leaves the block the way it does for compiled code, and
+mem_write() ends the analysis (see analysis_written() in lc3_vm.h)
+*/
+static void count_code(VM* vm, const vm_analysis* a, int delta){
+
+    for (uint32_t address = 0; address < DEVICE_PAGE; address++){
+        if (!a->code[address >> 6]){
+            address |= 63;  // none in these 64
+        } else if (is_code(a, address)){
+            vm->jit_code_map[address] += (uint8_t)delta;
+        }
+    }
+}
+
+// for jit_init(), a JIT that starts while the proof holds
+void analysis_jit_started(VM* vm){
+
+    if (vm->analysis){
+        count_code(vm, vm->analysis, 1);
+    }
+}
+
+// a makes the VM's analysis, the stores it proved are still to be marked
+static void analysis_start(VM* vm, vm_analysis* a){
+
+    // the blocks compiled so far check every store, and may have been compiled from words that are not code
+    jit_flush(vm);
+    vm->analysis = a;
+    vm->code_words = a->code;
+    if (vm->jit){
+        count_code(vm, a, 1);
+    }
+    for (int page = 0; page < DEVICE_PAGE >> PAGE_SHIFT; page++){
+        if (vm->page_owned[page]){
+            analysis_page_owned(vm, page);
+        }
+    }
+}
+
+/*
+analyzes the program from PC and turns the stores it proves never write over code into OP_ST_DATA and OP_STR_DATA.
+Returns how many it proved, -1 if there is no memory for it. *stores, if not NULL, gets the number of ST, STR and STI
+the analysis got to
+*/
+int vm_analyze(VM* vm, int* stores){
+
+    vm_analysis_stop(vm);
+    vm_analysis* a = calloc(1, sizeof(vm_analysis));
+    flow* f = calloc(1, sizeof(flow));
+    if (f){
+        f->in = malloc(MAX_MEMORY * sizeof(reg_state));
+        f->todo = malloc(MAX_MEMORY * sizeof(uint16_t));
+        f->queued = calloc(MAX_MEMORY, 1);
+    }
+    if (!a || !f || !f->in || !f->todo || !f->queued){
+        if (f){
+            free(f->in);
+            free(f->todo);
+            free(f->queued);
+        }
+        free(f);
+        free(a);
+        return -1;
+    }
+    f->vm = vm;
+    f->a = a;
+
+    reg_state entry;
+    for (int r = 0; r < 8; r++){
+        entry.reg[r] = vm->reg[r];  // the analysis is about the run from here
+    }
+    flow_to(f, vm->reg[R_PC], &entry);
+    while (f->todo_count){
+        uint16_t address = f->todo[--f->todo_count];
+        f->queued[address] = 0;
+        flow_step(f, address);
+    }
+
+    // every way into every instruction known, so the registers are too (see STR at the top)
+    int registers_known = !f->unresolved && !(f->returns && f->r7_written);
+    int candidates = 0;
+    a->stores = malloc(MAX_MEMORY * sizeof(uint16_t));
+    for (uint32_t address = 0; a->stores && address < DEVICE_PAGE; address++){
+        if (!is_code(a, address)){
+            continue;
+        }
+        int op = vm_peek(vm, (uint16_t)address) >> 12;
+        if (op != ST && op != STR && op != STI){
+            continue;
+        }
+        candidates++;
+        uint32_t target = store_target(f, (uint16_t)address, registers_known);
+        if (target != UNKNOWN && target < DEVICE_PAGE && !is_code(a, target)){
+            a->stores[a->store_count++] = (uint16_t)address;
+        }
+    }
+    free(f->in);
+    free(f->todo);
+    free(f->queued);
+    free(f);
+    if (!a->stores){
+        free(a);
+        return -1;
+    }
+    if (stores){
+        *stores = candidates;
+    }
+
+    analysis_start(vm, a);
+    for (int i = 0; i < a->store_count; i++){
+        uint16_t address = a->stores[i];
+        vm_page* p = vm_own_page(vm, address >> PAGE_SHIFT);
+        decoded_instr* slot = &p->decoded[address & (PAGE_WORDS - 1)];
+        if (slot->op == OP_DECODE){
+            decode_page_word(p, address & (PAGE_WORDS - 1));
+        }
+        slot->op = slot->op == ST ? OP_ST_DATA : OP_STR_DATA;
+    }
+    return a->store_count;
+}
+
+/*
+an analysis that proves no stores and stops like any other, for code worked out before: lc3_aot.c's translated
+words, whose unchecked stores hold only as long as it does. Returns 0 if there is no memory for it
+*/
+int vm_analysis_follow(VM* vm, const uint64_t* code){
+
+    vm_analysis_stop(vm);
+    vm_analysis* a = calloc(1, sizeof(vm_analysis));
+    if (!a){
+        return 0;
+    }
+    memcpy(a->code, code, sizeof(a->code));
+    analysis_start(vm, a);
+    return 1;
+}
+
+// turns the proved stores back into ordinary ones, for when the proof no longer holds or the memory is going away
+void vm_analysis_stop(VM* vm){
+
+    vm_analysis* a = vm->analysis;
+    if (!a){
+        return;
+    }
+    vm->analysis = NULL;
+    vm->code_words = NULL;
+    if (vm->jit){
+        count_code(vm, a, -1);
+    }
+    for (int i = 0; i < a->store_count; i++){
+        decoded_instr* slot = vm_slot(vm, a->stores[i]);
+        if (slot->op == OP_ST_DATA || slot->op == OP_STR_DATA){
+            slot->op = slot->op == OP_ST_DATA ? ST : STR;
+        }
+    }
+    jit_flush(vm);  // compiled blocks leave the check out for the proved stores
+    free(a->stores);
+    free(a);
+}
+
+// execution got to the words from start up to end (decode_slot(), jit_compile()), the proof is off if one is not code
+void analysis_reached(VM* vm, uint32_t start, uint32_t end){
+
+    for (uint32_t address = start; address < end; address++){
+        if (!is_code(vm->analysis, address)){
+            vm_analysis_stop(vm);
+            return;
+        }
+    }
+}
+
+// the slots of the words that are not code stay OP_DECODE, a proved store writes them without resetting them (for
+// vm_own_page(), which copies the slots of a shared page along with its words)
+void analysis_page_owned(VM* vm, int page){
+
+    vm_page* p = vm->pages[page];
+    for (int i = 0; i < PAGE_WORDS; i++){
+        if (!is_code(vm->analysis, (uint32_t)page * PAGE_WORDS + i)){
+            p->decoded[i].op = OP_DECODE;
+        }
+    }
+}
+
+// 1 if the analysis got to address, which makes it code (for lc3_aot.c, which translates the words it got to)
+int analysis_is_code(const VM* vm, uint16_t address){
+
+    return vm->analysis && is_code(vm->analysis, address);
+}
@@ -0,0 +1,545 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lc3_vm.h"
+
+/*
+Ahead of time translation. For a program that never changes and runs over and over, even the JIT's warm-up and the
+threaded engine's decoding are work done again on every run, so lc3 --aot=FILE.c translates the whole program to C
+once, and the C compiler makes a program of its own out of it:
+
+    ./lc3_vm --aot=game.c game.obj
+    gcc -O2 -DLC3_NO_MAIN -o game game.c lc3_vm.c lc3_io.c ... lc3_aot.c -lpthread
+    ./game
+
+What gets translated is what vm_analyze() (lc3_analysis.c) finds execution gets to from the start address, every
+word of it one after the other in a single function, run(). R0-R7 and the value the condition codes come from are
+locals of it, so the C compiler keeps them in host registers, and BR and JSR are plain gotos to the label of their
+target. Only JMP and JSRR (and RET, which is JMP R7) go through a switch over PC, and that switch only has the
+addresses they can go to: the word after every JSR and JSRR, the ones LEA or a data word points at, and the code
+nothing falls through or branches to, which the analysis can only have got to through a register.
+
+Everything else is the VM's. Traps call execute_trap() with the registers written back, loads from KBSR go through
+mem_read(), and the interpreter runs whatever run() does not have a translation for: a jump to anywhere the switch
+does not know leaves run(), and the threaded engine carries on from there, with a breakpoint on every address of
+the switch so it hands back to run() as soon as it gets to one.
+
+Self-modifying code: a store that can hit a translated word checks the code bits first (an ST knows its address
+when it is translated, and an STR vm_analyze() proved never writes code leaves the check out), a trap that can
+write memory (anything but the standard six) and the interpreter are checked afterwards against the words the
+program was translated from, by the pages they left dirty. Only the stores that check are right for registers
+the analysis never saw, so the VM gets an analysis of the translated words (vm_analysis_follow()), and once the
+interpreter has run a word that is not code, which stops it, run() is done with too. Once the program has
+written over its own code or gone where the analysis did not see it go, the interpreter runs the rest of it.
+
+A translated program runs the way lc3 does on a terminal or a pipe, with --io and --flush-ms, and with the traps it
+was translated with (--host-traps). It does not count instructions, so there is no --steps, --stats or virtual
+time, and none of the things that go with a VM being looked at from outside (profile, journal, trace, snapshots).
+*/
+
+// the sources a translated program gets built with, for the comment at the top of it
+static const char vm_sources[] =
+    "lc3_vm.c lc3_io.c lc3_jit.c lc3_batch.c lc3_image.c lc3_snapshot.c\n"
+    "        lc3_profile.c lc3_journal.c lc3_trace.c lc3_traps.c lc3_analysis.c lc3_fuzz.c lc3_metrics.c lc3_serve.c\n"
+    "        lc3_aot.c lc3_cores.c lc3_block.c -lpthread";
+
+static const char* const op_names[16] = {
+    "BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR", "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"
+};
+
+// translation---------------------------------------------------------------------------------
+
+typedef struct {
+    VM* vm;
+    FILE* out;
+    uint64_t code[MAX_MEMORY / 64];     // the words the analysis found are code, all of them get translated
+    uint64_t labels[MAX_MEMORY / 64];   // the ones something jumps to, they get a label
+    uint64_t entries[MAX_MEMORY / 64];  // the ones the switch goes to, a label too
+    int entry_count;
+    int instructions;
+    int checked_stores;                 // stores that check for code at run time
+    int uses_address;                   // run() needs its local for an effective address
+    int rewrites;                       // and its exit for code that got written over
+    int leaves;                         // and a label on the exit for everything else
+} translation;
+
+static int bit(const uint64_t* bits, uint32_t address){
+    return address < MAX_MEMORY && (bits[address >> 6] >> (address & 63)) & 1;
+}
+
+static void set_bit(uint64_t* bits, uint32_t address){
+    bits[address >> 6] |= (uint64_t)1 << (address & 63);
+}
+
+// whether execution can go on to the next word after d
+static int falls_through(const decoded_instr* d){
+    return !(d->op == BR && d->r0 == 7) && d->op != JMP && d->op != JSR;
+}
+
+static void add_entry(translation* t, uint32_t address){
+    if (bit(t->code, address) && !bit(t->entries, address)){
+        set_bit(t->entries, address);
+        set_bit(t->labels, address);
+        t->entry_count++;
+    }
+}
+
+// the labels BR and JSR go to, and the addresses the switch has to know (see the top)
+static void find_targets(translation* t){
+
+    VM* vm = t->vm;
+    add_entry(t, vm->reg[R_PC]);
+    for (uint32_t address = 0; address < DEVICE_PAGE; address++){
+        if (!bit(t->code, address)){
+            uint16_t points_at = vm_peek(vm, (uint16_t)address);
+            if (points_at){
+                add_entry(t, points_at);  // a .FILL of a label, a jump table or a routine pointer
+            }
+            continue;
+        }
+        decoded_instr d;
+        decode_instr(vm_peek(vm, (uint16_t)address), &d);
+        uint16_t next = (uint16_t)(address + 1);
+        if (d.op == BR && d.r0 && bit(t->code, (uint16_t)(next + d.imm))){
+            set_bit(t->labels, (uint16_t)(next + d.imm));
+        } else if (d.op == JSR){
+            if (d.flag && bit(t->code, (uint16_t)(next + d.imm))){
+                set_bit(t->labels, (uint16_t)(next + d.imm));
+            }
+            add_entry(t, next);  // where the RET comes back to
+        } else if (d.op == LEA){
+            add_entry(t, (uint16_t)(next + d.imm));
+        }
+    }
+    // the code nothing falls into or branches to: the analysis got there through a register
+    int fell = 0;  // whether the word before falls through to this one
+    for (uint32_t address = 0; address < DEVICE_PAGE; address++){
+        if (bit(t->code, address) && !fell && !bit(t->labels, address)){
+            add_entry(t, address);
+        }
+        decoded_instr d;
+        decode_instr(vm_peek(vm, (uint16_t)address), &d);
+        fell = bit(t->code, address) && falls_through(&d);
+    }
+}
+
+// r plus a sign extended offset, the way it reads in the source
+static void emit_sum(FILE* out, int r, uint16_t offset){
+    fprintf(out, "r%d", r);
+    if (offset){
+        fprintf(out, (int16_t)offset < 0 ? " - %d" : " + %d", abs((int16_t)offset));
+    }
+}
+
+// execution goes on at target: its label if it is translated, otherwise run() leaves it to the interpreter
+static void emit_goto(translation* t, uint16_t target){
+    if (bit(t->code, target)){
+        fprintf(t->out, "goto x%04X;", target);
+    } else {
+        fprintf(t->out, "{ pc = 0x%04X; goto leave; }", target);
+        t->leaves = 1;
+    }
+}
+
+// the word a store writes is in a, the register in r. The store leaves run() if it overwrites translated code
+static void emit_checked_store(translation* t, int r, uint16_t next){
+    fprintf(t->out, "    if (aot_is_code(code, a)) { mem_write(vm, a, r%d); pc = 0x%04X; goto rewritten; }\n", r, next);
+    fprintf(t->out, "    aot_store(vm, a, r%d);\n", r);
+    t->checked_stores++;
+    t->uses_address = 1;
+    t->rewrites = 1;
+}
+
+// the condition a BR with the nzp bits in mask is taken on, from the value the flags come from (see cond_flags())
+static const char* const branch_conditions[8] = {
+    NULL, "(int16_t)cv > 0", "cv == 0", "(int16_t)cv >= 0", "(int16_t)cv < 0", "cv != 0", "(int16_t)cv <= 0", NULL
+};
+
+static void emit_instr(translation* t, uint16_t address){
+
+    VM* vm = t->vm;
+    FILE* out = t->out;
+    uint16_t instr = vm_peek(vm, address);
+    decoded_instr d;
+    decode_instr(instr, &d);
+    uint16_t next = address + 1;
+    uint16_t at = next + d.imm;  // for the PC-relative ones
+
+    if (bit(t->labels, address)){
+        fprintf(out, "x%04X:\n", address);
+    }
+    fprintf(out, "    // x%04X  x%04X  %s\n", address, instr, op_names[d.op]);
+    switch (d.op){
+        case BR:
+            if (d.r0 == 7){
+                fprintf(out, "    ");
+                emit_goto(t, at);
+                fprintf(out, "\n");
+            } else if (d.r0){
+                fprintf(out, "    if (%s) ", branch_conditions[d.r0]);
+                emit_goto(t, at);
+                fprintf(out, "\n");
+            }
+            break;  // BR with no flags is never taken
+        case ADD:
+        case AND:
+            fprintf(out, "    cv = r%d = ", d.r0);
+            if (d.op == ADD && d.flag){
+                emit_sum(out, d.r1, d.imm);
+            } else if (d.flag){
+                fprintf(out, "r%d & 0x%04X", d.r1, d.imm);
+            } else {
+                fprintf(out, "r%d %c r%d", d.r1, d.op == ADD ? '+' : '&', d.r2);
+            }
+            fprintf(out, ";\n");
+            break;
+        case NOT:
+            fprintf(out, "    cv = r%d = ~r%d;\n", d.r0, d.r1);
+            break;
+        case LEA:
+            fprintf(out, "    cv = r%d = 0x%04X;\n", d.r0, at);
+            break;
+        case LD:
+            fprintf(out, "    cv = r%d = %s(vm, 0x%04X);\n", d.r0, at == MR_KBSR ? "mem_read" : "vm_peek", at);
+            break;
+        case LDI:
+            fprintf(out, "    cv = r%d = aot_load(vm, %s(vm, 0x%04X));\n", d.r0, at == MR_KBSR ? "mem_read" : "vm_peek", at);
+            break;
+        case LDR:
+            fprintf(out, "    cv = r%d = aot_load(vm, ", d.r0);
+            emit_sum(out, d.r1, d.imm);
+            fprintf(out, ");\n");
+            break;
+        case ST:
+            // the address is known here, so is whether it is code
+            if (bit(t->code, at)){
+                fprintf(out, "    mem_write(vm, 0x%04X, r%d);\n    pc = 0x%04X;\n    goto rewritten;\n", at, d.r0, next);
+                t->rewrites = 1;
+            } else {
+                fprintf(out, "    aot_store(vm, 0x%04X, r%d);\n", at, d.r0);
+            }
+            break;
+        case STR:
+            if (vm_slot(vm, address)->op == OP_STR_DATA){
+                fprintf(out, "    aot_store(vm, ");  // vm_analyze() proved it never writes code
+                emit_sum(out, d.r1, d.imm);
+                fprintf(out, ", r%d);\n", d.r0);
+            } else {
+                fprintf(out, "    a = ");
+                emit_sum(out, d.r1, d.imm);
+                fprintf(out, ";\n");
+                emit_checked_store(t, d.r0, next);
+            }
+            break;
+        case STI:
+            fprintf(out, "    a = %s(vm, 0x%04X);\n", at == MR_KBSR ? "mem_read" : "vm_peek", at);
+            emit_checked_store(t, d.r0, next);
+            break;
+        case JMP:
+            fprintf(out, "    pc = r%d;\n    goto dispatch;\n", d.r1);
+            break;
+        case JSR:
+            fprintf(out, "    r7 = 0x%04X;\n", next);
+            if (d.flag){
+                fprintf(out, "    ");
+                emit_goto(t, at);
+                fprintf(out, "\n");
+            } else {
+                fprintf(out, "    pc = r%d;\n    goto dispatch;\n", d.r1);  // after R7, like the engines do it
+            }
+            break;
+        case TRAP:
+        {
+            trap_handler handler = (vm->traps ? vm->traps : standard_traps)[d.imm];
+            fprintf(out, "    SAVE();\n    vm->reg[R_PC] = 0x%04X;\n", next);
+            fprintf(out, "    if (!execute_trap(vm, 0x%04X)) return AOT_LEFT;\n    RESTORE();\n", instr);
+            if (handler && !(d.imm >= TRAP_GETC && d.imm <= TRAP_HALT && handler == standard_traps[d.imm])){
+                fprintf(out, "    if (aot_code_changed(vm)) { pc = 0x%04X; goto rewritten; }\n", next);
+                t->rewrites = 1;
+            }
+            break;
+        }
+        default:
+            break;  // RTI and the reserved opcode do nothing, --aot does not go with --interrupts
+    }
+    if (falls_through(&d) && !bit(t->code, next)){
+        fprintf(out, "    pc = 0x%04X;\n    goto leave;\n", next);  // into words the analysis never got to
+        t->leaves = 1;
+    }
+    t->instructions++;
+}
+
+// the words of page from its first one that is not zero to its last, 0 if they are all zero
+static int page_span(const VM* vm, int page, uint32_t* start, uint32_t* end){
+
+    *start = (uint32_t)page * PAGE_WORDS;
+    *end = *start + PAGE_WORDS;
+    while (*start < *end && !vm_peek(vm, (uint16_t)*start)){
+        (*start)++;
+    }
+    while (*end > *start && !vm_peek(vm, (uint16_t)(*end - 1))){
+        (*end)--;
+    }
+    return *start < *end;
+}
+
+// the memory the program starts with, a segment for every page that is not all zero
+static int emit_segments(translation* t){
+
+    FILE* out = t->out;
+    int count = 0;
+    uint32_t start, end;
+    for (int page = 0; page < PAGE_COUNT; page++){
+        if (!page_span(t->vm, page, &start, &end)){
+            continue;
+        }
+        fprintf(out, "static const uint16_t words_%04X[] = {", start);
+        for (uint32_t address = start; address < end; address++){
+            fprintf(out, "%s0x%04X,", (address - start) % 12 ? " " : "\n    ", vm_peek(t->vm, (uint16_t)address));
+        }
+        fprintf(out, "\n};\n");
+        count++;
+    }
+    fprintf(out, "\nstatic const aot_segment segments[] = {\n");
+    for (int page = 0; page < PAGE_COUNT; page++){
+        if (page_span(t->vm, page, &start, &end)){
+            fprintf(out, "    { 0x%04X, %u, words_%04X },\n", start, end - start, start);
+        }
+    }
+    if (!count){
+        fprintf(out, "    { 0, 0, NULL }\n");
+    }
+    fprintf(out, "};\n\n");
+    return count;
+}
+
+// run(), written to body first: what it declares depends on what the instructions turn out to need
+static int emit_run(translation* t, FILE* body){
+
+    FILE* out = t->out;
+    t->out = body;
+    for (uint32_t address = 0; address < DEVICE_PAGE; address++){
+        if (bit(t->code, address)){
+            emit_instr(t, (uint16_t)address);
+        }
+    }
+    fprintf(body, "\ndispatch:\n    switch (pc){\n");
+    for (uint32_t address = 0; address < DEVICE_PAGE; address++){
+        if (bit(t->entries, address)){
+            fprintf(body, "        case 0x%04X: goto x%04X;\n", address, address);
+        }
+    }
+    fprintf(body, "    }\n%s    SAVE();\n    vm->reg[R_PC] = pc;\n    return AOT_LEFT;\n", t->leaves ? "leave:\n" : "");
+    if (t->rewrites){
+        fprintf(body, "rewritten:\n    SAVE();\n    vm->reg[R_PC] = pc;\n    return AOT_REWRITTEN;\n");
+    }
+    fprintf(body, "}\n");
+    t->out = out;
+
+    fprintf(out, "// R0-R7 and the condition codes live in run()'s locals, these put them in the VM for traps and back\n");
+    fprintf(out, "#define SAVE() (vm->reg[R_R0] = r0, vm->reg[R_R1] = r1, vm->reg[R_R2] = r2, vm->reg[R_R3] = r3, \\\n"
+                 "                vm->reg[R_R4] = r4, vm->reg[R_R5] = r5, vm->reg[R_R6] = r6, vm->reg[R_R7] = r7, "
+                 "vm->cond_value = cv)\n");
+    fprintf(out, "#define RESTORE() (r0 = vm->reg[R_R0], r1 = vm->reg[R_R1], r2 = vm->reg[R_R2], r3 = vm->reg[R_R3], \\\n"
+                 "                   r4 = vm->reg[R_R4], r5 = vm->reg[R_R5], r6 = vm->reg[R_R6], r7 = vm->reg[R_R7], "
+                 "cv = vm->cond_value)\n\n");
+    fprintf(out, "static int run(VM* vm){\n\n");
+    fprintf(out, "    uint16_t r0, r1, r2, r3, r4, r5, r6, r7, cv;\n    uint16_t pc = vm->reg[R_PC];\n");
+    if (t->uses_address){
+        fprintf(out, "    uint16_t a;  // what a store writes to\n");
+    }
+    fprintf(out, "    RESTORE();\n    goto dispatch;\n\n");
+    rewind(body);
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), body)) > 0){
+        fwrite(buf, 1, n, out);
+    }
+    return !ferror(body);
+}
+
+/*
+writes the program loaded into vm out as the C source of a program of its own (see the top). images are the files
+it was loaded from, for the comment at the top of it. Returns main()'s exit status, 0 if it got written
+*/
+int aot_translate(VM* vm, const char* path, const char* const* images, int image_count){
+
+    translation* t = calloc(1, sizeof(translation));
+    FILE* body = tmpfile();
+    predecode_memory(vm);  // vm_analyze() marks the stores it proves in the decoded slots
+    if (!t || !body || vm_analyze(vm, NULL) < 0){
+        printf("out of memory\n");
+        exit(1);
+    }
+    t->vm = vm;
+    for (uint32_t address = 0; address < DEVICE_PAGE; address++){
+        if (analysis_is_code(vm, (uint16_t)address)){
+            set_bit(t->code, address);
+        }
+    }
+    find_targets(t);
+
+    FILE* out = fopen(path, "w");
+    if (!out){
+        printf("failed to write %s\n", path);
+        exit(1);
+    }
+    t->out = out;
+    const char* name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    int length = strlen(name) > 2 && strcmp(name + strlen(name) - 2, ".c") == 0 ? (int)strlen(name) - 2 : (int)strlen(name);
+    fprintf(out, "/*\n%s: ", name);
+    for (int i = 0; i < image_count; i++){
+        fprintf(out, "%s%s", i ? ", " : "", images[i]);
+    }
+    fprintf(out, " translated to C by lc3 --aot (see lc3_aot.c). Build it with the VM sources, -DLC3_NO_MAIN leaves\n"
+                 "out their main():\n\n    gcc -O2 -DLC3_NO_MAIN -o %.*s %s %s\n*/\n\n", length, name, name, vm_sources);
+    fprintf(out, "#include \"lc3_vm.h\"\n\n");
+
+    int segment_count = emit_segments(t);
+    fprintf(out, "static const uint64_t code[MAX_MEMORY / 64] = {");
+    int words = 0;
+    for (int i = 0; i < MAX_MEMORY / 64; i++){
+        if (t->code[i]){
+            fprintf(out, "%s[%d] = 0x%016llXull,", words++ % 3 ? " " : "\n    ", i, (unsigned long long)t->code[i]);
+        }
+    }
+    fprintf(out, "%s\n};\n\nstatic const uint16_t entries[] = {", words ? "" : "\n    0");
+    for (uint32_t address = 0, n = 0; address < DEVICE_PAGE; address++){
+        if (bit(t->entries, address)){
+            fprintf(out, "%s0x%04X,", n++ % 12 ? " " : "\n    ", address);
+        }
+    }
+    fprintf(out, "%s\n};\n\n", t->entry_count ? "" : "\n    0");
+
+    int written = emit_run(t, body);
+    fprintf(out, "\nstatic const aot_program program = {\n");
+    fprintf(out, "    segments, %d, code, entries, %d,\n    {", segment_count, t->entry_count);
+    for (int r = 0; r < R_COUNT; r++){
+        fprintf(out, "%s0x%04X", r ? ", " : " ", vm->reg[r]);
+    }
+    fprintf(out, " }, 0x%04X, %d, run\n};\n\n", vm->cond_value, vm->traps != NULL);
+    fprintf(out, "int main(int argc, const char* argv[]){\n    return aot_main(&program, argc, argv);\n}\n");
+    fclose(body);
+    if (!written || ferror(out) || fclose(out) != 0){
+        printf("failed to write %s\n", path);
+        free(t);
+        return 1;
+    }
+    printf("Translated %d instructions to %s (%d in the switch for JMP and JSRR, %d stores that check for code)\n",
+           t->instructions, path, t->entry_count, t->checked_stores);
+    free(t);
+    return 0;
+}
+
+// runtime---------------------------------------------------------------------------------
+
+static const aot_program* program;  // the one aot_main() runs
+static VM* program_vm;              // and its VM, for the interrupt handler
+static const aot_segment* page_segments[PAGE_COUNT];  // the segment in each page, NULL for one that started out zero
+
+static void interrupted(int signal){
+    (void)signal;
+    restore_input_buffering(program_vm);  // this also writes out whatever output is still buffered
+    printf("\n");
+    exit(-2);
+}
+
+/*
+1 if a translated word is not what it was translated from any more. Only the pages something wrote to through
+mem_write() since the last look are compared, translated stores do not mark pages dirty (see aot_store())
+*/
+int aot_code_changed(VM* vm){
+
+    for (int page = 0; page < DEVICE_PAGE >> PAGE_SHIFT; page++){
+        if (!vm->page_dirty[page]){
+            continue;
+        }
+        vm->page_dirty[page] = 0;
+        const aot_segment* s = page_segments[page];
+        for (uint32_t address = (uint32_t)page * PAGE_WORDS; address < (uint32_t)(page + 1) * PAGE_WORDS; address++){
+            if (!aot_is_code(program->code, (uint16_t)address)){
+                continue;
+            }
+            uint16_t was = s && address >= s->start && address < (uint32_t)s->start + s->count ? s->words[address - s->start] : 0;
+            if (vm_peek(vm, (uint16_t)address) != was){
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// main() of a translated program
+int aot_main(const aot_program* p, int argc, const char* argv[]){
+
+    VM* vm = vm_create();
+    if (!vm){
+        printf("out of memory\n");
+        exit(1);
+    }
+    program = p;
+    program_vm = vm;
+    vm->io = io_default_backend();
+    int flush_ms = -1;
+    for (int i = 1; i < argc; i++){
+        if (strncmp(argv[i], "--io=", 5) == 0 && io_backend_named(argv[i] + 5)){
+            vm->io = io_backend_named(argv[i] + 5);
+        } else if (strncmp(argv[i], "--flush-ms=", 11) == 0){
+            flush_ms = atoi(argv[i] + 11);
+        } else {
+            printf("enter in this format: %s [--io=console|headless] [--flush-ms=N]\n", argv[0]);
+            exit(2);
+        }
+    }
+
+    for (int i = 0; i < p->segment_count; i++){
+        const aot_segment* s = &p->segments[i];
+        page_segments[s->start >> PAGE_SHIFT] = s;
+        for (int w = 0; w < s->count; w++){
+            mem_write(vm, (uint16_t)(s->start + w), s->words[w]);
+        }
+    }
+    memcpy(vm->reg, p->reg, sizeof(vm->reg));
+    vm->cond_value = p->cond_value;
+    if (p->host_traps && !vm_add_host_traps(vm)){
+        printf("out of memory\n");
+        exit(1);
+    }
+    // the words run() was translated from, for the interpreter: the first one it gets to that is not code stops
+    // the analysis, and the stores run() leaves unchecked with it (see the top)
+    if (!vm_analysis_follow(vm, p->code)){
+        printf("out of memory\n");
+        exit(1);
+    }
+    // the interpreter stops wherever run() can take over
+    for (int i = 0; i < p->entry_count; i++){
+        vm_set_breakpoint(vm, p->entries[i], 1);
+    }
+    memset(vm->page_dirty, 0, sizeof(vm->page_dirty));
+
+    vm->out_flush_ms = flush_ms >= 0 ? flush_ms : (vm->io == &io_console ? 0 : 100);
+    signal(SIGINT, interrupted);
+    disable_input_buffering(vm);
+
+    int translated = 1;  // until the program writes over its own code or goes where the analysis did not see
+    while (vm->status != VM_HALTED){
+        if (translated && p->run(vm) == AOT_REWRITTEN){
+            translated = 0;
+            vm_clear_breakpoints(vm);
+        }
+        if (vm->status == VM_HALTED){
+            break;
+        }
+        vm_run(vm, 0);
+        if (translated && (!vm->analysis || aot_code_changed(vm))){
+            translated = 0;
+            vm_clear_breakpoints(vm);
+        }
+    }
+    restore_input_buffering(vm);
+    vm_destroy(vm);
+    return 0;
+}
@@ -0,0 +1,412 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lc3_vm.h"
+
+/*
+The batch runner runs lots of small programs in one process, each on its own VM, instead of starting a process per
+program. Every worker thread owns one VM and reuses it for job after job (vm_reset() is a lot cheaper than
+vm_create()), the program reads its input from memory and its output is collected in memory (io_memory).
+
+Jobs are shared out with work stealing. The job list is cut into one contiguous run of jobs per worker, and each of
+those runs is a deque: the worker takes jobs off the back of its own deque, and once that is empty it steals from
+the front of somebody else's. Workers only touch each other's deques when they run dry, so a few long running
+programs do not hold everyone else up, and there is no shared queue for all the threads to fight over. Nothing adds
+jobs once the batch has started, so a worker that finds every deque empty is done.
+
+Each deque has its own lock. A job is at least a vm_reset() and a program run, taking the lock for it costs nothing
+next to that.
+
+Every image is only loaded once, however many jobs run it. Before the workers start, each distinct image is loaded
+into a scratch VM and frozen into a vm_template, and a job starts by resetting its worker's VM to that template. The
+VMs share the template's pages and only copy the ones their program writes to (see vm_page in lc3_vm.h), so a
+thousand runs of one image with different inputs cost a thousand sets of written pages, not a thousand memories.
+*/
+
+#ifdef _WIN32
+
+#include <Windows.h>
+
+typedef HANDLE batch_thread;
+typedef CRITICAL_SECTION batch_lock;
+
+static void lock_init(batch_lock* l){ InitializeCriticalSection(l); }
+static void lock_free(batch_lock* l){ DeleteCriticalSection(l); }
+static void lock_take(batch_lock* l){ EnterCriticalSection(l); }
+static void lock_give(batch_lock* l){ LeaveCriticalSection(l); }
+
+int cpu_count(void){
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+}
+
+#else
+
+#include <pthread.h>
+#include <unistd.h>
+
+typedef pthread_t batch_thread;
+typedef pthread_mutex_t batch_lock;
+
+static void lock_init(batch_lock* l){ pthread_mutex_init(l, NULL); }
+static void lock_free(batch_lock* l){ pthread_mutex_destroy(l); }
+static void lock_take(batch_lock* l){ pthread_mutex_lock(l); }
+static void lock_give(batch_lock* l){ pthread_mutex_unlock(l); }
+
+int cpu_count(void){
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+#endif
+
+typedef struct batch_worker batch_worker;
+
+typedef struct {
+    batch_job* jobs;
+    vm_template** templates;    // the image of each job, loaded and frozen, NULL if it could not be loaded
+    batch_worker* workers;
+    int worker_count;
+    int engine;
+    uint64_t max_steps;
+} batch_state;
+
+struct batch_worker {
+    batch_lock lock;
+    int top, bottom;    // jobs[top..bottom) are still waiting, the owner takes from the bottom, thieves from the top
+    uint32_t seed;      // picks where to start looking for work to steal
+    batch_state* batch;
+    VM* vm;
+    batch_thread thread;
+};
+
+// takes a job off the back of this worker's own deque, -1 if it is empty
+static int take_own(batch_worker* w){
+    int job = -1;
+    lock_take(&w->lock);
+    if (w->top < w->bottom){
+        job = --w->bottom;
+    }
+    lock_give(&w->lock);
+    return job;
+}
+
+// takes a job off the front of some other worker's deque, -1 if there is nothing left anywhere
+static int steal(batch_worker* w){
+    batch_state* b = w->batch;
+    w->seed = w->seed * 1103515245u + 12345u;
+    int first = (int)((w->seed >> 16) % (uint32_t)b->worker_count);
+    for (int i = 0; i < b->worker_count; i++){
+        batch_worker* victim = &b->workers[(first + i) % b->worker_count];
+        if (victim == w){
+            continue;
+        }
+        int job = -1;
+        lock_take(&victim->lock);
+        if (victim->top < victim->bottom){
+            job = victim->top++;
+        }
+        lock_give(&victim->lock);
+        if (job >= 0){
+            return job;
+        }
+    }
+    return -1;
+}
+
+static void run_job(batch_worker* w, int index){
+    VM* vm = w->vm;
+    batch_job* job = &w->batch->jobs[index];
+    const vm_template* t = w->batch->templates[index];
+    job->loaded = t != NULL;
+    if (!job->loaded){
+        return;
+    }
+    vm_reset_to(vm, t);
+    vm_set_input(vm, job->input, job->input_len);
+    job->status = vm_run(vm, w->batch->max_steps);
+    job->steps = vm->steps;
+    io_flush(vm);  // a program stopped by max_steps can still have output in the buffer
+
+    // the job keeps the output, the VM starts a new buffer for the next one
+    job->output = vm->output;
+    job->output_len = vm->output_len;
+    vm->output = NULL;
+    vm->output_len = vm->output_cap = 0;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI worker_main(LPVOID arg)
+#else
+static void* worker_main(void* arg)
+#endif
+{
+    batch_worker* w = arg;
+    for (;;){
+        int job = take_own(w);
+        if (job < 0){
+            job = steal(w);
+        }
+        if (job < 0){
+            break;
+        }
+        run_job(w, job);
+    }
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+typedef struct {
+    const char* image_path;
+    int job;
+} image_ref;
+
+static int compare_image_refs(const void* a, const void* b){
+    const image_ref* x = a;
+    const image_ref* y = b;
+    int order = strcmp(x->image_path, y->image_path);
+    return order ? order : x->job - y->job;
+}
+
+// loads every distinct image once and points all the jobs that run it at the same template, returns the number
+// of templates made (the ones that loaded), or -1 if it ran out of memory
+static int load_templates(batch_job* jobs, int job_count, vm_template** templates, vm_template** unique){
+    image_ref* refs = malloc(sizeof(image_ref) * (size_t)job_count);
+    VM* scratch = vm_create();
+    if (!refs || !scratch){
+        free(refs);
+        vm_destroy(scratch);
+        return -1;
+    }
+    for (int i = 0; i < job_count; i++){
+        refs[i].image_path = jobs[i].image_path;
+        refs[i].job = i;
+    }
+    qsort(refs, (size_t)job_count, sizeof(image_ref), compare_image_refs);
+
+    int made = 0;
+    vm_template* t = NULL;
+    for (int i = 0; i < job_count; i++){
+        if (i == 0 || strcmp(refs[i].image_path, refs[i - 1].image_path) != 0){
+            vm_reset(scratch);
+            t = vm_load_image(scratch, refs[i].image_path) ? vm_template_create(scratch) : NULL;
+            if (t){
+                unique[made++] = t;
+            }
+        }
+        templates[refs[i].job] = t;
+    }
+    vm_destroy(scratch);  // the templates do not point into it, it had no template of its own
+    free(refs);
+    return made;
+}
+
+// runs every job on up to threads worker threads (0 for one per CPU), returns 0 if it could not get going at all
+int batch_run(batch_job* jobs, int job_count, int threads, int engine, uint64_t max_steps){
+
+    if (threads <= 0){
+        threads = cpu_count();
+    }
+    if (threads > job_count){
+        threads = job_count;
+    }
+    if (threads == 0){
+        return 1;
+    }
+
+    vm_template** templates = calloc((size_t)job_count * 2, sizeof(vm_template*));  // one per job, then the distinct ones
+    int template_count = templates ? load_templates(jobs, job_count, templates, templates + job_count) : -1;
+    batch_state b = { jobs, templates, calloc((size_t)threads, sizeof(batch_worker)), threads, engine, max_steps };
+    if (template_count < 0 || !b.workers){
+        free(templates);
+        free(b.workers);
+        return 0;
+    }
+
+    int started = 0;
+    for (int i = 0; i < threads; i++){
+        batch_worker* w = &b.workers[i];
+        lock_init(&w->lock);
+        w->top = (int)((long long)job_count * i / threads);
+        w->bottom = (int)((long long)job_count * (i + 1) / threads);
+        w->seed = (uint32_t)i * 2654435761u + 1;
+        w->batch = &b;
+        w->vm = vm_create();
+        if (w->vm){
+            w->vm->engine = engine;
+        }
+    }
+    for (int i = 0; i < threads; i++){
+        batch_worker* w = &b.workers[i];
+        if (!w->vm){
+            continue;  // its jobs get stolen by the others
+        }
+#ifdef _WIN32
+        w->thread = CreateThread(NULL, 0, worker_main, w, 0, NULL);
+        int ok = w->thread != NULL;
+#else
+        int ok = pthread_create(&w->thread, NULL, worker_main, w) == 0;
+#endif
+        if (!ok){
+            vm_destroy(w->vm);
+            w->vm = NULL;
+            continue;
+        }
+        started++;
+    }
+    for (int i = 0; i < threads; i++){
+        batch_worker* w = &b.workers[i];
+        if (!w->vm){
+            continue;
+        }
+#ifdef _WIN32
+        WaitForSingleObject(w->thread, INFINITE);
+        CloseHandle(w->thread);
+#else
+        pthread_join(w->thread, NULL);
+#endif
+        vm_destroy(w->vm);
+    }
+    for (int i = 0; i < threads; i++){
+        lock_free(&b.workers[i].lock);
+    }
+    free(b.workers);
+    for (int i = 0; i < template_count; i++){
+        vm_template_destroy(templates[job_count + i]);
+    }
+    free(templates);
+    return started > 0;
+}
+
+// command line front end---------------------------------------------------------------------------------
+
+static char* read_whole_file(const char* path, size_t* size){
+    FILE* file = fopen(path, "rb");
+    if (!file){
+        return NULL;
+    }
+    size_t cap = 4096, len = 0;
+    char* data = malloc(cap + 1);  // one spare byte, so the caller can put a 0 after the data
+    size_t got;
+    while (data && (got = fread(data + len, 1, cap - len, file)) > 0){
+        len += got;
+        if (len == cap){
+            cap *= 2;
+            char* grown = realloc(data, cap + 1);
+            if (!grown){
+                free(data);
+            }
+            data = grown;
+        }
+    }
+    fclose(file);
+    *size = len;
+    return data;
+}
+
+static void add_job(batch_job** jobs, int* count, int* cap, const char* image_path, char* input, size_t input_len){
+    if (*count == *cap){
+        *cap = *cap ? *cap * 2 : 64;
+        *jobs = realloc(*jobs, sizeof(batch_job) * (size_t)*cap);
+    }
+    batch_job* job = &(*jobs)[(*count)++];
+    memset(job, 0, sizeof(*job));
+    job->image_path = image_path;
+    job->input = input;
+    job->input_len = input_len;
+}
+
+/*
+lc3 --batch[=threads] [--jobs=job-list] [image-file] ...
+
+Every image is run as a program of its own. The job list has one job per line, an image file optionally followed by
+a file the program reads its input from, blank lines and lines starting with # are skipped. Images named on the
+command line get no input. The results are printed in job order once everything has finished:
+
+    == games/hello.obj: halted after 312 instructions
+    Hello World!
+    HALT
+
+Returns 0 if every program halted, 1 if an image or input file could not be read, 3 if max_steps stopped a program.
+*/
+int batch_main(const char* job_list, const char* const* images, int image_count, int threads, int engine, uint64_t max_steps){
+
+    batch_job* jobs = NULL;
+    int count = 0, cap = 0;
+    int result = 0;
+    char* text = NULL;  // the job list, the jobs point into it
+
+    if (job_list){
+        size_t size;
+        text = read_whole_file(job_list, &size);
+        if (!text){
+            printf("failed to read job list: %s\n", job_list);
+            return 1;
+        }
+        text[size] = 0;
+        char* line = text;
+        while (*line){
+            char* end = line + strcspn(line, "\r\n");
+            char* next = end + strspn(end, "\r\n");
+            *end = 0;
+            char* image = line + strspn(line, " \t");
+            if (*image && *image != '#'){
+                char* gap = image + strcspn(image, " \t");
+                char* input_path = gap + strspn(gap, " \t");
+                *gap = 0;
+                char* input = NULL;
+                size_t input_len = 0;
+                if (*input_path){
+                    input_path[strcspn(input_path, " \t")] = 0;
+                    input = read_whole_file(input_path, &input_len);
+                    if (!input){
+                        printf("failed to read input file: %s\n", input_path);
+                        result = 1;
+                    }
+                }
+                add_job(&jobs, &count, &cap, image, input, input_len);
+            }
+            line = next;
+        }
+    }
+    for (int i = 0; i < image_count; i++){
+        add_job(&jobs, &count, &cap, images[i], NULL, 0);
+    }
+
+    if (!batch_run(jobs, count, threads, engine, max_steps)){
+        printf("failed to start the batch\n");
+        return 1;
+    }
+
+    for (int i = 0; i < count; i++){
+        batch_job* job = &jobs[i];
+        if (!job->loaded){
+            printf("== %s: failed to load image\n", job->image_path);
+            result = 1;
+            continue;
+        }
+        if (job->status == VM_HALTED){
+            printf("== %s: halted after %llu instructions\n", job->image_path, (unsigned long long)job->steps);
+        } else {
+            printf("== %s: stopped after %llu instructions\n", job->image_path, (unsigned long long)job->steps);
+            if (result == 0){
+                result = 3;
+            }
+        }
+        fwrite(job->output, 1, job->output_len, stdout);
+        if (job->output_len && job->output[job->output_len - 1] != '\n'){
+            putchar('\n');
+        }
+        free(job->output);
+        free((void*)job->input);  // read_whole_file() allocated it
+    }
+    free(jobs);
+    free(text);
+    return result;
+}
@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lc3_vm.h"
+
+/*
+The block device (see lc3_vm.h for what the program sees). The file is mapped into the address space the way
+lc3_image.c maps images, so a transfer is a copy out of the page cache straight into the VM's pages: a memcpy for
+BLOCK_READ_PACKED on little endian hosts, and a loop the compiler vectorizes for BLOCK_READ. A file that cannot be
+mapped (a pipe, say) is read into memory whole instead.
+
+The registers live in the VM's own device page like KBSR and KBDR, so vm_reset_to() puts them back (block_reset())
+and a snapshot keeps them, offset and all: a restored program given the same --block file reads on where it was.
+Only the VM the file was opened on has the device, which for --cores is core 0.
+*/
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+struct vm_block {
+    const unsigned char* data;
+    uint32_t size;      // the bytes a transfer can get to, what MR_BLOCK_SIZE says
+    size_t mapped;      // the length of the mapping, 0 if data was read in with stdio (or the file is empty)
+};
+
+// the stdio path, for files that cannot be mapped
+static unsigned char* read_whole(const char* path, size_t* size){
+    FILE* file = fopen(path, "rb");
+    if (!file){
+        return NULL;
+    }
+    size_t len = 0, cap = 1 << 16;
+    unsigned char* data = malloc(cap);
+    size_t n;
+    while (data && (n = fread(data + len, 1, cap - len, file)) > 0){
+        len += n;
+        if (len == cap){
+            unsigned char* grown = realloc(data, cap * 2);
+            if (!grown){
+                free(data);
+                data = NULL;
+                break;
+            }
+            data = grown;
+            cap *= 2;
+        }
+    }
+    fclose(file);
+    *size = len;
+    return data;
+}
+
+static const unsigned char* map_file(const char* path, size_t* size, int* missing){
+
+    *missing = 0;
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE){
+        *missing = 1;
+        return NULL;
+    }
+    LARGE_INTEGER length;
+    HANDLE mapping = NULL;
+    const unsigned char* data = NULL;
+    if (GetFileSizeEx(file, &length) && length.QuadPart > 0){
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    }
+    if (mapping){
+        data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(mapping);  // the view stays valid without either handle
+    }
+    CloseHandle(file);
+    *size = data ? (size_t)length.QuadPart : 0;
+    return data;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0){
+        *missing = 1;
+        return NULL;
+    }
+    struct stat st;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0){
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED){
+        return NULL;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+    *size = (size_t)st.st_size;
+    return data;
+#endif
+}
+
+int vm_block_open(VM* vm, const char* path){
+
+    vm_block* b = calloc(1, sizeof(vm_block));
+    if (!b){
+        return 0;
+    }
+    int missing;
+    size_t size;
+    b->data = map_file(path, &size, &missing);
+    if (b->data){
+        b->mapped = size;
+    } else if (missing || !(b->data = read_whole(path, &size))){
+        free(b);
+        return 0;
+    }
+    b->size = size > UINT32_MAX ? UINT32_MAX : (uint32_t)size;
+    vm_block_close(vm);
+    vm->block = b;
+    block_reset(vm);
+    return 1;
+}
+
+void vm_block_close(VM* vm){
+
+    vm_block* b = vm->block;
+    if (!b){
+        return;
+    }
+    vm->block = NULL;
+    if (b->mapped){
+#ifdef _WIN32
+        UnmapViewOfFile(b->data);
+#else
+        munmap((void*)b->data, b->mapped);
+#endif
+    } else {
+        free((void*)b->data);
+    }
+    free(b);
+}
+
+void block_reset(VM* vm){
+
+    for (uint16_t address = MR_BLOCK_BUFFER; address <= MR_BLOCK_SIZE_HIGH; address += 2){
+        device_word(vm, address) = 0;
+    }
+    device_word(vm, MR_BLOCK_STATUS) = BLOCK_DONE;
+    device_word(vm, MR_BLOCK_SIZE) = (uint16_t)vm->block->size;
+    device_word(vm, MR_BLOCK_SIZE_HIGH) = (uint16_t)(vm->block->size >> 16);
+    vm->page_dirty[DEVICE_PAGE >> PAGE_SHIFT] = 1;
+}
+
+static int little_endian(void){
+    const uint16_t one = 1;
+    return *(const uint8_t*)&one;
+}
+
+// count words from src into memory at address, one byte each or packed two to a word. The last packed word can
+// have only its low byte in the file, bytes says how many there are
+static void fill(VM* vm, uint32_t address, uint32_t count, const unsigned char* src, uint32_t bytes, int packed){
+
+    uint32_t end = address + count;
+    for (uint32_t a = address; vm->code_words && a < end; a++){
+        analysis_written(vm, (uint16_t)a);  // an overlay over code the analysis proved stores from
+    }
+    while (address < end){
+        uint32_t offset = address & (PAGE_WORDS - 1);
+        uint32_t n = PAGE_WORDS - offset;
+        if (n > end - address){
+            n = end - address;
+        }
+        // the same as mem_write() for every word, a page at a time (like load_words() in lc3_image.c)
+        int page = (int)(address >> PAGE_SHIFT);
+        int fresh = n == PAGE_WORDS && !vm->page_owned[page];
+        vm_page* p = fresh ? vm_replace_page(vm, page) : vm_own_page(vm, page);
+        vm->page_dirty[page] = 1;
+        uint16_t* w = p->words + offset;
+        if (!packed){
+            for (uint32_t i = 0; i < n; i++){
+                w[i] = src[i];
+            }
+            src += n;
+        } else {
+            uint32_t whole = n * 2 <= bytes ? n : bytes / 2;  // the words with both bytes in the file
+            if (little_endian()){
+                memcpy(w, src, whole * 2);
+            } else {
+                for (uint32_t i = 0; i < whole; i++){
+                    w[i] = (uint16_t)(src[2 * i] | src[2 * i + 1] << 8);
+                }
+            }
+            if (whole < n){
+                w[whole] = src[2 * whole];
+            }
+            src += n * 2;
+            bytes -= whole * 2;
+        }
+        for (uint32_t i = offset; !fresh && i < offset + n; i++){
+            p->decoded[i].op = OP_DECODE;
+        }
+        if (vm->jit){
+            for (uint32_t a = address; a < address + n; a++){
+                if (vm->jit_code_map[a]){
+                    jit_invalidate(vm, (uint16_t)a);
+                }
+            }
+        }
+        address += n;
+    }
+}
+
+void block_control(VM* vm, uint16_t command){
+
+    vm_block* b = vm->block;
+    uint32_t buffer = device_word(vm, MR_BLOCK_BUFFER);
+    uint32_t length = device_word(vm, MR_BLOCK_LENGTH);
+    uint32_t offset = device_word(vm, MR_BLOCK_OFFSET) | (uint32_t)device_word(vm, MR_BLOCK_OFFSET_HIGH) << 16;
+    uint16_t status = BLOCK_DONE;
+    uint32_t count = 0;
+
+    vm_journal_clear(vm);  // the journal cannot undo the transfer, or the registers it changes
+    if ((command != BLOCK_READ && command != BLOCK_READ_PACKED) || buffer + length > DEVICE_PAGE){
+        status |= BLOCK_FAILED;
+    } else {
+        int packed = command == BLOCK_READ_PACKED;
+        uint32_t left = offset < b->size ? b->size - offset : 0;
+        uint32_t bytes = packed ? (length * 2 < left ? length * 2 : left) : (length < left ? length : left);
+        count = packed ? (bytes + 1) / 2 : bytes;
+        if (count){
+            fill(vm, buffer, count, b->data + offset, bytes, packed);
+        }
+        offset += bytes;
+        if (offset >= b->size){
+            status |= BLOCK_END;
+        }
+    }
+    device_word(vm, MR_BLOCK_OFFSET) = (uint16_t)offset;
+    device_word(vm, MR_BLOCK_OFFSET_HIGH) = (uint16_t)(offset >> 16);
+    device_word(vm, MR_BLOCK_STATUS) = status;
+    device_word(vm, MR_BLOCK_COUNT) = (uint16_t)count;
+}
@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lc3_vm.h"
+
+/*
+Multi-core machine. lc3 --cores=N runs N LC-3 cores on N host threads, one VM each, all of them on one memory:
+core 0 is the VM main() loaded the images into, and the others point their page tables at its pages and mark them
+their own, so a store on any core goes straight into the page every core reads (copy on write never comes into it).
+Only the device page is a core's own (see vm_page in lc3_vm.h), with the core's number in MR_CORE and the number of
+cores in MR_CORES. Every core starts at the same PC with the same registers, and a program that wants them to do
+different things reads MR_CORE first.
+
+Every core has the rest of the ISA (see the interrupts section of lc3_vm.h): its own PSR, supervisor stack and vector
+table. The supervisor stacks start 256 words apart below x3000 (core 1 at x2F00 and so on) and the tables all start
+at x0100, a core that wants a table of its own writes where it is to MR_VECTORS. Only core 0 has the keyboard, the
+others have no input (GETC reads xFFFF) and write their output to stdout themselves, a batch at a time like core 0.
+
+The memory model is what the host gives aligned 16 bit words:
+
+- a load sees the whole of some word that was stored there, never half of one
+- apart from that nothing is promised about the order other cores see a core's loads and stores in
+- TRAP x37 (SWAP, R0 and the word at R1 change places) is atomic and a full barrier, so it is the way to take a
+  lock, and to give one back: the stores before a SWAP are seen by any core that sees the SWAP
+
+The decoded instructions are shared along with the words. A core that rewrites code another core is running at the
+same time can leave that core running the old instruction or the new one, so code should be written before the
+cores that run it get to it, or run with --engine=switch, which decodes every word as it fetches it. The JIT keeps
+compiled blocks per VM and would not see the other cores' stores, --cores runs the threaded engine instead.
+
+The run ends when every core has halted, or used up --steps (each core gets that many). lc3 exits with 0 if they
+all halted and 3 if not.
+*/
+
+#ifdef _WIN32
+#include <Windows.h>
+typedef HANDLE core_thread;
+#else
+#include <pthread.h>
+typedef pthread_t core_thread;
+#endif
+
+enum { CORE_STACK_GAP = 0x100 };  // words between the starts of the cores' supervisor stacks
+
+typedef struct {
+    VM* vm;
+    uint64_t max_steps;
+    int status;
+    core_thread thread;
+} core;
+
+#ifdef _WIN32
+static DWORD WINAPI core_main(LPVOID arg)
+#else
+static void* core_main(void* arg)
+#endif
+{
+    core* c = arg;
+    c->status = vm_run(c->vm, c->max_steps);
+    io_flush(c->vm);
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+// the core number on a machine of count cores that shares vm's memory, NULL if there is no memory for it
+static VM* core_create(VM* vm, int number, int count){
+
+    VM* c = vm_create();
+    if (!c){
+        return NULL;
+    }
+    for (int page = 0; page < DEVICE_PAGE >> PAGE_SHIFT; page++){
+        c->pages[page] = vm->pages[page];
+        c->page_owned[page] = 1;  // so mem_write() writes into it, core_destroy() gives it back before vm_destroy()
+    }
+    for (int vector = 0; vector < 256; vector++){
+        trap_handler handler = (vm->traps ? vm->traps : standard_traps)[vector];
+        if (handler != standard_traps[vector] && !vm_set_trap(c, (uint8_t)vector, handler)){
+            vm_destroy(c);
+            return NULL;
+        }
+    }
+    memcpy(c->reg, vm->reg, sizeof(c->reg));
+    c->cond_value = vm->cond_value;
+    c->engine = vm->engine;
+    c->out_flush_ms = vm->out_flush_ms;
+    c->out_puts_write = vm->out_puts_write;
+    c->io = &io_headless;  // for its output, there is no input to come: vm_set_input() left nothing to read
+    c->in_eof = 1;
+    vm_start_interrupts(c);
+    mem_write(c, MR_CORE, (uint16_t)number);
+    mem_write(c, MR_CORES, (uint16_t)count);
+    c->saved_ssp = (uint16_t)(SSP_START - number * CORE_STACK_GAP);
+    return c;
+}
+
+static void core_destroy(VM* c){
+
+    for (int page = 0; page < DEVICE_PAGE >> PAGE_SHIFT; page++){
+        c->page_owned[page] = 0;  // core 0's
+    }
+    vm_destroy(c);
+}
+
+/*
+lc3 --cores=N [--engine=...] [--steps=N] [--stats] [image-file] ...
+
+Runs the program vm has loaded on count cores, up to max_steps instructions each (0 for no limit). With stats it
+says how many instructions every core ran. Returns what main() exits with.
+*/
+int cores_main(VM* vm, int count, uint64_t max_steps, int stats){
+
+    if (vm->engine == ENGINE_JIT){
+        vm->engine = ENGINE_THREADED;
+    }
+    for (int page = 0; page < DEVICE_PAGE >> PAGE_SHIFT; page++){
+        vm_own_page(vm, page);  // memory nobody wrote to yet too, the cores share the pages themselves
+    }
+    if (vm->engine != ENGINE_SWITCH){
+        predecode_memory(vm);  // before the others share it, so the cores mostly only read the slots
+    }
+    if (!vm_set_trap(vm, TRAP_SWAP, host_trap_swap)){  // the others get it from vm's table
+        printf("out of memory\n");
+        return 1;
+    }
+    vm_start_interrupts(vm);
+    mem_write(vm, MR_CORE, 0);
+    mem_write(vm, MR_CORES, (uint16_t)count);
+
+    core* cores = calloc((size_t)count, sizeof(core));
+    if (!cores){
+        printf("out of memory\n");
+        return 1;
+    }
+    cores[0].vm = vm;
+    for (int i = 1; i < count; i++){
+        cores[i].vm = core_create(vm, i, count);
+        if (!cores[i].vm){
+            printf("out of memory\n");
+            exit(1);
+        }
+    }
+
+    disable_input_buffering(vm);
+    uint64_t started = io_clock(vm);  // milliseconds, --cores is never in virtual time
+    for (int i = 0; i < count; i++){
+        core* c = &cores[i];
+        c->max_steps = max_steps;
+#ifdef _WIN32
+        c->thread = CreateThread(NULL, 0, core_main, c, 0, NULL);
+        int ok = c->thread != NULL;
+#else
+        int ok = pthread_create(&c->thread, NULL, core_main, c) == 0;
+#endif
+        if (!ok){
+            restore_input_buffering(vm);
+            printf("failed to start a thread for core %d\n", i);
+            exit(1);
+        }
+    }
+    int halted = 1;
+    uint64_t steps = 0;
+    for (int i = 0; i < count; i++){
+        core* c = &cores[i];
+#ifdef _WIN32
+        WaitForSingleObject(c->thread, INFINITE);
+        CloseHandle(c->thread);
+#else
+        pthread_join(c->thread, NULL);
+#endif
+        halted &= c->status == VM_HALTED;
+        steps += c->vm->steps;
+    }
+    double seconds = (double)(io_clock(vm) - started) / 1000;
+    restore_input_buffering(vm);
+
+    if (stats){
+        for (int i = 0; i < count; i++){
+            fprintf(stderr, "core %d: %llu instructions%s\n", i, (unsigned long long)cores[i].vm->steps,
+                    cores[i].status == VM_HALTED ? "" : ", did not halt");
+        }
+        fprintf(stderr, "%llu instructions in %.3f s on %d cores, %.1f MIPS\n", (unsigned long long)steps, seconds,
+                count, seconds > 0 ? steps / seconds / 1e6 : 0.0);
+    }
+    for (int i = 1; i < count; i++){
+        core_destroy(cores[i].vm);
+    }
+    free(cores);
+    return halted ? 0 : 3;
+}
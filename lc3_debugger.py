@@ -1,8 +1,13 @@
 import tkinter as tk
 from tkinter import ttk, filedialog, messagebox, scrolledtext
+import tkinter.font as tkfont
 import struct
+import os
+import sys
+import ctypes
 import threading
 import time
+from collections import deque
 from typing import Dict, Set, Optional, List, Tuple
 
 class LC3VirtualMachine:
@@ -11,6 +16,8 @@ class LC3VirtualMachine:
         # Memory
         self.MAX_MEMORY = 1 << 16
         self.memory = [0] * self.MAX_MEMORY
+        self.PAGE_SHIFT, self.PAGE_WORDS, self.PAGE_COUNT = 9, 512, 128  # the same pages as lc3_vm.h
+        self.dirty_pages: Set[int] = set()  # pages written to since take_dirty_pages()
         
         # Registers
         self.R_R0, self.R_R1, self.R_R2, self.R_R3 = 0, 1, 2, 3
@@ -35,21 +42,37 @@ class LC3VirtualMachine:
         # Memory mapped registers
         self.MR_KBSR, self.MR_KBDR = 0xFE00, 0xFE02
         
+        # Why the last run stopped, and watchpoint kinds (the same numbers as in lc3_vm.h)
+        self.STOP_NONE, self.STOP_AT, self.STOP_BREAKPOINT = 0, 1, 2
+        self.STOP_WATCH_READ, self.STOP_WATCH_WRITE = 3, 4
+        self.WATCH_READ, self.WATCH_WRITE = 1, 2
+        
         # Debugging state
         self.running = False
         self.halted = False
         self.breakpoints: Set[int] = set()
+        self.watchpoints: Dict[int, int] = {}  # address -> WATCH_READ | WATCH_WRITE
+        self.stop_reason = 0
+        self.stop_address = 0
+        self.watch_hit: Optional[Tuple[int, int]] = None
         self.step_mode = False
         self.output_buffer = []
         self.input_buffer = []
         self.wait_for_input = False  # New flag for input waiting
         
+        # Reverse execution: for every instruction the registers before it, the (address, old word) pairs it
+        # stored over, the keyboard registers it changed and the characters it read, see step_back()
+        self.JOURNAL_STEPS = 100000
+        self.journal = deque(maxlen=self.JOURNAL_STEPS)
+        self.undo = None  # the entry of the instruction being executed
+        
         # Initialize
         self.reset()
     
     def reset(self):
         """Reset the virtual machine to initial state"""
         self.memory = [0] * self.MAX_MEMORY
+        self.dirty_pages = set(range(self.PAGE_COUNT))
         self.reg = [0] * self.R_COUNT
         self.reg[self.R_COND] = self.FL_ZERO
         self.reg[self.R_PC] = 0x3000
@@ -58,6 +81,8 @@ class LC3VirtualMachine:
         self.output_buffer = []
         self.input_buffer = []
         self.wait_for_input = False  # Reset input wait flag
+        self.stop_reason = self.STOP_NONE
+        self.journal.clear()
     
     def sign_extend(self, x: int, num_bits: int) -> int:
         """Sign extend a value to 16 bits"""
@@ -82,23 +107,50 @@ class LC3VirtualMachine:
         """Read from memory with memory-mapped I/O handling"""
         address &= 0xFFFF
         if address == self.MR_KBSR:
+            if self.undo is not None:
+                self.undo[2].append((self.MR_KBSR, self.memory[self.MR_KBSR]))
+                self.undo[2].append((self.MR_KBDR, self.memory[self.MR_KBDR]))
             if self.input_buffer:
                 self.memory[self.MR_KBSR] = 1 << 15
-                self.memory[self.MR_KBDR] = ord(self.input_buffer.pop(0))
+                self.memory[self.MR_KBDR] = ord(self.take_input())
             else:
                 self.memory[self.MR_KBSR] = 0
+            self.dirty_pages.add(self.MR_KBSR >> self.PAGE_SHIFT)
+        if self.watch_hit is None and self.watchpoints.get(address, 0) & self.WATCH_READ:
+            self.watch_hit = (self.STOP_WATCH_READ, address)
         return self.memory[address]
     
     def mem_write(self, address: int, val: int):
         """Write to memory"""
         address &= 0xFFFF
         val &= 0xFFFF
+        if self.watch_hit is None and self.watchpoints.get(address, 0) & self.WATCH_WRITE:
+            self.watch_hit = (self.STOP_WATCH_WRITE, address)
+        if self.undo is not None:
+            self.undo[1].append((address, self.memory[address]))
         self.memory[address] = val
+        self.dirty_pages.add(address >> self.PAGE_SHIFT)
+    
+    def take_input(self) -> str:
+        """The next input character, the caller has checked there is one"""
+        char = self.input_buffer.pop(0)
+        if self.undo is not None:
+            self.undo[3].append(char)
+        return char
+    
+    def take_dirty_pages(self) -> Set[int]:
+        """The pages written to since the last call, for redrawing only what changed"""
+        pages, self.dirty_pages = self.dirty_pages, set()
+        return pages
     
     def load_program(self, data: bytes) -> bool:
         """Load a program from binary data"""
         if len(data) < 2:
             return False
+        self.journal.clear()  # history from before the load cannot be undone over it
+        
+        if data[:4] == b'LC3N':
+            return self.load_native(data)
         
         try:
             # Read origin address
@@ -113,6 +165,7 @@ class LC3VirtualMachine:
                     break
                 word = struct.unpack('>H', program_data[i*2:(i+1)*2])[0]
                 self.memory[origin + i] = word
+            self.dirty_pages.update(range(self.PAGE_COUNT))
             
             self.reg[self.R_PC] = origin
             
@@ -120,18 +173,108 @@ class LC3VirtualMachine:
         except:
             return False
     
+    def load_native(self, data: bytes) -> bool:
+        """Load a native image (see lc3_image.c), PC starts at the first segment"""
+        if len(data) < 8:
+            return False
+        order = '<' if struct.unpack('<H', data[4:6])[0] == 0x0102 else '>'
+        if struct.unpack(order + 'H', data[4:6])[0] != 0x0102:
+            return False
+        count = struct.unpack(order + 'H', data[6:8])[0]
+        pos = 8
+        segments = []
+        for _ in range(count):
+            if len(data) - pos < 8:
+                return False
+            origin, _, words = struct.unpack(order + 'HHI', data[pos:pos + 8])
+            if origin + words > self.MAX_MEMORY or len(data) - pos - 8 < words * 2:
+                return False
+            segments.append((origin, struct.unpack(f'{order}{words}H', data[pos + 8:pos + 8 + words * 2])))
+            pos += 8 + words * 2
+        if pos != len(data):
+            return False
+        
+        for origin, words in segments:
+            self.memory[origin:origin + len(words)] = list(words)
+        self.dirty_pages.update(range(self.PAGE_COUNT))
+        if segments:
+            self.reg[self.R_PC] = segments[0][0]
+        return True
+    
+    def load_snapshot(self, data: bytes, base_dir: str = '') -> bool:
+        """Load a snapshot written by lc3_vm --snapshot (see lc3_snapshot.c): the images it names are loaded
+        again, checked against its hash, and the pages and registers it saved go on top"""
+        PAGE_WORDS = 512
+        if len(data) < 56 or data[:4] != b'LC3S':
+            return False
+        order = '<' if struct.unpack('<H', data[4:6])[0] == 0x0102 else '>'
+        header = struct.unpack(order + 'HH10HHHQQQ', data[4:56])
+        byte_order, version = header[0], header[1]
+        regs = header[2:12]
+        image_count, page_count, steps, input_consumed, base_hash = header[12:]
+        if byte_order != 0x0102 or version != 1:
+            return False
+        
+        pos = 56
+        images = []
+        for _ in range(image_count):
+            if len(data) - pos < 2:
+                return False
+            length = struct.unpack(order + 'H', data[pos:pos + 2])[0]
+            images.append(data[pos + 2:pos + 2 + length].decode())
+            pos += 2 + length + (length & 1)
+        if len(data) - pos != page_count * (4 + PAGE_WORDS * 2):
+            return False
+        
+        self.reset()
+        for path in images:
+            # the paths are the ones lc3_vm was given, try them next to the snapshot too
+            if not os.path.exists(path) and base_dir:
+                path = os.path.join(base_dir, path)
+            try:
+                with open(path, 'rb') as f:
+                    if not self.load_program(f.read()):
+                        return False
+            except OSError:
+                return False
+        h = 1469598103934665603  # FNV-1a over all of memory, one word at a time
+        for word in self.memory:
+            h = ((h ^ word) * 1099511628211) & 0xFFFFFFFFFFFFFFFF
+        if h != base_hash:
+            return False
+        
+        for _ in range(page_count):
+            page = struct.unpack(order + 'H', data[pos:pos + 2])[0]
+            if page >= self.MAX_MEMORY // PAGE_WORDS:
+                return False
+            words = struct.unpack(f'{order}{PAGE_WORDS}H', data[pos + 4:pos + 4 + PAGE_WORDS * 2])
+            self.memory[page * PAGE_WORDS:(page + 1) * PAGE_WORDS] = list(words)
+            self.dirty_pages.add(page)
+            pos += 4 + PAGE_WORDS * 2
+        self.reg = list(regs)
+        self.halted = False
+        return True
+        
+
     def step(self) -> bool:
         """Execute one instruction and return True if continuing"""
         if self.halted or self.wait_for_input:
             return False
         
         # Check for breakpoint
+        self.stop_reason = self.STOP_NONE
         if self.reg[self.R_PC] in self.breakpoints and not self.step_mode:
+            self.stop_reason, self.stop_address = self.STOP_BREAKPOINT, self.reg[self.R_PC]
             return False
         
+        # Note down what the instruction overwrites, so step_back() can undo it
+        self.undo = (self.reg[:], [], [], [])
+        self.journal.append(self.undo)
+        
         # Fetch instruction and increment PC (LC-3 spec)
         instr = self.mem_read(self.reg[self.R_PC])
         self.reg[self.R_PC] = (self.reg[self.R_PC] + 1) & 0xFFFF
+        self.watch_hit = None  # only the loads and stores of the instruction count, not fetching it
         
         # Decode and execute
         op = instr >> 12
@@ -172,13 +315,52 @@ class LC3VirtualMachine:
                 self.wait_for_input = True
                 # Undo PC increment so the TRAP is re-executed after input
                 self.reg[self.R_PC] = (self.reg[self.R_PC]-1) & 0xFFFF
+                self.journal.pop()  # it has not run
+                self.undo = None
                 return False
             if trap_result is False:
                 self.halted = True
+                self.undo = None
                 return False
         
+        self.undo = None
+        if self.watch_hit:
+            # the instruction has run, the same as in the C engines
+            self.stop_reason, self.stop_address = self.watch_hit
+            self.watch_hit = None
+            return False
         return True
     
+    def step_back(self) -> bool:
+        """Undo the last instruction, False if there is no history left. What it printed stays printed, the
+        characters it read go back into the input"""
+        if not self.journal:
+            return False
+        regs, stores, device, chars = self.journal.pop()
+        for address, old in reversed(stores + device):
+            self.memory[address] = old
+            self.dirty_pages.add(address >> self.PAGE_SHIFT)
+        self.input_buffer[:0] = chars
+        self.reg = regs
+        self.halted = self.wait_for_input = False
+        self.stop_reason = self.STOP_NONE
+        return True
+    
+    def run_back(self) -> bool:
+        """Step back until PC is at a breakpoint or an instruction that wrote to a write watchpoint has been
+        undone. False if the history ran out first"""
+        while self.journal:
+            stores = self.journal[-1][1]
+            self.step_back()
+            for address, _ in stores:
+                if self.watchpoints.get(address, 0) & self.WATCH_WRITE:
+                    self.stop_reason, self.stop_address = self.STOP_WATCH_WRITE, address
+                    return True
+            if self.reg[self.R_PC] in self.breakpoints:
+                self.stop_reason, self.stop_address = self.STOP_BREAKPOINT, self.reg[self.R_PC]
+                return True
+        return False
+    
     def _execute_br(self, instr: int):
         """Execute branch instruction"""
         pc_offset = self.sign_extend(instr & 0x1FF, 9)
@@ -290,15 +472,14 @@ class LC3VirtualMachine:
     
     def _execute_trap(self, instr: int) -> bool:
         """Execute trap instruction"""
-        self.reg[self.R_R7] = self.reg[self.R_PC]
         trap_code = instr & 0xFF
+        if trap_code in (self.TRAP_GETC, self.TRAP_IN) and not self.input_buffer:
+            return 'WAIT_FOR_INPUT'  # it has not run, R7 stays as it was
+        self.reg[self.R_R7] = self.reg[self.R_PC]
         
         if trap_code == self.TRAP_GETC:
-            if self.input_buffer:
-                self.reg[self.R_R0] = ord(self.input_buffer.pop(0))
-                self.update_flags(self.R_R0)
-            else:
-                return 'WAIT_FOR_INPUT'
+            self.reg[self.R_R0] = ord(self.take_input())
+            self.update_flags(self.R_R0)
         elif trap_code == self.TRAP_OUT:
             self.output_buffer.append(chr(self.reg[self.R_R0] & 0xFF))
         elif trap_code == self.TRAP_PUTS:
@@ -307,20 +488,16 @@ class LC3VirtualMachine:
                 self.output_buffer.append(chr(self.memory[addr] & 0xFF))
                 addr = (addr + 1) & 0xFFFF
         elif trap_code == self.TRAP_IN:
-            if self.input_buffer:
-                char = self.input_buffer.pop(0)
-                self.output_buffer.append(char)
-                self.reg[self.R_R0] = ord(char)
-                self.update_flags(self.R_R0)
-            else:
-                return 'WAIT_FOR_INPUT'
+            char = self.take_input()
+            self.output_buffer.append("Enter a character: " + char)  # the prompt is the C trap's
+            self.reg[self.R_R0] = ord(char)
+            self.update_flags(self.R_R0)
         elif trap_code == self.TRAP_PUTSP:
             addr = self.reg[self.R_R0]
             while self.memory[addr] != 0:
                 char1 = self.memory[addr] & 0xFF
                 char2 = (self.memory[addr] >> 8) & 0xFF
-                if char1:
-                    self.output_buffer.append(chr(char1))
+                self.output_buffer.append(chr(char1))  # even a zero one, only the high byte is left out then
                 if char2:
                     self.output_buffer.append(chr(char2))
                 addr = (addr + 1) & 0xFFFF
@@ -331,12 +508,185 @@ class LC3VirtualMachine:
         return True
 
 
+class NativeLC3VirtualMachine(LC3VirtualMachine):
+    """The same machine with the C core (lc3_lib.c) doing the running. reg and memory here are copies of the
+    VM in liblc3, refreshed after every run_until() and step(), so the debugger can draw them as before. Only the
+    pages the C side says were written get copied back"""
+    
+    VM_RUNNING, VM_HALTED, VM_STOPPED, VM_WAITING_INPUT = 0, 1, 2, 3
+    RUN_SLICE = 1000000  # instructions per run_until() call from the run thread, a few ms of native time
+    JOURNAL_BYTES = 1 << 24  # for step_back(), a few million instructions of history (see lc3_journal.c)
+    
+    @staticmethod
+    def load_library() -> Optional[ctypes.CDLL]:
+        """liblc3 from next to this script, None if it has not been built (see the README)"""
+        if sys.platform == 'win32':
+            name = 'lc3.dll'
+        elif sys.platform == 'darwin':
+            name = 'liblc3.dylib'
+        else:
+            name = 'liblc3.so'
+        try:
+            lib = ctypes.CDLL(os.path.join(os.path.dirname(os.path.abspath(__file__)), name))
+        except OSError:
+            return None
+        
+        vm = ctypes.c_void_p
+        words = ctypes.POINTER(ctypes.c_uint16)
+        lib.lc3_create.restype = vm
+        lib.lc3_create.argtypes = []
+        lib.vm_destroy.argtypes = [vm]
+        lib.vm_reset.argtypes = [vm]
+        lib.vm_add_input.argtypes = [vm, ctypes.c_char_p, ctypes.c_size_t]
+        lib.lc3_run_until.restype = ctypes.c_int
+        lib.lc3_run_until.argtypes = [vm, words, ctypes.c_int, ctypes.c_uint64]
+        lib.lc3_status.restype = ctypes.c_int
+        lib.lc3_status.argtypes = [vm]
+        lib.lc3_stop_reason.restype = ctypes.c_int
+        lib.lc3_stop_reason.argtypes = [vm]
+        lib.lc3_stop_address.restype = ctypes.c_uint16
+        lib.lc3_stop_address.argtypes = [vm]
+        lib.vm_set_watchpoint.argtypes = [vm, ctypes.c_uint16, ctypes.c_int]
+        lib.vm_clear_watchpoints.argtypes = [vm]
+        lib.lc3_read_regs.argtypes = [vm, words]
+        lib.lc3_write_reg.argtypes = [vm, ctypes.c_int, ctypes.c_uint16]
+        lib.lc3_read_memory.argtypes = [vm, ctypes.c_uint16, words, ctypes.c_uint32]
+        lib.lc3_write_memory.argtypes = [vm, ctypes.c_uint16, words, ctypes.c_uint32]
+        lib.lc3_take_output.restype = ctypes.c_size_t
+        lib.lc3_take_output.argtypes = [vm, ctypes.c_char_p, ctypes.c_size_t]
+        lib.lc3_take_dirty_pages.restype = ctypes.c_int
+        lib.lc3_take_dirty_pages.argtypes = [vm, ctypes.POINTER(ctypes.c_uint8)]
+        lib.vm_journal_start.restype = ctypes.c_int
+        lib.vm_journal_start.argtypes = [vm, ctypes.c_size_t]
+        lib.vm_step_back.restype = ctypes.c_uint64
+        lib.vm_step_back.argtypes = [vm, ctypes.c_uint64]
+        lib.lc3_run_back.restype = ctypes.c_int
+        lib.lc3_run_back.argtypes = [vm, words, ctypes.c_int, ctypes.c_uint64]
+        return lib
+    
+    def __init__(self, lib: ctypes.CDLL):
+        self.lib = lib
+        self.vm = lib.lc3_create()
+        if not self.vm:
+            raise MemoryError("lc3_create failed")
+        lib.vm_journal_start(self.vm, self.JOURNAL_BYTES)  # without one step_back() just finds no history
+        super().__init__()
+    
+    def __del__(self):
+        if getattr(self, 'vm', None):
+            self.lib.vm_destroy(self.vm)
+            self.vm = None
+    
+    def reset(self):
+        """Reset the virtual machine to initial state"""
+        super().reset()
+        self.lib.vm_reset(self.vm)
+        self.sync()
+    
+    def load_program(self, data: bytes) -> bool:
+        """Load a program from binary data, parsed here and then handed to the C side"""
+        if not super().load_program(data):
+            return False
+        self.push()
+        return True
+    
+    def load_snapshot(self, data: bytes, base_dir: str = '') -> bool:
+        if not super().load_snapshot(data, base_dir):
+            return False
+        self.push()
+        return True
+    
+    def push(self):
+        """Copy memory and reg into the C VM"""
+        memory = (ctypes.c_uint16 * self.MAX_MEMORY)(*self.memory)
+        self.lib.lc3_write_memory(self.vm, 0, memory, self.MAX_MEMORY)
+        for r, value in enumerate(self.reg):
+            self.lib.lc3_write_reg(self.vm, r, value)
+    
+    def sync(self):
+        """Copy the C VM's registers and the pages it wrote to since the last sync into reg and memory"""
+        regs = (ctypes.c_uint16 * self.R_COUNT)()
+        self.lib.lc3_read_regs(self.vm, regs)
+        self.reg = list(regs)
+        dirty = (ctypes.c_uint8 * self.PAGE_COUNT)()
+        if self.lib.lc3_take_dirty_pages(self.vm, dirty):
+            words = (ctypes.c_uint16 * self.PAGE_WORDS)()
+            for page in range(self.PAGE_COUNT):
+                if dirty[page]:
+                    self.lib.lc3_read_memory(self.vm, page << self.PAGE_SHIFT, words, self.PAGE_WORDS)
+                    self.memory[page << self.PAGE_SHIFT:(page + 1) << self.PAGE_SHIFT] = list(words)
+                    self.dirty_pages.add(page)
+        status = self.lib.lc3_status(self.vm)
+        self.halted = status == self.VM_HALTED
+        self.wait_for_input = status == self.VM_WAITING_INPUT
+        self.stop_reason = self.lib.lc3_stop_reason(self.vm) if status == self.VM_STOPPED else self.STOP_NONE
+        self.stop_address = self.lib.lc3_stop_address(self.vm)
+    
+    def _run(self, breakpoints, max_steps: int) -> int:
+        if self.input_buffer:
+            text = ''.join(self.input_buffer).encode('latin-1', 'replace')
+            self.input_buffer = []
+            self.lib.vm_add_input(self.vm, text, len(text))
+        self.lib.vm_clear_watchpoints(self.vm)
+        for address, kinds in self.watchpoints.items():
+            self.lib.vm_set_watchpoint(self.vm, address, kinds)
+        points = (ctypes.c_uint16 * max(len(breakpoints), 1))(*breakpoints)
+        status = self.lib.lc3_run_until(self.vm, points, len(breakpoints), max_steps)
+        out = ctypes.create_string_buffer(4096)
+        while True:
+            n = self.lib.lc3_take_output(self.vm, out, len(out))
+            if not n:
+                break
+            self.output_buffer.append(out.raw[:n].decode('latin-1'))
+        return status
+    
+    def step(self) -> bool:
+        """Execute one instruction and return True if continuing"""
+        if self.halted or self.wait_for_input:
+            return False
+        if self.reg[self.R_PC] in self.breakpoints and not self.step_mode:
+            self.stop_reason, self.stop_address = self.STOP_BREAKPOINT, self.reg[self.R_PC]
+            return False
+        status = self._run([], 1)
+        self.sync()
+        return status == self.VM_RUNNING
+    
+    def run_until(self, max_steps: int) -> bool:
+        """Run up to max_steps instructions in native code, stopping early at a breakpoint (not the one it stopped
+        at last time), a watchpoint, HALT or a read with no input. True if it only ran out of steps"""
+        if self.halted or self.wait_for_input:
+            return False
+        status = self._run(sorted(self.breakpoints), max_steps)
+        self.sync()
+        return status == self.VM_RUNNING
+    
+    def step_back(self) -> bool:
+        """Undo the last instruction from the C VM's journal, False if there is no history left"""
+        if not self.lib.vm_step_back(self.vm, 1):
+            return False
+        self.sync()
+        return True
+    
+    def run_back(self) -> bool:
+        """Step back in C until PC is at a breakpoint or a write to a write watchpoint has been undone. False if
+        the history ran out first"""
+        self.lib.vm_clear_watchpoints(self.vm)
+        for address, kinds in self.watchpoints.items():
+            self.lib.vm_set_watchpoint(self.vm, address, kinds)
+        breakpoints = sorted(self.breakpoints)
+        points = (ctypes.c_uint16 * max(len(breakpoints), 1))(*breakpoints)
+        status = self.lib.lc3_run_back(self.vm, points, len(breakpoints), 0)
+        self.sync()
+        return status == self.VM_STOPPED
+
+
 class LC3Debugger:
     
     def __init__(self):
-        self.vm = LC3VirtualMachine()
+        lib = NativeLC3VirtualMachine.load_library()
+        self.vm = NativeLC3VirtualMachine(lib) if lib else LC3VirtualMachine()
         self.root = tk.Tk()
-        self.root.title("LC-3 Interactive Debugger")
+        self.root.title("LC-3 Interactive Debugger" + (" (native core)" if lib else ""))
         self.root.geometry("1200x800")
         
         # Variables
@@ -344,6 +694,14 @@ class LC3Debugger:
         self.memory_view_start = tk.IntVar(value=0x3000)
         self.memory_view_end = tk.IntVar(value=0x3020)
         
+        # The memory view only holds the rows that fit in it: memory_top is the address in the first one,
+        # memory_lines what each row shows now, and memory_view_state what they were drawn from
+        self.memory_top = 0x3000
+        self.memory_rows = 15
+        self.memory_lines: List[str] = []
+        self.memory_view_state = None
+        self.disassembly: Dict[int, str] = {}  # word -> disassemble_instruction(word)
+        
         self.setup_ui()
         self.update_display()
         self.update_memory_view()
@@ -359,8 +717,11 @@ class LC3Debugger:
         control_frame.pack(fill=tk.X, pady=(0, 10))
         
         ttk.Button(control_frame, text="Load Program", command=self.load_program).pack(side=tk.LEFT, padx=5)
+        ttk.Button(control_frame, text="Load Snapshot", command=self.load_snapshot).pack(side=tk.LEFT, padx=5)
         ttk.Button(control_frame, text="Run", command=self.run_program).pack(side=tk.LEFT, padx=5)
         ttk.Button(control_frame, text="Step", command=self.step_program).pack(side=tk.LEFT, padx=5)
+        ttk.Button(control_frame, text="Step Back", command=self.step_back_program).pack(side=tk.LEFT, padx=5)
+        ttk.Button(control_frame, text="Reverse Continue", command=self.reverse_program).pack(side=tk.LEFT, padx=5)
         ttk.Button(control_frame, text="Stop", command=self.stop_program).pack(side=tk.LEFT, padx=5)
         ttk.Button(control_frame, text="Reset", command=self.reset_program).pack(side=tk.LEFT, padx=5)
         
@@ -409,6 +770,25 @@ class LC3Debugger:
         self.bp_listbox.pack(fill=tk.BOTH, expand=True, padx=5, pady=(0, 5))
         self.bp_listbox.bind('<Double-Button-1>', self.remove_breakpoint)
         
+        # Watchpoints
+        wp_frame = ttk.LabelFrame(left_frame, text="Watchpoints")
+        wp_frame.pack(fill=tk.BOTH, expand=True, pady=(10, 0))
+        
+        wp_input_frame = ttk.Frame(wp_frame)
+        wp_input_frame.pack(fill=tk.X, padx=5, pady=5)
+        
+        ttk.Label(wp_input_frame, text="Address:").pack(side=tk.LEFT)
+        self.wp_entry = ttk.Entry(wp_input_frame, width=8)
+        self.wp_entry.pack(side=tk.LEFT, padx=(5, 0))
+        self.wp_kind = ttk.Combobox(wp_input_frame, values=["write", "read", "read/write"], width=10, state="readonly")
+        self.wp_kind.current(0)
+        self.wp_kind.pack(side=tk.LEFT, padx=(5, 0))
+        ttk.Button(wp_input_frame, text="Add", command=self.add_watchpoint).pack(side=tk.LEFT, padx=(5, 0))
+        
+        self.wp_listbox = tk.Listbox(wp_frame, height=4)
+        self.wp_listbox.pack(fill=tk.BOTH, expand=True, padx=5, pady=(0, 5))
+        self.wp_listbox.bind('<Double-Button-1>', self.remove_watchpoint)
+        
         # Right panel - Memory and Output
         right_frame = ttk.Frame(content_frame)
         right_frame.pack(side=tk.RIGHT, fill=tk.BOTH, expand=True)
@@ -428,14 +808,22 @@ class LC3Debugger:
         end_entry = ttk.Entry(mem_control_frame, textvariable=self.memory_view_end, width=8)
         end_entry.pack(side=tk.LEFT, padx=(5, 10))
         
-        ttk.Button(mem_control_frame, text="Refresh", command=self.update_memory_view).pack(side=tk.LEFT, padx=(10, 0))
+        ttk.Button(mem_control_frame, text="Refresh", command=self.refresh_memory_view).pack(side=tk.LEFT, padx=(10, 0))
         
         # Memory display
         mem_display_frame = ttk.Frame(mem_frame)
         mem_display_frame.pack(fill=tk.BOTH, expand=True, padx=5, pady=(0, 5))
         
-        self.memory_text = scrolledtext.ScrolledText(mem_display_frame, height=15, font=("Courier", 9))
-        self.memory_text.pack(fill=tk.BOTH, expand=True)
+        # the scrollbar stands for the whole Start-End range, the text only for the rows on screen
+        self.memory_scroll = ttk.Scrollbar(mem_display_frame, orient=tk.VERTICAL, command=self.scroll_memory)
+        self.memory_scroll.pack(side=tk.RIGHT, fill=tk.Y)
+        self.memory_text = tk.Text(mem_display_frame, height=self.memory_rows, wrap=tk.NONE, font=("Courier", 9))
+        self.memory_text.pack(side=tk.LEFT, fill=tk.BOTH, expand=True)
+        self.memory_line_height = tkfont.Font(family="Courier", size=9).metrics("linespace")
+        self.memory_text.bind('<Configure>', self.resize_memory_view)
+        self.memory_text.bind('<MouseWheel>', lambda e: self.scroll_memory('scroll', -3 if e.delta > 0 else 3, 'units'))
+        self.memory_text.bind('<Button-4>', lambda e: self.scroll_memory('scroll', -3, 'units'))
+        self.memory_text.bind('<Button-5>', lambda e: self.scroll_memory('scroll', 3, 'units'))
         
         # Output/Console
         output_frame = ttk.LabelFrame(right_frame, text="Console Output")
@@ -460,6 +848,7 @@ class LC3Debugger:
         self.update_status()
         self.update_output()
         self.update_breakpoints()
+        self.update_memory_view()
         
         # Schedule next update
         self.root.after(100, self.update_display)
@@ -485,55 +874,122 @@ class LC3Debugger:
             self.status_label.config(text="Halted", foreground="red")
         elif self.vm.running:
             self.status_label.config(text="Running", foreground="blue")
+        elif self.vm.stop_reason == self.vm.STOP_BREAKPOINT:
+            self.status_label.config(text=f"Breakpoint at 0x{self.vm.stop_address:04X}", foreground="orange")
+        elif self.vm.stop_reason == self.vm.STOP_WATCH_READ:
+            self.status_label.config(text=f"Read from 0x{self.vm.stop_address:04X}", foreground="orange")
+        elif self.vm.stop_reason == self.vm.STOP_WATCH_WRITE:
+            self.status_label.config(text=f"Write to 0x{self.vm.stop_address:04X}", foreground="orange")
         else:
             self.status_label.config(text="Ready", foreground="green")
     
-    def update_memory_view(self):
-        """Update memory view display"""
-        self.memory_text.delete(1.0, tk.END)
-        
-        start = self.memory_view_start.get()
-        end = self.memory_view_end.get()
+    def update_memory_view(self, force: bool = False):
+        """Update memory view display, only the rows that are on screen and only if what they show can have changed:
+        a page under them was written, PC or a breakpoint moved, or the view was scrolled"""
+        try:
+            start = self.memory_view_start.get()
+            end = self.memory_view_end.get()
+        except tk.TclError:
+            start, end = -1, -1  # the entry is being edited
+        dirty = self.vm.take_dirty_pages()
         
         if start < 0 or end >= self.vm.MAX_MEMORY or start > end:
-            self.memory_text.insert(tk.END, "Invalid memory range\n")
+            self.memory_view_state = None
+            self._show_memory_lines(["Invalid memory range"])
+            self.memory_scroll.set(0.0, 1.0)
             return
         
-        for addr in range(start, min(end + 1, self.vm.MAX_MEMORY)):
-            value = self.vm.memory[addr]
-            
-            # Highlight current PC
-            if addr == self.vm.reg[self.vm.R_PC]:
-                prefix = ">> "
-            elif addr in self.vm.breakpoints:
-                prefix = "BP "
-            else:
-                prefix = "   "
-            
-            # Format: address: value (instruction or data)
-            instr_str = self.disassemble_instruction(value)
-            line = f"{prefix}0x{addr:04X}: 0x{value:04X} {instr_str}\n"
-            
-            self.memory_text.insert(tk.END, line)
+        self.memory_top = max(start, min(self.memory_top, end - self.memory_rows + 1))
+        last = min(self.memory_top + self.memory_rows, end + 1)
+        state = (start, end, self.memory_top, self.memory_rows, self.vm.reg[self.vm.R_PC],
+                 frozenset(self.vm.breakpoints), frozenset(self.vm.watchpoints))
+        shown = range(self.memory_top >> self.vm.PAGE_SHIFT, ((last - 1) >> self.vm.PAGE_SHIFT) + 1)
+        if not force and state == self.memory_view_state and not any(page in dirty for page in shown):
+            return
+        self.memory_view_state = state
+        
+        self._show_memory_lines([self.memory_line(addr) for addr in range(self.memory_top, last)])
+        count = end - start + 1
+        self.memory_scroll.set((self.memory_top - start) / count, (last - start) / count)
+    
+    def memory_line(self, addr: int) -> str:
+        """One row of the memory view"""
+        value = self.vm.memory[addr]
+        
+        # Highlight current PC
+        if addr == self.vm.reg[self.vm.R_PC]:
+            prefix = ">> "
+        elif addr in self.vm.breakpoints:
+            prefix = "BP "
+        elif addr in self.vm.watchpoints:
+            prefix = "WP "
+        else:
+            prefix = "   "
+        
+        instr_str = self.disassembly.get(value)
+        if instr_str is None:
+            instr_str = self.disassembly[value] = self.disassemble_instruction(value)
+        
+        # Format: address: value (instruction or data)
+        return f"{prefix}0x{addr:04X}: 0x{value:04X} {instr_str}"
+    
+    def _show_memory_lines(self, lines: List[str]):
+        """Put lines in the memory text, rewriting only the rows that differ from what is there"""
+        if len(lines) != len(self.memory_lines):
+            self.memory_text.delete(1.0, tk.END)
+            self.memory_text.insert(tk.END, "\n".join(lines))
+        else:
+            for row, (old, new) in enumerate(zip(self.memory_lines, lines), 1):
+                if old != new:
+                    self.memory_text.delete(f"{row}.0", f"{row}.end")
+                    self.memory_text.insert(f"{row}.0", new)
+        self.memory_lines = lines
+    
+    def refresh_memory_view(self):
+        """Go to the start of the range and redraw"""
+        self.memory_top = self.memory_view_start.get()
+        self.update_memory_view(force=True)
+    
+    def scroll_memory(self, *args):
+        """Scrollbar and mouse wheel: ('moveto', fraction) or ('scroll', n, 'units' or 'pages')"""
+        try:
+            start = self.memory_view_start.get()
+            count = self.memory_view_end.get() - start + 1
+        except tk.TclError:
+            return
+        if args[0] == 'moveto':
+            self.memory_top = start + int(float(args[1]) * count)
+        elif args[0] == 'scroll':
+            self.memory_top += int(args[1]) * (self.memory_rows - 1 if args[2] == 'pages' else 1)
+        self.update_memory_view()
+        return "break"
+    
+    def resize_memory_view(self, event):
+        """As many rows as fit in the text"""
+        rows = max(1, event.height // self.memory_line_height)
+        if rows != self.memory_rows:
+            self.memory_rows = rows
+            self.update_memory_view()
+    
+    OPCODE_NAMES = {
+        0: "BR", 1: "ADD", 2: "LD", 3: "ST", 4: "JSR", 5: "AND",
+        6: "LDR", 7: "STR", 8: "RTI", 9: "NOT", 10: "LDI", 11: "STI",
+        12: "JMP", 13: "RES", 14: "LEA", 15: "TRAP"
+    }
+    TRAP_NAMES = {
+        0x20: "GETC", 0x21: "OUT", 0x22: "PUTS",
+        0x23: "IN", 0x24: "PUTSP", 0x25: "HALT"
+    }
     
     def disassemble_instruction(self, instr: int) -> str:
         """Simple disassembler for display"""
         op = instr >> 12
-        opcode_names = {
-            0: "BR", 1: "ADD", 2: "LD", 3: "ST", 4: "JSR", 5: "AND",
-            6: "LDR", 7: "STR", 8: "RTI", 9: "NOT", 10: "LDI", 11: "STI",
-            12: "JMP", 13: "RES", 14: "LEA", 15: "TRAP"
-        }
         
-        if op in opcode_names:
+        if op in self.OPCODE_NAMES:
             if op == 15:  # TRAP
                 trap_code = instr & 0xFF
-                trap_names = {
-                    0x20: "GETC", 0x21: "OUT", 0x22: "PUTS",
-                    0x23: "IN", 0x24: "PUTSP", 0x25: "HALT"
-                }
-                return f"TRAP {trap_names.get(trap_code, f'0x{trap_code:02X}')}"
-            return opcode_names[op]
+                return f"TRAP {self.TRAP_NAMES.get(trap_code, f'0x{trap_code:02X}')}"
+            return self.OPCODE_NAMES[op]
         return "DATA"
     
     def update_output(self):
@@ -549,12 +1005,16 @@ class LC3Debugger:
         self.bp_listbox.delete(0, tk.END)
         for bp in sorted(self.vm.breakpoints):
             self.bp_listbox.insert(tk.END, f"0x{bp:04X}")
+        self.wp_listbox.delete(0, tk.END)
+        kind_names = {self.vm.WATCH_READ: "read", self.vm.WATCH_WRITE: "write", self.vm.WATCH_READ | self.vm.WATCH_WRITE: "read/write"}
+        for wp, kinds in sorted(self.vm.watchpoints.items()):
+            self.wp_listbox.insert(tk.END, f"0x{wp:04X} {kind_names[kinds]}")
     
     def load_program(self):
         """Load a program file"""
         filename = filedialog.askopenfilename(
             title="Load LC-3 Program",
-            filetypes=[("LC-3 Object Files", "*.obj"), ("All Files", "*.*")]
+            filetypes=[("LC-3 Object Files", "*.obj"), ("LC-3 Native Images", "*.img"), ("All Files", "*.*")]
         )
         
         if filename:
@@ -571,6 +1031,27 @@ class LC3Debugger:
             except Exception as e:
                 messagebox.showerror("Error", f"Error loading file: {str(e)}")
     
+    def load_snapshot(self):
+        """Load a snapshot written by lc3_vm --snapshot"""
+        filename = filedialog.askopenfilename(
+            title="Load LC-3 Snapshot",
+            filetypes=[("LC-3 Snapshots", "*.snap"), ("All Files", "*.*")]
+        )
+        
+        if filename:
+            try:
+                with open(filename, 'rb') as f:
+                    data = f.read()
+                
+                if self.vm.load_snapshot(data, os.path.dirname(filename)):
+                    messagebox.showinfo("Success", f"Snapshot loaded from {filename}, PC = 0x{self.vm.reg[self.vm.R_PC]:04X}")
+                    self.update_memory_view()
+                    self.update_display()
+                else:
+                    messagebox.showerror("Error", "Failed to load snapshot (not a snapshot, or its images have changed)")
+            except Exception as e:
+                messagebox.showerror("Error", f"Error loading file: {str(e)}")
+    
     def run_program(self):
         """Run the program"""
         if not self.vm.running and not self.vm.halted:
@@ -582,6 +1063,13 @@ class LC3Debugger:
     
     def _run_thread(self):
         """Thread for running the program"""
+        if isinstance(self.vm, NativeLC3VirtualMachine):
+            # breakpoints are checked in C, this only comes up for air between slices to see if Stop was pressed
+            while self.vm.running and self.vm.run_until(self.vm.RUN_SLICE):
+                time.sleep(0.001)
+            self.vm.running = False
+            return
+        
         while self.vm.running and not self.vm.halted:
             if not self.vm.step():
                 # If we paused for input, just stop running
@@ -604,6 +1092,25 @@ class LC3Debugger:
             self.update_memory_view()
             self.update_display()
     
+    def step_back_program(self):
+        """Undo the last instruction"""
+        if self.vm.running:
+            return
+        if not self.vm.step_back():
+            messagebox.showinfo("Step Back", "There is no earlier instruction to go back to")
+        self.update_memory_view()
+        self.update_display()
+    
+    def reverse_program(self):
+        """Run backwards to the last time PC was at a breakpoint, or to just before the last write to a write
+        watchpoint"""
+        if self.vm.running:
+            return
+        if not self.vm.run_back():
+            messagebox.showinfo("Reverse Continue", "Reached the start of the recorded history")
+        self.update_memory_view()
+        self.update_display()
+    
     def stop_program(self):
         """Stop program execution"""
         self.vm.running = False
@@ -644,6 +1151,33 @@ class LC3Debugger:
             self.update_breakpoints()
             self.update_memory_view()
     
+    def add_watchpoint(self):
+        """Add a watchpoint, the program stops right after an instruction reads or writes the address"""
+        try:
+            addr_str = self.wp_entry.get().strip()
+            if addr_str.startswith('0x'):
+                addr = int(addr_str, 16)
+            else:
+                addr = int(addr_str)
+            
+            if 0 <= addr < self.vm.MAX_MEMORY:
+                kinds = {"read": self.vm.WATCH_READ, "write": self.vm.WATCH_WRITE}.get(self.wp_kind.get(), self.vm.WATCH_READ | self.vm.WATCH_WRITE)
+                self.vm.watchpoints[addr] = kinds
+                self.wp_entry.delete(0, tk.END)
+                self.update_breakpoints()
+            else:
+                messagebox.showerror("Error", "Address out of range")
+        except ValueError:
+            messagebox.showerror("Error", "Invalid address format")
+    
+    def remove_watchpoint(self, event=None):
+        """Remove selected watchpoint"""
+        selection = self.wp_listbox.curselection()
+        if selection:
+            addr = int(self.wp_listbox.get(selection[0]).split()[0], 16)
+            self.vm.watchpoints.pop(addr, None)
+            self.update_breakpoints()
+    
     def send_input(self, event=None):
         """Send input to the virtual machine"""
         text = self.input_entry.get()
@@ -0,0 +1,533 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lc3_vm.h"
+
+/*
+The differential fuzzer (--fuzz). Every engine is meant to run a program exactly like the switch interpreter does,
+and this checks it on programs nobody would write by hand: each case is a random machine state, a few dozen random
+instructions (loops, stores over their own code, jumps through random registers, traps, RTI and the reserved
+opcode, now and then code rewritten under a proved store, see rewrite_lea()), data words that point back into
+them, random registers and a bit of input. The state is frozen into a vm_template, and the lanes below all start
+from it:
+
+    switch              the reference
+    threaded            the threaded engine, with the superinstructions
+    threaded+analysis   the same after vm_analyze(), the stores it proved skip their check (main() does this)
+    jit                 the JIT tier after vm_analyze(), the threaded engine on hosts without one
+
+The lanes run in lockstep, a slice of 1 to 64 instructions each (a random length every time, so the slices end in
+the middle of blocks and superinstructions as well as between them), and after every slice they have to agree on
+the status, the instruction count, all registers, what the program printed and every page any of them wrote to since
+the last slice. The first difference ends the case, and it gets reported with its seed: --fuzz=1 --fuzz-seed=SEED
+runs that case again on its own, and --snapshot=FILE saves the starting state of the first case that went wrong, so
+the debugger and --restore can start from it.
+
+Cases are independent, worker threads take every threads'th one, so it scales with the cores and the same seed
+gives the same cases however many threads there are. fuzz.py runs the same cases (fuzz_case() is exported with
+the rest) against the Python core in lc3_debugger.py.
+*/
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <pthread.h>
+#endif
+
+enum {
+    FUZZ_DATA_WORDS = 32,   // after the code, what LD, LDI and friends mostly read and write
+    FUZZ_SLICE_MAX = 64
+};
+
+typedef struct {
+    const char* name;
+    int engine;
+    int analyze;    // vm_analyze() before it starts
+} fuzz_lane;
+
+static const fuzz_lane lanes[] = {
+    { "switch", ENGINE_SWITCH, 0 },
+    { "threaded", ENGINE_THREADED, 0 },
+    { "threaded+analysis", ENGINE_THREADED, 1 },
+    { "jit", ENGINE_JIT, 1 },
+};
+
+enum { LANE_COUNT = sizeof(lanes) / sizeof(lanes[0]) };
+
+// random numbers---------------------------------------------------------------------------------
+
+// xorshift32, seeded through a multiply so neighbouring seeds do not start out alike
+static uint32_t fuzz_next(uint32_t* s){
+    uint32_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *s = x;
+}
+
+static uint32_t below(uint32_t* s, uint32_t n){
+    return fuzz_next(s) % n;
+}
+
+// the random program---------------------------------------------------------------------------------
+
+typedef struct {
+    uint32_t rng;
+    uint16_t origin;
+    int len;            // code words
+} fuzz_gen;
+
+// an address in or next to the code or its data, or one of the keyboard registers now and then
+static uint16_t near_address(fuzz_gen* g){
+    uint32_t pick = below(&g->rng, 16);
+    if (pick == 0){
+        return below(&g->rng, 2) ? MR_KBSR : MR_KBDR;
+    }
+    if (pick == 1){
+        return (uint16_t)fuzz_next(&g->rng);
+    }
+    return (uint16_t)(g->origin + below(&g->rng, (uint32_t)(g->len + FUZZ_DATA_WORDS)));
+}
+
+// a 9 bit offset from the word at index i to somewhere near the program, or anywhere in reach
+static uint16_t offset9(fuzz_gen* g, int i){
+    if (below(&g->rng, 4) == 0){
+        return (uint16_t)(fuzz_next(&g->rng) & 0x1FF);
+    }
+    return (uint16_t)((int)below(&g->rng, (uint32_t)(g->len + FUZZ_DATA_WORDS + 8)) - 4 - (i + 1)) & 0x1FF;
+}
+
+static uint16_t random_trap(fuzz_gen* g){
+    static const uint8_t vectors[] = { TRAP_OUT, TRAP_OUT, TRAP_OUT, TRAP_PUTS, TRAP_PUTSP, TRAP_GETC, TRAP_IN,
+                                       TRAP_HALT, 0x26, 0xFF };
+    return (uint16_t)(0xF000 | vectors[below(&g->rng, sizeof(vectors))]);
+}
+
+// one random instruction for the word at index i of the code, every opcode turns up
+static uint16_t random_instr(fuzz_gen* g, int i){
+    uint16_t r0 = (uint16_t)(below(&g->rng, 8) << 9);
+    uint16_t r1 = (uint16_t)(below(&g->rng, 8) << 6);
+    uint16_t low = (uint16_t)fuzz_next(&g->rng);
+    switch (below(&g->rng, 32)){
+        case 0: case 1: case 2: case 3: case 4:
+            return (uint16_t)(ADD << 12 | r0 | r1 | (low & 0x3F & (low & 0x20 ? 0x3F : 0x27)));
+        case 5: case 6:
+            return (uint16_t)(AND << 12 | r0 | r1 | (low & 0x3F & (low & 0x20 ? 0x3F : 0x27)));
+        case 7:
+            return (uint16_t)(NOT << 12 | r0 | r1 | 0x3F);
+        case 8: case 9: case 10: case 11:
+            // short loops backwards mostly, so blocks get hot enough for the JIT
+            if (below(&g->rng, 2)){
+                return (uint16_t)(BR << 12 | (low & 0x0E00) | ((uint16_t)-(int)(1 + below(&g->rng, 8)) & 0x1FF));
+            }
+            return (uint16_t)(BR << 12 | (low & 0x0E00) | offset9(g, i));
+        case 12: case 13:
+            return (uint16_t)(LD << 12 | r0 | offset9(g, i));
+        case 14: case 15:
+            return (uint16_t)(ST << 12 | r0 | offset9(g, i));
+        case 16:
+            return (uint16_t)(LDI << 12 | r0 | offset9(g, i));
+        case 17:
+            return (uint16_t)(STI << 12 | r0 | offset9(g, i));
+        case 18: case 19:
+            return (uint16_t)(LDR << 12 | r0 | r1 | (low & 0x3F));
+        case 20: case 21:
+            return (uint16_t)(STR << 12 | r0 | r1 | (low & 0x3F));
+        case 22:
+            return (uint16_t)(LEA << 12 | r0 | offset9(g, i));
+        case 23:
+            return (uint16_t)(JSR << 12 | 0x0800 | (((int)below(&g->rng, (uint32_t)g->len) - (i + 1)) & 0x7FF));
+        case 24:
+            return (uint16_t)(JSR << 12 | r1);
+        case 25:
+            return (uint16_t)(JMP << 12 | (below(&g->rng, 2) ? R_R7 << 6 : r1));
+        case 26: case 27: case 28:
+            return random_trap(g);
+        case 29:
+            return (uint16_t)((below(&g->rng, 2) ? RTI : RES) << 12 | (low & 0x0FFF));
+        default:
+            return low;
+    }
+}
+
+static uint16_t random_register(fuzz_gen* g){
+    switch (below(&g->rng, 4)){
+        case 0: return (uint16_t)fuzz_next(&g->rng);
+        case 1: return near_address(g);
+        default: return (uint16_t)((int)below(&g->rng, 64) - 32);
+    }
+}
+
+/*
+The start of the program in some cases: a store that was not proved rewrites a LEA the analysis found, so the proved
+STR through its register writes over code the analysis never counted on it writing. Random code would hardly ever
+get there, it has a JMP through an unknown register before long and then no STR gets proved. Half of the time the
+program halts right after, the other half it runs on into the random code
+
+    0   LD R0, NEWLEA
+    1   STI R0, PLEA            the LEA, the analysis has it as code
+    2   LEA R2, DATA            the first data word, until the STI makes it LEA R2, VICTIM
+    3   STR R0, R2, #0          proved, R2 is known to be DATA
+    4   VICTIM ADD R1, R1, #1   decoded before the STR writes a LEA over it
+    5   HALT or BRnzp #2
+    6   NEWLEA
+    7   PLEA
+*/
+enum { REWRITE_WORDS = 8 };
+
+static void rewrite_lea(VM* vm, fuzz_gen* g){
+
+    uint16_t o = g->origin;
+    const uint16_t words[REWRITE_WORDS] = {
+        LD << 12 | R_R0 << 9 | 5,
+        STI << 12 | R_R0 << 9 | 5,
+        (uint16_t)(LEA << 12 | R_R2 << 9 | ((g->len - 3) & 0x1FF)),
+        STR << 12 | R_R0 << 9 | R_R2 << 6,
+        ADD << 12 | R_R1 << 9 | R_R1 << 6 | 0x20 | 1,
+        below(&g->rng, 2) ? 0xF000 | TRAP_HALT : BR << 12 | 0x0E00 | 2,
+        LEA << 12 | R_R2 << 9 | 1,
+        (uint16_t)(o + 2)
+    };
+    for (int i = 0; i < REWRITE_WORDS; i++){
+        mem_write(vm, (uint16_t)(o + i), words[i]);
+    }
+}
+
+/*
+writes case seed into vm, which should be fresh or reset to nothing (vm_reset_to(vm, NULL)): its code, data and
+registers. *input_len (at most FUZZ_INPUT_MAX) characters of input for it go into input
+*/
+void fuzz_case(VM* vm, uint32_t seed, char* input, size_t* input_len){
+
+    fuzz_gen g;
+    g.rng = (seed + 1) * 2654435761u ^ 0x5BD1E995u;
+    if (!g.rng){
+        g.rng = 1;
+    }
+    switch (below(&g.rng, 10)){
+        case 0:
+            // across a page boundary, the threaded engine and the JIT keep pages apart
+            g.origin = (uint16_t)(PAGE_WORDS * (1 + below(&g.rng, 120)) - 1 - below(&g.rng, 16));
+            break;
+        case 1:
+            g.origin = (uint16_t)(DEVICE_PAGE - below(&g.rng, 24));  // running into the device page
+            break;
+        case 2:
+            g.origin = (uint16_t)(0xFFF0 + below(&g.rng, 16));  // and around the end of memory
+            break;
+        default:
+            g.origin = (uint16_t)(0x3000 + below(&g.rng, 0x200));
+            break;
+    }
+    g.len = 4 + (int)below(&g.rng, 92);
+
+    for (int i = 0; i < g.len; i++){
+        mem_write(vm, (uint16_t)(g.origin + i), random_instr(&g, i));
+    }
+    if (below(&g.rng, 5)){
+        mem_write(vm, (uint16_t)(g.origin + g.len - 1), 0xF000 | TRAP_HALT);
+    }
+    for (int i = 0; i < FUZZ_DATA_WORDS; i++){
+        uint16_t word = below(&g.rng, 2) ? near_address(&g) : (uint16_t)fuzz_next(&g.rng);
+        mem_write(vm, (uint16_t)(g.origin + g.len + i), word);
+    }
+
+    for (int r = R_R0; r <= R_R7; r++){
+        reg_write(vm, r, random_register(&g));
+    }
+    reg_write(vm, R_PC, g.origin);
+    reg_write(vm, R_COND, (uint16_t)(1 << below(&g.rng, 3)));
+
+    *input_len = below(&g.rng, FUZZ_INPUT_MAX + 1);
+    for (size_t i = 0; i < *input_len; i++){
+        input[i] = below(&g.rng, 8) ? (char)(' ' + below(&g.rng, 95)) : '\n';
+    }
+    if (g.len >= REWRITE_WORDS + 1 && below(&g.rng, 16) == 0){
+        rewrite_lea(vm, &g);
+    }
+}
+
+// running the lanes---------------------------------------------------------------------------------
+
+typedef struct {
+    uint32_t first_seed;
+    uint64_t first, count, stride;  // cases first, first + stride, ... below count
+    uint64_t max_steps;
+    VM* scratch;
+    VM* vms[LANE_COUNT];
+    uint64_t steps;                 // instructions each lane executed, over all the cases
+    uint64_t failed;
+    uint32_t failed_seed;           // the first case that went wrong
+    int reported;
+#ifdef _WIN32
+    HANDLE thread;
+#else
+    pthread_t thread;
+#endif
+} fuzz_worker;
+
+enum { FUZZ_REPORTS = 5 };  // cases a worker describes, the rest it counts
+
+// describes the first way lane differs from lane 0 into what, returns 0 if there is none
+static int lane_differs(VM** vms, int lane, char* what, size_t size){
+
+    VM* a = vms[0];
+    VM* b = vms[lane];
+    if (a->status != b->status || a->steps != b->steps){
+        snprintf(what, size, "status %d after %llu instructions, %s has %d after %llu", a->status,
+                 (unsigned long long)a->steps, lanes[lane].name, b->status, (unsigned long long)b->steps);
+        return 1;
+    }
+    for (int r = 0; r < R_COUNT; r++){
+        uint16_t x = reg_read(a, r), y = reg_read(b, r);
+        if (x != y){
+            static const char* names[R_COUNT] = { "R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7", "PC", "COND" };
+            snprintf(what, size, "%s = x%04X, %s has x%04X", names[r], x, lanes[lane].name, y);
+            return 1;
+        }
+    }
+    if (a->output_len != b->output_len || memcmp(a->output, b->output, a->output_len) != 0){
+        snprintf(what, size, "%zu characters of output, %s has %zu%s", a->output_len, lanes[lane].name,
+                 b->output_len, a->output_len == b->output_len ? " and different ones" : "");
+        return 1;
+    }
+    return 0;
+}
+
+// the first word of a page written since the last slice that some lane has different from lane 0, -1 for none.
+// *lane is set to that lane
+static int32_t memory_differs(VM** vms, int* lane){
+
+    for (int page = 0; page < PAGE_COUNT; page += 8){
+        uint64_t written = 0;  // eight pages at a time, most slices write one or two
+        for (int k = 0; k < LANE_COUNT; k++){
+            uint64_t flags;
+            memcpy(&flags, vms[k]->page_dirty + page, sizeof(flags));
+            written |= flags;
+        }
+        for (int p = page; written && p < page + 8; p++){
+            const uint16_t* x = vms[0]->pages[p]->words;
+            for (int k = 1; k < LANE_COUNT; k++){
+                const uint16_t* y = vms[k]->pages[p]->words;
+                if (x != y && memcmp(x, y, PAGE_WORDS * sizeof(uint16_t)) != 0){
+                    int i = 0;
+                    while (x[i] == y[i]){
+                        i++;
+                    }
+                    *lane = k;
+                    return p * PAGE_WORDS + i;
+                }
+            }
+        }
+    }
+    return -1;
+}
+
+// runs one case on every lane, returns 0 if they all agreed all the way
+static int run_case(fuzz_worker* w, uint32_t seed){
+
+    char input[FUZZ_INPUT_MAX];
+    size_t input_len;
+    vm_reset_to(w->scratch, NULL);
+    fuzz_case(w->scratch, seed, input, &input_len);
+    vm_template* t = vm_template_create(w->scratch);
+    if (!t){
+        printf("out of memory\n");
+        exit(1);
+    }
+    for (int k = 0; k < LANE_COUNT; k++){
+        VM* vm = w->vms[k];
+        vm_reset_to(vm, t);
+        vm_set_input(vm, input, input_len);
+        if (lanes[k].analyze){
+            vm_analyze(vm, NULL);
+        }
+        memset(vm->page_dirty, 0, sizeof(vm->page_dirty));  // they all start from the same memory
+    }
+
+    uint32_t rng = seed * 2246822519u + 1;  // the slice lengths, the same for every lane
+    char what[160] = "";
+    int32_t address = -1;
+    int lane = LANE_COUNT;
+    uint64_t from_steps = 0;   // where the last slice started
+    uint16_t from_pc = 0;
+    while (w->vms[0]->status == VM_RUNNING && w->vms[0]->steps < w->max_steps){
+        from_steps = w->vms[0]->steps;
+        from_pc = w->vms[0]->reg[R_PC];
+        uint64_t n = 1 + below(&rng, FUZZ_SLICE_MAX);
+        if (n > w->max_steps - w->vms[0]->steps){
+            n = w->max_steps - w->vms[0]->steps;
+        }
+        for (int k = 0; k < LANE_COUNT; k++){
+            vm_run(w->vms[k], n);
+            io_flush(w->vms[k]);  // into vm->output
+        }
+        lane = 1;
+        while (lane < LANE_COUNT && !lane_differs(w->vms, lane, what, sizeof(what))){
+            lane++;
+        }
+        if (lane < LANE_COUNT || (address = memory_differs(w->vms, &lane)) >= 0){
+            break;
+        }
+        for (int k = 0; k < LANE_COUNT; k++){
+            memset(w->vms[k]->page_dirty, 0, sizeof(w->vms[k]->page_dirty));
+        }
+    }
+    w->steps += w->vms[0]->steps;
+    if (lane < LANE_COUNT && w->reported++ < FUZZ_REPORTS){
+        if (address >= 0){
+            snprintf(what, sizeof(what), "x%04X = x%04X, %s has x%04X", (unsigned)address,
+                     vm_peek(w->vms[0], (uint16_t)address), lanes[lane].name, vm_peek(w->vms[lane], (uint16_t)address));
+        }
+        printf("seed %u: %s differs from switch in instructions %llu to %llu, from PC x%04X: %s\n", seed,
+               lanes[lane].name, (unsigned long long)from_steps + 1, (unsigned long long)w->vms[0]->steps, from_pc, what);
+    }
+    for (int k = 0; k < LANE_COUNT; k++){
+        vm_reset_to(w->vms[k], NULL);  // before the template goes
+    }
+    vm_template_destroy(t);
+    return lane < LANE_COUNT;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI fuzz_worker_main(LPVOID arg)
+#else
+static void* fuzz_worker_main(void* arg)
+#endif
+{
+    fuzz_worker* w = arg;
+    for (uint64_t i = w->first; i < w->count; i += w->stride){
+        uint32_t seed = w->first_seed + (uint32_t)i;
+        if (run_case(w, seed) && w->failed++ == 0){
+            w->failed_seed = seed;
+        }
+    }
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+// the VMs a worker runs its cases on, 0 if there is no memory for them
+static int worker_create(fuzz_worker* w){
+
+    w->scratch = vm_create();
+    int ok = w->scratch != NULL;
+    for (int k = 0; k < LANE_COUNT; k++){
+        w->vms[k] = vm_create();
+        if (w->vms[k]){
+            w->vms[k]->engine = lanes[k].engine;
+        }
+        ok &= w->vms[k] != NULL;
+    }
+    return ok;
+}
+
+static void worker_destroy(fuzz_worker* w){
+
+    vm_destroy(w->scratch);
+    for (int k = 0; k < LANE_COUNT; k++){
+        vm_destroy(w->vms[k]);
+    }
+}
+
+/*
+lc3 --fuzz[=cases] [--fuzz-seed=SEED] [--fuzz-threads=N] [--steps=N] [--snapshot=FILE]
+
+Runs cases (100000 by default) cases from seed on, up to max_steps instructions each, on threads threads (0 for one
+per CPU). With snapshot_path the starting state of the first case that went wrong is written there (see
+lc3_snapshot.c), without the input, which the report prints. Returns 0 if every lane agreed on every case, 4 if not
+*/
+int fuzz_main(uint64_t cases, uint32_t seed, int threads, uint64_t max_steps, const char* snapshot_path){
+
+    if (threads <= 0){
+        threads = cpu_count();
+    }
+    if ((uint64_t)threads > cases){
+        threads = cases ? (int)cases : 1;
+    }
+    fuzz_worker* workers = calloc((size_t)threads, sizeof(fuzz_worker));
+    if (!workers){
+        printf("out of memory\n");
+        return 1;
+    }
+    for (int i = 0; i < threads; i++){
+        fuzz_worker* w = &workers[i];
+        w->first_seed = seed;
+        w->first = (uint64_t)i;
+        w->count = cases;
+        w->stride = (uint64_t)threads;
+        w->max_steps = max_steps;
+        if (!worker_create(w)){
+            printf("out of memory\n");
+            exit(1);
+        }
+    }
+
+    uint64_t started = io_clock(workers[0].scratch);  // milliseconds, io_memory is not in virtual time
+    for (int i = 0; i < threads; i++){
+        fuzz_worker* w = &workers[i];
+#ifdef _WIN32
+        w->thread = CreateThread(NULL, 0, fuzz_worker_main, w, 0, NULL);
+        int ok = w->thread != NULL;
+#else
+        int ok = pthread_create(&w->thread, NULL, fuzz_worker_main, w) == 0;
+#endif
+        if (!ok){
+            printf("failed to start a fuzzing thread\n");
+            exit(1);
+        }
+    }
+    uint64_t steps = 0, failed = 0;
+    uint32_t failed_seed = 0;
+    for (int i = 0; i < threads; i++){
+        fuzz_worker* w = &workers[i];
+#ifdef _WIN32
+        WaitForSingleObject(w->thread, INFINITE);
+        CloseHandle(w->thread);
+#else
+        pthread_join(w->thread, NULL);
+#endif
+        steps += w->steps;
+        if (w->failed && (failed == 0 || w->failed_seed - seed < failed_seed - seed)){
+            failed_seed = w->failed_seed;
+        }
+        failed += w->failed;
+    }
+    double seconds = (double)(io_clock(workers[0].scratch) - started) / 1000;
+
+    printf("%llu cases, %llu instructions on each of %d lanes in %.1f s on %d threads, %.1f million a second: ",
+           (unsigned long long)cases, (unsigned long long)steps, LANE_COUNT, seconds, threads,
+           seconds > 0 ? steps * LANE_COUNT / seconds / 1e6 : 0.0);
+    if (!failed){
+        printf("no differences\n");
+    } else {
+        printf("%llu cases differ, the first is seed %u\n", (unsigned long long)failed, failed_seed);
+    }
+
+    if (failed && snapshot_path){
+        // the case again, on a VM of its own, so the snapshot holds every page it writes
+        VM* vm = workers[0].scratch;
+        char input[FUZZ_INPUT_MAX];
+        size_t input_len;
+        vm_reset_to(vm, NULL);
+        fuzz_case(vm, failed_seed, input, &input_len);
+        if (!vm_save_snapshot(vm, snapshot_path, NULL, 0)){
+            printf("failed to write snapshot: %s\n", snapshot_path);
+        } else {
+            printf("seed %u is in %s, its input is \"", failed_seed, snapshot_path);
+            for (size_t i = 0; i < input_len; i++){
+                printf(input[i] == '\n' ? "\\n" : "%c", input[i]);
+            }
+            printf("\"\n");
+        }
+    }
+    for (int i = 0; i < threads; i++){
+        worker_destroy(&workers[i]);
+    }
+    free(workers);
+    return failed ? 4 : 0;
+}
@@ -0,0 +1,334 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lc3_vm.h"
+
+/*
+Image loading. An image file is mapped into the address space instead of being read through stdio, and its words go
+from the mapping straight into the pages they belong in, so nothing is copied twice and a large data image only
+costs the page faults of reading it once.
+
+Two formats are understood, told apart by their first bytes:
+
+    .obj        the standard LC-3 object file, a big-endian origin followed by big-endian words. The byte swap is
+                done 8 or 16 words at a time with SSE2/SSSE3 or NEON where the compiler targets them.
+
+    native      a pre-swapped image with any number of segments (laid out below). The words are stored in
+                the byte order of the machine that wrote them, which means no conversion at all on the usual little
+                endian hosts. An image written on a big endian host still loads, just with the swap pass.
+
+If a file cannot be mapped (a pipe, say) vm_load_image() falls back to reading it with stdio.
+*/
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/*
+the native format, all fields in the writer's byte order:
+
+    char     magic[4]           "LC3N"
+    uint16   byte_order         NATIVE_BYTE_ORDER, reads as 0x0201 when the image comes from the other kind of host
+    uint16   segment_count
+    then segment_count times:
+    uint16   origin
+    uint16   flags              NATIVE_SEGMENT_DATA or 0
+    uint32   word_count         at most MAX_MEMORY - origin
+    uint16   words[word_count]
+
+assemble.py --native writes it. Every header field and every segment starts at an even offset, the words may be
+read unaligned. NATIVE_SEGMENT_DATA marks words that are data and not code (.FILL, .BLKW and .STRINGZ), so the
+analysis in lc3_analysis.c does not take them for code when it runs into them, after a JSR to a routine that never
+returns say. The VM does not hold a program to it, running data only costs it the proved stores.
+*/
+enum {
+    NATIVE_BYTE_ORDER = 0x0102,
+    NATIVE_HEADER_SIZE = 8,
+    NATIVE_SEGMENT_SIZE = 8,
+    NATIVE_SEGMENT_DATA = 1
+};
+
+static const char native_magic[4] = { 'L', 'C', '3', 'N' };
+
+static uint16_t read16(const unsigned char* p, int swap){
+    uint16_t v;
+    memcpy(&v, p, 2);
+    return swap ? swap16(v) : v;
+}
+
+static uint32_t read32(const unsigned char* p, int swap){
+    uint32_t v;
+    memcpy(&v, p, 4);
+    if (swap){
+        v = (v >> 24) | ((v >> 8) & 0xFF00) | ((v << 8) & 0xFF0000) | (v << 24);
+    }
+    return v;
+}
+
+// byte swapping---------------------------------------------------------------------------------
+
+// copies n big-endian words from src to dst in host order. src does not have to be aligned
+static void swap_words(uint16_t* dst, const unsigned char* src, size_t n){
+    size_t i = 0;
+#if defined(__SSSE3__)
+    const __m128i order = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    for (; i + 16 <= n; i += 16){
+        __m128i a = _mm_loadu_si128((const __m128i*)(src + i * 2));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + i * 2 + 16));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_shuffle_epi8(a, order));
+        _mm_storeu_si128((__m128i*)(dst + i + 8), _mm_shuffle_epi8(b, order));
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    for (; i + 8 <= n; i += 8){
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i * 2));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 16 <= n; i += 16){
+        uint8x16_t a = vld1q_u8(src + i * 2);
+        uint8x16_t b = vld1q_u8(src + i * 2 + 16);
+        vst1q_u16(dst + i, vreinterpretq_u16_u8(vrev16q_u8(a)));
+        vst1q_u16(dst + i + 8, vreinterpretq_u16_u8(vrev16q_u8(b)));
+    }
+#endif
+    for (; i < n; i++){
+        dst[i] = read16(src + i * 2, 1);
+    }
+}
+
+// loading---------------------------------------------------------------------------------
+
+// notes down whether the words from start up to end are data (see NATIVE_SEGMENT_DATA). Without memory for the
+// note they count as code, which is only ever slower
+static void mark_data(VM* vm, uint32_t start, uint32_t end, int data){
+
+    if (!vm->data_words){
+        if (!data){
+            return;
+        }
+        vm->data_words = calloc(MAX_MEMORY / 64, sizeof(uint64_t));
+        if (!vm->data_words){
+            return;
+        }
+    }
+    for (uint32_t address = start; address < end; address++){
+        uint64_t bit = (uint64_t)1 << (address & 63);
+        vm->data_words[address >> 6] = data ? vm->data_words[address >> 6] | bit : vm->data_words[address >> 6] & ~bit;
+    }
+}
+
+// puts count words from src into memory at origin, swapping them if swap is set. Words past the end of memory are
+// dropped. data: the image says they are data (NATIVE_SEGMENT_DATA)
+static void load_words(VM* vm, uint32_t origin, const unsigned char* src, size_t count, int swap, int data){
+
+    if (origin >= MAX_MEMORY){
+        return;
+    }
+    if (count > (size_t)(MAX_MEMORY - origin)){
+        count = MAX_MEMORY - origin;
+    }
+    uint32_t address = origin;
+    uint32_t end = origin + (uint32_t)count;
+    vm_journal_clear(vm);  // the journal cannot undo this
+    vm_analysis_stop(vm);  // nor is the analysis about these words
+    mark_data(vm, origin, end, data);
+    while (address < end){
+        uint32_t offset = address & (PAGE_WORDS - 1);
+        uint32_t n = PAGE_WORDS - offset;
+        if (n > end - address){
+            n = end - address;
+        }
+        // the same as mem_write() for every word, a page at a time: the VM gets its own copy of the page and
+        // whatever was decoded or compiled from the old words is thrown away
+        int page = (int)(address >> PAGE_SHIFT);
+        int fresh = n == PAGE_WORDS && !vm->page_owned[page];
+        vm_page* p = fresh ? vm_replace_page(vm, page) : vm_own_page(vm, page);
+        vm->page_dirty[page] = 1;
+        if (swap){
+            swap_words(p->words + offset, src, n);
+        } else {
+            memcpy(p->words + offset, src, n * 2);
+        }
+        for (uint32_t i = offset; !fresh && i < offset + n; i++){
+            p->decoded[i].op = OP_DECODE;
+        }
+        if (vm->jit){
+            for (uint32_t a = address; a < address + n; a++){
+                if (vm->jit_code_map[a]){
+                    jit_invalidate(vm, (uint16_t)a);
+                }
+            }
+        }
+        src += n * 2;
+        address += n;
+    }
+}
+
+static int is_native(const unsigned char* data, size_t size){
+    return size >= 4 && memcmp(data, native_magic, 4) == 0;
+}
+
+// checks the whole native image up front, so a damaged file loads nothing rather than half of itself
+static int check_native(const unsigned char* data, size_t size, int* swap){
+
+    if (size < NATIVE_HEADER_SIZE){
+        return 0;
+    }
+    uint16_t order;
+    memcpy(&order, data + 4, 2);
+    if (order != NATIVE_BYTE_ORDER && order != swap16(NATIVE_BYTE_ORDER)){
+        return 0;
+    }
+    *swap = order != NATIVE_BYTE_ORDER;
+    uint16_t segments = read16(data + 6, *swap);
+    size_t pos = NATIVE_HEADER_SIZE;
+    for (uint16_t s = 0; s < segments; s++){
+        if (size - pos < NATIVE_SEGMENT_SIZE){
+            return 0;
+        }
+        uint16_t origin = read16(data + pos, *swap);
+        uint32_t count = read32(data + pos + 4, *swap);
+        if (count > (uint32_t)(MAX_MEMORY - origin) || size - pos - NATIVE_SEGMENT_SIZE < (size_t)count * 2){
+            return 0;
+        }
+        pos += NATIVE_SEGMENT_SIZE + (size_t)count * 2;
+    }
+    return pos == size;
+}
+
+// loads an image held in memory, either format. Returns 0 if it is not an image at all, or a damaged native one
+// (an .obj file that starts with the magic would have to have its origin at 0x4C43 and "3N" as its first word)
+int vm_load_image_data(VM* vm, const unsigned char* data, size_t size){
+
+    int swap;
+    if (is_native(data, size)){
+        if (!check_native(data, size, &swap)){
+            return 0;
+        }
+        uint16_t segments = read16(data + 6, swap);
+        size_t pos = NATIVE_HEADER_SIZE;
+        for (uint16_t s = 0; s < segments; s++){
+            uint16_t origin = read16(data + pos, swap);
+            uint16_t flags = read16(data + pos + 2, swap);
+            uint32_t count = read32(data + pos + 4, swap);
+            load_words(vm, origin, data + pos + NATIVE_SEGMENT_SIZE, count, swap, flags & NATIVE_SEGMENT_DATA);
+            pos += NATIVE_SEGMENT_SIZE + (size_t)count * 2;
+        }
+        return 1;
+    }
+
+    if (size < 2){
+        return 0;  // not even an origin
+    }
+    uint16_t origin = read16(data, 1);  // .obj files are big-endian
+    load_words(vm, origin, data + 2, (size - 2) / 2, 1, 0);
+    return 1;
+}
+
+// reads all of a stream into a malloc'd buffer, NULL if it runs out of memory
+static unsigned char* read_stream(FILE* file, size_t* size){
+    size_t cap = 1 << 16, len = 0, got;
+    unsigned char* data = malloc(cap);
+    while (data && (got = fread(data + len, 1, cap - len, file)) > 0){
+        len += got;
+        if (len == cap){
+            cap *= 2;
+            unsigned char* grown = realloc(data, cap);
+            if (!grown){
+                free(data);
+            }
+            data = grown;
+        }
+    }
+    *size = len;
+    return data;
+}
+
+// the stdio path, for files that cannot be mapped
+void read_image_file(VM* vm, FILE* file){
+    size_t size;
+    unsigned char* data = read_stream(file, &size);
+    if (data){
+        vm_load_image_data(vm, data, size);
+    }
+    free(data);
+}
+
+static int load_with_stdio(VM* vm, const char* image_path){
+    FILE* file = fopen(image_path, "rb");
+    if (!file){
+        return 0;
+    }
+    size_t size;
+    unsigned char* data = read_stream(file, &size);
+    fclose(file);
+    int loaded = data && vm_load_image_data(vm, data, size);
+    free(data);
+    return loaded;
+}
+
+int vm_load_image(VM* vm, const char* image_path){
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(image_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE){
+        return 0;
+    }
+    LARGE_INTEGER size;
+    HANDLE mapping = NULL;
+    const unsigned char* data = NULL;
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0){
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    }
+    if (mapping){
+        data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    }
+    if (!data){
+        if (mapping){
+            CloseHandle(mapping);
+        }
+        CloseHandle(file);
+        return load_with_stdio(vm, image_path);
+    }
+    int loaded = vm_load_image_data(vm, data, (size_t)size.QuadPart);
+    UnmapViewOfFile(data);
+    CloseHandle(mapping);
+    CloseHandle(file);
+    return loaded;
+#else
+    int fd = open(image_path, O_RDONLY);
+    if (fd < 0){
+        return 0;
+    }
+    struct stat st;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0){
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);  // the mapping stays valid without it
+    if (data == MAP_FAILED){
+        return load_with_stdio(vm, image_path);
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+    int loaded = vm_load_image_data(vm, data, (size_t)st.st_size);
+    munmap(data, (size_t)st.st_size);
+    return loaded;
+#endif
+}
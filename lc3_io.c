@@ -0,0 +1,652 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lc3_vm.h"
+
+/*
+Keyboard input goes through an io_backend, so the rest of the VM does not care whether it is talking to a terminal
+or reading a pipe on a server:
+
+    console     interactive use. The terminal is switched out of line mode with echo off while the program runs,
+                and KBSR polls ask the OS whether a key is waiting without waiting for one (termios + poll on
+                POSIX, the console API on Windows).
+
+    headless    stdin is a pipe or a file. Input is read in big chunks into stdin_buf, so a KBSR poll is normally
+                just a comparison of two numbers. It only goes to the kernel when the buffer is empty, and then only
+                to ask (poll with a zero timeout), and once the input has hit EOF it never does again.
+
+    memory      no file descriptors at all, for VMs run as a library or by the batch runner. The input is whatever
+                vm_set_input() was given and the output piles up in vm->output.
+
+    virtual     input that arrives at set instruction counts instead of whenever somebody types it (vm_input_at(),
+                --events=FILE), for runs that have to come out the same every time. Output goes to stdout.
+
+main() picks console when stdin is a terminal and headless otherwise, --io= overrides it.
+
+The output traps fill vm->out_buf and it goes to the backend in one piece at a time, for console and headless that
+is one fwrite to stdout (see the comment in lc3_vm.h for when that happens).
+
+There is only one stdin, so only one VM at a time should use console or headless.
+*/
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <conio.h>  // _kbhit
+#include <io.h>     // _isatty
+#else
+#include <unistd.h>
+#include <termios.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <time.h>
+#endif
+
+// x86-64 always has SSE2, the string traps use it to go through 8 words at a time (see "string output" below)
+#if defined(__SSE2__) || defined(_M_X64)
+#define IO_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+static int lowest_bit(unsigned x){ unsigned long i; _BitScanForward(&i, x); return (int)i; }
+#else
+static int lowest_bit(unsigned x){ return __builtin_ctz(x); }
+#endif
+#endif
+
+// buffered input---------------------------------------------------------------------------------
+
+// vm->in_data points here for the backends that read stdin, vm->in_never_blocks is set when stdin is a regular file
+static unsigned char stdin_buf[1 << 16];
+
+static void use_stdin(VM* vm){
+    vm->in_data = stdin_buf;
+    vm->in_pos = vm->in_len = 0;
+    vm->in_eof = 0;
+}
+
+#ifdef _WIN32
+
+static HANDLE hInput = INVALID_HANDLE_VALUE;
+
+static int input_waiting(void){
+    DWORD available = 0;
+    if (GetFileType(hInput) != FILE_TYPE_PIPE){
+        return 1;
+    }
+    return PeekNamedPipe(hInput, NULL, 0, NULL, &available, NULL) ? available > 0 : 1;  // a broken pipe reads as EOF
+}
+
+static long read_input(void* buf, size_t size){
+    DWORD got = 0;
+    if (!ReadFile(hInput, buf, (DWORD)size, &got, NULL)){
+        return 0;
+    }
+    return (long)got;
+}
+
+#else
+
+static int input_waiting(void){
+    struct pollfd p = { STDIN_FILENO, POLLIN, 0 };
+    return poll(&p, 1, 0) > 0;  // POLLHUP counts too, the read then sees EOF
+}
+
+static long read_input(void* buf, size_t size){
+    ssize_t got;
+    do {
+        got = read(STDIN_FILENO, buf, size);
+    } while (got < 0 && errno == EINTR);
+    return got < 0 ? 0 : (long)got;
+}
+
+#endif
+
+// refills stdin_buf, without waiting unless block is set, returns 0 if there is still nothing to read
+static int refill(VM* vm, int block){
+    if (vm->in_eof){
+        return 0;  // always the case for io_memory
+    }
+    if (!block && !vm->in_never_blocks && !input_waiting()){
+        return 0;
+    }
+    long got = read_input(stdin_buf, sizeof(stdin_buf));
+    if (got <= 0){
+        vm->in_eof = 1;
+        return 0;
+    }
+    vm->in_pos = 0;
+    vm->in_len = (size_t)got;
+    return 1;
+}
+
+static int buffered_key_ready(VM* vm){
+    return vm->in_pos < vm->in_len || refill(vm, 0);
+}
+
+static int buffered_read_char(VM* vm){
+    if (vm->in_pos == vm->in_len && !refill(vm, 1)){
+        return EOF;
+    }
+    return vm->in_data[vm->in_pos++];
+}
+
+static void stdout_write(VM* vm, const char* s, size_t n){
+    (void)vm;
+    fwrite(s, 1, n, stdout);
+    fflush(stdout);
+}
+
+// buffered output---------------------------------------------------------------------------------
+
+static long long now_ms(void){
+#ifdef _WIN32
+    return (long long)GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+void io_flush(VM* vm){
+    if (!vm->out_len){
+        return;  // KBSR polls come through here, keep that cheap
+    }
+    vm->io->write(vm, vm->out_buf, vm->out_len);
+    if (vm->metrics){
+        metrics_output(vm->metrics, vm->out_len);
+    }
+    vm->out_len = 0;
+    if (vm->out_flush_ms > 0){
+        vm->out_last_flush = now_ms();
+    }
+}
+
+void io_putc(VM* vm, char c){
+    if (vm->out_len == OUT_BUF_SIZE){
+        io_flush(vm);
+    }
+    vm->out_buf[vm->out_len++] = c;
+}
+
+void io_write(VM* vm, const char* s, size_t n){
+    if (n > OUT_BUF_SIZE - vm->out_len){
+        io_flush(vm);
+        if (n > OUT_BUF_SIZE){
+            vm->io->write(vm, s, n);  // bigger than the whole buffer, no point copying it
+            if (vm->metrics){
+                metrics_output(vm->metrics, n);
+            }
+            return;
+        }
+    }
+    memcpy(vm->out_buf + vm->out_len, s, n);
+    vm->out_len += n;
+}
+
+// string output---------------------------------------------------------------------------------
+
+/*
+PUTS and PUTSP go through the string a page at a time, the words of a page are one array. An address past
+0xFFFF wraps around to 0x0000 like every other LC-3 address, and a string that never ends stops after all 65536
+words, so a missing zero word costs one lap of memory at most. Device page words are read as they are stored,
+without the side effects of mem_read(). With SSE2 both find the zero word 8 words at a time. PUTS narrows 8 words to
+8 characters with one pack, and PUTSP copies 8 words as 16 characters at a time for as long as no high byte is 0.
+*/
+
+// the number of words before the first zero word in words[0..n), n if there is none
+static size_t string_length(const uint16_t* words, size_t n){
+
+    size_t i = 0;
+#ifdef IO_SSE2
+    for (; i + 8 <= n; i += 8){
+        __m128i v = _mm_loadu_si128((const __m128i*)(words + i));
+        int zeros = _mm_movemask_epi8(_mm_cmpeq_epi16(v, _mm_setzero_si128()));  // two bits per zero word
+        if (zeros){
+            return i + lowest_bit((unsigned)zeros) / 2;
+        }
+    }
+#endif
+    while (i < n && words[i]){
+        i++;
+    }
+    return i;
+}
+
+// the low byte of each of n words into out
+static void narrow(char* out, const uint16_t* words, size_t n){
+
+    size_t i = 0;
+#ifdef IO_SSE2
+    const __m128i low = _mm_set1_epi16(0xFF);
+    for (; i + 16 <= n; i += 16){
+        __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i*)(words + i)), low);
+        __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i*)(words + i + 8)), low);
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(a, b));  // nothing to saturate once masked
+    }
+#endif
+    for (; i < n; i++){
+        out[i] = (char)words[i];
+    }
+}
+
+// calls put(vm, words, n) for the string at address, in one piece per page it is in
+static void for_string(VM* vm, uint16_t address, void (*put)(VM* vm, const uint16_t* words, size_t n)){
+
+    for (uint32_t left = MAX_MEMORY; left; ){
+        unsigned offset = address & (PAGE_WORDS - 1);
+        const uint16_t* words = vm->pages[address >> PAGE_SHIFT]->words + offset;
+        size_t n = PAGE_WORDS - offset < left ? PAGE_WORDS - offset : left;
+        size_t len = string_length(words, n);
+        put(vm, words, len);
+        if (len < n){
+            return;
+        }
+        address = (uint16_t)(address + n);
+        left -= (uint32_t)n;
+    }
+}
+
+static void put_chars(VM* vm, const uint16_t* words, size_t n){
+
+    while (n){
+        if (vm->out_len == OUT_BUF_SIZE){
+            io_flush(vm);
+        }
+        size_t room = OUT_BUF_SIZE - vm->out_len;
+        size_t k = n < room ? n : room;
+        narrow(vm->out_buf + vm->out_len, words, k);
+        vm->out_len += k;
+        words += k;
+        n -= k;
+    }
+}
+
+static void put_packed(VM* vm, const uint16_t* words, size_t n){
+
+    for (size_t i = 0; i < n; ){
+        if (OUT_BUF_SIZE - vm->out_len < 16){
+            io_flush(vm);
+        }
+        char* out = vm->out_buf + vm->out_len;
+#ifdef IO_SSE2
+        // the words are little endian like the characters, so if all 8 hold two characters they are the 16 bytes
+        if (i + 8 <= n){
+            __m128i v = _mm_loadu_si128((const __m128i*)(words + i));
+            __m128i high = _mm_and_si128(v, _mm_set1_epi16((short)0xFF00));
+            if (!_mm_movemask_epi8(_mm_cmpeq_epi16(high, _mm_setzero_si128()))){
+                _mm_storeu_si128((__m128i*)out, v);
+                vm->out_len += 16;
+                i += 8;
+                continue;
+            }
+        }
+#endif
+        out[0] = (char)(words[i] & 0xFF);
+        out[1] = (char)(words[i] >> 8);
+        vm->out_len += 1 + (out[1] != 0);  // only the second character if it is non-zero
+        i++;
+    }
+}
+
+void io_puts_words(VM* vm, uint16_t address){
+
+    for_string(vm, address, put_chars);
+    if (vm->out_puts_write){
+        io_flush(vm);
+    }
+}
+
+void io_putsp_words(VM* vm, uint16_t address){
+
+    for_string(vm, address, put_packed);
+    if (vm->out_puts_write){
+        io_flush(vm);
+    }
+}
+
+// count words from address on as characters, zero words too, wrapping around past 0xFFFF
+void io_write_words(VM* vm, uint16_t address, uint16_t count){
+
+    for (uint32_t left = count; left; ){
+        unsigned offset = address & (PAGE_WORDS - 1);
+        size_t n = PAGE_WORDS - offset < left ? PAGE_WORDS - offset : left;
+        put_chars(vm, vm->pages[address >> PAGE_SHIFT]->words + offset, n);
+        address = (uint16_t)(address + n);
+        left -= (uint32_t)n;
+    }
+    if (vm->out_puts_write){
+        io_flush(vm);
+    }
+}
+
+// the time TRAP_CLOCK reads: milliseconds on the host's monotonic clock, or instructions for a VM in virtual time
+uint64_t io_clock(VM* vm){
+    return vm->io == &io_virtual ? vm_clock(vm) : (uint64_t)now_ms();
+}
+
+void io_output_done(VM* vm){
+    if (vm->out_flush_ms == 0 || now_ms() - vm->out_last_flush >= vm->out_flush_ms){
+        io_flush(vm);
+    }
+}
+
+// console backend---------------------------------------------------------------------------------
+
+#ifdef _WIN32
+
+HANDLE hStdin = INVALID_HANDLE_VALUE;
+DWORD fdwMode, fdwOldMode;
+
+static int console_open(VM* vm)
+{
+    (void)vm;
+    hStdin = GetStdHandle(STD_INPUT_HANDLE);
+    GetConsoleMode(hStdin, &fdwOldMode); /* save old mode */
+    // fdwMode = fdwOldMode;
+    // fdwMode &= ~(ENABLE_ECHO_INPUT | ENABLE_LINE_INPUT);
+    fdwMode = fdwOldMode
+            ^ ENABLE_ECHO_INPUT  /* no input echo */
+            ^ ENABLE_LINE_INPUT; /* return when one or
+                                    more characters are available */
+    SetConsoleMode(hStdin, fdwMode); /* set new mode */
+    FlushConsoleInputBuffer(hStdin); /* clear buffer */
+    return 1;
+}
+
+static void console_close(VM* vm)
+{
+    (void)vm;
+    SetConsoleMode(hStdin, fdwOldMode);
+}
+
+static int console_key_ready(VM* vm)
+{
+    (void)vm;
+    // a zero timeout, so a poll only asks whether a key is waiting instead of sitting there for up to a second
+    return WaitForSingleObject(hStdin, 0) == WAIT_OBJECT_0 && _kbhit();
+}
+
+static int console_read_char(VM* vm)
+{
+    (void)vm;
+    return getchar();
+}
+
+#else
+
+static struct termios original_tio;
+static int tio_saved;
+
+static int console_open(VM* vm)
+{
+    use_stdin(vm);
+    vm->in_never_blocks = 0;
+    if (tcgetattr(STDIN_FILENO, &original_tio) == 0){
+        struct termios new_tio = original_tio;
+        new_tio.c_lflag &= ~(ICANON | ECHO);  // no line buffering, no echo
+        tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+        tio_saved = 1;
+    }
+    return 1;
+}
+
+static void console_close(VM* vm)
+{
+    (void)vm;
+    if (tio_saved){
+        tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+    }
+}
+
+#define console_key_ready buffered_key_ready
+#define console_read_char buffered_read_char
+
+#endif
+
+const io_backend io_console = { "console", console_open, console_close, console_key_ready, console_read_char, stdout_write };
+
+// headless backend---------------------------------------------------------------------------------
+
+static int headless_open(VM* vm)
+{
+    use_stdin(vm);
+#ifdef _WIN32
+    hInput = GetStdHandle(STD_INPUT_HANDLE);
+    vm->in_never_blocks = GetFileType(hInput) == FILE_TYPE_DISK;
+#else
+    struct stat st;
+    vm->in_never_blocks = fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode);
+#endif
+    return 1;
+}
+
+static void headless_close(VM* vm)
+{
+    (void)vm;
+}
+
+const io_backend io_headless = { "headless", headless_open, headless_close, buffered_key_ready, buffered_read_char, stdout_write };
+
+// memory backend---------------------------------------------------------------------------------
+
+static int memory_open(VM* vm)
+{
+    (void)vm;
+    return 1;
+}
+
+static void memory_close(VM* vm)
+{
+    (void)vm;
+}
+
+static void memory_write(VM* vm, const char* s, size_t n)
+{
+    if (vm->output_len + n > vm->output_cap){
+        size_t cap = vm->output_cap ? vm->output_cap : 256;
+        while (cap < vm->output_len + n){
+            cap *= 2;
+        }
+        char* grown = realloc(vm->output, cap);
+        if (!grown){
+            return;  // out of memory, the output is cut short
+        }
+        vm->output = grown;
+        vm->output_cap = cap;
+    }
+    memcpy(vm->output + vm->output_len, s, n);
+    vm->output_len += n;
+}
+
+const io_backend io_memory = { "memory", memory_open, memory_close, buffered_key_ready, buffered_read_char, memory_write };
+
+// virtual time backend---------------------------------------------------------------------------------
+
+// when the next character to read arrives, UINT64_MAX once everything has been read
+uint64_t io_next_arrival(VM* vm){
+    while (vm->in_event_next < vm->in_event_count && vm->in_events[vm->in_event_next].end <= vm->in_pos){
+        vm->in_event_next++;
+    }
+    return vm->in_pos < vm->in_len ? vm->in_events[vm->in_event_next].at : UINT64_MAX;
+}
+
+static int virtual_key_ready(VM* vm)
+{
+    uint64_t at = io_next_arrival(vm);
+    return at != UINT64_MAX && vm_clock(vm) > at;  // the clock counts the instruction doing the polling
+}
+
+// the next character, whether it has arrived or not, the program just does not see the time go by
+static int virtual_read_char(VM* vm)
+{
+    return vm->in_pos < vm->in_len ? vm->in_data[vm->in_pos++] : EOF;
+}
+
+const io_backend io_virtual = { "virtual", memory_open, memory_close, virtual_key_ready, virtual_read_char, stdout_write };
+
+/*
+size bytes of data arrive once at instructions have run (never before what came in earlier). The first call switches
+vm over to io_virtual and throws away any input it had
+*/
+void vm_input_at(VM* vm, uint64_t at, const char* data, size_t size){
+
+    if (vm->io != &io_virtual){
+        vm->io = &io_virtual;
+        free(vm->in_owned);
+        vm->in_owned = NULL;
+        vm->in_data = NULL;
+        vm->in_pos = vm->in_len = 0;
+        vm->in_event_count = vm->in_event_next = 0;
+        vm->in_eof = 1;
+    }
+    if (vm->in_event_count && at < vm->in_events[vm->in_event_count - 1].at){
+        at = vm->in_events[vm->in_event_count - 1].at;
+    }
+    if (vm->in_event_count == vm->in_event_cap){
+        size_t cap = vm->in_event_cap ? vm->in_event_cap * 2 : 16;
+        vm_input_event* grown = realloc(vm->in_events, cap * sizeof(vm_input_event));
+        if (!grown){
+            printf("out of memory\n");
+            exit(1);
+        }
+        vm->in_events = grown;
+        vm->in_event_cap = cap;
+    }
+    unsigned char* text = realloc(vm->in_owned, vm->in_len + size + 1);
+    if (!text){
+        printf("out of memory\n");
+        exit(1);
+    }
+    if (size){
+        memcpy(text + vm->in_len, data, size);
+    }
+    vm->in_owned = text;
+    vm->in_data = text;
+    vm->in_len += size;
+    vm->in_events[vm->in_event_count].at = at;
+    vm->in_events[vm->in_event_count].end = vm->in_len;
+    vm->in_event_count++;
+}
+
+/*
+--events=FILE: every line is an instruction count, a space, and the text that arrives then, the end of the line
+included. Returns 0 if the file cannot be read or a line does not start with a number
+*/
+int vm_load_input_events(VM* vm, const char* path){
+
+    FILE* file = fopen(path, "rb");
+    if (!file){
+        return 0;
+    }
+    vm_input_at(vm, 0, NULL, 0);  // a file with no lines still means no input
+    char line[4096];
+    int ok = 1;
+    uint64_t at = 0;
+    int continued = 0;  // the last line did not fit, this is the rest of its text
+    while (ok && fgets(line, sizeof(line), file)){
+        size_t len = strlen(line);
+        const char* text = line;
+        if (!continued && line[0] == '\n'){
+            continue;  // blank lines are allowed, the text that arrives is on the lines with numbers
+        }
+        if (!continued){
+            char* end;
+            at = strtoull(line, &end, 10);
+            ok = end != line && (*end == ' ' || *end == '\n' || *end == 0);
+            text = *end == ' ' ? end + 1 : end;
+        }
+        vm_input_at(vm, at, text, len - (size_t)(text - line));
+        continued = len && line[len - 1] != '\n';
+    }
+    fclose(file);
+    return ok;
+}
+
+// front end used by the rest of the VM---------------------------------------------------------------------------------
+
+const io_backend* io_backend_named(const char* name){
+    if (strcmp(name, "console") == 0){
+        return &io_console;
+    }
+    if (strcmp(name, "headless") == 0){
+        return &io_headless;
+    }
+    return NULL;
+}
+
+const io_backend* io_default_backend(void){
+#ifdef _WIN32
+    return _isatty(_fileno(stdin)) ? &io_console : &io_headless;
+#else
+    return isatty(STDIN_FILENO) ? &io_console : &io_headless;
+#endif
+}
+
+void disable_input_buffering(VM* vm)
+{
+    vm->io->open(vm);
+}
+
+void restore_input_buffering(VM* vm)
+{
+    io_flush(vm);
+    vm->io->close(vm);
+}
+
+// after a restore, the input the program had already read before the snapshot goes before anything else is read
+static void skip_input(VM* vm)
+{
+    while (vm->in_skip && vm->io->read_char(vm) != EOF){
+        vm->in_skip--;
+    }
+    vm->in_skip = 0;
+}
+
+// both input paths write out pending output first, so the program's prompt is on screen before it waits for an answer
+uint16_t check_key(VM* vm)
+{
+    io_flush(vm);
+    if (vm->in_skip){
+        skip_input(vm);
+    }
+    uint16_t ready;
+    if (vm->metrics){
+        uint64_t started = metrics_wait_start(vm->metrics);
+        ready = (uint16_t)vm->io->key_ready(vm);
+        metrics_wait_end(vm->metrics, started);
+    } else {
+        ready = (uint16_t)vm->io->key_ready(vm);
+    }
+    vm->in_empty_polls += !ready;
+    if (vm->trace){
+        trace_input(vm->trace, ready != 0);  // the replay needs every poll, not just the characters
+    }
+    return ready;
+}
+
+uint16_t io_getchar(VM* vm)
+{
+    io_flush(vm);
+    if (vm->in_skip){
+        skip_input(vm);
+    }
+    int c;
+    if (vm->metrics){
+        uint64_t started = metrics_wait_start(vm->metrics);  // GETC and IN block in here on the console
+        c = vm->io->read_char(vm);
+        metrics_wait_end(vm->metrics, started);
+    } else {
+        c = vm->io->read_char(vm);
+    }
+    if (c != EOF){
+        vm->in_consumed++;
+    }
+    if (vm->trace){
+        trace_input(vm->trace, (uint16_t)c);
+    }
+    return (uint16_t)c;
+}
@@ -0,0 +1,847 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lc3_vm.h"
+
+/*
+The JIT tier sits on top of the threaded engine. run_threaded() counts how many times execution enters a block at
+each address (after a taken branch, a jump, a subroutine call or a trap), and once an address gets hot enough
+jit_compile() translates the straight line code starting there into machine code. The slot of the first instruction
+in decoded[] is then switched to OP_JIT, so the next time execution gets there the interpreter calls the compiled
+block instead of dispatching the instruction.
+
+While a block runs, R0-R7 live in host registers r8-r15. They are loaded when the block starts and written back to
+reg[] when it returns, and the return value is the PC the interpreter carries on from. A block ends at an
+unconditional branch, JMP/RET, JSR/JSRR, or just before anything it leaves to the interpreter: TRAP, RTI, the
+reserved opcode, and loads from the device page (0xFE00 and up, where mem_read() has side effects). A conditional
+branch does not end a block, it just leaves it when the branch is taken. A branch back to the start of the block
+jumps straight back into the compiled code, so tight loops never go back through the interpreter.
+
+Condition codes are lazy here too (see cond_value in lc3_vm.h). The compiler keeps track of which register holds
+the last flag setting result and tests that register directly for branches inside the block, cond_value is only
+written when the block is left.
+
+Compiled code counts instructions too, so vm_run() stops after exactly as many instructions as it was asked for
+whichever engine runs them (see vm->budget). A block is only entered when the budget covers a whole pass through it,
+every exit takes off what that path executed, and a loop back to the start leaves the block instead when the budget
+would not cover another pass.
+
+Self-modifying code: jit_code_map[] counts the compiled blocks covering each word. Compiled stores check it and
+leave the block (before the store happens) when they would write over compiled code, the interpreter then does the
+store through mem_write(), which calls jit_invalidate() to throw the stale blocks away. MR_BLOCK_CONTROL counts one
+more than the blocks covering it (none ever do), so that a store to it leaves the block the same way and mem_write()
+does the transfer (see lc3_block.c). While the store analysis holds the code it found counts one more as well, a
+store over it ends the analysis in mem_write(). Stores vm_analyze() proved never write code (OP_ST_DATA and
+OP_STR_DATA, see lc3_analysis.c) go without the check, and without resetting the slot of the word they write.
+
+Each VM has its own blocks and code arena (struct jit_state), so VMs on different threads can all use the JIT.
+
+Only x86-64 (System V and Windows calling conventions) is supported, on other hosts jit_init() fails and the VM
+runs the threaded engine without the JIT.
+*/
+
+#if defined(__x86_64__) || defined(_M_X64)
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+enum {
+    JIT_ARENA_SIZE = 4 << 20,        // machine code for all blocks, flushed as a whole once it fills up
+    JIT_MAX_BLOCKS = 4096,
+    JIT_MAX_BLOCK_LEN = 128,         // LC-3 instructions per block
+    JIT_MAX_BLOCK_BYTES = 32 << 10   // generous upper bound on the machine code of one block
+};
+
+// the VM is the only argument of a block, everything it touches is at a fixed offset from it
+typedef uint16_t (*jit_block_fn)(VM* vm);
+
+#define OFF(field) ((int32_t)offsetof(VM, field))
+
+typedef struct {
+    uint16_t start;         // address of the first instruction
+    uint16_t end;           // one past the last compiled instruction
+    int live;
+    decoded_instr entry;    // decoded form of the first instruction, for when the interpreter has to run it itself
+    jit_block_fn code;
+} jit_block;
+
+struct jit_state {
+    jit_block blocks[JIT_MAX_BLOCKS];
+    int block_count;
+    uint8_t* arena;
+    size_t arena_used;
+};
+
+// x86-64 encoding---------------------------------------------------------------------------------
+
+enum { RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+#define HOST(r) (R8 + (r))  // host register holding LC-3 register r while a block runs
+
+/*
+the other registers a block uses:
+    rbp     the VM, pages[], page_owned[], reg[] and cond_value are all addressed from it
+    rbx     vm->jit_code_map
+    rcx     vm->budget
+    rax     scratch, effective addresses and the return value
+    rdx     scratch, the page an effective address is in
+*/
+
+enum {
+    CC_E = 0x4, CC_NE = 0x5, CC_AE = 0x3, CC_S = 0x8, CC_NS = 0x9, CC_LE = 0xE, CC_G = 0xF
+};
+
+#ifdef _MSC_VER
+#define JIT_THREAD_LOCAL __declspec(thread)
+#else
+#define JIT_THREAD_LOCAL __thread
+#endif
+
+static JIT_THREAD_LOCAL uint8_t* code;  // where the next byte of machine code goes, VMs on other threads may be compiling too
+
+static void emit8(uint8_t b){
+    *code++ = b;
+}
+
+static void emit32(uint32_t v){
+    memcpy(code, &v, 4);
+    code += 4;
+}
+
+static void emit_rex(int w, int r, int x, int b){
+    uint8_t rex = 0x40 | (w << 3) | (((r >> 3) & 1) << 2) | (((x >> 3) & 1) << 1) | ((b >> 3) & 1);
+    if (rex != 0x40){
+        emit8(rex);
+    }
+}
+
+// register to register form, op reg_field, rm
+static void emit_rr(uint8_t op, int reg_field, int rm){
+    emit_rex(0, reg_field, 0, rm);
+    emit8(op);
+    emit8(0xC0 | ((reg_field & 7) << 3) | (rm & 7));
+}
+
+static void emit_mov(int dst, int src){ emit_rr(0x89, src, dst); }
+static void emit_add(int dst, int src){ emit_rr(0x01, src, dst); }
+static void emit_and(int dst, int src){ emit_rr(0x21, src, dst); }
+
+// add/and/cmp r32, imm32
+static void emit_alu_imm(int ext, int dst, uint32_t imm){
+    emit_rex(0, 0, 0, dst);
+    emit8(0x81);
+    emit8(0xC0 | (ext << 3) | (dst & 7));
+    emit32(imm);
+}
+
+static void emit_add_imm(int dst, uint32_t imm){ emit_alu_imm(0, dst, imm); }
+static void emit_and_imm(int dst, uint32_t imm){ emit_alu_imm(4, dst, imm); }
+static void emit_cmp_imm(int dst, uint32_t imm){ emit_alu_imm(7, dst, imm); }
+
+// sub/cmp r64, imm32
+static void emit_alu64_imm(int ext, int dst, uint32_t imm){
+    emit_rex(1, 0, 0, dst);
+    emit8(0x81);
+    emit8(0xC0 | (ext << 3) | (dst & 7));
+    emit32(imm);
+}
+
+static void emit_shr_imm(int dst, uint8_t imm){
+    emit_rex(0, 0, 0, dst);
+    emit8(0xC1);
+    emit8(0xC0 | (5 << 3) | (dst & 7));
+    emit8(imm);
+}
+
+static void emit_not(int dst){
+    emit_rex(0, 0, 0, dst);
+    emit8(0xF7);
+    emit8(0xC0 | (2 << 3) | (dst & 7));
+}
+
+static void emit_mov_imm(int dst, uint32_t imm){
+    emit_rex(0, 0, 0, dst);
+    emit8(0xB8 + (dst & 7));
+    emit32(imm);
+}
+
+// movzx dst32, src16
+static void emit_movzx(int dst, int src){
+    emit_rex(0, dst, 0, src);
+    emit8(0x0F);
+    emit8(0xB7);
+    emit8(0xC0 | ((dst & 7) << 3) | (src & 7));
+}
+
+// test r16, r16
+static void emit_test16(int r){
+    emit8(0x66);
+    emit_rex(0, r, 0, r);
+    emit8(0x85);
+    emit8(0xC0 | ((r & 7) << 3) | (r & 7));
+}
+
+// ModRM/SIB for [base + index * (1 << scale) + disp32], index < 0 for no index
+static void emit_mem(int reg_field, int base, int index, int scale, int32_t disp){
+    if (index < 0){
+        emit8(0x80 | ((reg_field & 7) << 3) | (base & 7));
+    } else {
+        emit8(0x80 | ((reg_field & 7) << 3) | 4);
+        emit8((scale << 6) | ((index & 7) << 3) | (base & 7));
+    }
+    emit32((uint32_t)disp);
+}
+
+// movzx dst32, word [mem]
+static void emit_load16(int dst, int base, int index, int scale, int32_t disp){
+    emit_rex(0, dst, index < 0 ? 0 : index, base);
+    emit8(0x0F);
+    emit8(0xB7);
+    emit_mem(dst, base, index, scale, disp);
+}
+
+// mov word [mem], src16
+static void emit_store16(int src, int base, int index, int scale, int32_t disp){
+    emit8(0x66);
+    emit_rex(0, src, index < 0 ? 0 : index, base);
+    emit8(0x89);
+    emit_mem(src, base, index, scale, disp);
+}
+
+// mov byte [mem], imm8
+static void emit_store8_imm(int base, int index, int scale, int32_t disp, uint8_t imm){
+    emit_rex(0, 0, index < 0 ? 0 : index, base);
+    emit8(0xC6);
+    emit_mem(0, base, index, scale, disp);
+    emit8(imm);
+}
+
+// cmp byte [mem], imm8
+static void emit_cmp8_imm(int base, int index, int scale, int32_t disp, uint8_t imm){
+    emit_rex(0, 0, index < 0 ? 0 : index, base);
+    emit8(0x80);
+    emit_mem(7, base, index, scale, disp);
+    emit8(imm);
+}
+
+// mov dst64, qword [mem]
+static void emit_load64(int dst, int base, int index, int scale, int32_t disp){
+    emit_rex(1, dst, index < 0 ? 0 : index, base);
+    emit8(0x8B);
+    emit_mem(dst, base, index, scale, disp);
+}
+
+// mov qword [base + disp32], src64
+static void emit_store64(int src, int base, int32_t disp){
+    emit_rex(1, src, 0, base);
+    emit8(0x89);
+    emit_mem(src, base, -1, 0, disp);
+}
+
+static void emit_mov64(int dst, int src){
+    emit_rex(1, src, 0, dst);
+    emit8(0x89);
+    emit8(0xC0 | ((src & 7) << 3) | (dst & 7));
+}
+
+static void emit_push(int r){
+    emit_rex(0, 0, 0, r);
+    emit8(0x50 + (r & 7));
+}
+
+static void emit_pop(int r){
+    emit_rex(0, 0, 0, r);
+    emit8(0x58 + (r & 7));
+}
+
+static void emit_jmp_to(const uint8_t* target){
+    emit8(0xE9);
+    emit32((uint32_t)(target - (code + 4)));
+}
+
+// forward conditional jump, returns where its rel32 is so it can be patched once the target is known
+static uint8_t* emit_jcc_forward(int cc){
+    emit8(0x0F);
+    emit8(0x80 + cc);
+    uint8_t* patch = code;
+    emit32(0);
+    return patch;
+}
+
+static uint8_t* emit_jmp_forward(void){
+    emit8(0xE9);
+    uint8_t* patch = code;
+    emit32(0);
+    return patch;
+}
+
+static void patch_to_here(uint8_t* patch){
+    uint32_t rel = (uint32_t)(code - (patch + 4));
+    memcpy(patch, &rel, 4);
+}
+
+// block compiler---------------------------------------------------------------------------------
+
+// a cold exit path, after the body of the block
+typedef struct {
+    uint8_t* patch;     // rel32 of the jump that leads here
+    uint16_t pc;        // where the interpreter carries on
+    uint16_t steps;     // instructions executed in this pass when the jump is taken
+    int8_t flag_reg;    // register the condition codes follow at the jump, -1 if cond_value is up to date
+    uint8_t loop;       // jump back to the start of the block instead of leaving it
+} jit_stub;
+
+typedef struct {
+    VM* vm;
+    uint16_t start;
+    uint16_t count;         // instructions before the one being compiled
+    uint8_t* epilogue;
+    uint8_t* body;          // first instruction of the block, after the prologue
+    int flag_reg;           // LC-3 register whose value the condition codes come from right now, -1 for cond_value
+    int cond_read_early;    // a branch reads cond_value before the block sets the flags itself
+    jit_stub stubs[2 * JIT_MAX_BLOCK_LEN];
+    int stub_count;
+} jit_compiler;
+
+// x86 conditions after "test r16, r16" on the flag value, indexed by the BR nzp mask
+static const int nzp_cc[8] = { 0, CC_G, CC_E, CC_NS, CC_S, CC_NE, CC_LE, 0 };
+
+// copies the value in flag_reg to cond_value
+static void emit_store_cond(int flag_reg){
+    if (flag_reg < 0){
+        return;  // already up to date
+    }
+    emit_store16(HOST(flag_reg), RBP, -1, 0, OFF(cond_value));
+}
+
+// takes the instructions a path executed off the budget
+static void emit_count_steps(uint16_t steps){
+    if (steps){
+        emit_alu64_imm(5, RCX, steps);  // sub rcx, steps
+    }
+}
+
+// leave the block after steps instructions and carry on interpreting at pc
+static void emit_leave(int flag_reg, uint16_t steps, uint16_t pc, const uint8_t* epilogue){
+    emit_store_cond(flag_reg);
+    emit_count_steps(steps);
+    emit_mov_imm(RAX, pc);
+    emit_jmp_to(epilogue);
+}
+
+static void emit_exit(jit_compiler* c, uint16_t steps, uint16_t pc){
+    emit_leave(c->flag_reg, steps, pc, c->epilogue);
+}
+
+// jump back to the start of the block if the budget covers another pass through it of up to len instructions,
+// otherwise leave at the start. cond_value only has to be right if the block reads it before setting flags
+static void emit_loop(jit_compiler* c, int flag_reg, uint16_t steps, uint16_t len){
+    emit_count_steps(steps);
+    emit_alu64_imm(7, RCX, len);  // cmp rcx, len
+    uint8_t* enough = emit_jcc_forward(CC_AE);
+    emit_leave(flag_reg, 0, c->start, c->epilogue);
+    patch_to_here(enough);
+    if (c->cond_read_early){
+        emit_store_cond(flag_reg);
+    }
+    emit_jmp_to(c->body);
+}
+
+static void add_stub(jit_compiler* c, uint8_t* patch, uint16_t pc, uint16_t steps, int loop){
+    jit_stub* s = &c->stubs[c->stub_count++];
+    s->patch = patch;
+    s->pc = pc;
+    s->steps = steps;
+    s->flag_reg = (int8_t)c->flag_reg;
+    s->loop = (uint8_t)loop;
+}
+
+// leave the block before the instruction at pc when the last comparison came out with cc
+static void emit_side_exit(jit_compiler* c, int cc, uint16_t pc){
+    add_stub(c, emit_jcc_forward(cc), pc, c->count, 0);
+}
+
+// eax = (base + imm) & 0xFFFF
+static void emit_effective_address(int base, uint16_t imm){
+    emit_mov(RAX, base);
+    emit_add_imm(RAX, imm);
+    emit_movzx(RAX, RAX);
+}
+
+#define WORDS_OFF ((int32_t)offsetof(vm_page, words))
+#define SLOTS_OFF ((int32_t)offsetof(vm_page, decoded))   // slots are 8 bytes and op is the first one
+
+// the page pointers are loaded every time, mem_write() can give the VM its own copy of a page between two runs of
+// a block. Never during a run though, a compiled store to a page the VM does not own leaves the block first
+
+static void emit_load_static(int dst, uint16_t address){
+    emit_load64(RAX, RBP, -1, 0, OFF(pages) + (address >> PAGE_SHIFT) * 8);
+    emit_load16(dst, RAX, -1, 0, WORDS_OFF + (address & (PAGE_WORDS - 1)) * 2);
+}
+
+// rdx = pages[eax >> PAGE_SHIFT], eax = the offset into it
+static void emit_split_address(void){
+    emit_mov(RDX, RAX);
+    emit_shr_imm(RDX, PAGE_SHIFT);
+    emit_load64(RDX, RBP, RDX, 3, OFF(pages));
+    emit_and_imm(RAX, PAGE_WORDS - 1);
+}
+
+// load the word at the address in eax into dst, leaving the block first if eax is in the device page
+static void emit_load_dynamic(jit_compiler* c, int dst, uint16_t pc){
+    emit_cmp_imm(RAX, DEVICE_PAGE);
+    emit_side_exit(c, CC_AE, pc);
+    emit_split_address();
+    emit_load16(dst, RDX, RAX, 1, WORDS_OFF);
+}
+
+// the inline part of mem_write() for the address in eax, leaving the block first if eax holds compiled code or is
+// in a page the VM still shares with its template (the interpreter makes the copy)
+static void emit_store_dynamic(jit_compiler* c, int src, uint16_t pc, int proved){
+    if (!proved){
+        emit_cmp8_imm(RBX, RAX, 0, 0, 0);
+        emit_side_exit(c, CC_NE, pc);
+    }
+    emit_mov(RDX, RAX);
+    emit_shr_imm(RDX, PAGE_SHIFT);
+    emit_cmp8_imm(RBP, RDX, 0, OFF(page_owned), 0);
+    emit_side_exit(c, CC_E, pc);
+    emit_store8_imm(RBP, RDX, 0, OFF(page_dirty), 1);
+    emit_split_address();
+    emit_store16(src, RDX, RAX, 1, WORDS_OFF);
+    if (!proved){
+        emit_store8_imm(RDX, RAX, 3, SLOTS_OFF, OP_DECODE);
+    }
+}
+
+// proved: vm_analyze() proved the store never writes code, so it has no compiled block to look for and no slot to reset
+static void emit_store_static(jit_compiler* c, int src, uint16_t address, uint16_t pc, int proved){
+    int page = address >> PAGE_SHIFT, offset = address & (PAGE_WORDS - 1);
+    if (!proved){
+        emit_cmp8_imm(RBX, -1, 0, address, 0);
+        emit_side_exit(c, CC_NE, pc);
+    }
+    emit_cmp8_imm(RBP, -1, 0, OFF(page_owned) + page, 0);
+    emit_side_exit(c, CC_E, pc);
+    emit_store8_imm(RBP, -1, 0, OFF(page_dirty) + page, 1);
+    emit_load64(RAX, RBP, -1, 0, OFF(pages) + page * 8);
+    emit_store16(src, RAX, -1, 0, WORDS_OFF + offset * 2);
+    if (!proved){
+        emit_store8_imm(RAX, -1, 0, SLOTS_OFF + offset * 8, OP_DECODE);
+    }
+}
+
+static void emit_prologue_epilogue(jit_compiler* c, jit_block_fn* entry){
+    static const int saved[] = { RBX, RBP, R12, R13, R14, R15 };  // callee saved in both ABIs
+    enum { SAVED = sizeof(saved) / sizeof(saved[0]) };
+
+    // the epilogue goes first, so every exit is a backward jump to a known address
+    c->epilogue = code;
+    for (int r = 0; r < 8; r++){
+        emit_store16(HOST(r), RBP, -1, 0, OFF(reg) + r * 2);
+    }
+    emit_store64(RCX, RBP, OFF(budget));
+    for (int i = SAVED - 1; i >= 0; i--){
+        emit_pop(saved[i]);
+    }
+    emit8(0xC3);  // ret
+
+    *entry = (jit_block_fn)(void*)code;
+    for (int i = 0; i < SAVED; i++){
+        emit_push(saved[i]);
+    }
+#ifdef _WIN32
+    emit_mov64(RBP, RCX);   // first argument
+#else
+    emit_mov64(RBP, RDI);
+#endif
+    emit_load64(RCX, RBP, -1, 0, OFF(budget));
+    emit_load64(RBX, RBP, -1, 0, OFF(jit_code_map));
+    for (int r = 0; r < 8; r++){
+        emit_load16(HOST(r), RBP, -1, 0, OFF(reg) + r * 2);
+    }
+    c->body = code;
+}
+
+// translates one instruction, returns 0 once the block is finished
+static int compile_instr(jit_compiler* c, uint16_t pc, int first){
+
+    decoded_instr d;
+    decode_instr(vm_peek(c->vm, pc), &d);
+    uint16_t next = pc + 1;
+    int h0 = HOST(d.r0), h1 = HOST(d.r1), h2 = HOST(d.r2);
+
+    switch (d.op){
+        case ADD:
+        case AND:
+        {
+            void (*op_rr)(int, int) = d.op == ADD ? emit_add : emit_and;
+            if (d.flag){
+                if (h0 != h1){
+                    emit_mov(h0, h1);
+                }
+                if (d.op == ADD){
+                    emit_add_imm(h0, (uint32_t)(int16_t)d.imm);
+                } else {
+                    emit_and_imm(h0, (uint32_t)(int16_t)d.imm);
+                }
+            } else if (h0 == h1){
+                op_rr(h0, h2);
+            } else if (h0 == h2){
+                op_rr(h0, h1);
+            } else {
+                emit_mov(h0, h1);
+                op_rr(h0, h2);
+            }
+            c->flag_reg = d.r0;
+            return 1;
+        }
+        case NOT:
+            if (h0 != h1){
+                emit_mov(h0, h1);
+            }
+            emit_not(h0);
+            c->flag_reg = d.r0;
+            return 1;
+        case LEA:
+            emit_mov_imm(h0, (uint16_t)(next + d.imm));
+            c->flag_reg = d.r0;
+            return 1;
+        case LD:
+        {
+            uint16_t address = next + d.imm;
+            if (address >= DEVICE_PAGE){
+                break;
+            }
+            emit_load_static(h0, address);
+            c->flag_reg = d.r0;
+            return 1;
+        }
+        case LDI:
+        {
+            uint16_t pointer = next + d.imm;
+            if (pointer >= DEVICE_PAGE){
+                break;
+            }
+            emit_load_static(RAX, pointer);
+            emit_load_dynamic(c, h0, pc);
+            c->flag_reg = d.r0;
+            return 1;
+        }
+        case LDR:
+            emit_effective_address(h1, d.imm);
+            emit_load_dynamic(c, h0, pc);
+            c->flag_reg = d.r0;
+            return 1;
+        case ST:
+            emit_store_static(c, h0, next + d.imm, pc, vm_slot(c->vm, pc)->op == OP_ST_DATA);
+            return 1;
+        case STI:
+        {
+            uint16_t pointer = next + d.imm;
+            if (pointer >= DEVICE_PAGE){
+                break;
+            }
+            emit_load_static(RAX, pointer);
+            emit_store_dynamic(c, h0, pc, 0);
+            return 1;
+        }
+        case STR:
+            emit_effective_address(h1, d.imm);
+            emit_store_dynamic(c, h0, pc, vm_slot(c->vm, pc)->op == OP_STR_DATA);
+            return 1;
+        case BR:
+        {
+            uint16_t mask = d.r0;
+            uint16_t target = next + d.imm;
+            if (mask == 0){
+                return 1;  // never taken
+            }
+            if (mask == 7){
+                if (target == c->start){
+                    add_stub(c, emit_jmp_forward(), target, c->count + 1, 1);  // the loop check needs the block length
+                } else {
+                    emit_exit(c, c->count + 1, target);
+                }
+                return 0;
+            }
+            if (c->flag_reg >= 0){
+                emit_test16(HOST(c->flag_reg));
+            } else {
+                c->cond_read_early = 1;
+                emit_load16(RAX, RBP, -1, 0, OFF(cond_value));
+                emit_test16(RAX);
+            }
+            add_stub(c, emit_jcc_forward(nzp_cc[mask]), target, c->count + 1, target == c->start);
+            return 1;
+        }
+        case JMP:
+            emit_store_cond(c->flag_reg);
+            emit_count_steps(c->count + 1);
+            emit_movzx(RAX, h1);
+            emit_jmp_to(c->epilogue);
+            return 0;
+        case JSR:
+            emit_store_cond(c->flag_reg);  // before R7 changes, it may be the register the flags follow
+            emit_count_steps(c->count + 1);
+            emit_mov_imm(HOST(R_R7), next);
+            if (d.flag){
+                emit_mov_imm(RAX, (uint16_t)(next + d.imm));
+            } else {
+                emit_movzx(RAX, h1);  // after R7 is written, JSRR R7 jumps to the return address like the interpreter
+            }
+            emit_jmp_to(c->epilogue);
+            return 0;
+        default:
+            break;  // TRAP, RTI and RES are left to the interpreter
+    }
+
+    // the instruction has to run in the interpreter, so the block ends just before it
+    if (first){
+        return -1;
+    }
+    emit_exit(c, c->count, pc);
+    return 0;
+}
+
+static void kill_block(VM* vm, int i){
+    jit_block* b = &vm->jit->blocks[i];
+    if (!b->live){
+        return;
+    }
+    b->live = 0;
+    for (uint32_t address = b->start; address < b->end; address++){
+        vm->jit_code_map[address]--;
+    }
+    vm_slot(vm, b->start)->op = OP_DECODE;  // back to being an ordinary instruction, the page is the VM's own
+    vm->jit_counts[b->start] = 0;
+}
+
+void jit_flush(VM* vm){
+    if (!vm->jit){
+        return;
+    }
+    for (int i = 0; i < vm->jit->block_count; i++){
+        kill_block(vm, i);
+    }
+    vm->jit->block_count = 0;
+    vm->jit->arena_used = 0;
+}
+
+static void set_arena_writable(struct jit_state* j, int writable){
+#ifdef _WIN32
+    DWORD old;
+    VirtualProtect(j->arena, JIT_ARENA_SIZE, writable ? PAGE_READWRITE : PAGE_EXECUTE_READ, &old);
+    if (!writable){
+        FlushInstructionCache(GetCurrentProcess(), j->arena, JIT_ARENA_SIZE);
+    }
+#else
+    mprotect(j->arena, JIT_ARENA_SIZE, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC);
+#endif
+}
+
+int jit_init(VM* vm){
+    if (vm->jit){
+        return 1;
+    }
+    struct jit_state* j = calloc(1, sizeof(*j));
+    uint16_t* counts = calloc(MAX_MEMORY, sizeof(uint16_t));
+    uint8_t* code_map = calloc(MAX_MEMORY, 1);
+    if (!j || !counts || !code_map){
+        free(j);
+        free(counts);
+        free(code_map);
+        return 0;
+    }
+#ifdef _WIN32
+    j->arena = VirtualAlloc(NULL, JIT_ARENA_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (!j->arena){
+        free(j);
+        free(counts);
+        free(code_map);
+        return 0;
+    }
+#else
+    void* p = mmap(NULL, JIT_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED){
+        free(j);
+        free(counts);
+        free(code_map);
+        return 0;
+    }
+    j->arena = p;
+#endif
+    set_arena_writable(j, 0);
+    code_map[MR_BLOCK_CONTROL] = 1;  // never compiled, kill_block() and jit_flush() leave it alone (see above)
+    vm->jit = j;
+    vm->jit_counts = counts;
+    vm->jit_code_map = code_map;
+    analysis_jit_started(vm);  // the code the store analysis found counts one more as well
+    return 1;
+}
+
+void jit_free(VM* vm){
+    if (!vm->jit){
+        return;
+    }
+    jit_flush(vm);
+#ifdef _WIN32
+    VirtualFree(vm->jit->arena, 0, MEM_RELEASE);
+#else
+    munmap(vm->jit->arena, JIT_ARENA_SIZE);
+#endif
+    free(vm->jit);
+    vm->jit = NULL;
+    free(vm->jit_counts);
+    free(vm->jit_code_map);
+    vm->jit_counts = NULL;
+    vm->jit_code_map = NULL;
+}
+
+void jit_compile(VM* vm, uint16_t start){
+
+    struct jit_state* j = vm->jit;
+    if (!j || vm_slot(vm, start)->op == OP_JIT || start >= DEVICE_PAGE){
+        return;
+    }
+    if (j->block_count == JIT_MAX_BLOCKS || j->arena_used + JIT_MAX_BLOCK_BYTES > JIT_ARENA_SIZE){
+        jit_flush(vm);
+    }
+
+    jit_compiler c;
+    c.vm = vm;
+    c.start = start;
+    c.flag_reg = -1;
+    c.cond_read_early = 0;
+    c.stub_count = 0;
+
+    set_arena_writable(j, 1);
+    code = j->arena + j->arena_used;
+
+    jit_block* b = &j->blocks[j->block_count];
+    emit_prologue_epilogue(&c, &b->code);
+
+    uint32_t pc = start;
+    int n = 0;
+    for (;;){
+        c.count = (uint16_t)n;
+        if (pc >= DEVICE_PAGE || n == JIT_MAX_BLOCK_LEN){
+            emit_exit(&c, (uint16_t)n, (uint16_t)pc);
+            break;
+        }
+        int more = compile_instr(&c, (uint16_t)pc, n == 0);
+        if (more < 0){
+            set_arena_writable(j, 0);  // nothing worth compiling, the first instruction is left to the interpreter
+            return;
+        }
+        pc++;
+        n++;
+        if (!more){
+            break;
+        }
+    }
+
+    for (int i = 0; i < c.stub_count; i++){
+        jit_stub* s = &c.stubs[i];
+        patch_to_here(s->patch);
+        if (s->loop){
+            emit_loop(&c, s->flag_reg, s->steps, (uint16_t)n);
+        } else {
+            emit_leave(s->flag_reg, s->steps, s->pc, c.epilogue);
+        }
+    }
+
+    set_arena_writable(j, 0);
+    if (vm->analysis){
+        analysis_reached(vm, start, pc);  // a block made from words that are not code ends the proof, and is not kept
+        if (!vm->analysis){
+            return;
+        }
+    }
+    j->arena_used = (size_t)(code - j->arena + 15) & ~(size_t)15;
+
+    b->start = start;
+    b->end = (uint16_t)pc;
+    b->live = 1;
+    decode_instr(vm_peek(vm, start), &b->entry);
+    for (uint32_t address = start; address < pc; address++){
+        vm->jit_code_map[address]++;
+    }
+    decoded_instr* slot = &vm_own_page(vm, start >> PAGE_SHIFT)->decoded[start & (PAGE_WORDS - 1)];  // never patch a shared page
+    slot->op = OP_JIT;
+    slot->imm = (uint16_t)j->block_count;
+    j->block_count++;
+}
+
+uint16_t jit_execute(VM* vm, uint16_t block){
+    return vm->jit->blocks[block].code(vm);
+}
+
+uint16_t jit_block_len(VM* vm, uint16_t block){
+    jit_block* b = &vm->jit->blocks[block];
+    return (uint16_t)(b->end - b->start);
+}
+
+const decoded_instr* jit_entry_instr(VM* vm, uint16_t block){
+    return &vm->jit->blocks[block].entry;
+}
+
+void jit_invalidate(VM* vm, uint16_t address){
+    struct jit_state* j = vm->jit;
+    for (int i = 0; i < j->block_count; i++){
+        if (j->blocks[i].live && j->blocks[i].start <= address && address < j->blocks[i].end){
+            kill_block(vm, i);
+        }
+    }
+}
+
+#else
+
+int jit_init(VM* vm){
+    (void)vm;
+    return 0;
+}
+
+void jit_free(VM* vm){
+    (void)vm;
+}
+
+void jit_flush(VM* vm){
+    (void)vm;
+}
+
+void jit_compile(VM* vm, uint16_t start){
+    (void)vm;
+    (void)start;
+}
+
+uint16_t jit_execute(VM* vm, uint16_t block){
+    (void)vm;
+    (void)block;
+    return 0;
+}
+
+uint16_t jit_block_len(VM* vm, uint16_t block){
+    (void)vm;
+    (void)block;
+    return 0;
+}
+
+const decoded_instr* jit_entry_instr(VM* vm, uint16_t block){
+    (void)vm;
+    (void)block;
+    return NULL;
+}
+
+void jit_invalidate(VM* vm, uint16_t address){
+    (void)vm;
+    (void)address;
+}
+
+#endif
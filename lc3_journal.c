@@ -0,0 +1,438 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lc3_vm.h"
+
+/*
+Reverse execution. vm_journal_start() gives a VM a journal, and from then on the engines note down what every
+instruction is about to overwrite before it runs: the old value of the register it writes, the old word at the
+address it stores to, PC, and the condition codes where it changes them. vm_step_back() reads that back the other
+way and puts the machine back one instruction at a time, so going back n instructions costs n records, however
+long the program has been running.
+
+The journal is a ring of 16 bit words, each record written as its fields followed by a tag word saying what it is,
+so it is read from the end:
+
+    J_PC        pc                              BR, JMP, RTI and RES
+    J_REG       pc, old                         JSR, old R7
+    J_REG_CC    pc, cond_value, old             ADD, AND, NOT, LEA, LD, LDR and LDI
+    J_STORE     pc, address, old                ST, STR and STI
+    J_TRAP      pc, cond_value, R0, R1, R7,     the traps, input being the low 16 bits of vm->in_consumed
+                input
+    J_WORD      address, old                    a word the next record's instruction may store to
+    J_DEVICE    KBSR, KBDR, input               the next record's instruction reads MR_KBSR
+
+For most instructions that is 4 to 8 bytes. J_WORD and J_DEVICE come before the record of the instruction they
+belong to and have no PC of their own, undoing an instruction undoes them with it.
+
+The ring is cut into chunks, and every chunk starts with a checkpoint: the registers and the number of instructions
+journaled so far, taken just before its first instruction. When the ring is full the oldest chunk is thrown away
+in one go, so the journal always starts on an instruction, and the oldest checkpoint says how far back it goes.
+
+What cannot be undone: output the program has printed stays printed, and input it has read is only given back to
+io_memory VMs (the debugger's), a terminal cannot un-read a key. Loading an image, restoring a snapshot, resetting
+the VM and writing its memory or registers from outside (lc3_lib.c) empty the journal, and so do the host traps that
+write memory (TRAP_MEMCPY, TRAP_MEMSET and TRAP_READ, see lc3_traps.c), and so does every store to the block
+device's MR_BLOCK_CONTROL, whether it transfers anything or not. A VM with vm->interrupts gets no journal at all,
+an interrupt or RTI changes more than a record keeps (see vm_journal_start()). Like --profile, a VM with a journal runs the
+threaded engine in place of the JIT, compiled blocks do their stores without telling anyone.
+*/
+
+enum {
+    J_PC = 1,
+    J_REG,
+    J_REG_CC,
+    J_STORE,
+    J_TRAP,
+    J_WORD,
+    J_DEVICE
+};
+
+enum {
+    JOURNAL_CHUNKS = 16,        // a chunk is a 16th of the ring
+    JOURNAL_MAX_RECORD = 16,    // words one instruction can write, its record and the ones that come before it
+    JOURNAL_MIN_WORDS = 1 << 12
+};
+
+typedef struct {
+    uint64_t start;             // where its first record starts
+    uint64_t instructions;      // journal->instructions when it started
+    uint16_t reg[R_COUNT];      // and the registers then, R_PC the instruction's own address
+    uint16_t cond_value;
+} journal_chunk;
+
+struct vm_journal {
+    uint16_t* words;
+    uint64_t mask;              // the size of the ring in words, minus 1
+    uint64_t head, tail;        // the next word to write and the oldest one kept, both only ever count up
+    uint64_t chunk_words;
+    uint64_t limit;             // head can go up to here before begin_instruction() has anything to do
+    uint64_t instructions;      // how many instructions the records in the ring are for, plus the ones thrown away
+    journal_chunk chunks[2 * JOURNAL_CHUNKS];   // a ring too, counted from first
+    int first, count;
+};
+
+/*
+gives vm a journal of about bytes bytes (rounded up to a power of two, 8 KB at least), or empties the one it has.
+Returns 0 if there is no memory for it, or if vm->interrupts is set: taking an interrupt and RTI change the PSR, R6
+and the saved stack pointer and push onto the stack, none of which the records hold
+*/
+int vm_journal_start(VM* vm, size_t bytes){
+
+    if (vm->interrupts){
+        return 0;
+    }
+    if (vm->journal){
+        vm_journal_clear(vm);
+        return 1;
+    }
+    uint64_t size = JOURNAL_MIN_WORDS;
+    while (size * 2 < bytes){
+        size *= 2;
+    }
+    vm_journal* j = calloc(1, sizeof(vm_journal));
+    if (!j){
+        return 0;
+    }
+    j->words = malloc(size * sizeof(uint16_t));
+    if (!j->words){
+        free(j);
+        return 0;
+    }
+    j->mask = size - 1;
+    j->chunk_words = size / JOURNAL_CHUNKS;
+    vm->journal = j;
+    return 1;
+}
+
+// throws the journal away, vm runs at full speed again
+void vm_journal_stop(VM* vm){
+
+    if (vm->journal){
+        free(vm->journal->words);
+        free(vm->journal);
+        vm->journal = NULL;
+    }
+}
+
+// forgets everything journaled so far
+void vm_journal_clear(VM* vm){
+
+    vm_journal* j = vm->journal;
+    if (j){
+        j->tail = j->head;
+        j->count = 0;
+        j->limit = 0;
+    }
+}
+
+// how many instructions vm_step_back() can undo
+uint64_t vm_journal_steps(const VM* vm){
+
+    const vm_journal* j = vm->journal;
+    return j && j->count ? j->instructions - j->chunks[j->first].instructions : 0;
+}
+
+// recording---------------------------------------------------------------------------------
+
+static inline void put(vm_journal* j, uint16_t word){
+    j->words[j->head++ & j->mask] = word;
+}
+
+static inline uint16_t tag(int kind, int r){
+    return (uint16_t)(kind | r << 4);
+}
+
+// makes room for another instruction's records, and starts a new chunk when the current one is full
+static void make_room(VM* vm, vm_journal* j, uint16_t pc, uint16_t cond_value){
+
+    while (j->count > 1 && j->head + JOURNAL_MAX_RECORD - j->tail > j->mask + 1){
+        j->first = (j->first + 1) % (2 * JOURNAL_CHUNKS);
+        j->count--;
+        j->tail = j->chunks[j->first].start;
+    }
+    journal_chunk* last = &j->chunks[(j->first + j->count - 1) % (2 * JOURNAL_CHUNKS)];
+    if (!j->count || j->head - last->start >= j->chunk_words){
+        // every chunk but the newest holds chunk_words or more, so the ring never has more than JOURNAL_CHUNKS + 1
+        last = &j->chunks[(j->first + j->count) % (2 * JOURNAL_CHUNKS)];
+        j->count++;
+        last->start = j->head;
+        last->instructions = j->instructions;
+        memcpy(last->reg, vm->reg, sizeof(last->reg));
+        last->reg[R_PC] = pc;
+        last->cond_value = cond_value;
+    }
+    uint64_t full = j->tail + j->mask + 1 - JOURNAL_MAX_RECORD + 1;
+    j->limit = last->start + j->chunk_words < full ? last->start + j->chunk_words : full;
+}
+
+static inline void begin_instruction(VM* vm, vm_journal* j, uint16_t pc, uint16_t cond_value){
+    if (j->head >= j->limit){
+        make_room(vm, j, pc, cond_value);
+    }
+}
+
+// MR_KBSR is the one address whose read writes something: the keyboard registers, and the input position
+static void note_read(VM* vm, vm_journal* j, uint16_t address){
+
+    if (address == MR_KBSR){
+        put(j, vm_peek(vm, MR_KBSR));
+        put(j, vm_peek(vm, MR_KBDR));
+        put(j, (uint16_t)vm->in_consumed);
+        put(j, tag(J_DEVICE, 0));
+    }
+}
+
+static void note_store(vm_journal* j, uint16_t pc, VM* vm, uint16_t address){
+    put(j, pc);
+    put(j, address);
+    put(j, vm_peek(vm, address));
+    put(j, tag(J_STORE, 0));
+}
+
+/*
+for the engines: the instruction d at pc is about to run, with the registers in vm->reg and the condition codes
+from cond_value. Not for TRAP, execute_trap() calls journal_trap() itself once it knows the trap is going to run
+*/
+void journal_record(VM* vm, uint16_t pc, uint16_t cond_value, const decoded_instr* d){
+
+    vm_journal* j = vm->journal;
+    begin_instruction(vm, j, pc, cond_value);
+    uint16_t next = pc + 1;
+    switch (d->op){
+        case LD:
+        case LDR:
+        case LDI:
+        {
+            uint16_t address = d->op == LDR ? (uint16_t)(vm->reg[d->r1] + d->imm) : (uint16_t)(next + d->imm);
+            note_read(vm, j, address);
+            if (d->op == LDI && address != MR_KBSR){
+                note_read(vm, j, vm_peek(vm, address));
+            }
+            // reading MR_KBSR as the pointer leaves 0 or x8000 in it, neither of which has a side effect
+        }
+            // fall through
+        case ADD:
+        case AND:
+        case NOT:
+        case LEA:
+            put(j, pc);
+            put(j, cond_value);
+            put(j, vm->reg[d->r0]);
+            put(j, tag(J_REG_CC, d->r0));
+            break;
+        case ST:
+            note_store(j, pc, vm, next + d->imm);
+            break;
+        case STR:
+            note_store(j, pc, vm, vm->reg[d->r1] + d->imm);
+            break;
+        case STI:
+        {
+            uint16_t pointer = next + d->imm;
+            if (pointer != MR_KBSR){
+                note_store(j, pc, vm, vm_peek(vm, pointer));
+                break;
+            }
+            // the address comes out of the read of MR_KBSR, and is x8000 if there is a key and 0 if there is not
+            put(j, 0x0000);
+            put(j, vm_peek(vm, 0x0000));
+            put(j, tag(J_WORD, 0));
+            put(j, 0x8000);
+            put(j, vm_peek(vm, 0x8000));
+            put(j, tag(J_WORD, 0));
+            note_read(vm, j, MR_KBSR);
+            put(j, pc);
+            put(j, tag(J_PC, 0));
+        }
+            break;
+        case JSR:
+            put(j, pc);
+            put(j, vm->reg[R_R7]);
+            put(j, tag(J_REG, R_R7));
+            break;
+        default:
+            put(j, pc);
+            put(j, tag(J_PC, 0));
+            break;
+    }
+    j->instructions++;
+}
+
+// for execute_trap(): the trap in instr is about to run, PC already points past it
+void journal_trap(VM* vm, uint16_t instr){
+
+    (void)instr;  // they all get the same record, PUTS and OUT only write output, which stays written
+    vm_journal* j = vm->journal;
+    uint16_t pc = vm->reg[R_PC] - 1;
+    begin_instruction(vm, j, pc, vm->cond_value);
+    put(j, pc);
+    put(j, vm->cond_value);
+    put(j, vm->reg[R_R0]);
+    put(j, vm->reg[R_R1]);  // TRAP_DIV and TRAP_CLOCK write it
+    put(j, vm->reg[R_R7]);
+    put(j, (uint16_t)vm->in_consumed);
+    put(j, tag(J_TRAP, 0));
+    j->instructions++;
+}
+
+// going back---------------------------------------------------------------------------------
+
+static inline uint16_t pop(vm_journal* j){
+    return j->words[--j->head & j->mask];
+}
+
+// gives back the characters read since vm->in_consumed was consumed (in its low 16 bits)
+static void unread(VM* vm, uint16_t consumed){
+
+    uint16_t n = (uint16_t)vm->in_consumed - consumed;
+    vm->in_consumed -= n;
+    if (vm->io == &io_memory){
+        vm->in_pos -= n <= vm->in_pos ? n : vm->in_pos;  // vm_add_input() keeps what was read while there is a journal
+    }
+}
+
+// puts a word back, and says whether that undid a store to a write watchpoint. Device words go back as they were
+// without mem_write(), which would start a block transfer again for MR_BLOCK_CONTROL
+static int unstore(VM* vm, uint16_t address, uint16_t old){
+
+    if (address >= DEVICE_PAGE){
+        device_word(vm, address) = old;
+        vm->page_dirty[DEVICE_PAGE >> PAGE_SHIFT] = 1;
+    } else {
+        mem_write(vm, address, old);
+    }
+    return vm->watch_write && (vm->watch_write[address >> 6] >> (address & 63)) & 1;
+}
+
+/*
+undoes the last journaled instruction. Returns 0 if there is none, else 1, or 2 if it had stored to a write
+watchpoint (*address tells which)
+*/
+static int undo_instruction(VM* vm, vm_journal* j, uint16_t* address){
+
+    if (j->head == j->tail){
+        return 0;
+    }
+    int result = 1;
+    uint16_t t = pop(j);
+    uint16_t pc;
+    switch (t & 0xF){
+        case J_REG:
+            vm->reg[(t >> 4) & 0xF] = pop(j);
+            pc = pop(j);
+            break;
+        case J_REG_CC:
+            vm->reg[(t >> 4) & 0xF] = pop(j);
+            vm->cond_value = pop(j);
+            pc = pop(j);
+            break;
+        case J_STORE:
+        {
+            uint16_t old = pop(j);
+            uint16_t at = pop(j);
+            pc = pop(j);
+            if (unstore(vm, at, old)){
+                result = 2;
+                *address = at;
+            }
+        }
+            break;
+        case J_TRAP:
+            unread(vm, pop(j));
+            vm->reg[R_R7] = pop(j);
+            vm->reg[R_R1] = pop(j);
+            vm->reg[R_R0] = pop(j);
+            vm->cond_value = pop(j);
+            pc = pop(j);
+            break;
+        default:
+            pc = pop(j);
+            break;
+    }
+
+    // the records that went in before it, for the same instruction
+    while (j->head != j->tail){
+        t = j->words[(j->head - 1) & j->mask];
+        if ((t & 0xF) == J_WORD){
+            pop(j);
+            uint16_t old = pop(j);
+            uint16_t at = pop(j);
+            if (unstore(vm, at, old) && result == 1){
+                result = 2;
+                *address = at;
+            }
+        } else if ((t & 0xF) == J_DEVICE){
+            pop(j);
+            unread(vm, pop(j));
+            mem_write(vm, MR_KBDR, pop(j));
+            mem_write(vm, MR_KBSR, pop(j));
+        } else {
+            break;
+        }
+    }
+    vm->reg[R_PC] = pc;
+    vm->steps--;
+    j->instructions--;
+    j->limit = 0;  // begin_instruction() works it out again
+
+    // back at the start of the newest chunk, which is exactly the state its checkpoint holds
+    journal_chunk* last = &j->chunks[(j->first + j->count - 1) % (2 * JOURNAL_CHUNKS)];
+    if (j->head == last->start){
+        memcpy(vm->reg, last->reg, sizeof(vm->reg));
+        vm->cond_value = last->cond_value;
+        j->count--;
+    }
+    return result;
+}
+
+// undoes up to n_steps instructions (0 for all there are), returns how many it did
+uint64_t vm_step_back(VM* vm, uint64_t n_steps){
+
+    vm_journal* j = vm->journal;
+    uint64_t done = 0;
+    uint16_t address;
+    while (j && (!n_steps || done < n_steps) && undo_instruction(vm, j, &address)){
+        done++;
+    }
+    if (done){
+        vm->status = VM_RUNNING;
+        vm->stop_reason = STOP_NONE;
+    }
+    return done;
+}
+
+/*
+vm_run() backwards: undoes instructions until PC is back at vm->stop_at or a breakpoint, an instruction that stored
+to a write watchpoint has been undone, the journal runs out, or n_steps instructions have been undone (0 for no
+limit). It always goes back at least one instruction, so it does not stop where it started. Returns VM_STOPPED with
+vm->stop_reason set like vm_run() does, or VM_RUNNING (vm_journal_steps() is 0 if it ran out of journal)
+*/
+int vm_run_back(VM* vm, uint64_t n_steps){
+
+    vm_journal* j = vm->journal;
+    uint64_t done = 0;
+    uint16_t address;
+    int undone;
+    while (j && (!n_steps || done < n_steps) && (undone = undo_instruction(vm, j, &address))){
+        done++;
+        vm->status = VM_RUNNING;
+        vm->stop_reason = STOP_NONE;
+        uint16_t pc = vm->reg[R_PC];
+        if (undone == 2){
+            vm->status = VM_STOPPED;
+            vm->stop_reason = STOP_WATCH_WRITE;
+            vm->stop_address = address;
+            break;
+        }
+        if (pc == vm->stop_at || (vm->breakpoints && (vm->breakpoints[pc >> 6] >> (pc & 63)) & 1)){
+            vm->status = VM_STOPPED;
+            vm->stop_reason = pc == vm->stop_at ? STOP_AT : STOP_BREAKPOINT;
+            vm->stop_address = pc;
+            break;
+        }
+    }
+    return done ? vm->status : VM_RUNNING;
+}
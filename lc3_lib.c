@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lc3_vm.h"
+
+/*
+The VM as a shared library, for the debugger (NativeLC3VirtualMachine in lc3_debugger.py is the ctypes side).
+Everything in lc3_vm.h is exported, these are the few extra functions a binding needs because it only has a pointer
+to the VM and cannot look inside the struct. Build with -DLC3_NO_MAIN so lc3_vm.c leaves main() out:
+
+    gcc -O2 -shared -fPIC -DLC3_NO_MAIN -o liblc3.so lc3_vm.c lc3_io.c lc3_jit.c lc3_batch.c lc3_image.c
+        lc3_snapshot.c lc3_profile.c lc3_journal.c lc3_trace.c lc3_traps.c lc3_analysis.c lc3_fuzz.c lc3_metrics.c
+        lc3_serve.c lc3_aot.c lc3_cores.c lc3_block.c lc3_lib.c -lpthread
+
+A VM from lc3_create() reads the input it gets from vm_add_input() and collects what it prints for
+lc3_take_output(). When the program wants input that is not there yet it stops with VM_WAITING_INPUT instead of
+reading EOF.
+*/
+
+VM* lc3_create(void){
+
+    VM* vm = vm_create();
+    if (vm){
+        vm->in_can_wait = 1;
+    }
+    return vm;
+}
+
+/*
+runs until the program reaches one of the count addresses in breakpoints, halts, waits for input, or max_steps
+instructions have executed (0 for no limit). Calling it again after it stopped at a breakpoint carries on past
+that breakpoint. Returns vm->status, VM_STOPPED for a breakpoint or one of the watchpoints set with
+vm_set_watchpoint() (lc3_stop_reason() tells which)
+*/
+int lc3_run_until(VM* vm, const uint16_t* breakpoints, int count, uint64_t max_steps){
+
+    vm_clear_breakpoints(vm);
+    int on_breakpoint = 0;
+    for (int i = 0; i < count; i++){
+        vm_set_breakpoint(vm, breakpoints[i], 1);
+        on_breakpoint |= breakpoints[i] == vm->reg[R_PC];
+    }
+    // only the one it stopped at last time, a run that ran out of steps just before a breakpoint still stops there
+    on_breakpoint &= vm->status == VM_STOPPED && vm->stop_reason == STOP_BREAKPOINT && vm->stop_address == vm->reg[R_PC];
+    if (on_breakpoint){
+        uint16_t at = vm->reg[R_PC];
+        vm_set_breakpoint(vm, at, 0);
+        int status = vm_run(vm, 1);
+        vm_set_breakpoint(vm, at, 1);
+        if (status != VM_RUNNING || max_steps == 1){
+            return status;
+        }
+        max_steps -= max_steps != 0;
+    }
+    return vm_run(vm, max_steps);
+}
+
+/*
+lc3_run_until() going backwards through the journal (vm_journal_start()): undoes instructions until PC is back at one
+of the breakpoints, an instruction that wrote to a write watchpoint has been undone, the journal runs out or
+max_steps instructions have been undone. Returns VM_STOPPED if it stopped at one, VM_RUNNING if not
+*/
+int lc3_run_back(VM* vm, const uint16_t* breakpoints, int count, uint64_t max_steps){
+
+    vm_clear_breakpoints(vm);
+    for (int i = 0; i < count; i++){
+        vm_set_breakpoint(vm, breakpoints[i], 1);
+    }
+    return vm_run_back(vm, max_steps);
+}
+
+int lc3_status(const VM* vm){
+    return vm->status;
+}
+
+// why it returned VM_STOPPED: STOP_BREAKPOINT, STOP_WATCH_READ or STOP_WATCH_WRITE (STOP_AT is main()'s)
+int lc3_stop_reason(const VM* vm){
+    return vm->stop_reason;
+}
+
+// the breakpoint, or the address the watchpoint caught
+uint16_t lc3_stop_address(const VM* vm){
+    return vm->stop_address;
+}
+
+uint64_t lc3_steps(const VM* vm){
+    return vm->steps;
+}
+
+// all R_COUNT registers, R_COND as FL_NEG, FL_ZERO or FL_POS
+void lc3_read_regs(VM* vm, uint16_t* regs){
+    for (int r = 0; r < R_COUNT; r++){
+        regs[r] = reg_read(vm, r);
+    }
+}
+
+// writing registers or memory from outside empties the journal, undoing through the change would not be undoing the program
+void lc3_write_reg(VM* vm, int r, uint16_t val){
+    if (r >= 0 && r < R_COUNT){
+        reg_write(vm, r, val);
+        vm_journal_clear(vm);
+    }
+}
+
+// count words from start on (wrapping around at the end of memory), without the side effects of reading MR_KBSR
+void lc3_read_memory(const VM* vm, uint16_t start, uint16_t* words, uint32_t count){
+    for (uint32_t i = 0; i < count; i++){
+        words[i] = vm_peek(vm, (uint16_t)(start + i));
+    }
+}
+
+void lc3_write_memory(VM* vm, uint16_t start, const uint16_t* words, uint32_t count){
+    for (uint32_t i = 0; i < count; i++){
+        mem_write(vm, (uint16_t)(start + i), words[i]);
+    }
+    vm_journal_clear(vm);
+}
+
+/*
+fills in pages[PAGE_COUNT] with 1 for every page written to since the last call (or since the VM was created or
+reset) and 0 for the others, and starts over. Returns how many were written, a debugger only has to read those back
+*/
+int lc3_take_dirty_pages(VM* vm, uint8_t* pages){
+
+    int count = 0;
+    for (int page = 0; page < PAGE_COUNT; page++){
+        pages[page] = vm->page_dirty[page];
+        count += pages[page];
+    }
+    memset(vm->page_dirty, 0, sizeof(vm->page_dirty));
+    return count;
+}
+
+// moves up to size bytes of what the program printed into buf, returns how many
+size_t lc3_take_output(VM* vm, char* buf, size_t size){
+
+    io_flush(vm);
+    size_t n = vm->output_len < size ? vm->output_len : size;
+    if (!n){
+        return 0;
+    }
+    memcpy(buf, vm->output, n);
+    memmove(vm->output, vm->output + n, vm->output_len - n);
+    vm->output_len -= n;
+    return n;
+}
@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "lc3_vm.h"
+
+/*
+Live metrics. --metrics=PORT starts a thread that answers HTTP requests on 127.0.0.1:PORT with the VM's counters in
+the Prometheus text format, so a scraper (or curl) can watch a long running program or batch while it runs and tell
+a guest busy computing from one blocked on input:
+
+    lc3_instructions_total          instructions executed
+    lc3_traps_total{vector="x21"}   TRAPs executed, by vector (the ones nobody has a handler for too)
+    lc3_kbsr_polls_total            reads of KBSR, a program polling the keyboard does little else
+    lc3_input_wait_seconds_total    time in check_key() and in the reads of GETC, IN and KBDR
+    lc3_output_bytes_total          bytes of output handed to the terminal, the pipe or vm->output
+    lc3_vms                         VMs counted right now
+    lc3_vms_waiting_input           how many of them are inside a read of input at the moment
+
+Every VM made while the endpoint is up (the batch workers' too) and the one main() runs gets a vm_metrics block of
+its own, and only the thread running that VM writes to it, with relaxed atomic stores: no locks, no read-modify-write
+instructions, and no cache line shared with another VM's counters. The endpoint thread adds the blocks up when a
+request comes in. A block outlives its VM, vm_destroy() gives it back and the next VM carries on counting in it, so
+the totals only ever go up, the way Prometheus wants counters to.
+
+The counting is off the straight-line path, like the profile's: one test of vm->metrics per trap, KBSR poll, output
+flush and read of input. The instruction count goes up when vm_run() returns, and a VM with metrics runs in slices of
+METRICS_SLICE instructions (about a millisecond), so the count moves while a long vm_run() runs too. On Windows link
+with -lws2_32.
+*/
+
+#ifdef _WIN32
+
+#include <winsock2.h>
+#include <Windows.h>
+
+typedef SOCKET metrics_socket;
+typedef HANDLE metrics_thread;
+
+static void close_socket(metrics_socket s){ closesocket(s); }
+
+static uint64_t now_ns(void){
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER now;
+    if (!frequency.QuadPart){
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / frequency.QuadPart * 1000000000 +
+                      now.QuadPart % frequency.QuadPart * 1000000000 / frequency.QuadPart);
+}
+
+#else
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+typedef int metrics_socket;
+typedef pthread_t metrics_thread;
+
+#define INVALID_SOCKET (-1)
+
+static void close_socket(metrics_socket s){ close(s); }
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+#endif
+
+enum { METRICS_BLOCKS = 256 };  // VMs past this many at once run uncounted
+
+struct vm_metrics {
+    atomic_int in_use;
+    atomic_uint_fast64_t wait_started;  // now_ns() when the read of input it is in started, 0 outside one
+    atomic_uint wait_seq;               // odd while metrics_wait_end() moves the wait into input_wait_ns
+    atomic_uint_fast64_t instructions;
+    atomic_uint_fast64_t kbsr_polls;
+    atomic_uint_fast64_t input_wait_ns;
+    atomic_uint_fast64_t output_bytes;
+    atomic_uint_fast64_t traps[256];
+    char pad[64];                       // the next VM's block starts on a cache line of its own
+};
+
+static vm_metrics* blocks;  // METRICS_BLOCKS of them once the endpoint is up, never freed
+static metrics_socket listener = INVALID_SOCKET;
+
+// only the VM's own thread writes a block, so adding is a plain load and store
+static void add(atomic_uint_fast64_t* counter, uint64_t n){
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+void metrics_instructions(vm_metrics* m, uint64_t n){
+    add(&m->instructions, n);
+}
+
+void metrics_trap(vm_metrics* m, uint8_t vector){
+    add(&m->traps[vector], 1);
+}
+
+void metrics_kbsr_poll(vm_metrics* m){
+    add(&m->kbsr_polls, 1);
+}
+
+void metrics_output(vm_metrics* m, size_t bytes){
+    add(&m->output_bytes, bytes);
+}
+
+// for check_key() and io_getchar(), around the read: returns the time it started, for metrics_wait_end()
+uint64_t metrics_wait_start(vm_metrics* m){
+    uint64_t started = now_ns();
+    atomic_store_explicit(&m->wait_started, started, memory_order_relaxed);
+    return started;
+}
+
+// the wait goes into input_wait_ns and out of wait_started in one go as far as metrics_page() can tell, which
+// would otherwise count it twice if it looked in between, and less the next time
+void metrics_wait_end(vm_metrics* m, uint64_t started){
+    unsigned seq = atomic_load_explicit(&m->wait_seq, memory_order_relaxed);
+    atomic_store_explicit(&m->wait_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    add(&m->input_wait_ns, now_ns() - started);
+    atomic_store_explicit(&m->wait_started, 0, memory_order_relaxed);
+    atomic_store_explicit(&m->wait_seq, seq + 2, memory_order_release);
+}
+
+// gives vm a block to count in if the endpoint is up, returns 0 if it is not or every block is taken
+int vm_metrics_start(VM* vm){
+
+    if (vm->metrics || !blocks){
+        return vm->metrics != NULL;
+    }
+    for (int i = 0; i < METRICS_BLOCKS; i++){
+        int free_block = 0;
+        if (atomic_compare_exchange_strong_explicit(&blocks[i].in_use, &free_block, 1, memory_order_acquire,
+                                                    memory_order_relaxed)){
+            vm->metrics = &blocks[i];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// the block goes back for the next VM, with the counts in it
+void vm_metrics_stop(VM* vm){
+
+    if (vm->metrics){
+        atomic_store_explicit(&vm->metrics->in_use, 0, memory_order_release);
+        vm->metrics = NULL;
+    }
+}
+
+// vm_run() for a VM with metrics, a slice at a time so the instruction count keeps up with it
+int metrics_run(VM* vm, uint64_t n_steps){
+
+    uint64_t end = vm->steps + n_steps;
+    for (;;){
+        uint64_t n = n_steps && end - vm->steps < METRICS_SLICE ? end - vm->steps : METRICS_SLICE;
+        int status = vm_run(vm, n);
+        if (status != VM_RUNNING || (n_steps && vm->steps == end)){
+            return status;
+        }
+    }
+}
+
+// the endpoint---------------------------------------------------------------------------------
+
+// appends to the page being put together, what does not fit in it is cut off
+static void put(char* page, size_t size, size_t* len, const char* format, uint64_t value){
+    if (*len < size){
+        int n = snprintf(page + *len, size - *len, format, (unsigned long long)value);
+        *len += n > 0 ? (size_t)n : 0;
+        if (*len > size){
+            *len = size;
+        }
+    }
+}
+
+// the counters of every block added up, in the Prometheus text format, returns its length
+static size_t metrics_page(char* page, size_t size){
+
+    uint64_t instructions = 0, polls = 0, wait_ns = 0, output = 0, vms = 0, waiting = 0;
+    uint64_t traps[256] = { 0 };
+    uint64_t now = now_ns();
+    for (int i = 0; i < METRICS_BLOCKS; i++){
+        vm_metrics* m = &blocks[i];
+        // the wait so far and the one going on from the same side of metrics_wait_end()
+        uint64_t started, waited;
+        unsigned seq;
+        do {
+            seq = atomic_load_explicit(&m->wait_seq, memory_order_acquire);
+            started = atomic_load_explicit(&m->wait_started, memory_order_relaxed);
+            waited = atomic_load_explicit(&m->input_wait_ns, memory_order_relaxed);
+            atomic_thread_fence(memory_order_acquire);
+        } while ((seq & 1) || atomic_load_explicit(&m->wait_seq, memory_order_relaxed) != seq);
+        wait_ns += waited;
+        instructions += atomic_load_explicit(&m->instructions, memory_order_relaxed);
+        polls += atomic_load_explicit(&m->kbsr_polls, memory_order_relaxed);
+        output += atomic_load_explicit(&m->output_bytes, memory_order_relaxed);
+        for (int v = 0; v < 256; v++){
+            traps[v] += atomic_load_explicit(&m->traps[v], memory_order_relaxed);
+        }
+        if (atomic_load_explicit(&m->in_use, memory_order_relaxed)){
+            vms++;
+            // a read that is still waiting counts up to now, not just once it is over
+            if (started){
+                waiting++;
+                wait_ns += now > started ? now - started : 0;
+            }
+        }
+    }
+
+    // a wait that ended just after now was taken can have gone in a few nanoseconds short of what was counted for
+    // it while it went on, and a counter must not go down
+    static uint64_t reported_wait_ns;  // only the endpoint thread puts pages together
+    if (wait_ns < reported_wait_ns){
+        wait_ns = reported_wait_ns;
+    }
+    reported_wait_ns = wait_ns;
+
+    size_t len = 0;
+    put(page, size, &len, "# HELP lc3_instructions_total Instructions executed.\n"
+                          "# TYPE lc3_instructions_total counter\n"
+                          "lc3_instructions_total %llu\n", instructions);
+    put(page, size, &len, "# HELP lc3_traps_total TRAPs executed, by vector.\n"
+                          "# TYPE lc3_traps_total counter\n", 0);
+    for (int v = 0; v < 256; v++){
+        if (traps[v]){
+            char line[64];
+            snprintf(line, sizeof(line), "lc3_traps_total{vector=\"x%02X\"} %%llu\n", v);
+            put(page, size, &len, line, traps[v]);
+        }
+    }
+    put(page, size, &len, "# HELP lc3_kbsr_polls_total Reads of KBSR.\n"
+                          "# TYPE lc3_kbsr_polls_total counter\n"
+                          "lc3_kbsr_polls_total %llu\n", polls);
+    put(page, size, &len, "# HELP lc3_input_wait_seconds_total Time spent checking for and waiting on input.\n"
+                          "# TYPE lc3_input_wait_seconds_total counter\n"
+                          "lc3_input_wait_seconds_total %llu", wait_ns / 1000000000);
+    put(page, size, &len, ".%09llu\n", wait_ns % 1000000000);
+    put(page, size, &len, "# HELP lc3_output_bytes_total Bytes of output written.\n"
+                          "# TYPE lc3_output_bytes_total counter\n"
+                          "lc3_output_bytes_total %llu\n", output);
+    put(page, size, &len, "# HELP lc3_vms VMs being counted.\n"
+                          "# TYPE lc3_vms gauge\n"
+                          "lc3_vms %llu\n", vms);
+    put(page, size, &len, "# HELP lc3_vms_waiting_input VMs inside a read of input right now.\n"
+                          "# TYPE lc3_vms_waiting_input gauge\n"
+                          "lc3_vms_waiting_input %llu\n", waiting);
+    return len;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI serve(LPVOID arg)
+#else
+static void* serve(void* arg)
+#endif
+{
+    (void)arg;
+    static char page[32768];  // only this thread uses it
+    for (;;){
+        metrics_socket client = accept(listener, NULL, NULL);
+        if (client == INVALID_SOCKET){
+            continue;
+        }
+        char request[1024];
+        int got = (int)recv(client, request, sizeof(request) - 1, 0);  // whatever it asks for, it gets the metrics
+        if (got > 0){
+            char header[128];
+            size_t len = metrics_page(page, sizeof(page));
+            int n = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                             "Content-Length: %zu\r\n\r\n", len);
+            send(client, header, n, 0);
+            send(client, page, (int)len, 0);
+        }
+        close_socket(client);
+    }
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+// starts the endpoint on 127.0.0.1:port, returns 0 if it cannot listen there
+int metrics_serve(int port){
+
+    if (blocks){
+        return 1;
+    }
+#ifdef _WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0){
+        return 0;
+    }
+#endif
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener == INVALID_SOCKET){
+        return 0;
+    }
+    int yes = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((uint16_t)port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);  // not for the whole network, a scraper on the same host
+    vm_metrics* all = calloc(METRICS_BLOCKS, sizeof(vm_metrics));
+    if (!all || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 16) != 0){
+        free(all);
+        close_socket(listener);
+        listener = INVALID_SOCKET;
+        return 0;
+    }
+    blocks = all;
+
+#ifdef _WIN32
+    metrics_thread thread = CreateThread(NULL, 0, serve, NULL, 0, NULL);
+    int ok = thread != NULL;
+    if (ok){
+        CloseHandle(thread);
+    }
+#else
+    metrics_thread thread;
+    int ok = pthread_create(&thread, NULL, serve, NULL) == 0;
+    if (ok){
+        pthread_detach(thread);  // it answers requests until the process ends
+    }
+#endif
+    return ok;
+}
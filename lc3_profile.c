@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lc3_vm.h"
+
+/*
+The profiler. vm_profile_start() gives a VM a vm_profile and from then on the engines count every control transfer
+into it (see lc3_vm.h). Nothing is counted on straight-line code, which is what keeps it cheap enough to leave on:
+
+    taken[a]    how often the instruction at a jumped somewhere (a taken branch, JMP, JSR/JSRR or RET)
+    entries[a]  how often something jumped to a
+
+and vm_run() adds 1 to entries[] where it starts and takes 1 off where it stops, so execution that carries on from
+one vm_run() to the next adds up to nothing. vm_profile_report() works the execution count of every address out
+from those in one pass over memory:
+
+    count[a] = entries[a] + count[a - 1] - taken[a - 1]
+
+x0000 comes after xFFFF, and the engines count how often xFFFF runs so the sum has somewhere to start.
+
+JSR/JSRR and RET also keep a shadow call stack, which gives the call graph: how often each routine (an address
+something called, or where the program started) called each other one. The flat profile charges every
+instruction to the routine at or below its address, the same way a symbol table lookup would.
+
+The opcode of an instruction is read from memory at report time, so the opcode counts of code that rewrites
+itself are only as good as what is there at the end. --profile runs the threaded engine in place of the JIT,
+compiled blocks go round their loops without telling anyone.
+*/
+
+static const char* const op_names[16] = {
+    "BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR", "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"
+};
+
+// gives vm a profile, all counts zero. Returns 0 if there is no memory for it
+int vm_profile_start(VM* vm){
+
+    if (!vm->profile){
+        vm->profile = calloc(1, sizeof(vm_profile));
+    }
+    return vm->profile != NULL;
+}
+
+// counting---------------------------------------------------------------------------------
+
+static void add_arc(vm_profile* p, uint16_t caller, uint16_t callee){
+
+    uint32_t arc = (uint32_t)caller << 16 | callee;
+    uint32_t i = (arc * 2654435761u) >> (32 - 13);  // PROFILE_ARCS is 1 << 13
+    for (int probe = 0; probe < PROFILE_ARCS; probe++, i = (i + 1) & (PROFILE_ARCS - 1)){
+        if (p->arcs[i].count == 0){
+            p->arcs[i].arc = arc;
+        }
+        if (p->arcs[i].arc == arc){
+            p->arcs[i].count++;
+            return;
+        }
+    }
+    // the table is full, and a program with 8192 different calls in it is not going to miss one
+}
+
+void profile_call(vm_profile* p, uint16_t from, uint16_t to){
+
+    profile_jump(p, from, to);
+    add_arc(p, p->depth ? p->stack[p->depth - 1].routine : p->entry, to);
+    if (p->depth == PROFILE_STACK){
+        p->lost_depth++;
+        return;
+    }
+    p->stack[p->depth].routine = to;
+    p->stack[p->depth].ret = (uint16_t)(from + 1);
+    p->depth++;
+}
+
+void profile_return(vm_profile* p, uint16_t from, uint16_t to){
+
+    profile_jump(p, from, to);
+    // usually the innermost call returns. A routine that returns for its callee as well pops both, and a JMP R7
+    // that goes back to none of them is just a jump
+    for (int i = p->depth - 1; i >= 0; i--){
+        if (p->stack[i].ret == to){
+            p->depth = i;
+            return;
+        }
+    }
+}
+
+// the report---------------------------------------------------------------------------------
+
+typedef struct {
+    uint16_t start;
+    uint64_t self;
+    uint64_t calls;
+} routine_stats;
+
+static int by_start(const void* a, const void* b){
+    return (int)((const routine_stats*)a)->start - (int)((const routine_stats*)b)->start;
+}
+
+static int by_self(const void* a, const void* b){
+    uint64_t x = ((const routine_stats*)a)->self, y = ((const routine_stats*)b)->self;
+    return x < y ? 1 : x > y ? -1 : by_start(a, b);
+}
+
+static const uint64_t* sort_counts;  // for by_count(), qsort has no context argument
+
+static int by_count(const void* a, const void* b){
+    uint64_t x = sort_counts[*(const uint16_t*)a], y = sort_counts[*(const uint16_t*)b];
+    return x < y ? 1 : x > y ? -1 : (int)*(const uint16_t*)a - (int)*(const uint16_t*)b;
+}
+
+static int by_arc_count(const void* a, const void* b){
+    uint64_t x = ((const uint64_t*)a)[1], y = ((const uint64_t*)b)[1];
+    return x < y ? 1 : x > y ? -1 : (((const uint64_t*)a)[0] > ((const uint64_t*)b)[0]) - (((const uint64_t*)a)[0] < ((const uint64_t*)b)[0]);
+}
+
+static double percent(uint64_t part, uint64_t total){
+    return total ? 100.0 * (double)part / (double)total : 0.0;
+}
+
+/*
+writes out the flat profile (by routine, then the hottest addresses), the opcode counts and the call graph. The
+counts are the ones since vm_profile_start(), over every run and reset of vm since then
+*/
+void vm_profile_report(VM* vm, FILE* out){
+
+    enum { HOT_ADDRESSES = 20 };
+    vm_profile* p = vm->profile;
+    uint64_t* counts = malloc(MAX_MEMORY * sizeof(uint64_t));
+    uint16_t* order = malloc(MAX_MEMORY * sizeof(uint16_t));
+    routine_stats* routines = malloc((PROFILE_ARCS + 1) * sizeof(routine_stats));
+    uint64_t (*arcs)[2] = malloc(PROFILE_ARCS * sizeof(*arcs));
+    if (!p || !counts || !order || !routines || !arcs){
+        free(counts);
+        free(order);
+        free(routines);
+        free(arcs);
+        return;
+    }
+
+    // the execution count of every address. The first pass starts with nothing falling into x0000, which leaves
+    // every count short by how often execution did fall into it, and xFFFF tells how much that was
+    int64_t fall = 0;
+    for (uint32_t a = 0; a < MAX_MEMORY; a++){
+        fall += p->entries[a];
+        counts[a] = (uint64_t)fall;
+        fall -= (int64_t)p->taken[a];
+    }
+    fall = (int64_t)p->last_word_runs - (int64_t)counts[MAX_MEMORY - 1];
+    uint64_t total = 0, ops[16] = { 0 }, taken_branches = 0, jumps = 0, calls = 0, returns = 0;
+    int executed = 0;
+    for (uint32_t a = 0; a < MAX_MEMORY; a++){
+        int64_t c = (int64_t)counts[a] + fall;
+        counts[a] = c > 0 ? (uint64_t)c : 0;
+        int op = vm_peek(vm, (uint16_t)a) >> 12;
+        uint16_t r1 = (vm_peek(vm, (uint16_t)a) >> 6) & 0x7;
+        total += counts[a];
+        ops[op] += counts[a];
+        if (op == BR){
+            taken_branches += p->taken[a];
+        } else if (op == JSR){
+            calls += p->taken[a];
+        } else if (op == JMP && r1 == R_R7){
+            returns += p->taken[a];
+        } else {
+            jumps += p->taken[a];
+        }
+        if (counts[a]){
+            order[executed++] = (uint16_t)a;
+        }
+    }
+
+    // the routines are the addresses something called, plus where the program started
+    int routine_count = 0, arc_count = 0;
+    routines[routine_count++] = (routine_stats){ p->entry, 0, 0 };
+    for (int i = 0; i < PROFILE_ARCS; i++){
+        if (p->arcs[i].count){
+            arcs[arc_count][0] = p->arcs[i].arc;
+            arcs[arc_count][1] = p->arcs[i].count;
+            arc_count++;
+            routines[routine_count++] = (routine_stats){ (uint16_t)p->arcs[i].arc, 0, p->arcs[i].count };
+        }
+    }
+    qsort(routines, (size_t)routine_count, sizeof(routine_stats), by_start);
+    int unique = 0;
+    for (int i = 0; i < routine_count; i++){
+        if (unique && routines[unique - 1].start == routines[i].start){
+            routines[unique - 1].calls += routines[i].calls;
+        } else {
+            routines[unique++] = routines[i];
+        }
+    }
+    routine_count = unique;
+    int r = -1;
+    for (uint32_t a = 0; a < MAX_MEMORY; a++){
+        while (r + 1 < routine_count && routines[r + 1].start <= a){
+            r++;
+        }
+        if (r >= 0){
+            routines[r].self += counts[a];
+        }
+    }
+    // code below the lowest routine (only possible if the program jumped below where it started) is not charged
+
+    fprintf(out, "== profile: %llu instructions\n", (unsigned long long)total);
+    fprintf(out, "taken branches %llu, jumps %llu, calls %llu, returns %llu, KBSR polls %llu\n",
+            (unsigned long long)taken_branches, (unsigned long long)jumps, (unsigned long long)calls,
+            (unsigned long long)returns, (unsigned long long)p->kbsr_polls);
+    if (p->lost_depth){
+        fprintf(out, "%llu calls nested too deep to follow, the call graph is missing them\n", (unsigned long long)p->lost_depth);
+    }
+
+    fprintf(out, "\nflat profile, by routine:\n  %%instr  instructions        calls  routine\n");
+    qsort(routines, (size_t)routine_count, sizeof(routine_stats), by_self);
+    for (int i = 0; i < routine_count; i++){
+        if (!routines[i].self && !routines[i].calls){
+            continue;
+        }
+        fprintf(out, "  %6.2f  %12llu %12llu  x%04X%s\n", percent(routines[i].self, total),
+                (unsigned long long)routines[i].self, (unsigned long long)routines[i].calls, routines[i].start,
+                routines[i].start == p->entry ? " (entry)" : "");
+    }
+
+    fprintf(out, "\nhottest addresses:\n  %%instr  instructions  address  word  op\n");
+    sort_counts = counts;
+    qsort(order, (size_t)executed, sizeof(uint16_t), by_count);
+    for (int i = 0; i < executed && i < HOT_ADDRESSES; i++){
+        uint16_t word = vm_peek(vm, order[i]);
+        fprintf(out, "  %6.2f  %12llu    x%04X  %04X  %s\n", percent(counts[order[i]], total),
+                (unsigned long long)counts[order[i]], order[i], word, op_names[word >> 12]);
+    }
+
+    fprintf(out, "\nopcodes:\n");
+    for (int op = 0; op < 16; op++){
+        if (ops[op]){
+            fprintf(out, "  %-5s %12llu  %6.2f%%\n", op_names[op], (unsigned long long)ops[op], percent(ops[op], total));
+        }
+    }
+
+    fprintf(out, "\ncall graph:\n         calls  caller -> callee\n");
+    qsort(arcs, (size_t)arc_count, sizeof(*arcs), by_arc_count);
+    for (int i = 0; i < arc_count; i++){
+        fprintf(out, "  %12llu  x%04X -> x%04X\n", (unsigned long long)arcs[i][1],
+                (unsigned)(arcs[i][0] >> 16), (unsigned)(arcs[i][0] & 0xFFFF));
+    }
+
+    free(counts);
+    free(order);
+    free(routines);
+    free(arcs);
+}
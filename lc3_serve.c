@@ -0,0 +1,404 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lc3_vm.h"
+
+/*
+lc3 --serve=[ADDR:]PORT [--serve-threads=N] [--steps=N] image-file ...
+
+Interactive sessions over TCP: every connection gets a machine of its own, started from the loaded images, that
+reads what the client sends and sends back what the program prints. One process holds thousands of them on a few
+threads, each thread an event loop over an epoll set of its own, instead of a thread per session blocked in a read.
+
+That works because a VM never blocks. Its input comes from memory (io_memory with vm->in_can_wait, the same as
+lc3_create() in the library), so GETC or IN with nothing to read stops vm_run() with VM_WAITING_INPUT and PC back on
+the TRAP, and once vm_add_input() has given it something the next vm_run() runs the TRAP again as if nothing had
+happened. A session is then always in one of these:
+
+    running     on its thread's run queue, which runs each one for SERVE_SLICE instructions and goes round
+    waiting     in GETC or IN, it goes back on the run queue when input comes
+    polling     it read KBSR in its last slice and found no key, it sleeps SERVE_POLL_MS (or until input comes) so
+                a program that waits for a key in a loop of its own does not spin a core for nothing. It wakes up
+                to a short slice, and gets whole ones again once it does something besides polling
+    sending     the client has not taken the output yet, it runs again once the socket has room
+    closing     HALT (or --steps) ran, the output that is left goes out and the connection is closed
+
+The client closing its side is end of input: GETC reads EOF from then on, and the program gets to finish. Sessions
+never move between threads, so nothing a session owns needs a lock; new connections go to whichever thread's epoll
+wakes for the listening socket (EPOLLEXCLUSIVE wakes just one). All the sessions share the loaded image's pages,
+decoded instructions included, and copy the pages they write (see vm_page in lc3_vm.h).
+
+It listens on 127.0.0.1 unless an address is given. epoll makes it Linux only, elsewhere --serve says so.
+*/
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+enum {
+    SERVE_SLICE = 1 << 16,          // instructions a session runs before the next one gets a turn
+    SERVE_POLL_SLICE = 32,          // the slice of one waking up from polling, enough to look for a key again
+    SERVE_POLL_MS = 10,             // how long a session polling KBSR for a key that is not there sleeps
+    SERVE_OUTPUT_MAX = 1 << 16,     // output the client has not taken yet that stops the program from running
+    SERVE_EVENTS = 256
+};
+
+enum { SESSION_RUNNING, SESSION_WAITING, SESSION_POLLING, SESSION_SENDING, SESSION_CLOSING };
+
+typedef struct session {
+    VM* vm;
+    int fd;
+    int state;
+    int want_write;                 // EPOLLOUT is in its epoll events
+    int read_closed;                // the client shut its side, EPOLLIN is not in them any more
+    size_t sent;                    // bytes of vm->output the client has already
+    uint64_t slice;                 // instructions its next turn runs
+    long long wake_ms;              // SESSION_POLLING: when it runs again
+    struct session *prev, *next;    // on its thread's run queue or poll queue, or neither
+} session;
+
+typedef struct {
+    session* head;
+    session* tail;
+} session_queue;
+
+typedef struct {
+    int epoll;
+    session_queue run;              // SESSION_RUNNING
+    session_queue poll;             // SESSION_POLLING, in the order their wake_ms comes up
+} serve_thread;
+
+static int listener;
+static const vm_template* boot;     // every session starts from this
+static int boot_engine;
+static int boot_host_traps;
+static uint64_t session_steps;      // --steps, 0 for no limit
+
+static long long now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void queue_push(session_queue* q, session* s){
+    s->prev = q->tail;
+    s->next = NULL;
+    if (q->tail){
+        q->tail->next = s;
+    } else {
+        q->head = s;
+    }
+    q->tail = s;
+}
+
+static void queue_remove(session_queue* q, session* s){
+    if (s->prev){
+        s->prev->next = s->next;
+    } else {
+        q->head = s->next;
+    }
+    if (s->next){
+        s->next->prev = s->prev;
+    } else {
+        q->tail = s->prev;
+    }
+    s->prev = s->next = NULL;
+}
+
+// takes s off whichever queue it is on and gives it its new state
+static void set_state(serve_thread* t, session* s, int state){
+    if (s->state == SESSION_RUNNING){
+        queue_remove(&t->run, s);
+    } else if (s->state == SESSION_POLLING){
+        queue_remove(&t->poll, s);
+    }
+    s->state = state;
+    if (state == SESSION_RUNNING){
+        queue_push(&t->run, s);
+    } else if (state == SESSION_POLLING){
+        s->wake_ms = now_ms() + SERVE_POLL_MS;
+        queue_push(&t->poll, s);  // they all sleep as long, so the queue stays in wake_ms order
+    }
+}
+
+static void watch(serve_thread* t, session* s, int write){
+    struct epoll_event e = { .events = (s->read_closed ? 0 : EPOLLIN | EPOLLRDHUP) | (write ? EPOLLOUT : 0),
+                             .data.ptr = s };
+    epoll_ctl(t->epoll, EPOLL_CTL_MOD, s->fd, &e);
+    s->want_write = write;
+}
+
+static void close_session(serve_thread* t, session* s){
+    set_state(t, s, SESSION_CLOSING);
+    close(s->fd);  // which takes it out of the epoll set too
+    vm_destroy(s->vm);
+    free(s);
+}
+
+// sends what the program printed, returns 0 if the connection is gone
+static int send_output(session* s){
+    VM* vm = s->vm;
+    while (s->sent < vm->output_len){
+        ssize_t n = send(s->fd, vm->output + s->sent, vm->output_len - s->sent, MSG_NOSIGNAL);
+        if (n < 0){
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        s->sent += (size_t)n;
+    }
+    vm->output_len = s->sent = 0;
+    return 1;
+}
+
+// where s goes after its output went out as far as it could, from what the program did last
+static void reschedule(serve_thread* t, session* s, int polled){
+    VM* vm = s->vm;
+    if (!send_output(s)){
+        close_session(t, s);
+        return;
+    }
+    int done = vm->status == VM_HALTED || vm->status == VM_STOPPED || (session_steps && vm->steps >= session_steps);
+    size_t pending = vm->output_len - s->sent;
+    if (s->want_write != (pending != 0)){
+        watch(t, s, pending != 0);
+    }
+    if (done){
+        if (pending){
+            set_state(t, s, SESSION_CLOSING);  // the output that is left goes first
+        } else {
+            close_session(t, s);
+        }
+    } else if (pending > SERVE_OUTPUT_MAX){
+        set_state(t, s, SESSION_SENDING);
+    } else if (vm->status == VM_WAITING_INPUT){
+        set_state(t, s, SESSION_WAITING);
+    } else if (polled && vm->in_pos == vm->in_len){
+        s->slice = SERVE_POLL_SLICE;  // most likely it only looks and goes back to sleep
+        set_state(t, s, SESSION_POLLING);
+    } else {
+        s->slice = SERVE_SLICE;
+        set_state(t, s, SESSION_RUNNING);
+    }
+}
+
+static void run_session(serve_thread* t, session* s){
+    VM* vm = s->vm;
+    uint64_t n = s->slice;
+    if (session_steps && session_steps - vm->steps < n){
+        n = session_steps - vm->steps;
+    }
+    uint64_t polls = vm->in_empty_polls;
+    vm_run(vm, n);
+    io_flush(vm);
+    reschedule(t, s, vm->in_empty_polls != polls);
+}
+
+static void open_session(serve_thread* t, int fd){
+    session* s = calloc(1, sizeof(session));
+    VM* vm = s ? vm_create_from(boot) : NULL;
+    if (!vm || (boot_host_traps && !vm_add_host_traps(vm))){
+        vm_destroy(vm);
+        free(s);
+        close(fd);
+        return;
+    }
+    vm->engine = boot_engine;
+    vm->io = &io_memory;
+    vm->in_can_wait = 1;
+    vm->in_eof = 1;  // nothing but what vm_add_input() hands it
+    s->vm = vm;
+    s->fd = fd;
+    s->slice = SERVE_SLICE;
+    s->state = SESSION_CLOSING;  // on no queue yet
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));  // prompts go out now, not after 40ms
+    struct epoll_event e = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = s };
+    epoll_ctl(t->epoll, EPOLL_CTL_ADD, fd, &e);
+    set_state(t, s, SESSION_RUNNING);  // it prints its prompt before anybody types anything
+}
+
+static void session_event(serve_thread* t, session* s, uint32_t events){
+    if (events & (EPOLLHUP | EPOLLERR)){
+        close_session(t, s);  // nobody left to send the output to
+        return;
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP)){
+        char buf[4096];
+        for (;;){
+            ssize_t n = recv(s->fd, buf, sizeof(buf), 0);
+            if (n > 0){
+                if (s->state != SESSION_CLOSING){
+                    vm_add_input(s->vm, buf, (size_t)n);
+                }
+                continue;
+            }
+            if (n == 0){
+                s->vm->in_can_wait = 0;  // the client is done typing, GETC reads EOF from here on
+                s->read_closed = 1;
+                watch(t, s, s->want_write);
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+                close_session(t, s);
+                return;
+            }
+            break;
+        }
+        if (s->state == SESSION_WAITING || s->state == SESSION_POLLING){
+            set_state(t, s, SESSION_RUNNING);
+        }
+    }
+    if (events & EPOLLOUT){
+        if (s->state == SESSION_CLOSING || s->state == SESSION_SENDING){
+            reschedule(t, s, 0);
+        } else if (!send_output(s)){
+            close_session(t, s);
+        } else {
+            watch(t, s, s->sent < s->vm->output_len);
+        }
+    }
+}
+
+static void accept_sessions(serve_thread* t){
+    for (;;){
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0){
+            return;  // EAGAIN, or another thread got there first
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        open_session(t, fd);
+    }
+}
+
+static void* serve_loop(void* arg){
+    serve_thread* t = arg;
+    struct epoll_event events[SERVE_EVENTS];
+    for (;;){
+        int timeout = -1;
+        if (t->run.head){
+            timeout = 0;  // just look, there is work to do
+        } else if (t->poll.head){
+            long long wait = t->poll.head->wake_ms - now_ms();
+            timeout = wait > 0 ? (int)wait : 0;
+        }
+        int n = epoll_wait(t->epoll, events, SERVE_EVENTS, timeout);
+        for (int i = 0; i < n; i++){
+            if (events[i].data.ptr == NULL){
+                accept_sessions(t);
+            } else {
+                session_event(t, events[i].data.ptr, events[i].events);
+            }
+        }
+        long long now = now_ms();
+        while (t->poll.head && t->poll.head->wake_ms <= now){
+            set_state(t, t->poll.head, SESSION_RUNNING);
+        }
+        // one slice for every session that was runnable when the round started, then back to the sockets
+        session* last = t->run.tail;
+        int more = last != NULL;
+        while (more){
+            session* s = t->run.head;
+            more = s != last;
+            run_session(t, s);  // which takes it off the front, and maybe puts it back at the end
+        }
+    }
+    return NULL;
+}
+
+static int listen_on(const char* address){
+    const char* colon = strrchr(address, ':');
+    struct sockaddr_in at;
+    memset(&at, 0, sizeof(at));
+    at.sin_family = AF_INET;
+    at.sin_port = htons((uint16_t)atoi(colon ? colon + 1 : address));
+    at.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (colon){
+        char host[64];
+        size_t len = (size_t)(colon - address);
+        if (len >= sizeof(host)){
+            return -1;
+        }
+        memcpy(host, address, len);
+        host[len] = 0;
+        if (len && inet_pton(AF_INET, host, &at.sin_addr) != 1){
+            return -1;
+        }
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int yes = 1;
+    if (fd < 0){
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    if (bind(fd, (struct sockaddr*)&at, sizeof(at)) != 0 || listen(fd, 1024) != 0){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+serves the program loaded into vm (predecoded, with whatever a snapshot restored) until the process is killed.
+threads 0 is one per CPU. Returns 1 if it could not start
+*/
+int serve_main(VM* vm, const char* address, int threads, uint64_t max_steps, int host_traps){
+
+    vm_template* t = vm_template_create(vm);
+    if (!t){
+        printf("out of memory\n");
+        return 1;
+    }
+    boot = t;
+    boot_engine = vm->engine;
+    boot_host_traps = host_traps;
+    session_steps = max_steps;
+    listener = listen_on(address);
+    if (listener < 0){
+        printf("cannot listen on %s (PORT or ADDR:PORT)\n", address);
+        return 1;
+    }
+    if (threads <= 0){
+        threads = cpu_count();
+    }
+
+    serve_thread* loops = calloc((size_t)threads, sizeof(serve_thread));
+    for (int i = 0; i < threads; i++){
+        loops[i].epoll = epoll_create1(EPOLL_CLOEXEC);
+        struct epoll_event e = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL };
+        if (loops[i].epoll < 0 || epoll_ctl(loops[i].epoll, EPOLL_CTL_ADD, listener, &e) != 0){
+            printf("cannot set up epoll\n");
+            return 1;
+        }
+    }
+    printf("serving on %s with %d threads\n", address, threads);
+    fflush(stdout);
+    for (int i = 1; i < threads; i++){
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve_loop, &loops[i]) != 0){
+            printf("failed to start thread %d\n", i);
+            return 1;
+        }
+        pthread_detach(thread);
+    }
+    serve_loop(&loops[0]);  // the main thread is one of them
+    return 0;
+}
+
+#else
+
+int serve_main(VM* vm, const char* address, int threads, uint64_t max_steps, int host_traps){
+    (void)vm; (void)address; (void)threads; (void)max_steps; (void)host_traps;
+    printf("--serve needs epoll, it only runs on Linux\n");
+    return 1;
+}
+
+#endif
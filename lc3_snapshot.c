@@ -0,0 +1,287 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lc3_vm.h"
+
+/*
+Snapshots. A snapshot is the complete state of a running machine (memory, registers and how far it has read into
+its input) written to a file, so a long computation can be picked up where it was instead of running it again from
+the start. main() writes one when PC first reaches --snapshot-at=ADDR, or on SIGUSR1, and --restore=FILE carries on
+from it.
+
+A snapshot does not hold all of memory, only the pages that differ from the images the program was loaded from.
+They are named in the snapshot and loaded again on restore, and a hash of the memory they produce makes sure they
+are still the same images. Most programs only ever write to a handful of pages, so a snapshot is a few KB.
+
+The layout, all fields in the writer's byte order (the same as native images, see lc3_image.c):
+
+    char     magic[4]           "LC3S"
+    uint16   byte_order         SNAPSHOT_BYTE_ORDER
+    uint16   version            SNAPSHOT_VERSION
+    uint16   reg[R_COUNT]       R0-R7, PC, and COND as FL_NEG, FL_ZERO or FL_POS
+    uint16   image_count
+    uint16   page_count
+    uint64   steps              instructions executed up to the snapshot
+    uint64   input_consumed     characters the program had read, a restore skips that many
+    uint64   base_hash          FNV-1a over the 65536 words of memory the images load into
+    then image_count times:
+    uint16   path_length
+    char     path[path_length]  followed by a zero byte if the length is odd
+    then page_count times:
+    uint16   page               0 to PAGE_COUNT - 1
+    uint16   reserved           0
+    uint16   words[PAGE_WORDS]
+
+lc3_debugger.py loads the same files. Snapshots are not converted between byte orders, a snapshot written on a big
+endian host only restores on another one (the debugger reads both).
+*/
+
+enum {
+    SNAPSHOT_BYTE_ORDER = 0x0102,
+    SNAPSHOT_VERSION = 1
+};
+
+typedef struct {
+    char magic[4];
+    uint16_t byte_order;
+    uint16_t version;
+    uint16_t reg[R_COUNT];
+    uint16_t image_count;
+    uint16_t page_count;
+    uint64_t steps;         // at offset 32, so there is no padding anywhere
+    uint64_t input_consumed;
+    uint64_t base_hash;
+} snapshot_header;
+
+static const char snapshot_magic[4] = { 'L', 'C', '3', 'S' };
+
+static const uint16_t zero_words[PAGE_WORDS];
+
+// the words page holds in the memory the snapshot is a delta against: the VM's template, or empty memory
+static const uint16_t* base_words(const VM* vm, int page){
+    return vm->base ? vm->base->pages[page]->words : zero_words;
+}
+
+// FNV-1a, one word at a time
+static const uint64_t FNV_OFFSET = 1469598103934665603ULL;
+static const uint64_t FNV_PRIME = 1099511628211ULL;
+
+static uint64_t hash_words(uint64_t h, const uint16_t* words, size_t n){
+    for (size_t i = 0; i < n; i++){
+        h = (h ^ words[i]) * FNV_PRIME;
+    }
+    return h;
+}
+
+// FNV-1a over all of vm's memory, the hash a snapshot (or a trace, see lc3_trace.c) checks its images with
+uint64_t vm_memory_hash(const VM* vm){
+
+    uint64_t hash = FNV_OFFSET;
+    for (int page = 0; page < PAGE_COUNT; page++){
+        hash = hash_words(hash, vm->pages[page]->words, PAGE_WORDS);
+    }
+    return hash;
+}
+
+// saving---------------------------------------------------------------------------------
+
+/*
+writes the state of vm to path, with its memory as a delta against the template it was made from (empty memory
+if there is none). images are the images that template was loaded from, in order, a restore loads them again.
+Pending output is written out first, so everything printed before the snapshot is on its way. Returns 0 if the file
+could not be written.
+*/
+int vm_save_snapshot(VM* vm, const char* path, const char* const* images, int image_count){
+
+    io_flush(vm);
+
+    snapshot_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, snapshot_magic, 4);
+    h.byte_order = SNAPSHOT_BYTE_ORDER;
+    h.version = SNAPSHOT_VERSION;
+    for (int r = 0; r < R_COUNT; r++){
+        h.reg[r] = reg_read(vm, r);
+    }
+    h.image_count = (uint16_t)image_count;
+    h.steps = vm->steps;
+    h.input_consumed = vm->in_consumed;
+    h.base_hash = FNV_OFFSET;
+    uint8_t changed[PAGE_COUNT];
+    for (int page = 0; page < PAGE_COUNT; page++){
+        const uint16_t* base = base_words(vm, page);
+        h.base_hash = hash_words(h.base_hash, base, PAGE_WORDS);
+        // a page the VM never copied is still the template's
+        changed[page] = vm->page_owned[page] && memcmp(vm->pages[page]->words, base, PAGE_WORDS * 2) != 0;
+        h.page_count += changed[page];
+    }
+
+    FILE* file = fopen(path, "wb");
+    if (!file){
+        return 0;
+    }
+    int ok = fwrite(&h, sizeof(h), 1, file) == 1;
+    for (int i = 0; ok && i < image_count; i++){
+        size_t len = strlen(images[i]);
+        uint16_t len16 = (uint16_t)len;
+        ok = len <= 0xFFFF && fwrite(&len16, 2, 1, file) == 1 && fwrite(images[i], 1, len, file) == len;
+        if (ok && len % 2){
+            ok = fputc(0, file) != EOF;
+        }
+    }
+    for (int page = 0; ok && page < PAGE_COUNT; page++){
+        if (!changed[page]){
+            continue;
+        }
+        uint16_t record[2] = { (uint16_t)page, 0 };
+        ok = fwrite(record, sizeof(record), 1, file) == 1 && fwrite(vm->pages[page]->words, PAGE_WORDS * 2, 1, file) == 1;
+    }
+    ok = fclose(file) == 0 && ok;
+    return ok;
+}
+
+// restoring---------------------------------------------------------------------------------
+
+// reads all of path into a malloc'd buffer, NULL if it cannot
+static unsigned char* read_file(const char* path, size_t* size){
+
+    FILE* file = fopen(path, "rb");
+    if (!file){
+        return NULL;
+    }
+    unsigned char* data = NULL;
+    long len;
+    if (fseek(file, 0, SEEK_END) == 0 && (len = ftell(file)) >= 0 && fseek(file, 0, SEEK_SET) == 0){
+        data = malloc(len ? (size_t)len : 1);
+        if (data && fread(data, 1, (size_t)len, file) != (size_t)len){
+            free(data);
+            data = NULL;
+        }
+        *size = (size_t)len;
+    }
+    fclose(file);
+    return data;
+}
+
+// checks the header and that the image paths and pages are all there, returns the offset of the first page record
+static size_t check_snapshot(const unsigned char* data, size_t size, snapshot_header* h){
+
+    if (size < sizeof(*h)){
+        return 0;
+    }
+    memcpy(h, data, sizeof(*h));
+    if (memcmp(h->magic, snapshot_magic, 4) != 0 || h->byte_order != SNAPSHOT_BYTE_ORDER || h->version != SNAPSHOT_VERSION){
+        return 0;
+    }
+    size_t pos = sizeof(*h);
+    for (int i = 0; i < h->image_count; i++){
+        uint16_t len;
+        if (size - pos < 2){
+            return 0;
+        }
+        memcpy(&len, data + pos, 2);
+        pos += 2 + len + (len & 1);
+        if (pos > size){
+            return 0;
+        }
+    }
+    if ((size - pos) != (size_t)h->page_count * (4 + PAGE_WORDS * 2)){
+        return 0;
+    }
+    return pos;
+}
+
+/*
+the image paths a snapshot names, in a malloc'd array of malloc'd strings (the caller frees them). Returns the number
+of images, -1 if path is not a snapshot
+*/
+int vm_snapshot_images(const char* path, char*** images){
+
+    size_t size;
+    unsigned char* data = read_file(path, &size);
+    snapshot_header h;
+    if (!data || !check_snapshot(data, size, &h)){
+        free(data);
+        return -1;
+    }
+    char** names = malloc(sizeof(char*) * (h.image_count ? h.image_count : 1));
+    if (!names){
+        printf("out of memory\n");
+        exit(1);
+    }
+    size_t pos = sizeof(h);
+    for (int i = 0; i < h.image_count; i++){
+        uint16_t len;
+        memcpy(&len, data + pos, 2);
+        names[i] = malloc((size_t)len + 1);
+        if (!names[i]){
+            printf("out of memory\n");
+            exit(1);
+        }
+        memcpy(names[i], data + pos + 2, len);
+        names[i][len] = 0;
+        pos += 2 + len + (len & 1);
+    }
+    free(data);
+    *images = names;
+    return h.image_count;
+}
+
+/*
+puts vm in the state the snapshot at path was taken in. vm has to hold what the snapshot's images load into and
+nothing else (freshly created or reset, with the images loaded or made from a template of them), that is checked
+against the hash in the snapshot. The snapshot's pages are written over it, the registers, the instruction count and
+the input position are restored, and the characters the program had already read get skipped the next time it reads
+(so a restored program should be given the same input again). Returns 0 and leaves vm alone if path is not a
+snapshot or the memory underneath it does not match.
+*/
+int vm_restore_snapshot(VM* vm, const char* path){
+
+    size_t size;
+    unsigned char* data = read_file(path, &size);
+    snapshot_header h;
+    size_t pos = data ? check_snapshot(data, size, &h) : 0;
+    if (!pos){
+        free(data);
+        return 0;
+    }
+
+    int ok = vm_memory_hash(vm) == h.base_hash;
+    for (const unsigned char* p = data + pos; ok && p < data + size; p += 4 + PAGE_WORDS * 2){
+        uint16_t page;
+        memcpy(&page, p, 2);
+        ok = page < PAGE_COUNT;
+    }
+    if (!ok){
+        free(data);
+        return 0;
+    }
+
+    vm_analysis_stop(vm);  // the analysis was about the memory the snapshot replaces
+    for (const unsigned char* p = data + pos; p < data + size; p += 4 + PAGE_WORDS * 2){
+        uint16_t page;
+        memcpy(&page, p, 2);
+        vm_page* to = vm_replace_page(vm, page);
+        vm->page_dirty[page] = 1;
+        memcpy(to->words, p + 4, PAGE_WORDS * 2);
+        for (int i = 0; i < PAGE_WORDS; i++){
+            to->decoded[i].op = OP_DECODE;  // the page may have been the VM's own already
+        }
+        for (uint32_t a = (uint32_t)page * PAGE_WORDS; vm->jit && a < (uint32_t)(page + 1) * PAGE_WORDS; a++){
+            if (vm->jit_code_map[a]){
+                jit_invalidate(vm, (uint16_t)a);
+            }
+        }
+    }
+    for (int r = 0; r < R_COUNT; r++){
+        reg_write(vm, r, h.reg[r]);
+    }
+    vm->status = VM_RUNNING;
+    vm->steps = h.steps;
+    vm_journal_clear(vm);
+    vm->in_consumed = vm->in_skip = h.input_consumed;
+    free(data);
+    return 1;
+}
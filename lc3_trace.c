@@ -0,0 +1,616 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "lc3_vm.h"
+
+/*
+Execution traces. --trace=FILE writes down what every instruction did while the program runs, and --replay=FILE
+runs the program again on the input the trace recorded, checking every instruction against it. A run that went
+wrong somewhere (on a user's machine, or before a change to the VM) can be replayed exactly, and the replay says
+at which instruction it stops doing what the trace did.
+
+The trace does not hold the instructions, only what they left behind, in the order they ran:
+
+    ADD, AND, NOT, LEA, LD, LDR, LDI    the new value of DR, as the difference from its old value
+    TRAP                                the same for R0 (GETC, IN and some host traps write it, for the others it is 0)
+    BR                                  one bit, 1 if taken. Eight branches share a byte, which goes where the
+                                        first of them would have
+    JMP, JSR, JSRR                      where it went, as the difference from the address after it
+    ST, STR, STI, RTI, RES              nothing, what they do follows from the registers
+
+and in between, right where the program reads it, the input: a byte for every KBSR poll (1 if a key was there) and
+the character for every GETC, IN and KBDR read (0xFFFF for EOF). Numbers are varints, 7 bits a byte with the low
+ones first, and the differences are zigzag coded (trace_zigzag() in lc3_vm.h) so a register counting down by one
+costs a byte like one counting up. Most instructions take one byte, branches an eighth of one.
+
+Reading a trace means executing the program alongside it, the reader only knows what a byte is from the
+instruction it belongs to. That is what vm_replay() does, anything the program did differently shows up as a byte
+that does not match.
+
+The engines put the bytes into a ring of TRACE_RING bytes (lc3_vm.h), and a writer thread takes them out to the
+file. The ring has one producer and one consumer, so there are no locks, just two positions: the engines hand the
+writer a TRACE_CHUNK bytes at a time at the first instruction past the end of a chunk (trace_chunk()), the writer
+says how far it has written, and the engines only wait for it when the ring is full. A group of branch bits never
+goes past the end of a chunk, so no byte is changed after the writer has it. The reader starts a new group at the
+same places, it knows where the chunks end from the number of bytes it has read.
+
+Built with -DLC3_ZSTD (and -lzstd) the writer compresses the stream with zstd, the replay reads both.
+
+The file, header fields in the writer's byte order like snapshots (lc3_snapshot.c):
+
+    char     magic[4]           "LC3T"
+    uint16   byte_order         TRACE_BYTE_ORDER
+    uint16   version            TRACE_VERSION
+    uint16   reg[R_COUNT]       the registers when the trace starts, COND as FL_NEG, FL_ZERO or FL_POS
+    uint16   image_count
+    uint16   flags              TRACE_ZSTD if the stream is compressed
+    uint64   steps              instructions in the trace, written when it is closed (TRACE_NO_STEPS if it never was)
+    uint64   memory_hash        vm_memory_hash() when the trace starts, with the images loaded
+    then image_count times:
+    uint16   path_length
+    char     path[path_length]  followed by a zero byte if the length is odd
+    then the stream, to the end of the file
+
+Like --profile, a traced VM runs the threaded engine in place of the JIT, compiled blocks would run without it.
+*/
+
+#ifdef LC3_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef _WIN32
+
+#include <Windows.h>
+
+typedef HANDLE trace_thread;
+
+static void nap(void){ Sleep(1); }
+
+#else
+
+#include <pthread.h>
+#include <time.h>
+
+typedef pthread_t trace_thread;
+
+static void nap(void){
+    struct timespec ts = { 0, 200000 };  // 0.2ms
+    nanosleep(&ts, NULL);
+}
+
+#endif
+
+enum {
+    TRACE_BYTE_ORDER = 0x0102,
+    TRACE_VERSION = 1,
+    TRACE_ZSTD = 1
+};
+
+static const uint64_t TRACE_NO_STEPS = UINT64_MAX;
+
+typedef struct {
+    char magic[4];
+    uint16_t byte_order;
+    uint16_t version;
+    uint16_t reg[R_COUNT];
+    uint16_t image_count;
+    uint16_t flags;
+    uint64_t steps;         // at offset 32, so there is no padding anywhere
+    uint64_t memory_hash;
+} trace_header;
+
+static const char trace_magic[4] = { 'L', 'C', '3', 'T' };
+
+// writing---------------------------------------------------------------------------------
+
+struct trace_writer {
+    FILE* file;
+    atomic_uint_fast64_t published;     // the engines are done with the ring up to here
+    atomic_uint_fast64_t taken;         // and the writer has written it out up to here
+    atomic_int done;                    // nothing more gets published
+    int failed;
+    trace_thread thread;
+    trace_header header;
+#ifdef LC3_ZSTD
+    ZSTD_CCtx* zstd;
+    unsigned char* packed;
+    size_t packed_size;
+#endif
+};
+
+// n bytes of the stream to the file, last at the very end (with n 0) to finish off the compressed stream
+static int write_stream(struct trace_writer* w, const unsigned char* data, size_t n, int last){
+#ifdef LC3_ZSTD
+    if (w->zstd){
+        ZSTD_inBuffer in = { data, n, 0 };
+        for (;;){
+            ZSTD_outBuffer out = { w->packed, w->packed_size, 0 };
+            size_t left = ZSTD_compressStream2(w->zstd, &out, &in, last ? ZSTD_e_end : ZSTD_e_continue);
+            if (ZSTD_isError(left) || fwrite(w->packed, 1, out.pos, w->file) != out.pos){
+                return 0;
+            }
+            if (last ? left == 0 : in.pos == in.size){
+                return 1;
+            }
+        }
+    }
+#endif
+    (void)last;
+    return !n || fwrite(data, 1, n, w->file) == n;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI writer_main(LPVOID arg)
+#else
+static void* writer_main(void* arg)
+#endif
+{
+    vm_trace* t = arg;
+    struct trace_writer* w = t->writer;
+    uint64_t from = 0;
+    for (;;){
+        int done = atomic_load_explicit(&w->done, memory_order_acquire);
+        uint64_t to = atomic_load_explicit(&w->published, memory_order_acquire);
+        if (to == from){
+            if (done){
+                break;
+            }
+            nap();
+            continue;
+        }
+        size_t at = from & (TRACE_RING - 1);
+        size_t n = to - from;
+        size_t first = n < TRACE_RING - at ? n : TRACE_RING - at;
+        if (!w->failed){  // after a failed write it keeps taking bytes, so the engines never wait for it
+            w->failed = !write_stream(w, t->ring + at, first, 0) || !write_stream(w, t->ring, n - first, 0);
+        }
+        from = to;
+        atomic_store_explicit(&w->taken, to, memory_order_release);
+    }
+    if (!w->failed){
+        w->failed = !write_stream(w, NULL, 0, 1);
+    }
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+// head got to the end of a chunk: hand it to the writer and make sure the next one fits in the ring
+void trace_chunk(vm_trace* t){
+
+    struct trace_writer* w = t->writer;
+    t->bits = 0;  // the next branch starts a new byte, the reader does the same
+    atomic_store_explicit(&w->published, t->head, memory_order_release);
+    t->limit = t->head + TRACE_CHUNK;
+    while (t->limit + TRACE_MAX_RECORD - atomic_load_explicit(&w->taken, memory_order_acquire) > TRACE_RING){
+        nap();
+    }
+}
+
+void trace_input(vm_trace* t, uint16_t value){
+    trace_put(t, value);
+}
+
+static void free_trace(vm_trace* t){
+#ifdef LC3_ZSTD
+    ZSTD_freeCCtx(t->writer->zstd);
+    free(t->writer->packed);
+#endif
+    free(t->writer);
+    free(t->ring);
+    free(t);
+}
+
+/*
+starts writing a trace of vm to path, from the state it is in now. images are the images vm was loaded from, in
+order, the replay loads them again. Returns 0 if the file cannot be written or there is no memory for the ring
+*/
+int vm_trace_start(VM* vm, const char* path, const char* const* images, int image_count){
+
+    vm_trace* t = calloc(1, sizeof(vm_trace));
+    struct trace_writer* w = calloc(1, sizeof(struct trace_writer));
+    unsigned char* ring = malloc(TRACE_RING);
+    if (!t || !w || !ring){
+        free(t);
+        free(w);
+        free(ring);
+        return 0;
+    }
+    t->ring = ring;
+    t->writer = w;
+
+    trace_header* h = &w->header;
+    memcpy(h->magic, trace_magic, 4);
+    h->byte_order = TRACE_BYTE_ORDER;
+    h->version = TRACE_VERSION;
+    for (int r = 0; r < R_COUNT; r++){
+        h->reg[r] = reg_read(vm, r);
+    }
+    h->image_count = (uint16_t)image_count;
+    h->steps = TRACE_NO_STEPS;
+    h->memory_hash = vm_memory_hash(vm);
+#ifdef LC3_ZSTD
+    w->zstd = ZSTD_createCCtx();
+    w->packed_size = ZSTD_CStreamOutSize();
+    w->packed = malloc(w->packed_size);
+    if (!w->zstd || !w->packed){
+        free_trace(t);
+        return 0;
+    }
+    ZSTD_CCtx_setParameter(w->zstd, ZSTD_c_compressionLevel, 3);
+    h->flags = TRACE_ZSTD;
+#endif
+
+    w->file = fopen(path, "wb");
+    int ok = w->file && fwrite(h, sizeof(*h), 1, w->file) == 1;
+    for (int i = 0; ok && i < image_count; i++){
+        size_t len = strlen(images[i]);
+        uint16_t len16 = (uint16_t)len;
+        ok = len <= 0xFFFF && fwrite(&len16, 2, 1, w->file) == 1 && fwrite(images[i], 1, len, w->file) == len;
+        if (ok && len % 2){
+            ok = fputc(0, w->file) != EOF;
+        }
+    }
+#ifdef _WIN32
+    ok = ok && (w->thread = CreateThread(NULL, 0, writer_main, t, 0, NULL)) != NULL;
+#else
+    ok = ok && pthread_create(&w->thread, NULL, writer_main, t) == 0;
+#endif
+    if (!ok){
+        if (w->file){
+            fclose(w->file);
+        }
+        free_trace(t);
+        return 0;
+    }
+    vm->trace = t;
+    return 1;
+}
+
+/*
+finishes the trace and closes the file. With complete set the results of the last instruction are written down
+too, vm has to be between vm_run()s for that (not inside one, like a signal handler that stops the program is).
+Returns 0 if any of it could not be written
+*/
+int vm_trace_stop(VM* vm, int complete){
+
+    vm_trace* t = vm->trace;
+    if (!t){
+        return 1;
+    }
+    vm->trace = NULL;
+    struct trace_writer* w = t->writer;
+    if (complete){
+        trace_results(t, vm->reg, vm->reg[R_PC]);
+    }
+    w->header.steps = complete || !t->count ? t->count : t->count - 1;  // the one that was running has no results yet
+
+    atomic_store_explicit(&w->published, t->head, memory_order_release);
+    atomic_store_explicit(&w->done, 1, memory_order_release);
+#ifdef _WIN32
+    WaitForSingleObject(w->thread, INFINITE);
+    CloseHandle(w->thread);
+#else
+    pthread_join(w->thread, NULL);
+#endif
+    int ok = !w->failed;
+
+    // the number of instructions goes into the header now that it is known, a pipe is left with TRACE_NO_STEPS
+    if (ok && fseek(w->file, offsetof(trace_header, steps), SEEK_SET) == 0){
+        ok = fwrite(&w->header.steps, sizeof(w->header.steps), 1, w->file) == 1;
+    }
+    ok = fclose(w->file) == 0 && ok;
+    free_trace(t);
+    return ok;
+}
+
+// reading---------------------------------------------------------------------------------
+
+struct trace_reader {
+    FILE* file;
+    trace_header header;
+    unsigned char buf[1 << 16];     // the stream, uncompressed
+    size_t pos, len;
+    uint64_t offset;                // bytes of the stream read so far
+    int ended;                      // something wanted a byte past the end
+    uint64_t limit;                 // where the current chunk ends, see trace_chunk()
+    int bits;                       // like vm_trace
+    unsigned char bits_byte;
+#ifdef LC3_ZSTD
+    ZSTD_DCtx* zstd;
+    unsigned char packed[1 << 16];
+    ZSTD_inBuffer in;
+#endif
+};
+
+static int reader_fill(struct trace_reader* r){
+    r->pos = 0;
+#ifdef LC3_ZSTD
+    if (r->zstd){
+        for (;;){
+            ZSTD_outBuffer out = { r->buf, sizeof(r->buf), 0 };
+            if (ZSTD_isError(ZSTD_decompressStream(r->zstd, &out, &r->in))){
+                return 0;
+            }
+            if (out.pos){
+                r->len = out.pos;
+                return 1;
+            }
+            if (r->in.pos == r->in.size){
+                r->in.size = fread(r->packed, 1, sizeof(r->packed), r->file);
+                r->in.pos = 0;
+                if (!r->in.size){
+                    return 0;
+                }
+            }
+        }
+    }
+#endif
+    r->len = fread(r->buf, 1, sizeof(r->buf), r->file);
+    return r->len > 0;
+}
+
+static unsigned reader_byte(struct trace_reader* r){
+    if (r->pos == r->len && !reader_fill(r)){
+        r->ended = 1;
+        return 0;
+    }
+    r->offset++;
+    return r->buf[r->pos++];
+}
+
+static uint16_t reader_varint(struct trace_reader* r){
+    unsigned v = 0;
+    for (int shift = 0; shift < 21; shift += 7){
+        unsigned b = reader_byte(r);
+        v |= (b & 0x7F) << shift;
+        if (!(b & 0x80)){
+            break;
+        }
+    }
+    return (uint16_t)v;
+}
+
+// undoes trace_zigzag()
+static uint16_t reader_delta(struct trace_reader* r){
+    uint16_t z = reader_varint(r);
+    return (uint16_t)((z >> 1) ^ (0 - (z & 1)));
+}
+
+static void free_reader(struct trace_reader* r){
+    if (r->file){
+        fclose(r->file);
+    }
+#ifdef LC3_ZSTD
+    ZSTD_freeDCtx(r->zstd);
+#endif
+    free(r);
+}
+
+// opens path and reads the header, the image paths go to images (malloc'd, the caller frees them). NULL if path is
+// not a trace, or one this build cannot read
+static struct trace_reader* open_reader(const char* path, char*** images){
+
+    struct trace_reader* r = calloc(1, sizeof(struct trace_reader));
+    if (!r){
+        printf("out of memory\n");
+        exit(1);
+    }
+    trace_header* h = &r->header;
+    r->file = fopen(path, "rb");
+    int ok = r->file && fread(h, sizeof(*h), 1, r->file) == 1 && memcmp(h->magic, trace_magic, 4) == 0 &&
+        h->byte_order == TRACE_BYTE_ORDER && h->version == TRACE_VERSION;
+#ifdef LC3_ZSTD
+    if (ok && (h->flags & TRACE_ZSTD)){
+        r->zstd = ZSTD_createDCtx();
+        r->in.src = r->packed;
+        ok = r->zstd != NULL;
+    }
+#else
+    ok = ok && !(h->flags & TRACE_ZSTD);  // compressed, this build has no zstd
+#endif
+    char** names = ok ? calloc(h->image_count ? h->image_count : 1, sizeof(char*)) : NULL;
+    for (int i = 0; ok && i < h->image_count; i++){
+        uint16_t len;
+        ok = fread(&len, 2, 1, r->file) == 1 && (names[i] = malloc((size_t)len + 2)) != NULL &&
+            fread(names[i], 1, len + (len & 1), r->file) == (size_t)(len + (len & 1));
+        if (ok){
+            names[i][len] = 0;
+        }
+    }
+    if (!ok){
+        for (int i = 0; names && i < h->image_count; i++){
+            free(names[i]);
+        }
+        free(names);
+        free_reader(r);
+        return NULL;
+    }
+    *images = names;
+    return r;
+}
+
+/*
+the image paths a trace names, in a malloc'd array of malloc'd strings (the caller frees them). Returns the number
+of images, -1 if path is not a trace
+*/
+int vm_trace_images(const char* path, char*** images){
+
+    struct trace_reader* r = open_reader(path, images);
+    if (!r){
+        return -1;
+    }
+    int count = r->header.image_count;
+    free_reader(r);
+    return count;
+}
+
+// replaying---------------------------------------------------------------------------------
+
+// io_replay's input is the trace's, in exactly the order the program read it the first time
+static int replay_open(VM* vm)
+{
+    (void)vm;
+    return 1;
+}
+
+static void replay_close(VM* vm)
+{
+    (void)vm;
+}
+
+static int replay_key_ready(VM* vm)
+{
+    return reader_varint(vm->replay) != 0;
+}
+
+static int replay_read_char(VM* vm)
+{
+    uint16_t c = reader_varint(vm->replay);
+    return c == 0xFFFF ? EOF : c;
+}
+
+static void replay_write(VM* vm, const char* s, size_t n)
+{
+    (void)vm;
+    fwrite(s, 1, n, stdout);
+    fflush(stdout);
+}
+
+static const io_backend io_replay = { "replay", replay_open, replay_close, replay_key_ready, replay_read_char, replay_write };
+
+/*
+reads the results of the instruction at from (kind, reg, old and next as trace_step() had them) and compares them
+with what the replay did, the registers and PC now. Describes the first difference to report and returns 0 if there
+is one
+*/
+static int check_results(struct trace_reader* r, VM* vm, uint8_t kind, uint8_t reg, uint16_t old, uint16_t next,
+    uint16_t from, uint64_t n, FILE* report){
+
+    if (r->offset >= r->limit){
+        r->limit = r->offset + TRACE_CHUNK;
+        r->bits = 0;
+    }
+    uint16_t pc = vm->reg[R_PC];
+    switch (kind){
+        case TRACE_REG:
+        {
+            uint16_t traced = old + reader_delta(r);
+            if (!r->ended && vm->reg[reg] != traced){
+                fprintf(report, "replay: instruction %llu (x%04X) left R%d = x%04X, the trace has x%04X\n",
+                    (unsigned long long)n, from, reg, vm->reg[reg], traced);
+                return 0;
+            }
+        }
+            break;
+        case TRACE_JUMP:
+        {
+            uint16_t traced = next + reader_delta(r);
+            if (!r->ended && pc != traced){
+                fprintf(report, "replay: instruction %llu (x%04X) went to x%04X, the trace has x%04X\n",
+                    (unsigned long long)n, from, pc, traced);
+                return 0;
+            }
+        }
+            break;
+        case TRACE_BRANCH:
+        {
+            if (!r->bits){
+                r->bits_byte = (unsigned char)reader_byte(r);
+            }
+            int taken = (r->bits_byte >> r->bits) & 1;
+            r->bits = (r->bits + 1) & 7;
+            if (!r->ended && taken != (pc != next)){
+                fprintf(report, "replay: the branch at instruction %llu (x%04X) was %s, in the trace it was %s\n",
+                    (unsigned long long)n, from, taken ? "not taken" : "taken", taken ? "taken" : "not taken");
+                return 0;
+            }
+        }
+            break;
+    }
+    if (r->ended){
+        fprintf(report, "replay: the trace ends at instruction %llu (x%04X)\n", (unsigned long long)n, from);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+runs the program again the way the trace at path saw it run, checking every instruction's results against the
+trace, and writes how that went to report. vm has to hold what the trace's images load into and nothing else (that
+is checked against its hash), the program reads its input from the trace and prints to stdout. Returns 1 if it
+did everything the trace did, 0 if it did something else at some point, -1 if path is not a trace or the memory
+does not match
+*/
+int vm_replay(VM* vm, const char* path, FILE* report){
+
+    char** images;
+    struct trace_reader* r = open_reader(path, &images);
+    if (!r){
+        return -1;
+    }
+    for (int i = 0; i < r->header.image_count; i++){
+        free(images[i]);
+    }
+    free(images);
+    if (vm_memory_hash(vm) != r->header.memory_hash){
+        free_reader(r);
+        return -1;
+    }
+    for (int reg = 0; reg < R_COUNT; reg++){
+        reg_write(vm, reg, r->header.reg[reg]);
+    }
+    const io_backend* io = vm->io;
+    vm->io = &io_replay;
+    vm->replay = r;
+
+    uint64_t steps = r->header.steps;
+    uint8_t kind = TRACE_NONE, reg = 0;
+    uint16_t old = 0, next = 0, from = 0;
+    uint64_t n = 0;
+    int same = 1;
+    for (;;){
+        if (!check_results(r, vm, kind, reg, old, next, from, n, report)){
+            same = steps == TRACE_NO_STEPS && r->ended;  // a trace that was never closed just stops somewhere
+            break;
+        }
+        if (n == steps || vm->status == VM_HALTED){
+            break;
+        }
+        // the same as trace_step() noted down. Code in the device page is only known once it has been fetched
+        uint16_t pc = vm->reg[R_PC];
+        uint16_t before[8];
+        memcpy(before, vm->reg, sizeof(before));
+        decoded_instr d;
+        decode_instr(vm_peek(vm, pc), &d);
+        vm_run(vm, 1);
+        if (pc >= DEVICE_PAGE){
+            decode_instr(vm_peek(vm, pc), &d);
+        }
+        kind = trace_kind(d.op);
+        reg = d.r0 & 7;
+        old = before[reg];
+        next = pc + 1;
+        from = pc;
+        n++;
+        if (vm->status == VM_HALTED && steps != TRACE_NO_STEPS && n < steps){
+            fprintf(report, "replay: the program halted after %llu instructions, the trace has %llu\n",
+                (unsigned long long)n, (unsigned long long)steps);
+            same = 0;
+            break;
+        }
+    }
+    io_flush(vm);
+    if (same){
+        fprintf(report, "replay: %llu instructions, all the same as the trace\n", (unsigned long long)n);
+    }
+    vm->io = io;
+    vm->replay = NULL;
+    free_reader(r);
+    return same;
+}
@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lc3_vm.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+/*
+Host traps. LC-3 has no multiply, divide or block move, so programs do them in loops of their own: a 16 bit MUL by
+shifting and adding is a hundred instructions or more, and copying a buffer is four instructions a word. The traps
+here do them in C with one dispatch each. vm_add_host_traps() (--host-traps) puts them in the VM's trap table at
+vectors the standard traps do not use, and an embedder can put handlers of their own next to them with
+vm_set_trap() (see lc3_vm.h):
+
+    TRAP x30    MUL     R0 = R0 * R1, the low 16 bits
+    TRAP x31    DIV     R0 = R0 / R1 and R1 = R0 % R1, signed and rounded towards zero like C. Dividing by zero
+                        gives R0 = 0 and leaves the dividend in R1
+    TRAP x32    MEMCPY  copies R2 words from the address in R1 to the one in R0, the right way round if they overlap
+    TRAP x33    MEMSET  sets R2 words from the address in R0 on to R1
+    TRAP x34    READ    reads up to R1 characters of input into the words from R0 on, one per word, stopping after a
+                        newline. It waits for the first one like GETC does and then takes what is already there,
+                        R0 = how many it read (0 at the end of the input)
+    TRAP x35    WRITE   writes R1 characters from the words from R0 on, like PUTS without the zero word
+    TRAP x36    CLOCK   R1:R0 = a millisecond clock, or in virtual time (io_virtual) the instructions executed
+    TRAP x37    SWAP    R0 = the word at the address in R1, and that word = the old R0, in one atomic step. The cores of
+                        --cores share memory (see lc3_cores.c), and this is how they take a lock: SWAP a 1 in, and if
+                        R0 comes back 0 the lock is theirs. It is a full barrier both ways, which the plain loads and
+                        stores between cores are not, so a lock is released with a SWAP of 0 as well
+
+All of them leave the condition codes set by R0, and addresses wrap around past xFFFF. They read memory without the
+side effects of mem_read(), like PUTS, and write it through mem_write() so code they overwrite gets decoded again.
+Reading and writing files goes through the VM's input and output, whatever those are connected to, the VM does not
+give a program a way to open files of the host. The assembler has no names for them, MUL and READ are labels in
+plenty of programs, so they are written TRAP x30 and so on.
+
+The journal cannot undo the ones that write memory, running one empties it (see lc3_journal.c). A trace does not
+replay past a CLOCK, the replay reads the clock again and gets a different time (even in virtual time, a replay
+runs on the trace's input and not on io_virtual).
+*/
+
+// the journal cannot put back what a trap writes, it lets go of everything before it
+static void memory_written(VM* vm){
+
+    if (vm->journal){
+        vm_journal_clear(vm);
+    }
+}
+
+static int trap_mul(VM* vm){
+
+    vm->reg[R_R0] = (uint16_t)(vm->reg[R_R0] * vm->reg[R_R1]);
+    vm->cond_value = vm->reg[R_R0];
+    return 1;
+}
+
+static int trap_div(VM* vm){
+
+    int32_t dividend = (int16_t)vm->reg[R_R0];
+    int32_t divisor = (int16_t)vm->reg[R_R1];
+    if (divisor){
+        vm->reg[R_R0] = (uint16_t)(dividend / divisor);  // x8000 / -1 comes out as x8000, like it would in 16 bits
+        vm->reg[R_R1] = (uint16_t)(dividend % divisor);
+    } else {
+        vm->reg[R_R0] = 0;
+        vm->reg[R_R1] = (uint16_t)dividend;
+    }
+    vm->cond_value = vm->reg[R_R0];
+    return 1;
+}
+
+static int trap_memcpy(VM* vm){
+
+    uint16_t to = vm->reg[R_R0], from = vm->reg[R_R1], count = vm->reg[R_R2];
+    if ((uint16_t)(to - from) < count){
+        // the destination starts inside the source, the end has to go first
+        for (uint16_t i = count; i--; ){
+            mem_write(vm, (uint16_t)(to + i), vm_peek(vm, (uint16_t)(from + i)));
+        }
+    } else {
+        for (uint16_t i = 0; i < count; i++){
+            mem_write(vm, (uint16_t)(to + i), vm_peek(vm, (uint16_t)(from + i)));
+        }
+    }
+    memory_written(vm);
+    vm->cond_value = vm->reg[R_R0];
+    return 1;
+}
+
+static int trap_memset(VM* vm){
+
+    uint16_t to = vm->reg[R_R0], value = vm->reg[R_R1], count = vm->reg[R_R2];
+    for (uint16_t i = 0; i < count; i++){
+        mem_write(vm, (uint16_t)(to + i), value);
+    }
+    memory_written(vm);
+    vm->cond_value = vm->reg[R_R0];
+    return 1;
+}
+
+// execute_trap() knows this one, with vm->in_can_wait it stops the VM instead of waiting for the first character
+int host_trap_read(VM* vm){
+
+    uint16_t to = vm->reg[R_R0], count = 0;
+    while (count < vm->reg[R_R1] && (count == 0 || check_key(vm))){
+        uint16_t c = io_getchar(vm);
+        if (c == (uint16_t)EOF){
+            break;
+        }
+        mem_write(vm, (uint16_t)(to + count++), c);
+        if (c == '\n'){
+            break;
+        }
+    }
+    memory_written(vm);
+    vm->reg[R_R0] = count;
+    vm->cond_value = vm->reg[R_R0];
+    return 1;
+}
+
+static int trap_write(VM* vm){
+
+    io_write_words(vm, vm->reg[R_R0], vm->reg[R_R1]);
+    io_output_done(vm);
+    vm->cond_value = vm->reg[R_R0];
+    return 1;
+}
+
+static int trap_clock(VM* vm){
+
+    uint64_t now = io_clock(vm);
+    vm->reg[R_R0] = (uint16_t)now;
+    vm->reg[R_R1] = (uint16_t)(now >> 16);
+    vm->cond_value = vm->reg[R_R0];
+    return 1;
+}
+
+// TRAP_SWAP. The exchange is one host instruction on the word in the page, another core swapping the same word
+// comes before or after it and never in between. The rest is what mem_write() does after a store
+int host_trap_swap(VM* vm){
+
+    uint16_t address = vm->reg[R_R1];
+    uint16_t val = vm->reg[R_R0];
+    int page = address >> PAGE_SHIFT;
+    analysis_written(vm, address);
+    vm_page* p = vm->page_owned[page] ? vm->pages[page] : vm_own_page(vm, page);
+    uint16_t* word = &p->words[address & (PAGE_WORDS - 1)];
+#ifdef _MSC_VER
+    vm->reg[R_R0] = (uint16_t)_InterlockedExchange16((volatile short*)word, (short)val);
+#else
+    vm->reg[R_R0] = __atomic_exchange_n(word, val, __ATOMIC_SEQ_CST);
+#endif
+    vm->page_dirty[page] = 1;
+    p->decoded[address & (PAGE_WORDS - 1)].op = OP_DECODE;
+    if (vm->jit && vm->jit_code_map[address]){
+        jit_invalidate(vm, address);
+    }
+    if (address == MR_BLOCK_CONTROL && vm->block){
+        block_control(vm, val);  // a command swapped in starts the transfer like a stored one
+    }
+    memory_written(vm);
+    vm->cond_value = vm->reg[R_R0];
+    return 1;
+}
+
+// puts the host traps into vm's trap table, returns 0 if there is no memory for it
+int vm_add_host_traps(VM* vm){
+
+    return vm_set_trap(vm, TRAP_MUL, trap_mul) &&
+        vm_set_trap(vm, TRAP_DIV, trap_div) &&
+        vm_set_trap(vm, TRAP_MEMCPY, trap_memcpy) &&
+        vm_set_trap(vm, TRAP_MEMSET, trap_memset) &&
+        vm_set_trap(vm, TRAP_READ, host_trap_read) &&
+        vm_set_trap(vm, TRAP_WRITE, trap_write) &&
+        vm_set_trap(vm, TRAP_CLOCK, trap_clock) &&
+        vm_set_trap(vm, TRAP_SWAP, host_trap_swap);
+}
@@ -1,198 +1,883 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <signal.h>
-/* windows only */
-#include <Windows.h>
-#include <conio.h>  // _kbhit
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
+#include "lc3_vm.h"
 
-#define MAX_MEMORY (1 << 16)  // this shifts the 1 to the left by 16 places
-uint16_t memory[MAX_MEMORY];  // memory is stored in a an array with 65536 (2^16) locations, where each location can store 16 bits
+void update_flags(VM* vm, uint16_t r);
 
-//registers----------------------------------------------------------------------------------
+// command line---------------------------------------------------------------------------------
 
-enum {
+// built with -DLC3_NO_MAIN this is left out, for the shared library the debugger loads (see lc3_lib.c)
+#ifndef LC3_NO_MAIN
 
-    R_R0 = 0,
-    R_R1,
-    R_R2,
-    R_R3,
-    R_R4,
-    R_R5,
-    R_R6,
-    R_R7,
-    R_PC,
-    R_COND,
-    R_COUNT
-};
+static VM* main_vm;  // the VM main() runs, so handle_interrupt() can put the terminal back and write out its output
+static const char* profile_path;  // --profile=FILE, NULL for stderr
 
-uint16_t reg[R_COUNT];  // creating an array called reg, that has 11 locations, each able to store 16 bits of data
-
-// instruction set----------------------------------------------------------------------------------
-
-enum {
-
-    BR = 0, /* branch */
-    ADD,    /* add  */
-    LD,     /* load */
-    ST,     /* store */
-    JSR,    /* jump register */
-    AND,    /* bitwise and */
-    LDR,    /* load register */
-    STR,    /* store register */
-    RTI,    /* unused */
-    NOT,    /* bitwise not */
-    LDI,    /* load indirect */
-    STI,    /* store indirect */
-    JMP,    /* jump */
-    RES,    /* reserved (unused) */
-    LEA,    /* load effective address */
-    TRAP    /* execute trap */
+// the --profile report, written when the program halts or gets interrupted
+static void write_profile(VM* vm)
+{
+    if (!vm->profile){
+        return;
+    }
+    FILE* out = profile_path ? fopen(profile_path, "w") : stderr;
+    if (!out){
+        printf("failed to write profile: %s\n", profile_path);
+        return;
+    }
+    vm_profile_report(vm, out);
+    if (out != stderr){
+        fclose(out);
+    }
+}
 
-};
 
-//condition flags----------------------------------------------------------------------------------
+void handle_interrupt(int signal)
+{
+    restore_input_buffering(main_vm);  // this also writes out whatever output is still buffered
+    printf("\n");
+    write_profile(main_vm);
+    vm_trace_stop(main_vm, 0);  // the instruction it was in the middle of is left out
+    exit(-2);
+}
 
-enum {
-    //represent individual bits in a bit field, allowing the use of bitwise operations to store and check multiple flags efficiently in a single integer
 
-    FL_POS = 1,  // 0001
-    FL_ZERO = 2, // 0010
-    FL_NEG = 4   // 0100
+static volatile sig_atomic_t snapshot_requested;  // set by SIGUSR1, main() writes a snapshot at the next chance
 
-    //this way we can easily
-    /*
-    
-    Set a flag: flags |= FL_POS;
+static void request_snapshot(int signal)
+{
+    (void)signal;
+    snapshot_requested = 1;
+}
 
-    Clear a flag: flags &= ~FL_POS;
+/*
+vm_run() for main() when it writes snapshots. The program runs in slices of a million instructions, so a SIGUSR1
+gets its snapshot within a millisecond or so, and when PC first reaches vm->stop_at it gets one there and carries on.
+A program that --steps stops before it halts gets one too, so --restore can carry on with it later
+*/
+static int run_with_snapshots(VM* vm, uint64_t max_steps, const char* path, const char* const* images, int image_count){
+
+    enum { SLICE = 1 << 20 };
+    uint64_t end = max_steps ? vm->steps + max_steps : UINT64_MAX;
+    for (;;){
+        int status = vm_run(vm, end - vm->steps < SLICE ? end - vm->steps : SLICE);
+        if (status == VM_STOPPED){
+            vm->stop_at = VM_NO_STOP;
+        }
+        int out_of_steps = status != VM_HALTED && vm->steps == end;
+        if (status == VM_STOPPED || snapshot_requested || out_of_steps){
+            snapshot_requested = 0;
+            if (!vm_save_snapshot(vm, path, images, image_count)){
+                printf("failed to write snapshot: %s\n", path);
+            }
+        }
+        if (status == VM_HALTED || out_of_steps){
+            return status;
+        }
+    }
+}
 
-    Check a flag: if (flags & FL_POS) {...}
+int main(int argc, const char*argv[]){
 
-    */
+    // (load arguments)
+    VM* vm = vm_create();
+    if (!vm){
+        printf("out of memory\n");
+        exit(1);
+    }
+    main_vm = vm;
+    int flush_ms = -1;  // not given, depends on the io backend
+    int batch_threads = -1;  // not a batch run
+    const char* job_list = NULL;
+    uint64_t max_steps = 0;
+    const char* snapshot_path = NULL;
+    const char* restore_path = NULL;
+    const char* trace_path = NULL;
+    const char* replay_path = NULL;
+    const char* events_path = NULL;
+    int stats = 0;
+    int host_traps = 0;
+    uint32_t snapshot_at = VM_NO_STOP;
+    uint64_t fuzz_cases = 0;  // not a fuzzing run
+    uint32_t fuzz_seed = 1;
+    int fuzz_threads = 0;
+    const char* serve_address = NULL;  // not a server
+    int serve_threads = 0;
+    const char* aot_path = NULL;  // run the program, not translate it
+    int interrupts = 0;
+    int cores = 0;  // one core, the ordinary machine
+    const char* block_path = NULL;
+    const char** images = malloc(sizeof(char*) * (argc > 1 ? argc : 1));
+    int image_count = 0;
+    vm->io = io_default_backend();
 
-    /*
-    this is a more standard way of writing it
+    for (int i = 1; i < argc; i++){
+        if (strncmp(argv[i], "--engine=", 9) == 0){
+            const char* name = argv[i] + 9;
+            if (strcmp(name, "switch") == 0){
+                vm->engine = ENGINE_SWITCH;
+            } else if (strcmp(name, "threaded") == 0){
+                vm->engine = ENGINE_THREADED;
+            } else if (strcmp(name, "jit") == 0){
+                vm->engine = ENGINE_JIT;
+            } else {
+                printf("unknown engine: %s (expected switch, threaded or jit)\n", name);
+                exit(2);
+            }
+            continue;
+        }
+        if (strncmp(argv[i], "--io=", 5) == 0){
+            vm->io = io_backend_named(argv[i] + 5);
+            if (!vm->io){
+                printf("unknown io backend: %s (expected console or headless)\n", argv[i] + 5);
+                exit(2);
+            }
+            continue;
+        }
+        if (strncmp(argv[i], "--flush-ms=", 11) == 0){
+            flush_ms = atoi(argv[i] + 11);
+            continue;
+        }
+        if (strcmp(argv[i], "--puts-write") == 0){
+            vm->out_puts_write = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--batch") == 0 || strncmp(argv[i], "--batch=", 8) == 0){
+            batch_threads = argv[i][7] == '=' ? atoi(argv[i] + 8) : 0;  // 0 picks one thread per CPU
+            continue;
+        }
+        if (strncmp(argv[i], "--jobs=", 7) == 0){
+            job_list = argv[i] + 7;
+            if (batch_threads < 0){
+                batch_threads = 0;
+            }
+            continue;
+        }
+        if (strcmp(argv[i], "--fuzz") == 0 || strncmp(argv[i], "--fuzz=", 7) == 0){
+            fuzz_cases = argv[i][6] == '=' ? strtoull(argv[i] + 7, NULL, 10) : 100000;
+            continue;
+        }
+        if (strncmp(argv[i], "--fuzz-seed=", 12) == 0){
+            fuzz_seed = (uint32_t)strtoul(argv[i] + 12, NULL, 10);
+            continue;
+        }
+        if (strncmp(argv[i], "--fuzz-threads=", 15) == 0){
+            fuzz_threads = atoi(argv[i] + 15);  // 0 picks one thread per CPU
+            continue;
+        }
+        if (strncmp(argv[i], "--serve=", 8) == 0){
+            serve_address = argv[i] + 8;
+            continue;
+        }
+        if (strncmp(argv[i], "--serve-threads=", 16) == 0){
+            serve_threads = atoi(argv[i] + 16);  // 0 picks one thread per CPU
+            continue;
+        }
+        if (strncmp(argv[i], "--aot=", 6) == 0){
+            aot_path = argv[i] + 6;
+            continue;
+        }
+        if (strcmp(argv[i], "--interrupts") == 0){
+            interrupts = 1;
+            continue;
+        }
+        if (strncmp(argv[i], "--cores=", 8) == 0){
+            cores = atoi(argv[i] + 8);
+            if (cores < 1 || cores > 256){
+                printf("--cores takes 1 to 256 cores\n");
+                exit(2);
+            }
+            interrupts = 1;  // every core has the whole ISA, see lc3_cores.c
+            continue;
+        }
+        if (strncmp(argv[i], "--block=", 8) == 0){
+            block_path = argv[i] + 8;
+            continue;
+        }
+        if (strncmp(argv[i], "--steps=", 8) == 0){
+            max_steps = strtoull(argv[i] + 8, NULL, 10);
+            continue;
+        }
+        if (strncmp(argv[i], "--snapshot=", 11) == 0){
+            snapshot_path = argv[i] + 11;
+            continue;
+        }
+        if (strncmp(argv[i], "--snapshot-at=", 14) == 0){
+            snapshot_at = (uint32_t)strtoul(argv[i] + 14, NULL, 16) & 0xFFFF;  // hex, with or without 0x
+            continue;
+        }
+        if (strcmp(argv[i], "--profile") == 0 || strncmp(argv[i], "--profile=", 10) == 0){
+            if (!vm_profile_start(vm)){
+                printf("out of memory\n");
+                exit(1);
+            }
+            profile_path = argv[i][9] == '=' ? argv[i] + 10 : NULL;
+            continue;
+        }
+        if (strncmp(argv[i], "--metrics=", 10) == 0){
+            // the counters on http://127.0.0.1:PORT/, for this VM and every one made from here on (see lc3_metrics.c)
+            if (!metrics_serve(atoi(argv[i] + 10)) || !vm_metrics_start(vm)){
+                printf("cannot serve metrics on port %s\n", argv[i] + 10);
+                exit(1);
+            }
+            continue;
+        }
+        if (strcmp(argv[i], "--host-traps") == 0){
+            if (!vm_add_host_traps(vm)){
+                printf("out of memory\n");
+                exit(1);
+            }
+            host_traps = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--stats") == 0){
+            stats = 1;
+            continue;
+        }
+        if (strncmp(argv[i], "--restore=", 10) == 0){
+            restore_path = argv[i] + 10;
+            continue;
+        }
+        if (strncmp(argv[i], "--events=", 9) == 0){
+            events_path = argv[i] + 9;
+            continue;
+        }
+        if (strncmp(argv[i], "--trace=", 8) == 0){
+            trace_path = argv[i] + 8;
+            continue;
+        }
+        if (strncmp(argv[i], "--replay=", 9) == 0){
+            replay_path = argv[i] + 9;
+            continue;
+        }
+        images[image_count++] = argv[i];
+    }
 
-    FL_POS = 1 << 0, 
-    FL_ZERO = 1 << 1, 
-    FL_NEG = 1 << 2, 
-    
-    */
+    if (restore_path && image_count == 0 && batch_threads < 0){
+        // the images the snapshot was taken against, unless the command line names them
+        char** named;
+        image_count = vm_snapshot_images(restore_path, &named);
+        if (image_count < 0){
+            printf("failed to restore snapshot: %s\n", restore_path);
+            exit(1);
+        }
+        free(images);
+        images = (const char**)named;
+    }
+    if (replay_path && image_count == 0){
+        // the same for the images a trace was recorded with
+        char** named;
+        image_count = vm_trace_images(replay_path, &named);
+        if (image_count < 0){
+            printf("not a trace: %s (or a compressed one, and this VM was built without -DLC3_ZSTD)\n", replay_path);
+            exit(1);
+        }
+        free(images);
+        images = (const char**)named;
+    }
+    if (events_path && !vm_load_input_events(vm, events_path)){
+        // the input in virtual time instead of from stdin, see io_virtual
+        printf("failed to read input events: %s (one \"instruction-count text\" per line)\n", events_path);
+        exit(1);
+    }
+    if ((trace_path || replay_path) && (restore_path || batch_threads >= 0)){
+        printf("--trace and --replay start from the images, they do not go with --restore or --batch\n");
+        exit(2);
+    }
+    if (serve_address && (trace_path || replay_path || snapshot_path || batch_threads >= 0)){
+        printf("--serve does not go with --trace, --replay, --snapshot or --batch\n");
+        exit(2);
+    }
+    if (aot_path && (trace_path || replay_path || snapshot_path || restore_path || batch_threads >= 0 || serve_address)){
+        printf("--aot translates the images, it does not go with --trace, --replay, --snapshot, --restore, --batch or --serve\n");
+        exit(2);
+    }
 
-};
+    if (interrupts && (trace_path || replay_path || snapshot_path || restore_path || vm->profile || batch_threads >= 0 ||
+                       serve_address || aot_path)){
+        printf("--interrupts and --cores do not go with --trace, --replay, --snapshot, --restore, --profile, --batch, --serve or --aot\n");
+        exit(2);
+    }
+    if (block_path && (trace_path || replay_path || batch_threads >= 0 || serve_address || aot_path)){
+        printf("--block does not go with --trace, --replay, --batch, --serve or --aot\n");
+        exit(2);
+    }
+    if (cores && events_path){
+        printf("--cores runs in real time, it does not go with --events\n");
+        exit(2);
+    }
 
+    if (fuzz_cases){
+        // random programs on every engine at once, see lc3_fuzz.c
+        return fuzz_main(fuzz_cases, fuzz_seed, fuzz_threads, max_steps ? max_steps : 4096, snapshot_path);
+    }
 
-enum {
+    if (image_count == 0 && !job_list && !restore_path){
+        printf("enter in this format: lc3 [--engine=switch|threaded|jit] [--io=console|headless] [--flush-ms=N] [--puts-write] [--steps=N] [--profile[=FILE]] [--stats] [--events=FILE] [--host-traps] [--metrics=PORT] [--block=FILE] [image-file] ... \n");
+        printf("                  or: lc3 [--snapshot=FILE [--snapshot-at=ADDR]] [--restore=FILE] [options] [image-file] ... \n");
+        printf("                  or: lc3 --trace=FILE [options] [image-file] ... \n");
+        printf("                  or: lc3 --replay=FILE [--engine=...] [image-file] ... \n");
+        printf("                  or: lc3 --batch[=threads] [--jobs=job-list] [--engine=...] [--steps=N] [--metrics=PORT] [image-file] ... \n");
+        printf("                  or: lc3 --serve=[ADDR:]PORT [--serve-threads=N] [--engine=...] [--steps=N] [--host-traps] [image-file] ... \n");
+        printf("                  or: lc3 --aot=FILE.c [--host-traps] [image-file] ... \n");
+        printf("                  or: lc3 --interrupts [options] [image-file] ... \n");
+        printf("                  or: lc3 --cores=N [--engine=...] [--io=...] [--steps=N] [--stats] [--host-traps] [image-file] ... \n");
+        printf("                  or: lc3 --fuzz[=cases] [--fuzz-seed=N] [--fuzz-threads=N] [--steps=N] [--snapshot=FILE]\n");
+        exit(2);
+    }
 
-    // trap routines
+    if (batch_threads >= 0){
+        if (host_traps){
+            printf("--host-traps does not go with --batch, batch programs get the standard traps\n");
+            exit(2);
+        }
+        // every image is a program of its own, see lc3_batch.c
+        return batch_main(job_list, images, image_count, batch_threads, vm->engine, max_steps);
+    }
 
-    TRAP_GETC = 0x20,   // get character from keyboard, not echoed onto the terminal , 0b00100000
-    TRAP_OUT = 0x21,    // output a character  0b00100001
-    TRAP_PUTS = 0x22,   // output a word string     0b00100010
-    TRAP_IN = 0x23,     // get character from keyboard, echoed onto the terminal        0b00100011
-    TRAP_PUTSP = 0x24,  // output a byte program    0b00100100
-    TRAP_HALT = 0x25    // halt the program     0b00100101
+    for (int i = 0; i < image_count; i++){
+        if(!vm_load_image(vm, images[i])){
+            printf("failed to load image: %s\n", images[i]);
+            exit(1);
+        }
+    }
 
-};
+    if (aot_path){
+        // the program as C, for a binary of its own, see lc3_aot.c
+        return aot_translate(vm, aot_path, images, image_count);
+    }
+    if (block_path && !vm_block_open(vm, block_path)){
+        // the file behind the block device, see lc3_vm.h
+        printf("failed to open block file: %s\n", block_path);
+        exit(1);
+    }
+    if (interrupts){
+        vm_start_interrupts(vm);  // RTI, the PSR and the keyboard interrupt, see lc3_vm.h
+    }
+
+    if (snapshot_path){
+        // snapshots only store the pages that differ from the loaded images, so keep a copy of those to compare with
+        vm_template* boot = vm_template_create(vm);
+        if (!boot){
+            printf("out of memory\n");
+            exit(1);
+        }
+        vm_reset_to(vm, boot);
+        vm->stop_at = snapshot_at;
+    }
+    if (restore_path && !vm_restore_snapshot(vm, restore_path)){
+        printf("failed to restore snapshot: %s (not a snapshot, or its images have changed)\n", restore_path);
+        exit(1);
+    }
+    if (serve_address){
+        // a session of the program for every connection, see lc3_serve.c. They share the decoded instructions
+        if (vm->engine != ENGINE_SWITCH){
+            predecode_memory(vm);
+        }
+        return serve_main(vm, serve_address, serve_threads, max_steps, host_traps);
+    }
+
+    if (replay_path){
+        // the input comes out of the trace, the output goes to stdout as it did the first time
+        vm->out_flush_ms = flush_ms >= 0 ? flush_ms : 100;
+        int same = vm_replay(vm, replay_path, stderr);
+        if (same < 0){
+            printf("failed to replay: %s (not a trace, or its images have changed)\n", replay_path);
+            exit(1);
+        }
+        return same ? 0 : 4;  // 4: the program did something the trace did not
+    }
+    if (trace_path && !vm_trace_start(vm, trace_path, images, image_count)){
+        printf("failed to write trace: %s\n", trace_path);
+        exit(1);
+    }
 
-//memory mapped registers----------------------------------------------------------------------------------
+    // someone at a terminal sees every character as it is printed, a pipe gets the output in batches of up to 100ms
+    vm->out_flush_ms = flush_ms >= 0 ? flush_ms : (vm->io == &io_console ? 0 : 100);
 
-enum
-{
-    MR_KBSR = 0xFE00, // keyboard status
-    MR_KBDR = 0xFE02  // keyboard data 
-};
+    signal(SIGINT, handle_interrupt);
+#ifdef SIGUSR1
+    if (snapshot_path){
+        signal(SIGUSR1, request_snapshot);  // kill -USR1 <pid> writes a snapshot of where the program is now
+    }
+#endif
+    if (cores){
+        // the program on that many cores sharing its memory, see lc3_cores.c
+        return cores_main(vm, cores, max_steps, stats);
+    }
+    disable_input_buffering(vm);
+
+    int proved = 0, stores = 0;
+    if (vm->engine != ENGINE_SWITCH){
+        predecode_memory(vm);
+        if (!interrupts){  // no jump the analysis can follow goes to an interrupt handler
+            proved = vm_analyze(vm, &stores);  // the stores that never write code skip the check (see lc3_analysis.c)
+        }
+    }
+    uint64_t steps_before = vm->steps;  // a restored program has run some already
+    clock_t started = clock();
+    int status = snapshot_path ? run_with_snapshots(vm, max_steps, snapshot_path, images, image_count) : vm_run(vm, max_steps);
+    double seconds = (double)(clock() - started) / CLOCKS_PER_SEC;
+    restore_input_buffering(vm);
+    if (stats){
+        // for bench/bench.py: processor time of the run alone, loading the images and starting up not counted
+        uint64_t steps = vm->steps - steps_before;
+        fprintf(stderr, "%llu instructions in %.3f s, %.1f MIPS\n", (unsigned long long)steps, seconds,
+                seconds > 0 ? steps / seconds / 1e6 : 0.0);
+        if (proved >= 0 && stores){
+            fprintf(stderr, "%d of %d stores proved never to write code%s\n", proved, stores,
+                    vm->analysis ? "" : ", until the program wrote over code or went where the analysis did not see it go");
+        }
+    }
+    write_profile(vm);
+    if (!vm_trace_stop(vm, 1)){
+        printf("failed to write trace: %s\n", trace_path);
+    }
+    return status == VM_HALTED ? 0 : 3;  // 3: stopped by --steps before it halted
+}
 
+#endif
 
+// the machine---------------------------------------------------------------------------------
 
+static vm_page zero_page;  // memory nobody has written to, zero words decode to BR instructions that are never taken
 
+// a new machine with empty memory, PC at 0x3000 and the Z flag set, reading and writing through io_memory
+VM* vm_create(void){
 
-HANDLE hStdin = INVALID_HANDLE_VALUE;
-DWORD fdwMode, fdwOldMode;
+    return vm_create_from(NULL);
+}
 
-void disable_input_buffering()
-{
-    hStdin = GetStdHandle(STD_INPUT_HANDLE);
-    GetConsoleMode(hStdin, &fdwOldMode); /* save old mode */
-    // fdwMode = fdwOldMode;
-    // fdwMode &= ~(ENABLE_ECHO_INPUT | ENABLE_LINE_INPUT);
-    fdwMode = fdwOldMode
-            ^ ENABLE_ECHO_INPUT  /* no input echo */
-            ^ ENABLE_LINE_INPUT; /* return when one or
-                                    more characters are available */
-    SetConsoleMode(hStdin, fdwMode); /* set new mode */
-    FlushConsoleInputBuffer(hStdin); /* clear buffer */
-}
-
-void restore_input_buffering()
-{
-    SetConsoleMode(hStdin, fdwOldMode);
+// a new machine in the state t was in when it was made, or an empty one for NULL. t has to outlive the VM
+VM* vm_create_from(const vm_template* t){
+
+    VM* vm = calloc(1, sizeof(VM));
+    if (!vm){
+        return NULL;
+    }
+    vm->out_buf = malloc(OUT_BUF_SIZE);  // only the part the program prints into ever gets touched
+    if (!vm->out_buf){
+        free(vm);
+        return NULL;
+    }
+    vm->engine = ENGINE_THREADED;
+    vm->stop_at = VM_NO_STOP;
+    vm->io = &io_memory;
+    for (int page = 0; page < PAGE_COUNT; page++){
+        vm->pages[page] = &zero_page;
+    }
+    vm_reset_to(vm, t);
+    vm_metrics_start(vm);  // nothing unless the --metrics endpoint is up
+    return vm;
 }
 
-uint16_t check_key()
-{
-    return WaitForSingleObject(hStdin, 1000) == WAIT_OBJECT_0 && _kbhit();
+// the pages go on the spare list, so the next program on this VM does not have to go back to malloc for them
+static void free_own_pages(VM* vm){
+
+    for (int page = 0; page < PAGE_COUNT; page++){
+        if (vm->page_owned[page]){
+            vm->spare_pages[vm->spare_count++] = vm->pages[page];
+            vm->page_owned[page] = 0;
+        }
+        vm->pages[page] = &zero_page;
+    }
 }
 
+void vm_destroy(VM* vm){
 
+    if (!vm){
+        return;
+    }
+    jit_free(vm);
+    free(vm->profile);
+    vm_metrics_stop(vm);
+    vm_journal_stop(vm);
+    vm_trace_stop(vm, 1);
+    free(vm->breakpoints);
+    free(vm->watch_read);
+    free(vm->watch_write);
+    free(vm->traps);
+    vm_analysis_stop(vm);
+    free(vm->data_words);
+    vm_block_close(vm);
+    free_own_pages(vm);
+    while (vm->spare_count){
+        free(vm->spare_pages[--vm->spare_count]);
+    }
+    free(vm->in_owned);
+    free(vm->in_events);
+    free(vm->out_buf);
+    free(vm->output);
+    free(vm);
+}
 
-void handle_interrupt(int signal)
-{
-    restore_input_buffering();
-    printf("\n");
-    exit(-2);
+void vm_reset(VM* vm){
+
+    vm_reset_to(vm, vm->base);
 }
 
+// puts the machine back in the state t was made in (empty for NULL), keeping the engine, io backend, output
+// settings and JIT arena. Only the pages the VM wrote to have to be thrown away
+void vm_reset_to(VM* vm, const vm_template* t){
 
-int read_image(const char* image_path);
-uint16_t sign_extend(uint16_t x, int num_bits);
-void update_flags(uint16_t r);
-uint16_t mem_read(uint16_t address);
-void mem_write(uint16_t address, uint16_t val);
-uint16_t swap16(uint16_t x);
-void read_image_file(FILE* file);
+    jit_flush(vm);  // before the pages go, it marks the first slot of each block as ordinary again
+    vm_analysis_stop(vm);
+    free(vm->data_words);
+    vm->data_words = NULL;
+    if (vm->jit_counts){
+        memset(vm->jit_counts, 0, MAX_MEMORY * sizeof(uint16_t));
+    }
+    free_own_pages(vm);
+    memset(vm->page_dirty, 1, sizeof(vm->page_dirty));  // all of memory may be different now
+    vm->base = t;
+    if (t){
+        memcpy(vm->pages, t->pages, sizeof(vm->pages));
+    }
 
-int main(int argc, const char*argv[]){
+    // every VM has its own device page, mem_read() writes the keyboard registers into it
+    vm_page* device = vm_own_page(vm, DEVICE_PAGE >> PAGE_SHIFT);
+    for (int i = 0; i < PAGE_WORDS; i++){
+        device->decoded[i].op = OP_DECODE;
+    }
 
-    // (load arguments)
-    if (argc < 2){
-        printf("enter in this format: lc3 [image-file] ... \n");
-        exit(2);
+    if (t){
+        memcpy(vm->reg, t->reg, sizeof(vm->reg));
+        vm->cond_value = t->cond_value;
+    } else {
+        memset(vm->reg, 0, sizeof(vm->reg));
+        reg_write(vm, R_COND, FL_ZERO);
+
+        enum { PC_START = 0x3000 }; // this is to declare a local constant in C
+        //can also do this #define PC_START 0x3000 , but this is global, and its not necessary for this variable to be global
+
+        vm->reg[R_PC] = PC_START;
+    }
+    vm->psr = PSR_USER;
+    vm->saved_ssp = SSP_START;
+    vm->saved_usp = 0;
+    if (vm->interrupts){
+        device->words[MR_VECTORS & (PAGE_WORDS - 1)] = VECTORS_START;
+    }
+    if (vm->block){
+        block_reset(vm);
+    }
+    vm->status = VM_RUNNING;
+    vm->stop_reason = STOP_NONE;
+    vm->steps = 0;
+    vm_journal_clear(vm);  // there is nothing before this to go back to
+    if (vm->profile){
+        vm->profile->depth = 0;  // the counts add up over all the runs, the calls in progress are gone
     }
 
-    for (int i = 1; i < argc; i++){
-        if(!read_image(argv[i])){
-            printf("failed to load image: %s\n", argv[i]);
+    vm_set_input(vm, NULL, 0);
+    vm->in_consumed = vm->in_skip = 0;
+    vm->out_len = 0;
+    vm->output_len = 0;
+}
+
+static vm_page* new_page(VM* vm, int page){
+
+    vm_page* p = vm->spare_count ? vm->spare_pages[--vm->spare_count] : malloc(sizeof(vm_page));
+    if (!p){
+        printf("out of memory\n");
+        exit(1);
+    }
+    vm->pages[page] = p;
+    vm->page_owned[page] = 1;
+    return p;
+}
+
+// gives the VM its own copy of a page before it writes to it, returns the page
+vm_page* vm_own_page(VM* vm, int page){
+
+    if (!vm->page_owned[page]){
+        const vm_page* shared = vm->pages[page];
+        memcpy(new_page(vm, page), shared, sizeof(vm_page));  // the decoded slots are still right for the copied words
+        if (vm->analysis && page < DEVICE_PAGE >> PAGE_SHIFT){
+            analysis_page_owned(vm, page);  // except for words a proved store may write from now on
+        }
+    }
+    return vm->pages[page];
+}
+
+// the same for a caller about to write over every word of the page, which does not need the old contents. Only the
+// words are left undefined, the slots of a new page are all OP_DECODE
+vm_page* vm_replace_page(VM* vm, int page){
+
+    if (vm->page_owned[page]){
+        return vm->pages[page];
+    }
+    vm_page* p = new_page(vm, page);
+    for (int i = 0; i < PAGE_WORDS; i++){
+        p->decoded[i].op = OP_DECODE;
+    }
+    return p;
+}
+
+/*
+freezes the memory and registers of vm into a template, all its pages fully decoded. Pages the VM never wrote to
+stay shared with its own template (which then has to outlive this one), pages that are all zeros become the zero
+page again.
+*/
+vm_template* vm_template_create(const VM* vm){
+
+    vm_template* t = calloc(1, sizeof(vm_template));
+    if (!t){
+        return NULL;
+    }
+    static const uint16_t zero_words[PAGE_WORDS];
+    for (int page = 0; page < PAGE_COUNT; page++){
+        const vm_page* from = vm->pages[page];
+        if (!vm->page_owned[page] || (page != DEVICE_PAGE >> PAGE_SHIFT && memcmp(from->words, zero_words, sizeof(zero_words)) == 0)){
+            t->pages[page] = vm->page_owned[page] ? &zero_page : vm->pages[page];
+            continue;
+        }
+        vm_page* copy = malloc(sizeof(vm_page));
+        if (!copy){
+            vm_template_destroy(t);
+            return NULL;
+        }
+        memcpy(copy->words, from->words, sizeof(copy->words));
+        for (int i = 0; i < PAGE_WORDS; i++){
+            uint32_t address = (uint32_t)page * PAGE_WORDS + i;
+            if (address >= DEVICE_PAGE){
+                copy->decoded[i].op = OP_DECODE;
+            } else {
+                decode_page_word(copy, i);  // this also turns OP_JIT slots back into instructions
+            }
+        }
+        t->pages[page] = copy;
+        t->page_owned[page] = 1;
+    }
+    memcpy(t->reg, vm->reg, sizeof(t->reg));
+    t->cond_value = vm->cond_value;
+    return t;
+}
+
+void vm_template_destroy(vm_template* t){
+
+    if (!t){
+        return;
+    }
+    for (int page = 0; page < PAGE_COUNT; page++){
+        if (t->page_owned[page]){
+            free(t->pages[page]);
+        }
+    }
+    free(t);
+}
+
+// copies data, so the caller can free it straight away. Only io_memory reads it
+void vm_set_input(VM* vm, const char* data, size_t size){
+
+    free(vm->in_owned);
+    vm->in_owned = NULL;
+    if (size){
+        vm->in_owned = malloc(size);
+        memcpy(vm->in_owned, data, size);
+    }
+    vm->in_data = vm->in_owned;
+    vm->in_pos = 0;
+    vm->in_len = size;
+    vm->in_eof = vm->io == &io_memory;  // there is nothing more to read than what is already in the buffer
+}
+
+// appends to the input of an io_memory VM, for programs that get their input while they run (a debugger console).
+// With a journal the characters already read stay in the buffer, vm_step_back() can give them back
+void vm_add_input(VM* vm, const char* data, size_t size){
+
+    size_t from = vm->journal ? 0 : vm->in_pos;  // what is kept starts here
+    size_t left = vm->in_len - from;
+    unsigned char* grown = malloc(left + size + 1);
+    if (!grown){
+        printf("out of memory\n");
+        exit(1);
+    }
+    if (left){
+        memcpy(grown, vm->in_data + from, left);
+    }
+    memcpy(grown + left, data, size);
+    free(vm->in_owned);
+    vm->in_owned = grown;
+    vm->in_data = grown;
+    vm->in_pos -= from;
+    vm->in_len = left + size;
+}
+
+// breakpoints and watchpoints are bitmaps of all of memory, allocated when the first bit goes in
+static void set_bit(uint64_t** bits, uint16_t address, int on){
+
+    if (!*bits){
+        if (!on){
+            return;
+        }
+        *bits = calloc(MAX_MEMORY / 64, sizeof(uint64_t));
+        if (!*bits){
+            printf("out of memory\n");
             exit(1);
         }
     }
-    signal(SIGINT, handle_interrupt);
-    disable_input_buffering();
+    if (on){
+        (*bits)[address >> 6] |= (uint64_t)1 << (address & 63);
+    } else {
+        (*bits)[address >> 6] &= ~((uint64_t)1 << (address & 63));
+    }
+}
 
-    // (setup)
+static inline int bit_set(const uint64_t* bits, uint16_t address){
+    return bits && (bits[address >> 6] >> (address & 63)) & 1;
+}
 
-    reg[R_COND] = FL_ZERO;
+void vm_set_breakpoint(VM* vm, uint16_t address, int on){
+    set_bit(&vm->breakpoints, address, on);
+}
 
-    enum { PC_START = 0x3000 }; // this is to declare a local constant in C
-    //can also do this #define PC_START 0x3000 , but this is global, and its not necessary for this variable to be global
+// kinds is VM_WATCH_READ, VM_WATCH_WRITE or both, the others are turned off
+void vm_set_watchpoint(VM* vm, uint16_t address, int kinds){
+    set_bit(&vm->watch_read, address, kinds & VM_WATCH_READ);
+    set_bit(&vm->watch_write, address, kinds & VM_WATCH_WRITE);
+}
+
+// with no breakpoints or watchpoints left the engines go back to running at full speed
+void vm_clear_breakpoints(VM* vm){
+
+    free(vm->breakpoints);
+    vm->breakpoints = NULL;
+}
+
+void vm_clear_watchpoints(VM* vm){
+
+    free(vm->watch_read);
+    free(vm->watch_write);
+    vm->watch_read = vm->watch_write = NULL;
+}
+
+// for the engines: if address is in watch, says so in vm->stop_reason and stops the VM after the current instruction
+static inline int watch_hit(VM* vm, const uint64_t* watch, uint16_t address, int reason){
+
+    if (!bit_set(watch, address)){
+        return 0;
+    }
+    vm->status = VM_STOPPED;
+    vm->stop_reason = reason;
+    vm->stop_address = address;
+    return 1;
+}
+
+// vm_run() once the slices are worked out
+static int run_engine(VM* vm, uint64_t n_steps){
+
+    vm->status = VM_RUNNING;  // a stopped VM carries on, it stops again straight away unless stop_at was changed (or the breakpoint cleared)
+    vm->stop_reason = STOP_NONE;
+    vm->budget = n_steps ? n_steps : UINT64_MAX;
+    vm->clock_end = vm->steps + vm->budget;  // wraps around for UINT64_MAX, vm_clock() still comes out right
+    uint64_t given = vm->budget;
+
+    if (vm->engine == ENGINE_JIT && !jit_init(vm)){
+        vm->engine = ENGINE_THREADED;  // no JIT for this host, the threaded engine is the next best thing
+    }
+
+    vm_profile* profile = vm->profile;
+    if (profile){
+        if (!profile->started){
+            profile->started = 1;
+            profile->entry = vm->reg[R_PC];
+        }
+        profile->entries[vm->reg[R_PC]]++;  // execution flows in here, and back out wherever it stops below
+    }
+
+    if (vm->engine != ENGINE_SWITCH){
+        run_threaded(vm, vm->engine == ENGINE_JIT);
+    } else {
+        run_switch(vm);
+    }
+    vm->steps += given - vm->budget;
+    if (profile){
+        profile->entries[vm->reg[R_PC]]--;
+    }
+    if (vm->metrics){
+        metrics_instructions(vm->metrics, given - vm->budget);
+    }
+    return vm->status;
+}
+
+// vm_run() with vm->interrupts, a slice at a time so the keyboard gets looked at in between (see take_interrupts()).
+// A slice can end early, when an RTI goes back to a program that waits for the next key
+static int interrupts_run(VM* vm, uint64_t n_steps){
+
+    uint64_t end = vm->steps + n_steps;
+    for (;;){
+        if (!take_interrupts(vm)){
+            return vm->status;  // waiting for the key
+        }
+        uint64_t n = n_steps && end - vm->steps < INTERRUPT_SLICE ? end - vm->steps : INTERRUPT_SLICE;
+        int status = run_engine(vm, n);
+        if (status != VM_RUNNING || (n_steps && vm->steps == end)){
+            return status;
+        }
+    }
+}
+
+// runs until the program halts, PC gets to vm->stop_at or a breakpoint, the program waits for input, or n_steps
+// instructions have executed (0 for no limit), returns vm->status
+int vm_run(VM* vm, uint64_t n_steps){
+
+    if (vm->status == VM_HALTED){
+        return VM_HALTED;
+    }
+    if (vm->metrics && (n_steps == 0 || n_steps > METRICS_SLICE)){
+        return metrics_run(vm, n_steps);  // comes back here a slice at a time
+    }
+    if (vm->interrupts){
+        return interrupts_run(vm, n_steps);
+    }
+    return run_engine(vm, n_steps);
+}
+
+// the original fetch/decode/execute loop, it decodes every instruction again each time it is executed
+void run_switch(VM* vm){
 
-    reg[R_PC] = PC_START;
-    
     int running = 1;
-    while(running){
+    while(running && vm->budget){
 
-        uint16_t instr = mem_read(reg[R_PC]++);
+        if (vm->reg[R_PC] == vm->stop_at || bit_set(vm->breakpoints, vm->reg[R_PC])){
+            vm->status = VM_STOPPED;
+            vm->stop_reason = vm->reg[R_PC] == vm->stop_at ? STOP_AT : STOP_BREAKPOINT;
+            vm->stop_address = vm->reg[R_PC];
+            break;
+        }
+        vm->budget--;
+        if (vm->reg[R_PC] == 0xFFFF && vm->profile){
+            vm->profile->last_word_runs++;
+        }
+        uint16_t instr = mem_read(vm, vm->reg[R_PC]++);
         uint16_t op = instr >> 12; // extracts the top 4 bits to determine the opcode
 
+        if ((vm->journal && op != TRAP) || vm->trace){
+            decoded_instr d;
+            decode_instr(instr, &d);
+            if (vm->trace){
+                trace_step(vm->trace, vm->reg, vm->reg[R_PC] - 1, &d);
+            }
+            if (vm->journal && op != TRAP){
+                journal_record(vm, vm->reg[R_PC] - 1, vm->cond_value, &d);
+            }
+        }
+
         switch(op){
 
             case BR:
             {
                 uint16_t pc_offset = sign_extend(instr & 0x1FF,9);
                 uint16_t condition_flag = (instr >> 9) & 0x7;
-                if (reg[R_COND] & condition_flag){
-                    reg[R_PC] += pc_offset;
+                if (cond_flags(vm->cond_value) & condition_flag){
+                    vm->reg[R_PC] += pc_offset;
+                    if (vm->profile){
+                        profile_jump(vm->profile, vm->reg[R_PC] - pc_offset - 1, vm->reg[R_PC]);
+                    }
                 }
             }
                 break;
@@ -212,22 +897,24 @@ int main(int argc, const char*argv[]){
                 //this is the second operand (SR2)
                 if (imm_flag) {
                     uint16_t imm5 = sign_extend(instr & 0b11111,5); 
-                    reg[r0] = reg[r1] + imm5;   
+                    vm->reg[r0] = vm->reg[r1] + imm5;   
                 } else {
                     uint16_t r2 = instr & 0b111;
-                    reg[r0] = reg[r1] + reg[r2];
+                    vm->reg[r0] = vm->reg[r1] + vm->reg[r2];
                 }
                 
                 
-                update_flags(r0);
+                update_flags(vm, r0);
             }
                 break;
             case LD:
             {
                 uint16_t r0 = (instr >> 9) & 0x7;
                 uint16_t pc_offset = sign_extend(instr & 0x1FF,9);
-                reg[r0] = mem_read(reg[R_PC]+pc_offset);
-                update_flags(r0);
+                uint16_t address = vm->reg[R_PC]+pc_offset;
+                vm->reg[r0] = mem_read(vm, address);
+                update_flags(vm, r0);
+                running = !watch_hit(vm, vm->watch_read, address, STOP_WATCH_READ);
             }
                 break;
             case ST:
@@ -235,19 +922,24 @@ int main(int argc, const char*argv[]){
                 uint16_t r0 = (instr >> 9) & 0x7;
                  
                 uint16_t offset = sign_extend(instr & 0b111111111,9);
-                mem_write(reg[R_PC]+offset,reg[r0]);
+                uint16_t address = vm->reg[R_PC]+offset;
+                mem_write(vm, address, vm->reg[r0]);
+                running = !watch_hit(vm, vm->watch_write, address, STOP_WATCH_WRITE);
             }
                 break;
             case JSR:
             {
                 uint16_t flag = (instr >> 11) & 0b1;
-                reg[R_R7] = reg[R_PC];
+                vm->reg[R_R7] = vm->reg[R_PC];
                 if (flag){
-                    reg[R_PC] += sign_extend((instr & 0x7FF),11);
+                    vm->reg[R_PC] += sign_extend((instr & 0x7FF),11);
                 }
                 else {
                     uint16_t r1 = (instr >> 6) & 0x7;
-                    reg[R_PC] = reg[r1];
+                    vm->reg[R_PC] = vm->reg[r1];
+                }
+                if (vm->profile){
+                    profile_call(vm->profile, vm->reg[R_R7] - 1, vm->reg[R_PC]);
                 }
             }
                 break;
@@ -260,13 +952,13 @@ int main(int argc, const char*argv[]){
                 uint16_t result;
                 if (imm_flag){
                     uint16_t imm_val = sign_extend(instr & 0b11111,5);
-                    result = reg[r1] & imm_val;
+                    result = vm->reg[r1] & imm_val;
                 } else {
                     uint16_t r2 = instr & 0x7;
-                    result = reg[r1] & reg[r2];
+                    result = vm->reg[r1] & vm->reg[r2];
                 }
-                reg[r0] = result;
-                update_flags(r0);
+                vm->reg[r0] = result;
+                update_flags(vm, r0);
             }
                 break;
             case LDR:
@@ -275,8 +967,10 @@ int main(int argc, const char*argv[]){
                 uint16_t r1 = (instr >> 6) & 0x7;
 
                 uint16_t offset = sign_extend((instr & 0b111111),6);
-                reg[r0] = mem_read(reg[r1] + offset);
-                update_flags(r0);
+                uint16_t address = vm->reg[r1] + offset;
+                vm->reg[r0] = mem_read(vm, address);
+                update_flags(vm, r0);
+                running = !watch_hit(vm, vm->watch_read, address, STOP_WATCH_READ);
             }
                 break;
             case STR:
@@ -284,18 +978,21 @@ int main(int argc, const char*argv[]){
                     uint16_t r0 = (instr >> 9) & 0x7;
                     uint16_t r1 = (instr >> 6) & 0x7;
                     uint16_t offset = sign_extend(instr & 0x3F, 6);
-                    mem_write(reg[r1] + offset, reg[r0]);
+                    uint16_t address = vm->reg[r1] + offset;
+                    mem_write(vm, address, vm->reg[r0]);
+                    running = !watch_hit(vm, vm->watch_write, address, STOP_WATCH_WRITE);
             }
                 break;
             case RTI:
+                running = execute_system(vm, RTI);  // nothing without vm->interrupts
                 break;
             case NOT:
             {
                 // destination register (DR)
                 uint16_t r0 = (instr >> 9) & 0x7;
                 uint16_t r1 = (instr >> 6) & 0x7;
-                reg[r0] = ~reg[r1];
-                update_flags(r0);
+                vm->reg[r0] = ~vm->reg[r1];
+                update_flags(vm, r0);
             }
                 break;  
             case LDI:
@@ -306,8 +1003,11 @@ int main(int argc, const char*argv[]){
                     //get PCoffset9 and sign extend it
                     uint16_t pc_offset = sign_extend(instr& 0b000000111111111,9);
 
-                    reg[r0] = mem_read(mem_read(reg[R_PC]+pc_offset));
-                    update_flags(r0);
+                    uint16_t pointer = vm->reg[R_PC]+pc_offset;
+                    uint16_t address = mem_read(vm, pointer);
+                    vm->reg[r0] = mem_read(vm, address);
+                    update_flags(vm, r0);
+                    running = !(watch_hit(vm, vm->watch_read, pointer, STOP_WATCH_READ) || watch_hit(vm, vm->watch_read, address, STOP_WATCH_READ));
 
                 }
                 break;
@@ -319,123 +1019,847 @@ int main(int argc, const char*argv[]){
                     //get PCoffset9 and sign extend it
                     uint16_t pc_offset = sign_extend(instr& 0b000000111111111,9);
 
-                    mem_write(mem_read(reg[R_PC]+pc_offset),reg[r0]);
+                    uint16_t pointer = vm->reg[R_PC]+pc_offset;
+                    uint16_t address = mem_read(vm, pointer);
+                    mem_write(vm, address, vm->reg[r0]);
+                    running = !(watch_hit(vm, vm->watch_read, pointer, STOP_WATCH_READ) || watch_hit(vm, vm->watch_write, address, STOP_WATCH_WRITE));
                     
             }
                 break;
             case JMP:
             {
-                reg[R_PC] = reg[(instr >> 6) & 0x7];
+                uint16_t r1 = (instr >> 6) & 0x7;
+                if (vm->profile){
+                    (r1 == R_R7 ? profile_return : profile_jump)(vm->profile, vm->reg[R_PC] - 1, vm->reg[r1]);
+                }
+                vm->reg[R_PC] = vm->reg[r1];
             }
                 break;
             case RES:
+                running = execute_system(vm, RES);
                 break;
             case LEA:
             {
                 uint16_t r0 = (instr >> 9) & 0x7;
                 uint16_t offset = sign_extend((instr & 0x1FF),9);
-                reg[r0] = reg[R_PC] + offset;
-                update_flags(r0); 
+                vm->reg[r0] = vm->reg[R_PC] + offset;
+                update_flags(vm, r0); 
             }
                 break;
             case TRAP:
-                reg[R_R7] = reg[R_PC];
-                
-                switch (instr & 0xFF)
-                {
-                    case TRAP_GETC:
-                        // reads a single ASCII char
-                        reg[R_R0] = (uint16_t)getchar();
-
-                        //Reads a single character from input without echo
-                        //Stores it in R0
-                        //Updates condition flags based on the character's value
-
-                        update_flags(R_R0);
-                        break;
-                    case TRAP_OUT:
-                        putc((char)reg[R_R0], stdout);
-                        fflush(stdout);
-                        /*
-                        Outputs the character in R0 to the screen.
-                        fflush(stdout) ensures it is shown immediately.
-                        */
-                        break;
-                    case TRAP_PUTS:
-                        {
-                            // one char per 16 bit word
-                            uint16_t* c = memory + reg[R_R0]; // memory is a pointer to the first element of the memory array
-                            while (*c)
-                            {
-                                putc((char)*c, stdout);
-                                //Casts the 16-bit word to an 8-bit char, which is what putc() expects
-                                //Sends it to stdout (standard output)
-                                //This prints one character to the screen
-
-
-                                c++; //Move to the next word in memory, because c is a uint16_t*, this increments by 2 bytes, advancing to the next character
-                            }
-                            fflush(stdout); // make sure that all buffered output is immediately displayed to the screen
-                        }
-                        break;
-                    case TRAP_IN:
-                        {
-                            printf("Enter a character: "); //prompt user to enter a character
-                            char c = getchar();
-                            putc(c, stdout);    //echoes it back
-                            fflush(stdout);
-                            reg[R_R0] = (uint16_t)c;        // stores it in R0
-                            update_flags(R_R0);         // updates flags
-                        }
-                        break;
-                    case TRAP_PUTSP:
-                        {
-
-                            /*
-                            The TRAP_PUTSP routine in the LC-3 emulator is used to print strings stored in memory with two characters per word, also known as packed strings. This is more space-efficient than TRAP_PUTS, which uses one character per 16-bit word.
-                            */
-
-                            //for example
-
-                            /*
-                            memory[0x3000] = 0x6548; // 'H' (0x48), 'e' (0x65)
-                            memory[0x3001] = 0x6C6C; // 'l', 'l'
-                            memory[0x3002] = 0x006F; // 'o', '\0'
-                            reg[R_R0] = 0x3000;
-
-                            */
-
-                            //storing characters this way is more space efficient 
-
-                            uint16_t* c = memory + reg[R_R0];  // c points to the first word of the packed string 
-                            while (*c)
-                            {
-                                char char1 = (*c) & 0xFF;   //Extracts the low-order byte (bits 0–7) from the 16-bit word, the first character stored in the word
-                                putc(char1, stdout);        //Prints the first character to the screen
-                                char char2 = (*c) >> 8;     //Extracts the high-order byte (bits 8–15) from the word, this is the second character
-                                if (char2){
-                                    putc(char2, stdout);    //only print the second character if it is non-zero
-                                }    
-                                c++;    //Move to the next word in memory
-                            }
-                            fflush(stdout);
-                        }
-                        break;
-                    case TRAP_HALT:
-                        puts("HALT");
-                        fflush(stdout);
-                        running = 0;        // stops the execution loop by setting running to 0
-                        break;
-
-                }
-
+                running = execute_trap(vm, instr);
                 break;
             default:
                 abort();
                 break;
         }
     }
-    restore_input_buffering();
+}
+
+// superinstructions---------------------------------------------------------------------------------
+
+/*
+the superinstructions, by the opcodes of the two words. These are the adjacent pairs that came out on top in a static
+count over the sample programs and the benchmark kernels (bench/idioms.py), the instructions in loops weighted most:
+ADD+BR and ADD+ADD far ahead of the rest, then LEA+TRAP, the constant loads, negations, copies and the halves of
+read-modify-writes. The first instruction of a pair has to carry on to the next word and must not store (a store can leave
+the slots of the page out of date until the engine looks them up again)
+*/
+static const uint8_t fused_op[16][16] = {
+    [ADD][BR] = OP_ADD_BR,      [ADD][ADD] = OP_ADD_ADD,    [AND][ADD] = OP_AND_ADD,    [NOT][ADD] = OP_NOT_ADD,
+    [LDR][ADD] = OP_LDR_ADD,    [ADD][STR] = OP_ADD_STR,    [LDR][STR] = OP_LDR_STR,    [LD][ADD] = OP_LD_ADD,
+    [LEA][TRAP] = OP_LEA_TRAP
+};
+
+// the opcode of the first instruction of each superinstruction, of each proved store and of each specialized one
+static const uint8_t fused_first[OP_COUNT] = {
+    [OP_ADD_BR] = ADD,  [OP_ADD_ADD] = ADD, [OP_AND_ADD] = AND, [OP_NOT_ADD] = NOT, [OP_LDR_ADD] = LDR,
+    [OP_ADD_STR] = ADD, [OP_LDR_STR] = LDR, [OP_LD_ADD] = LD,   [OP_LEA_TRAP] = LEA,
+    [OP_ST_DATA] = ST,  [OP_STR_DATA] = STR,
+    [OP_ADD_IMM] = ADD, [OP_ADD_REG] = ADD, [OP_AND_IMM] = AND, [OP_AND_REG] = AND,
+    [OP_JSR_OFFSET] = JSR, [OP_JSRR] = JSR,
+    [OP_BR_NEVER ... OP_BR_ALWAYS] = BR
+};
+
+// the specialized form of a plain instruction, by its mode: the immediate bit for ADD and AND, the PC-relative bit
+// for JSR, the nzp mask for BR
+static uint8_t specialized_op(const decoded_instr* d){
+
+    switch (d->op){
+        case ADD:
+            return d->flag ? OP_ADD_IMM : OP_ADD_REG;
+        case AND:
+            return d->flag ? OP_AND_IMM : OP_AND_REG;
+        case JSR:
+            return d->flag ? OP_JSR_OFFSET : OP_JSRR;
+        case BR:
+            return OP_BR_NEVER + d->r0;
+    }
+    return d->op;
+}
+
+// the first instruction of superinstruction d on its own in scratch, for what has to see every instruction singly
+const decoded_instr* unfuse(const decoded_instr* d, decoded_instr* scratch){
+
+    *scratch = *d;
+    scratch->op = fused_first[d->op];
+    return scratch;
+}
+
+/*
+decodes word i of p into its slot, as a superinstruction if it and the word after it are one of the pairs above. Only
+pairs within the page, the engine finds the second instruction in the next slot. In a run where every instruction
+pairs up with the next (ADD, ADD, ADD, BR) only every other one starts a pair, the second instruction of a pair is
+then always an ordinary one and the engine never has to turn down the pair because it was fused itself.
+
+A word that is not in a pair gets the specialized form of its instruction (OP_ADD_IMM, OP_BR_ZP and so on), whose
+handler does not look at the mode bits. The second one of a pair stays plain, that is what the superinstruction
+checks the next slot for
+*/
+void decode_page_word(vm_page* p, int i){
+
+    decoded_instr* d = &p->decoded[i];
+    decode_instr(p->words[i], d);
+    int second = 0;  // the second one of a pair that starts further back
+    for (int j = i; j > 0 && fused_op[p->words[j - 1] >> 12][p->words[j] >> 12]; j--){
+        second = !second;
+    }
+    if (second){
+        return;
+    }
+    uint8_t op = i + 1 < PAGE_WORDS ? fused_op[p->words[i] >> 12][p->words[i + 1] >> 12] : 0;
+    d->op = op ? op : specialized_op(d);
+}
+
+// threaded engine---------------------------------------------------------------------------------
+
+/*
+run_threaded() executes out of the decoded slots instead of memory. Each handler ends by jumping straight to
+the handler of the next instruction (computed goto), so there is no loop condition, no switch bounds check and no
+shared indirect branch for the branch predictor to get confused by. Fields like the sign extended offsets were
+already worked out by decode_instr(), so handlers only do the actual work of the instruction. Superinstructions
+(see decode_page_word()) do the work of their first instruction and go on to the handler of the second one with a
+plain jump, a loop like ADD R3, R3, #-1 / BRp LOOP costs one dispatch per pass instead of two.
+
+With use_jit set, taken branches, jumps, calls and traps go through counting versions of their handlers that feed
+jit_compile(vm, ) (see lc3_jit.c). Everything else is shared, the two modes only differ in the dispatch table.
+
+While vm->stop_at or any breakpoints are set every instruction goes through op_check first, which compares PC
+with them. With watchpoints set the loads and stores go through versions that test their addresses, and with
+vm->profile set the control transfers go through versions that count them (see lc3_profile.c). With vm->journal set
+every instruction goes through op_journal, which notes down what it is about to overwrite (see lc3_journal.c), and
+with vm->trace through op_trace, which writes down what the one before it did (lc3_trace.c). In all of these cases
+blocks that were compiled earlier are not entered, their first instruction runs in the interpreter like any other,
+and superinstructions run as their first instruction alone, so the next one goes through the check too.
+Without any of them the handlers test nothing, so the debugging features cost nothing when they are off.
+
+In virtual time (io_virtual) the loads that can reach KBSR write the budget back first, so mem_read() knows what
+time it is, compiled blocks leave device page loads to the interpreter anyway.
+
+Labels as values are a GNU C extension, on other compilers the threaded engine falls back to run_switch().
+*/
+
+#if defined(__GNUC__)
+
+__attribute__((optimize("no-gcse", "no-crossjumping")))
+void run_threaded(VM* vm, int use_jit){
+
+    static const void* plain_dispatch[OP_COUNT] = {
+        [BR] = &&op_br,     [ADD] = &&op_add,   [LD] = &&op_ld,     [ST] = &&op_st,
+        [JSR] = &&op_jsr,   [AND] = &&op_and,   [LDR] = &&op_ldr,   [STR] = &&op_str,
+        [RTI] = &&op_system, [NOT] = &&op_not,   [LDI] = &&op_ldi,   [STI] = &&op_sti,
+        [JMP] = &&op_jmp,   [RES] = &&op_system, [LEA] = &&op_lea,   [TRAP] = &&op_trap,
+        [OP_DECODE] = &&op_decode, [OP_JIT] = &&op_jit,
+        [OP_ADD_BR] = &&op_add_br,  [OP_ADD_ADD] = &&op_add_add, [OP_AND_ADD] = &&op_and_add, [OP_NOT_ADD] = &&op_not_add,
+        [OP_LDR_ADD] = &&op_ldr_add, [OP_ADD_STR] = &&op_add_str, [OP_LDR_STR] = &&op_ldr_str, [OP_LD_ADD] = &&op_ld_add,
+        [OP_LEA_TRAP] = &&op_lea_trap,
+        [OP_ST_DATA] = &&op_st_data, [OP_STR_DATA] = &&op_str_data,
+        [OP_ADD_IMM] = &&op_add_imm, [OP_ADD_REG] = &&op_add_reg, [OP_AND_IMM] = &&op_and_imm, [OP_AND_REG] = &&op_and_reg,
+        [OP_JSR_OFFSET] = &&op_jsr_offset, [OP_JSRR] = &&op_jsrr,
+        [OP_BR_NEVER] = &&op_nop,   [OP_BR_P] = &&op_br_p,      [OP_BR_Z] = &&op_br_z,      [OP_BR_ZP] = &&op_br_zp,
+        [OP_BR_N] = &&op_br_n,      [OP_BR_NP] = &&op_br_np,    [OP_BR_NZ] = &&op_br_nz,    [OP_BR_ALWAYS] = &&op_br_always
+    };
+    static const void* jit_dispatch[OP_COUNT] = {
+        [BR] = &&op_br_jit, [ADD] = &&op_add,   [LD] = &&op_ld,     [ST] = &&op_st,
+        [JSR] = &&op_jsr_jit, [AND] = &&op_and, [LDR] = &&op_ldr,   [STR] = &&op_str,
+        [RTI] = &&op_system, [NOT] = &&op_not,   [LDI] = &&op_ldi,   [STI] = &&op_sti,
+        [JMP] = &&op_jmp_jit, [RES] = &&op_system, [LEA] = &&op_lea, [TRAP] = &&op_trap_jit,
+        [OP_DECODE] = &&op_decode, [OP_JIT] = &&op_jit,
+        [OP_ADD_BR] = &&op_add_br_jit, [OP_ADD_ADD] = &&op_add_add, [OP_AND_ADD] = &&op_and_add, [OP_NOT_ADD] = &&op_not_add,
+        [OP_LDR_ADD] = &&op_ldr_add, [OP_ADD_STR] = &&op_add_str, [OP_LDR_STR] = &&op_ldr_str, [OP_LD_ADD] = &&op_ld_add,
+        [OP_LEA_TRAP] = &&op_lea_trap_jit,
+        [OP_ST_DATA] = &&op_st_data, [OP_STR_DATA] = &&op_str_data,
+        // the control transfers count block entries, the mode bits are left to the handlers that do
+        [OP_ADD_IMM] = &&op_add_imm, [OP_ADD_REG] = &&op_add_reg, [OP_AND_IMM] = &&op_and_imm, [OP_AND_REG] = &&op_and_reg,
+        [OP_JSR_OFFSET] = &&op_jsr_jit, [OP_JSRR] = &&op_jsr_jit,
+        [OP_BR_NEVER] = &&op_nop,   [OP_BR_P ... OP_BR_ALWAYS] = &&op_br_jit
+    };
+    static const void* profile_dispatch[OP_COUNT] = {
+        [BR] = &&op_br_prof, [ADD] = &&op_add,  [LD] = &&op_ld,     [ST] = &&op_st,
+        [JSR] = &&op_jsr_prof, [AND] = &&op_and, [LDR] = &&op_ldr,  [STR] = &&op_str,
+        [RTI] = &&op_system, [NOT] = &&op_not,   [LDI] = &&op_ldi,   [STI] = &&op_sti,
+        [JMP] = &&op_jmp_prof, [RES] = &&op_system, [LEA] = &&op_lea, [TRAP] = &&op_trap,
+        [OP_DECODE] = &&op_decode, [OP_JIT] = &&op_not_compiled,
+        // superinstructions run as their first instruction, so the branch that comes after gets counted
+        [OP_ADD_BR] = &&op_add,     [OP_ADD_ADD] = &&op_add,    [OP_AND_ADD] = &&op_and,    [OP_NOT_ADD] = &&op_not,
+        [OP_LDR_ADD] = &&op_ldr,    [OP_ADD_STR] = &&op_add,    [OP_LDR_STR] = &&op_ldr,    [OP_LD_ADD] = &&op_ld,
+        [OP_LEA_TRAP] = &&op_lea,
+        [OP_ST_DATA] = &&op_st_data, [OP_STR_DATA] = &&op_str_data,
+        [OP_ADD_IMM] = &&op_add_imm, [OP_ADD_REG] = &&op_add_reg, [OP_AND_IMM] = &&op_and_imm, [OP_AND_REG] = &&op_and_reg,
+        [OP_JSR_OFFSET] = &&op_jsr_prof, [OP_JSRR] = &&op_jsr_prof,
+        [OP_BR_NEVER ... OP_BR_ALWAYS] = &&op_br_prof
+    };
+    static const void* stop_dispatch[OP_COUNT] = { [0 ... OP_COUNT - 1] = &&op_check };
+    const uint32_t stop = vm->stop_at;
+    const uint64_t* const breakpoints = vm->breakpoints;
+    vm_profile* const profile = vm->profile;
+    const void* const* interpreted = profile ? profile_dispatch : plain_dispatch;  // where op_check goes on to
+
+    // with watchpoints the loads and stores go through versions that look their addresses up, in a copy of the
+    // table that would have been used. Compiled blocks are not entered, they do their own loads and stores
+    const void* watch_dispatch[OP_COUNT];
+    if (vm->watch_read || vm->watch_write){
+        memcpy(watch_dispatch, interpreted, sizeof(watch_dispatch));
+        watch_dispatch[LD] = &&op_ld_watch;
+        watch_dispatch[ST] = &&op_st_watch;
+        watch_dispatch[LDR] = &&op_ldr_watch;
+        watch_dispatch[STR] = &&op_str_watch;
+        watch_dispatch[LDI] = &&op_ldi_watch;
+        watch_dispatch[STI] = &&op_sti_watch;
+        watch_dispatch[OP_JIT] = &&op_not_compiled;
+        for (int op = OP_FUSED; op < OP_COUNT; op++){
+            watch_dispatch[op] = watch_dispatch[fused_first[op]];  // every load and store gets looked at
+        }
+        interpreted = watch_dispatch;
+        use_jit = 0;
+    }
+
+    // in virtual time the loads and STI (whose pointer can be KBSR) go through versions that give mem_read() the
+    // clock and PC, and take the budget back afterwards (skip_polling() can use some up). The watch versions do it too
+    const void* timed_dispatch[OP_COUNT];
+    const void* timed_jit_dispatch[OP_COUNT];
+    const void* const* compiled = jit_dispatch;
+    if (vm->io == &io_virtual && interpreted != watch_dispatch){
+        memcpy(timed_dispatch, interpreted, sizeof(timed_dispatch));
+        memcpy(timed_jit_dispatch, jit_dispatch, sizeof(timed_jit_dispatch));
+        timed_dispatch[LD] = timed_jit_dispatch[LD] = &&op_ld_timed;
+        timed_dispatch[LDR] = timed_jit_dispatch[LDR] = &&op_ldr_timed;
+        timed_dispatch[LDI] = timed_jit_dispatch[LDI] = &&op_ldi_timed;
+        timed_dispatch[STI] = timed_jit_dispatch[STI] = &&op_sti_timed;
+        timed_dispatch[OP_DECODE] = timed_jit_dispatch[OP_DECODE] = &&op_decode_timed;  // fetching from KBSR reads it
+        for (int op = OP_FUSED; op < OP_COUNT; op++){
+            timed_dispatch[op] = timed_dispatch[fused_first[op]];
+            timed_jit_dispatch[op] = timed_jit_dispatch[fused_first[op]];
+        }
+        interpreted = timed_dispatch;
+        compiled = timed_jit_dispatch;
+    }
+
+    // with a trace op_trace writes down what every instruction did before it goes on to the next one
+    static const void* trace_dispatch[OP_COUNT] = { [0 ... OP_COUNT - 1] = &&op_trace };
+    const void* const* traced = interpreted;  // where op_trace goes on to
+    vm_trace* const trace = vm->trace;
+    if (trace){
+        interpreted = trace_dispatch;
+        use_jit = 0;
+    }
+
+    // and with a journal op_journal comes before all of them
+    static const void* journal_dispatch[OP_COUNT] = { [0 ... OP_COUNT - 1] = &&op_journal };
+    const void* const* journaled = interpreted;  // where op_journal goes on to
+    if (vm->journal){
+        interpreted = journal_dispatch;
+        use_jit = 0;
+    }
+    const void* const* dispatch = stop != VM_NO_STOP || breakpoints ? stop_dispatch : use_jit ? compiled : interpreted;
+
+    decoded_instr scratch;  // holds instructions fetched from the device page, which are never cached
+    const decoded_instr* d;
+    uint16_t pc = vm->reg[R_PC];  // kept in a local so it can live in a host register, reg[R_PC] is only synced around traps
+    uint16_t flags = vm->cond_value;  // same for the lazy condition codes
+    uint64_t budget = vm->budget;  // and for the number of instructions left to run
+
+    // the decoded slots of the page PC is in, so fetching stays one load while execution stays in the page. Anything
+    // that can give the VM its own copy of a page (stores, decoding, compiling, traps) makes DISPATCH() look it up again
+    const decoded_instr* slots = NULL;
+    unsigned slots_page = PAGE_COUNT;
+    #define PAGES_CHANGED() (slots_page = PAGE_COUNT)
+
+    // fetch the decoded form of the instruction at PC, increment PC and jump to its handler
+    #define DISPATCH() do { \
+        if (!budget) goto out_of_steps; \
+        budget--; \
+        if ((unsigned)(pc >> PAGE_SHIFT) != slots_page){ \
+            slots_page = pc >> PAGE_SHIFT; \
+            slots = vm->pages[slots_page]->decoded; \
+        } \
+        d = &slots[pc++ & (PAGE_WORDS - 1)]; \
+        goto *dispatch[d->op]; \
+    } while (0)
+
+    DISPATCH();
+
+    out_of_steps:
+        vm->reg[R_PC] = pc;
+        vm->cond_value = flags;
+        vm->budget = 0;
+        return;
+
+    op_check:
+        if ((uint16_t)(pc - 1) == stop || bit_set(breakpoints, pc - 1)){
+            vm->reg[R_PC] = --pc;  // DISPATCH() already counted the instruction, it has not run
+            vm->cond_value = flags;
+            vm->budget = budget + 1;
+            vm->status = VM_STOPPED;
+            vm->stop_reason = pc == stop ? STOP_AT : STOP_BREAKPOINT;
+            vm->stop_address = pc;
+            return;
+        }
+        if (d->op == OP_JIT){
+            d = jit_entry_instr(vm, d->imm);
+        } else if (d->op >= OP_FUSED){
+            d = unfuse(d, &scratch);  // the next instruction has to come back here too
+        }
+        goto *interpreted[d->op];
+    op_not_compiled:
+        d = jit_entry_instr(vm, d->imm);
+        goto *dispatch[d->op];
+    op_journal:
+        if (d->op == OP_JIT){
+            d = jit_entry_instr(vm, d->imm);
+        } else if (d->op >= OP_FUSED){
+            d = unfuse(d, &scratch);
+        }
+        if (d->op < TRAP){  // OP_DECODE comes back here once decoded, TRAP is journaled by execute_trap()
+            journal_record(vm, pc - 1, flags, d);
+        }
+        goto *journaled[d->op];
+    op_trace:
+        if (d->op == OP_JIT){
+            d = jit_entry_instr(vm, d->imm);
+        } else if (d->op >= OP_FUSED){
+            d = unfuse(d, &scratch);
+        }
+        if (d->op < OP_DECODE){  // OP_DECODE comes back here once decoded
+            trace_step(trace, vm->reg, pc - 1, d);
+        }
+        goto *traced[d->op];
+    op_decode:
+        vm->reg[R_PC] = pc;
+        d = decode_slot(vm, pc - 1, &scratch);
+        PAGES_CHANGED();
+        goto *dispatch[d->op];
+    // what the instructions superinstructions start with do, for their handlers and the superinstructions
+    #define DO_ADD() (flags = vm->reg[d->r0] = vm->reg[d->r1] + (d->flag ? d->imm : vm->reg[d->r2]))
+    #define DO_AND() (flags = vm->reg[d->r0] = vm->reg[d->r1] & (d->flag ? d->imm : vm->reg[d->r2]))
+    #define DO_NOT() (flags = vm->reg[d->r0] = ~vm->reg[d->r1])
+    #define DO_LD() (flags = vm->reg[d->r0] = mem_read(vm, pc + d->imm))
+    #define DO_LDR() (flags = vm->reg[d->r0] = mem_read(vm, vm->reg[d->r1] + d->imm))
+    #define DO_LEA() (flags = vm->reg[d->r0] = pc + d->imm)
+
+    op_br:
+        if (cond_flags(flags) & d->r0){
+            pc += d->imm;
+        }
+        DISPATCH();
+    op_add:
+        DO_ADD();
+        DISPATCH();
+    op_ld:
+        DO_LD();
+        DISPATCH();
+    op_st:
+        mem_write(vm, pc + d->imm, vm->reg[d->r0]);
+        PAGES_CHANGED();
+        DISPATCH();
+    op_jsr:
+        vm->reg[R_R7] = pc;
+        pc = d->flag ? (uint16_t)(pc + d->imm) : vm->reg[d->r1];
+        DISPATCH();
+    op_and:
+        DO_AND();
+        DISPATCH();
+    op_ldr:
+        DO_LDR();
+        DISPATCH();
+    op_str:
+        mem_write(vm, vm->reg[d->r1] + d->imm, vm->reg[d->r0]);
+        PAGES_CHANGED();
+        DISPATCH();
+    // stores vm_analyze() proved never write code: no slot to reset, no compiled block to look for, and no page
+    // that can have changed under the slots in use. The first store to a page the VM shares still makes the copy
+    op_st_data:
+    {
+        uint16_t address = pc + d->imm;
+        if (!vm->page_owned[address >> PAGE_SHIFT]){
+            goto op_st;
+        }
+        mem_write_data(vm, address, vm->reg[d->r0]);
+        DISPATCH();
+    }
+    op_str_data:
+    {
+        uint16_t address = vm->reg[d->r1] + d->imm;
+        if (!vm->page_owned[address >> PAGE_SHIFT]){
+            goto op_str;
+        }
+        mem_write_data(vm, address, vm->reg[d->r0]);
+        DISPATCH();
+    }
+    op_not:
+        DO_NOT();
+        DISPATCH();
+    op_ldi:
+        vm->reg[d->r0] = mem_read(vm, mem_read(vm, pc + d->imm));
+        flags = vm->reg[d->r0];
+        DISPATCH();
+    op_sti:
+        mem_write(vm, mem_read(vm, pc + d->imm), vm->reg[d->r0]);
+        PAGES_CHANGED();
+        DISPATCH();
+    op_jmp:
+        pc = vm->reg[d->r1];
+        DISPATCH();
+    op_lea:
+        DO_LEA();
+        DISPATCH();
+    op_nop:
+        DISPATCH();
+    op_system:
+        if (vm->interrupts){
+            vm->reg[R_PC] = pc;
+            vm->cond_value = flags;
+            vm->budget = budget;
+            if (!execute_system(vm, d->op)){  // pushes onto the supervisor stack or pops from it, and goes somewhere else
+                return;
+            }
+            pc = vm->reg[R_PC];
+            flags = vm->cond_value;
+            PAGES_CHANGED();
+        }
+        DISPATCH();
+
+    // the specialized forms (see decode_page_word()): the same as the handlers above with the mode already known
+    op_add_imm:
+        flags = vm->reg[d->r0] = vm->reg[d->r1] + d->imm;
+        DISPATCH();
+    op_add_reg:
+        flags = vm->reg[d->r0] = vm->reg[d->r1] + vm->reg[d->r2];
+        DISPATCH();
+    op_and_imm:
+        flags = vm->reg[d->r0] = vm->reg[d->r1] & d->imm;
+        DISPATCH();
+    op_and_reg:
+        flags = vm->reg[d->r0] = vm->reg[d->r1] & vm->reg[d->r2];
+        DISPATCH();
+    op_jsr_offset:
+        vm->reg[R_R7] = pc;
+        pc += d->imm;
+        DISPATCH();
+    op_jsrr:
+        vm->reg[R_R7] = pc;
+        pc = vm->reg[d->r1];  // after R7 is written, like op_jsr: JSRR R7 goes to the next instruction
+        DISPATCH();
+    // BR by its nzp mask, each one testing the value the flags come from directly (see cond_flags())
+    #define BRANCH_IF(taken) do { \
+        if (taken) pc += d->imm; \
+        DISPATCH(); \
+    } while (0)
+    op_br_p:
+        BRANCH_IF((int16_t)flags > 0);
+    op_br_z:
+        BRANCH_IF(flags == 0);
+    op_br_zp:
+        BRANCH_IF((int16_t)flags >= 0);
+    op_br_n:
+        BRANCH_IF((int16_t)flags < 0);
+    op_br_np:
+        BRANCH_IF(flags != 0);
+    op_br_nz:
+        BRANCH_IF((int16_t)flags <= 0);
+    op_br_always:
+        pc += d->imm;
+        DISPATCH();
+    #undef BRANCH_IF
+
+    op_trap:
+        vm->reg[R_PC] = pc;
+        vm->cond_value = flags;
+        vm->budget = budget;  // a trap that has to wait for input gives its instruction back
+        if (execute_trap(vm, d->imm)){
+            pc = vm->reg[R_PC];
+            flags = vm->cond_value;
+            PAGES_CHANGED();
+            DISPATCH();
+        }
+        return;
+
+    // superinstructions: the first instruction, then the handler of the second one straight away, as long as the
+    // next slot still holds the kind of instruction it was fused with. Anything else goes through dispatch as usual
+    #define FUSED(second, handler) do { \
+        if (d[1].op != (second) || !budget) DISPATCH(); \
+        budget--; \
+        pc++; \
+        d++; \
+        goto handler; \
+    } while (0)
+    op_add_br:
+        DO_ADD();
+        FUSED(BR, op_br);
+    op_add_add:
+        DO_ADD();
+        FUSED(ADD, op_add);
+    op_and_add:
+        DO_AND();
+        FUSED(ADD, op_add);
+    op_not_add:
+        DO_NOT();
+        FUSED(ADD, op_add);
+    op_ldr_add:
+        DO_LDR();
+        FUSED(ADD, op_add);
+    op_add_str:
+        DO_ADD();
+        if (d[1].op == OP_STR_DATA){
+            FUSED(OP_STR_DATA, op_str_data);
+        }
+        FUSED(STR, op_str);
+    op_ldr_str:
+        DO_LDR();
+        if (d[1].op == OP_STR_DATA){
+            FUSED(OP_STR_DATA, op_str_data);
+        }
+        FUSED(STR, op_str);
+    op_ld_add:
+        DO_LD();
+        FUSED(ADD, op_add);
+    op_lea_trap:
+        DO_LEA();
+        FUSED(TRAP, op_trap);
+    // the same with the second one counting block entries, for the JIT
+    op_add_br_jit:
+        DO_ADD();
+        FUSED(BR, op_br_jit);
+    op_lea_trap_jit:
+        DO_LEA();
+        FUSED(TRAP, op_trap_jit);
+    #undef FUSED
+
+    // virtual time
+    #define TIMED(load) do { \
+        vm->reg[R_PC] = pc; \
+        vm->budget = budget; \
+        load; \
+        budget = vm->budget; \
+    } while (0)
+    op_ld_timed:
+        TIMED(vm->reg[d->r0] = mem_read(vm, pc + d->imm));
+        flags = vm->reg[d->r0];
+        DISPATCH();
+    op_ldr_timed:
+        TIMED(vm->reg[d->r0] = mem_read(vm, vm->reg[d->r1] + d->imm));
+        flags = vm->reg[d->r0];
+        DISPATCH();
+    op_ldi_timed:
+        TIMED(vm->reg[d->r0] = mem_read(vm, mem_read(vm, pc + d->imm)));
+        flags = vm->reg[d->r0];
+        DISPATCH();
+    op_sti_timed:
+        TIMED(mem_write(vm, mem_read(vm, pc + d->imm), vm->reg[d->r0]));
+        PAGES_CHANGED();
+        DISPATCH();
+    op_decode_timed:
+        vm->budget = budget;
+        goto op_decode;
+
+    // watchpoints: the access has happened and the instruction has run when it stops
+    #define WATCH(watch, address, reason) do { \
+        if (watch_hit(vm, watch, address, reason)) goto watch_stop; \
+    } while (0)
+
+    op_ld_watch:
+    {
+        uint16_t address = pc + d->imm;
+        vm->budget = budget;  // for virtual time, see op_ld_timed
+        vm->reg[d->r0] = mem_read(vm, address);
+        flags = vm->reg[d->r0];
+        WATCH(vm->watch_read, address, STOP_WATCH_READ);
+        DISPATCH();
+    }
+    op_st_watch:
+    {
+        uint16_t address = pc + d->imm;
+        mem_write(vm, address, vm->reg[d->r0]);
+        PAGES_CHANGED();
+        WATCH(vm->watch_write, address, STOP_WATCH_WRITE);
+        DISPATCH();
+    }
+    op_ldr_watch:
+    {
+        uint16_t address = vm->reg[d->r1] + d->imm;
+        vm->budget = budget;
+        vm->reg[d->r0] = mem_read(vm, address);
+        flags = vm->reg[d->r0];
+        WATCH(vm->watch_read, address, STOP_WATCH_READ);
+        DISPATCH();
+    }
+    op_str_watch:
+    {
+        uint16_t address = vm->reg[d->r1] + d->imm;
+        mem_write(vm, address, vm->reg[d->r0]);
+        PAGES_CHANGED();
+        WATCH(vm->watch_write, address, STOP_WATCH_WRITE);
+        DISPATCH();
+    }
+    op_ldi_watch:
+    {
+        uint16_t pointer = pc + d->imm;
+        vm->budget = budget;
+        uint16_t address = mem_read(vm, pointer);
+        vm->reg[d->r0] = mem_read(vm, address);
+        flags = vm->reg[d->r0];
+        WATCH(vm->watch_read, pointer, STOP_WATCH_READ);
+        WATCH(vm->watch_read, address, STOP_WATCH_READ);
+        DISPATCH();
+    }
+    op_sti_watch:
+    {
+        uint16_t pointer = pc + d->imm;
+        vm->budget = budget;
+        uint16_t address = mem_read(vm, pointer);
+        mem_write(vm, address, vm->reg[d->r0]);
+        PAGES_CHANGED();
+        WATCH(vm->watch_read, pointer, STOP_WATCH_READ);
+        WATCH(vm->watch_write, address, STOP_WATCH_WRITE);
+        DISPATCH();
+    }
+    watch_stop:
+        vm->reg[R_PC] = pc;
+        vm->cond_value = flags;
+        vm->budget = budget;
+        return;
+    #undef WATCH
+
+    // profiling: the control transfers are counted
+    op_br_prof:
+        if (cond_flags(flags) & d->r0){
+            uint16_t from = pc - 1;
+            pc += d->imm;
+            profile_jump(profile, from, pc);
+        }
+        DISPATCH();
+    op_jsr_prof:
+        vm->reg[R_R7] = pc;
+        pc = d->flag ? (uint16_t)(pc + d->imm) : vm->reg[d->r1];
+        profile_call(profile, vm->reg[R_R7] - 1, pc);
+        DISPATCH();
+    op_jmp_prof:
+    {
+        uint16_t from = pc - 1;
+        pc = vm->reg[d->r1];
+        (d->r1 == R_R7 ? profile_return : profile_jump)(profile, from, pc);
+        DISPATCH();
+    }
+
+    // JIT mode: the control transfers count block entries, OP_JIT runs compiled blocks
+    op_br_jit:
+        if (cond_flags(flags) & d->r0){
+            pc += d->imm;
+            goto block_entry;
+        }
+        DISPATCH();
+    op_jsr_jit:
+        vm->reg[R_R7] = pc;
+        pc = d->flag ? (uint16_t)(pc + d->imm) : vm->reg[d->r1];
+        goto block_entry;
+    op_jmp_jit:
+        pc = vm->reg[d->r1];
+        goto block_entry;
+    op_trap_jit:
+        vm->reg[R_PC] = pc;
+        vm->cond_value = flags;
+        vm->budget = budget;
+        if (!execute_trap(vm, d->imm)){
+            return;
+        }
+        pc = vm->reg[R_PC];
+        flags = vm->cond_value;
+        PAGES_CHANGED();
+        goto block_entry;
+    block_entry:
+        if (++vm->jit_counts[pc] == JIT_THRESHOLD){
+            jit_compile(vm, pc);
+            PAGES_CHANGED();
+        }
+        DISPATCH();
+    op_jit:
+    {
+        uint16_t start = pc - 1;
+        uint16_t block = d->imm;
+        d = jit_entry_instr(vm, block);
+        // DISPATCH() already counted the first instruction, the block only runs if the budget covers a whole pass
+        if (budget + 1 >= jit_block_len(vm, block)){
+            vm->cond_value = flags;
+            vm->budget = budget + 1;
+            pc = jit_execute(vm, block);
+            flags = vm->cond_value;
+            budget = vm->budget;
+            if (pc != start){
+                goto block_entry;
+            }
+            // the block left before finishing its first instruction (or had no budget left to loop), so that one runs here
+            if (!budget){
+                goto out_of_steps;
+            }
+            budget--;
+            pc++;
+        }
+        goto *dispatch[d->op];
+    }
+
+    #undef DO_ADD
+    #undef DO_AND
+    #undef DO_NOT
+    #undef DO_LD
+    #undef DO_LDR
+    #undef DO_LEA
+    #undef DISPATCH
+    #undef PAGES_CHANGED
+}
+
+#else
+
+void run_threaded(VM* vm, int use_jit){
+    (void)use_jit;
+    run_switch(vm);
+}
+
+#endif
+
+// trap routines---------------------------------------------------------------------------------
+
+static int trap_getc(VM* vm){
+
+    // reads a single ASCII char
+    vm->reg[R_R0] = io_getchar(vm);
+
+    //Reads a single character from input without echo
+    //Stores it in R0
+    //Updates condition flags based on the character's value
+
+    update_flags(vm, R_R0);
+    return 1;
+}
+
+static int trap_out(VM* vm){
+
+    io_putc(vm, (char)vm->reg[R_R0]);
+    io_output_done(vm);
+    /*
+    Outputs the character in R0 to the screen.
+    io_output_done(vm) writes it out now, or once enough output has built up (see out_flush_ms).
+    */
+    return 1;
+}
+
+static int trap_puts(VM* vm){
+
+    // one char per 16 bit word
+    uint16_t c = vm->reg[R_R0]; // address of the first character
+    io_puts_words(vm, c);
+    //Each word is cast to an 8-bit char and copied into the output buffer, up to the zero word that ends the string
+    io_output_done(vm);
+    return 1;
+}
+
+static int trap_in(VM* vm){
+
+    io_write(vm, "Enter a character: ", 19); //prompt user to enter a character
+    char c = io_getchar(vm);   // this writes the prompt out first
+    io_putc(vm, c);    //echoes it back
+    io_output_done(vm);
+    vm->reg[R_R0] = (uint16_t)c;        // stores it in R0
+    update_flags(vm, R_R0);         // updates flags
+    return 1;
+}
+
+static int trap_putsp(VM* vm){
+
+    /*
+    The TRAP_PUTSP routine in the LC-3 emulator is used to print strings stored in memory with two characters per word, also known as packed strings. This is more space-efficient than TRAP_PUTS, which uses one character per 16-bit word.
+    */
+
+    //for example
+
+    /*
+    memory[0x3000] = 0x6548; // 'H' (0x48), 'e' (0x65)
+    memory[0x3001] = 0x6C6C; // 'l', 'l'
+    memory[0x3002] = 0x006F; // 'o', '\0'
+    reg[R_R0] = 0x3000;
+
+    */
+
+    //storing characters this way is more space efficient 
+
+    uint16_t c = vm->reg[R_R0];  // c is the address of the first word of the packed string 
+    io_putsp_words(vm, c);   // the low byte of each word first, then the high byte if it is non-zero
+    io_output_done(vm);
+    return 1;
+}
+
+static int trap_halt(VM* vm){
+
+    io_write(vm, "HALT\n", 5);
+    io_flush(vm);
+    vm->status = VM_HALTED;
+    return 0;        // stops the execution loop
+}
+
+const trap_handler standard_traps[256] = {
+    [TRAP_GETC] = trap_getc,
+    [TRAP_OUT] = trap_out,
+    [TRAP_PUTS] = trap_puts,
+    [TRAP_IN] = trap_in,
+    [TRAP_PUTSP] = trap_putsp,
+    [TRAP_HALT] = trap_halt
+};
+
+// makes handler the one for vector on this VM (NULL for a trap that does nothing), the others stay as they were
+int vm_set_trap(VM* vm, uint8_t vector, trap_handler handler){
+
+    if (!vm->traps){
+        vm->traps = malloc(sizeof(standard_traps));
+        if (!vm->traps){
+            return 0;
+        }
+        memcpy(vm->traps, standard_traps, sizeof(standard_traps));
+    }
+    vm->traps[vector] = handler;
+    return 1;
+}
+
+// executes the trap routine selected by the low 8 bits of instr, returns 0 once the program has halted, or has to
+// wait for input
+int execute_trap(VM* vm, uint16_t instr){
+
+    trap_handler handler = (vm->traps ? vm->traps : standard_traps)[instr & 0xFF];
+    int reads = handler == trap_getc || handler == trap_in || handler == host_trap_read;
+    if (vm->in_can_wait && reads && !vm->io->key_ready(vm)){
+        // nothing to read yet, the TRAP runs again once there is (vm_add_input()), as if it had not been reached
+        vm->reg[R_PC]--;
+        vm->budget++;
+        vm->status = VM_WAITING_INPUT;
+        return 0;
+    }
+    if (vm->journal){
+        journal_trap(vm, instr);
+    }
+    if (vm->metrics){
+        metrics_trap(vm->metrics, instr & 0xFF);
+    }
+
+    vm->reg[R_R7] = vm->reg[R_PC];
+    return handler ? handler(vm) : 1;
 }
 
 uint16_t sign_extend(uint16_t x, int num_bits){
@@ -450,16 +1874,36 @@ uint16_t sign_extend(uint16_t x, int num_bits){
     return x;
 };
 
-void update_flags(uint16_t r){
+// remembers the value the condition codes come from, they are only worked out when a BR tests them (see cond_flags())
+void update_flags(VM* vm, uint16_t r){
 
-    if (reg[r]==0){
-        reg[R_COND] = FL_ZERO;
-    } else if (reg[r]>>15){
-        reg[R_COND] = FL_NEG;
-    } else {
-        reg[R_COND] = FL_POS;
+    vm->cond_value = vm->reg[r];
+
+}
+
+// registers as the program sees them, R_COND is worked out from the lazy condition code state
+uint16_t reg_read(VM* vm, int r){
+
+    if (r == R_COND){
+        return cond_flags(vm->cond_value);
     }
+    return vm->reg[r];
+}
+
+void reg_write(VM* vm, int r, uint16_t val){
 
+    if (r == R_COND){
+        // pick a value that produces the requested flag, only one of N, Z and P can be set at a time
+        if (val & FL_NEG){
+            vm->cond_value = 0x8000;
+        } else if (val & FL_ZERO){
+            vm->cond_value = 0;
+        } else {
+            vm->cond_value = 1;
+        }
+        return;
+    }
+    vm->reg[r] = val;
 }
 
 //LC-3 programs are big-endian, but most modern computers are little-endian. So, we need to swap each uint16 that is loaded
@@ -485,59 +1929,279 @@ uint16_t swap16(uint16_t x){
 
 }
 
-void read_image_file(FILE* file){
-    //the code for reading an LC-3 program into memory
+inline void mem_write(VM* vm, uint16_t address, uint16_t val)
+{
+    analysis_written(vm, address);  // the proof was about the code as it was
+    int page = address >> PAGE_SHIFT;
+    vm_page* p = vm->page_owned[page] ? vm->pages[page] : vm_own_page(vm, page);  // copy on write
+    vm->page_dirty[page] = 1;
+    p->words[address & (PAGE_WORDS - 1)] = val;
+    p->decoded[address & (PAGE_WORDS - 1)].op = OP_DECODE;  // the word may be code, so its decoded form is out of date now
+    if (vm->jit && vm->jit_code_map[address]){
+        jit_invalidate(vm, address);  // it is code, and compiled blocks have a copy of it
+    }
+    if (address == MR_BLOCK_CONTROL && vm->block){
+        block_control(vm, val);  // the transfer, see lc3_block.c
+    }
+}
+
+/*
+Virtual time (io_virtual, see lc3_vm.h): a program waiting for a key in a loop of its own,
 
-    uint16_t origin;
-    fread(&origin, sizeof(origin), 1, file);  //reads the first 16 bits of the file into origin
-    origin = swap16(origin);
+    POLL    LDI R1, KBSR        (or LDR R1, R2, #0 with R2 holding xFE00)
+            BRzp POLL
 
-    uint16_t max_read = MAX_MEMORY - origin;  //computes how many words we can safely load without going out of bounds.
+does nothing but go round it until the key arrives, every pass the same two instructions with the same results. So
+when the load finds nothing there, the passes up to the next arrival are taken off the budget in one go (as many as
+the budget has room for), and the load looks again at the time the last of them would have. The program, vm->steps
+and where vm_run() stops all come out exactly the same as going round, the host just does not do the work. Returns 1
+if the clock moved.
 
-    uint16_t* p = memory + origin;  //p now points to the memory address where the program should begin loading e.g., memory[0x3000]
-    size_t read = fread(p, sizeof(uint16_t), max_read, file); //reads up to max_read 16-bit words from the file into memory, starting at p
+Breakpoints, watchpoints, the profile, the journal and traces would all miss the passes, with any of them on the
+loop goes round the long way.
+*/
+static int skip_polling(VM* vm){
+
+    if (vm->breakpoints || vm->stop_at != VM_NO_STOP || vm->watch_read || vm->watch_write || vm->profile ||
+        vm->journal || vm->trace){
+        return 0;
+    }
+    uint16_t at = vm->reg[R_PC] - 1;  // the load, PC is past it
+    decoded_instr load, branch;
+    decode_instr(vm_peek(vm, at), &load);
+    decode_instr(vm_peek(vm, (uint16_t)(at + 1)), &branch);
+    int loop = (load.op == LDI || (load.op == LDR && load.r1 != load.r0)) && branch.op == BR &&
+        (branch.r0 & (FL_NEG | FL_ZERO)) == FL_ZERO && branch.imm == (uint16_t)-2;
+    if (!loop){
+        return 0;
+    }
+    uint64_t now = vm_clock(vm);
+    uint64_t next = io_next_arrival(vm);
+    uint64_t passes = vm->budget / 2;  // a BR and a load each
+    if (next != UINT64_MAX){
+        uint64_t wanted = (next - now) / 2 + 1;  // the load of the last one sees a clock past next
+        passes = wanted < passes ? wanted : passes;
+    } else if (vm->budget > UINT64_MAX / 2){
+        return 0;  // nothing more is coming and the run has no end, going round is all the program does from now on
+    }
+    vm->budget -= 2 * passes;
+    return passes != 0;
+}
 
-    // swap to little endian
-    while (read-- > 0)
+// what reading KBSR or KBDR does besides handing back the word, out of line so the check in mem_read() is all the
+// other loads pay for
+static void keyboard_read(VM* vm, uint16_t address)
+{
+    if (address == MR_KBDR)
+    {
+        if (vm->interrupts)
+        {
+            device_word(vm, MR_KBSR) &= ~KBSR_READY;  // reading the key takes it, the next poll or interrupt gets another one
+            vm->page_dirty[DEVICE_PAGE >> PAGE_SHIFT] = 1;
+        }
+        return;
+    }
+    if (vm->profile){
+        vm->profile->kbsr_polls++;
+    }
+    if (vm->metrics){
+        metrics_kbsr_poll(vm->metrics);
+    }
+    if (vm->interrupts)
+    {
+        // KBSR_IE stays as the program set it, and a key nobody has read from KBDR yet stays there
+        uint16_t kbsr = device_word(vm, MR_KBSR);
+        if (!(kbsr & KBSR_READY) && (check_key(vm) || (vm->io == &io_virtual && skip_polling(vm) && check_key(vm))))
+        {
+            device_word(vm, MR_KBSR) = kbsr | KBSR_READY;
+            device_word(vm, MR_KBDR) = io_getchar(vm);
+        }
+    }
+    else if (check_key(vm) || (vm->io == &io_virtual && skip_polling(vm) && check_key(vm)))
+    {
+        device_word(vm, MR_KBSR) = (1 << 15);
+        device_word(vm, MR_KBDR) = io_getchar(vm);
+    }
+    else
+    {
+        device_word(vm, MR_KBSR) = 0;
+    }
+    vm->page_dirty[DEVICE_PAGE >> PAGE_SHIFT] = 1;
+}
+
+inline uint16_t mem_read(VM* vm, uint16_t address)
+{
+    if ((address | 2) == MR_KBDR)  // KBSR or KBDR
     {
-        *p = swap16(*p);
-        ++p;
+        keyboard_read(vm, address);
     }
+    return vm_peek(vm, address);
+}
 
+// interrupts---------------------------------------------------------------------------------
 
+// a word onto the stack R6 points at and back off it, the same as an ST and an LD would
+static void push(VM* vm, uint16_t val){
+    vm->reg[R_R6]--;
+    mem_write(vm, vm->reg[R_R6], val);
 }
 
+static uint16_t pop(VM* vm){
+    return mem_read(vm, vm->reg[R_R6]++);
+}
 
-int read_image(const char* image_path){
-    FILE* file = fopen(image_path, "rb");
-    if (!file){
-        return 0;
-        };
-    read_image_file(file);
-    fclose(file);
+// goes to the handler of vector in supervisor mode at priority, with the PSR and PC of the program it interrupted
+// on the supervisor stack
+static void interrupt(VM* vm, uint8_t vector, uint16_t priority){
+
+    uint16_t psr = vm->psr | cond_flags(vm->cond_value);
+    if (vm->psr & PSR_USER){
+        vm->saved_usp = vm->reg[R_R6];
+        vm->reg[R_R6] = vm->saved_ssp;
+    }
+    push(vm, psr);
+    push(vm, vm->reg[R_PC]);
+    vm->psr = (uint16_t)(priority << 8);
+    vm->reg[R_PC] = mem_read(vm, (uint16_t)(device_word(vm, MR_VECTORS) + vector));
+}
+
+// a program sitting on a BRnzp to itself with the keyboard interrupt on, it has nothing to do until the key comes
+static int idle(VM* vm){
+    return vm_peek(vm, vm->reg[R_PC]) == 0x0FFF && (device_word(vm, MR_KBSR) & KBSR_IE) && vm->io != &io_virtual;
+}
+
+// RTI and the reserved opcode, which do nothing unless vm->interrupts is set (see lc3_vm.h). Returns 0 when RTI
+// goes back to a program that is idle(), the run stops there so take_interrupts() can wait for the key
+int execute_system(VM* vm, uint16_t op){
+
+    if (!vm->interrupts){
+        return 1;
+    }
+    uint16_t priority = (vm->psr & PSR_PRIORITY) >> 8;
+    if (op == RES){
+        interrupt(vm, VECTOR_ILLEGAL, priority);
+        return 1;
+    }
+    if (vm->psr & PSR_USER){
+        interrupt(vm, VECTOR_PRIVILEGE, priority);  // only handlers return from interrupts
+        return 1;
+    }
+    vm->reg[R_PC] = pop(vm);
+    uint16_t psr = pop(vm);
+    vm->psr = psr & (PSR_USER | PSR_PRIORITY);
+    reg_write(vm, R_COND, psr & (FL_NEG | FL_ZERO | FL_POS));
+    if (vm->psr & PSR_USER){
+        vm->saved_ssp = vm->reg[R_R6];
+        vm->reg[R_R6] = vm->saved_usp;
+    }
+    return !idle(vm);
+}
+
+// the keyboard interrupt, if the program turned it on and is below its priority. For a program that is idle() this
+// waits for the key rather than going round (not in virtual time, where going round is how the time passes)
+int take_interrupts(VM* vm){
+
+    uint16_t kbsr = device_word(vm, MR_KBSR);
+    if (!(kbsr & KBSR_IE) || ((vm->psr & PSR_PRIORITY) >> 8) >= KEYBOARD_PRIORITY){
+        return 1;
+    }
+    if (!(kbsr & KBSR_READY)){
+        if (!check_key(vm)){
+            if (!idle(vm)){
+                return 1;
+            }
+            if (vm->in_can_wait){
+                vm->status = VM_WAITING_INPUT;  // vm_add_input() with the key, and the next vm_run() takes it
+                return 0;
+            }
+        }
+        device_word(vm, MR_KBDR) = io_getchar(vm);  // xFFFF at the end of the input
+        device_word(vm, MR_KBSR) = kbsr | KBSR_READY;
+        vm->page_dirty[DEVICE_PAGE >> PAGE_SHIFT] = 1;
+    }
+    interrupt(vm, VECTOR_KEYBOARD, KEYBOARD_PRIORITY);
     return 1;
 }
 
+// turns the rest of the ISA on, for a VM that has not run yet (--interrupts)
+void vm_start_interrupts(VM* vm){
 
+    vm->interrupts = 1;
+    vm_journal_stop(vm);  // it cannot undo interrupts (see vm_journal_start())
+    device_word(vm, MR_VECTORS) = VECTORS_START;
+    vm->page_dirty[DEVICE_PAGE >> PAGE_SHIFT] = 1;
+}
 
-void mem_write(uint16_t address, uint16_t val)
-{
-    memory[address] = val;
+// instruction decoding---------------------------------------------------------------------------------
+
+void decode_instr(uint16_t instr, decoded_instr* d){
+
+    d->op = instr >> 12;
+    d->r0 = (instr >> 9) & 0x7;
+    d->r1 = (instr >> 6) & 0x7;
+    d->r2 = instr & 0x7;
+    d->flag = 0;
+    d->imm = 0;
+
+    switch (d->op){
+        case BR:
+        case LD:
+        case ST:
+        case LDI:
+        case STI:
+        case LEA:
+            d->imm = sign_extend(instr & 0x1FF, 9);  // for BR, r0 already holds the nzp bits
+            break;
+        case ADD:
+        case AND:
+            d->flag = (instr >> 5) & 0x1;
+            d->imm = sign_extend(instr & 0x1F, 5);
+            break;
+        case JSR:
+            d->flag = (instr >> 11) & 0x1;
+            d->imm = sign_extend(instr & 0x7FF, 11);
+            break;
+        case LDR:
+        case STR:
+            d->imm = sign_extend(instr & 0x3F, 6);
+            break;
+        case TRAP:
+            d->imm = instr & 0xFF;
+            break;
+    }
 }
 
-uint16_t mem_read(uint16_t address)
-{
-    if (address == MR_KBSR)
-    {
-        if (check_key())
-        {
-            memory[MR_KBSR] = (1 << 15);
-            memory[MR_KBDR] = getchar();
+// decodes the word at address into its slot and returns it, device page words are decoded into scratch instead
+const decoded_instr* decode_slot(VM* vm, uint16_t address, decoded_instr* scratch){
+
+    if (vm->analysis){
+        analysis_reached(vm, address, address + 1);  // execution got somewhere the analysis did not see coming
+    }
+    if (address >= DEVICE_PAGE){
+        if (address == 0xFFFF && vm->profile){
+            vm->profile->last_word_runs++;  // the threaded engine decodes device page words every time they run
         }
-        else
-        {
-            memory[MR_KBSR] = 0;
+        decode_instr(mem_read(vm, address), scratch);
+        return scratch;
+    }
+    vm_page* p = vm_own_page(vm, address >> PAGE_SHIFT);  // shared pages never need this, they are decoded already
+    decode_page_word(p, address & (PAGE_WORDS - 1));
+    return &p->decoded[address & (PAGE_WORDS - 1)];
+}
+
+// decodes the pages the VM has its own copy of up front, so a program never has to stop at OP_DECODE unless it
+// rewrites itself. Shared pages were decoded when their template was made
+void predecode_memory(VM* vm){
+
+    for (int page = 0; page < DEVICE_PAGE >> PAGE_SHIFT; page++){
+        if (!vm->page_owned[page]){
+            continue;
+        }
+        vm_page* p = vm->pages[page];
+        for (int i = 0; i < PAGE_WORDS; i++){
+            if (p->decoded[i].op == OP_DECODE){
+                decode_page_word(p, i);
+            }
         }
     }
-    return memory[address];
-}
\ No newline at end of file
+}
@@ -0,0 +1,908 @@
+#ifndef LC3_VM_H
+#define LC3_VM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define MAX_MEMORY (1 << 16)  // this shifts the 1 to the left by 16 places
+
+typedef struct VM VM;  // everything one LC-3 machine needs, defined further down
+
+//registers----------------------------------------------------------------------------------
+
+enum {
+
+    R_R0 = 0,
+    R_R1,
+    R_R2,
+    R_R3,
+    R_R4,
+    R_R5,
+    R_R6,
+    R_R7,
+    R_PC,
+    R_COND,
+    R_COUNT
+};
+
+/*
+The condition codes are evaluated lazily. Instead of working out N/Z/P after every ADD, AND, NOT, LD, LDR, LDI, LEA
+and GETC, the engines only remember the value that would have set them in cond_value, and BR works the flags out
+from it when it actually tests them. Most results are overwritten before any branch looks at them, so this takes a
+data dependent branch off nearly every instruction.
+
+reg[R_COND] is not kept up to date, anything outside the engines has to go through reg_read()/reg_write().
+*/
+
+// the condition code (FL_NEG, FL_ZERO or FL_POS) for a value, without branching
+static inline uint16_t cond_flags(uint16_t value){
+    return (uint16_t)(1 << ((value == 0) | ((value >> 15) << 1)));  // FL_POS << 0, 1 or 2
+}
+
+uint16_t reg_read(VM* vm, int r);
+void reg_write(VM* vm, int r, uint16_t val);
+
+// instruction set----------------------------------------------------------------------------------
+
+enum {
+
+    BR = 0, /* branch */
+    ADD,    /* add  */
+    LD,     /* load */
+    ST,     /* store */
+    JSR,    /* jump register */
+    AND,    /* bitwise and */
+    LDR,    /* load register */
+    STR,    /* store register */
+    RTI,    /* return from interrupt, does nothing without vm->interrupts */
+    NOT,    /* bitwise not */
+    LDI,    /* load indirect */
+    STI,    /* store indirect */
+    JMP,    /* jump */
+    RES,    /* reserved (unused), the illegal opcode exception with vm->interrupts */
+    LEA,    /* load effective address */
+    TRAP    /* execute trap */
+
+};
+
+//condition flags----------------------------------------------------------------------------------
+
+enum {
+    //represent individual bits in a bit field, allowing the use of bitwise operations to store and check multiple flags efficiently in a single integer
+
+    FL_POS = 1,  // 0001
+    FL_ZERO = 2, // 0010
+    FL_NEG = 4   // 0100
+
+    //this way we can easily
+    /*
+    
+    Set a flag: flags |= FL_POS;
+
+    Clear a flag: flags &= ~FL_POS;
+
+    Check a flag: if (flags & FL_POS) {...}
+
+    */
+
+    /*
+    this is a more standard way of writing it
+
+    FL_POS = 1 << 0, 
+    FL_ZERO = 1 << 1, 
+    FL_NEG = 1 << 2, 
+    
+    */
+
+};
+
+
+enum {
+
+    // trap routines
+
+    TRAP_GETC = 0x20,   // get character from keyboard, not echoed onto the terminal , 0b00100000
+    TRAP_OUT = 0x21,    // output a character  0b00100001
+    TRAP_PUTS = 0x22,   // output a word string     0b00100010
+    TRAP_IN = 0x23,     // get character from keyboard, echoed onto the terminal        0b00100011
+    TRAP_PUTSP = 0x24,  // output a byte program    0b00100100
+    TRAP_HALT = 0x25,   // halt the program     0b00100101
+
+    // host traps, not there unless vm_add_host_traps() (--host-traps) adds them, see lc3_traps.c
+
+    TRAP_MUL = 0x30,    // R0 = R0 * R1
+    TRAP_DIV = 0x31,    // R0 = R0 / R1 and R1 = the remainder, signed
+    TRAP_MEMCPY = 0x32, // copy R2 words from R1 to R0
+    TRAP_MEMSET = 0x33, // set R2 words from R0 on to R1
+    TRAP_READ = 0x34,   // read up to R1 characters into the words from R0 on, R0 = how many
+    TRAP_WRITE = 0x35,  // write the R1 characters in the words from R0 on
+    TRAP_CLOCK = 0x36,  // R1:R0 = milliseconds, or instructions executed in virtual time
+    TRAP_SWAP = 0x37    // R0 = the word at R1 and the word at R1 = R0 in one atomic step, for locks between cores
+
+};
+
+/*
+Every trap vector has a handler in a table of 256, NULL for the vectors that do nothing (like the original VM did
+for all but the six above). A handler runs with R7 and PC already pointing past the TRAP, and returns 1 for the
+program to carry on or 0 to end the run with vm->status set, like TRAP_HALT does. It may change R0, R1, the
+condition codes and memory (through mem_write()), the journal puts the registers back but not the memory, so a
+handler that writes memory calls vm_journal_clear() as well. A VM runs the standard_traps until vm_set_trap() gives
+it a table of its own.
+*/
+typedef int (*trap_handler)(VM* vm);
+
+extern const trap_handler standard_traps[256];
+
+int vm_set_trap(VM* vm, uint8_t vector, trap_handler handler);  // 0 if there is no memory for the table
+int vm_add_host_traps(VM* vm);
+int host_trap_read(VM* vm);  // TRAP_READ, waits for input like GETC does
+int host_trap_swap(VM* vm);  // TRAP_SWAP, which --cores gives every core even without --host-traps
+
+//memory mapped registers----------------------------------------------------------------------------------
+
+enum
+{
+    MR_KBSR = 0xFE00, // keyboard status
+    MR_KBDR = 0xFE02,   // keyboard data
+    // with vm->interrupts, see the interrupts section below. Every VM has a device page of its own, so every core has its own
+    MR_CORE = 0xFE10,   // the number of this core, 0 to MR_CORES - 1
+    MR_CORES = 0xFE12,  // how many cores the machine has
+    MR_VECTORS = 0xFE14,    // where this core's interrupt vector table starts, x0100 to begin with
+    // the block device, with a --block file. See the block device section below
+    MR_BLOCK_BUFFER = 0xFE20,       // where in memory the next transfer puts the words
+    MR_BLOCK_LENGTH = 0xFE22,       // how many words it fills at most
+    MR_BLOCK_OFFSET = 0xFE24,       // the byte of the file it starts at, the low 16 bits
+    MR_BLOCK_OFFSET_HIGH = 0xFE26,  // and the high 16. A transfer moves the offset on past what it read
+    MR_BLOCK_CONTROL = 0xFE28,      // storing BLOCK_READ or BLOCK_READ_PACKED here does the transfer
+    MR_BLOCK_STATUS = 0xFE2A,       // BLOCK_DONE and the other BLOCK_ bits, for the last one
+    MR_BLOCK_COUNT = 0xFE2C,        // the words it filled
+    MR_BLOCK_SIZE = 0xFE2E,         // the size of the file in bytes, the low 16 bits
+    MR_BLOCK_SIZE_HIGH = 0xFE30     // and the high 16
+};
+
+enum {
+    KBSR_READY = 1 << 15,   // a key is waiting in KBDR
+    KBSR_IE = 1 << 14       // the program set it to have the key interrupt it instead of polling, with vm->interrupts
+};
+
+
+//decoded instruction cache----------------------------------------------------------------------------------
+
+/*
+Decoding an instruction (shifting out the opcode, masking the register fields, sign extending the offset) gives the
+same answer every time the same word is executed, so the threaded engine does it once per memory location and keeps
+the result in a slot next to the word (see vm_page below). A slot only has to be decoded again when something writes
+over that word, which is why mem_write() resets the slot to OP_DECODE, the next time it is executed it gets decoded
+from the new value.
+
+Some pairs of instructions are decoded as one superinstruction, which saves a dispatch whenever the second one runs
+straight after the first. The second slot stays an ordinary instruction (it can be a branch target), and the
+engine checks that it still holds the kind of instruction it was fused with before running it that way, so a store
+over the second word needs nothing more than setting its own slot to OP_DECODE.
+
+Words in the device page (0xFE00 and up) are never cached, reading them can have side effects (see mem_read())
+*/
+
+enum {
+    OP_DECODE = 16, // pseudo opcode for a slot that has to be (re)decoded before it can run
+    OP_JIT,         // the slot starts a JIT compiled block, imm holds the block number (see lc3_jit.c)
+    // superinstructions: the slot holds the first of two instructions that often come together, and the threaded
+    // engine runs the one in the next slot without going back through dispatch (see decode_page_word())
+    OP_ADD_BR,      // counting down to a branch, or comparing: ADD R3, R3, #-1 / BRp LOOP
+    OP_ADD_ADD,
+    OP_AND_ADD,     // loading a constant: AND R0, R0, #0 / ADD R0, R0, #5
+    OP_NOT_ADD,     // negating: NOT R1, R1 / ADD R1, R1, #1
+    OP_LDR_ADD,     // read-modify-write, with...
+    OP_ADD_STR,     // ...this for the second half
+    OP_LDR_STR,     // copying a word
+    OP_LD_ADD,
+    OP_LEA_TRAP,    // LEA R0, MESSAGE / PUTS
+    // stores vm_analyze() proved never write over code, they write the word and nothing else (see lc3_analysis.c)
+    OP_ST_DATA,
+    OP_STR_DATA,
+    // instructions whose mode bits were settled when they were decoded, so their handlers do not test them
+    OP_ADD_IMM,
+    OP_ADD_REG,
+    OP_AND_IMM,
+    OP_AND_REG,
+    OP_JSR_OFFSET,  // JSR
+    OP_JSRR,
+    OP_BR_NEVER,    // a BR with no nzp bits, it does nothing. The seven after it are OP_BR_NEVER + the nzp mask
+    OP_BR_P, OP_BR_Z, OP_BR_ZP, OP_BR_N, OP_BR_NP, OP_BR_NZ,
+    OP_BR_ALWAYS,   // BRnzp (and BR written without flags), an unconditional jump
+    OP_COUNT
+};
+// the first superinstruction. It and everything after it stands for the plain instruction in fused_first[] wherever
+// every instruction has to be looked at on its own (watchpoints, breakpoints, the profile, the journal, traces)
+enum { OP_FUSED = OP_ADD_BR };
+
+enum { DEVICE_PAGE = 0xFE00 };
+
+enum {
+    ENGINE_SWITCH = 0,  // run_switch(), decodes every instruction each time
+    ENGINE_THREADED,    // run_threaded(), dispatches out of the decoded slots
+    ENGINE_JIT          // run_threaded() that also compiles hot blocks to native code
+};
+
+typedef struct {
+    uint8_t op;     // opcode (BR..TRAP), OP_DECODE, OP_JIT, a superinstruction, a proved store or a specialized form
+    uint8_t r0;     // DR/SR field (bits 11-9), or the nzp mask for BR
+    uint8_t r1;     // SR1/BaseR field (bits 8-6)
+    uint8_t r2;     // SR2 field (bits 2-0)
+    uint8_t flag;   // immediate bit (bit 5) for ADD/AND, PC-relative bit (bit 11) for JSR
+    uint16_t imm;   // already sign extended immediate or offset, the trap vector for TRAP
+} decoded_instr;
+
+//input/output (lc3_io.c)----------------------------------------------------------------------------------
+
+typedef struct {
+    const char* name;
+    int (*open)(VM* vm);        // set up the terminal/input before the program runs
+    void (*close)(VM* vm);      // put the terminal back the way it was
+    int (*key_ready)(VM* vm);   // nonzero if a character can be read without waiting
+    int (*read_char)(VM* vm);   // next input character, waits for one, EOF at the end of the input
+    void (*write)(VM* vm, const char* s, size_t n);  // program output, called with whole buffers (see io_flush())
+} io_backend;
+
+extern const io_backend io_console;     // interactive terminal
+extern const io_backend io_headless;    // stdin is a pipe or a file
+extern const io_backend io_memory;      // input from vm_set_input(), output collected in vm->output
+extern const io_backend io_virtual;     // input from vm_input_at(), in virtual time, output to stdout
+
+const io_backend* io_backend_named(const char* name);
+const io_backend* io_default_backend(void);
+
+void disable_input_buffering(VM* vm);
+void restore_input_buffering(VM* vm);
+uint16_t check_key(VM* vm);
+uint16_t io_getchar(VM* vm);
+
+/*
+Virtual time. With io_virtual the clock is the number of instructions executed (vm_clock()), and every piece of
+input arrives at a set time on it: vm_input_at(vm, n, ...) text can be read once n instructions have run. A KBSR
+poll compares two numbers instead of asking the OS, so a program gets its input at exactly the same point in every
+run, whichever engine runs it, however fast the host is and whatever else it is doing.
+
+GETC and IN take the next character straight away, if it has not arrived yet they wait for it without any
+instructions running. A program that polls KBSR in a loop of its own does not have to go round it until the clock
+gets there either, mem_read() spots the loop and counts off the instructions it would have run in one go (see
+skip_polling()).
+*/
+typedef struct {
+    uint64_t at;    // arrives once this many instructions have run
+    size_t end;     // the text ends here in vm->in_data, it starts where the one before ends
+} vm_input_event;
+
+void vm_input_at(VM* vm, uint64_t at, const char* data, size_t size);
+int vm_load_input_events(VM* vm, const char* path);
+uint64_t io_next_arrival(VM* vm);
+
+/*
+Program output. The output traps append to vm->out_buf instead of writing each character straight to stdout, and
+the buffer is handed to the backend in one piece when:
+
+    - the program halts, or the VM exits
+    - the program is about to read input (GETC, IN, or a KBSR/KBDR read), so a prompt is always visible first
+    - the buffer is full
+    - an output trap finds that out_flush_ms milliseconds have gone by since the last write (0 writes after every
+      output trap, which is how the original VM behaved)
+
+With out_puts_write set, PUTS and PUTSP also write out as soon as the string is in the buffer, so every string
+reaches stdout in one piece with one write call instead of being split over two.
+*/
+enum { OUT_BUF_SIZE = 1 << 16 };
+
+void io_putc(VM* vm, char c);
+void io_write(VM* vm, const char* s, size_t n);
+void io_puts_words(VM* vm, uint16_t address);      // TRAP_PUTS, one character per word up to a zero word, wrapping around past 0xFFFF
+void io_putsp_words(VM* vm, uint16_t address);     // TRAP_PUTSP, two characters per word
+void io_write_words(VM* vm, uint16_t address, uint16_t count);  // TRAP_WRITE, count words as characters
+uint64_t io_clock(VM* vm);                         // TRAP_CLOCK, milliseconds, vm_clock() for io_virtual
+void io_output_done(VM* vm);                       // end of an output trap, writes out if the timer says so
+void io_flush(VM* vm);
+
+//memory pages----------------------------------------------------------------------------------
+
+/*
+Memory is split into 128 pages of 512 words, and a VM only has a table of pointers to them. Pages can be shared:
+a vm_template is a frozen machine (memory and registers, usually straight after loading an image), and every VM
+made from it starts out pointing at the template's pages. The first write to a page through mem_write() gives
+the VM its own copy (see vm_own_page()), so a thousand runs of the same image with different inputs keep one copy
+of the image between them, and making a VM from a template only copies the page table.
+
+Every page carries the decoded form of its words, so the decoded instructions are shared along with the words. A
+template decodes all its pages when it is made, which means a shared page never has to be decoded again. Memory
+nobody has written to points at one zero page that everyone shares.
+
+The device page (0xFE00 and up) is page 127, and every VM has its own copy of it from the start, mem_read() writes
+to it whenever the program polls the keyboard.
+*/
+
+enum {
+    PAGE_SHIFT = 9,
+    PAGE_WORDS = 1 << PAGE_SHIFT,           // 512 words
+    PAGE_COUNT = MAX_MEMORY / PAGE_WORDS    // 128 pages
+};
+
+typedef struct {
+    uint16_t words[PAGE_WORDS];
+    decoded_instr decoded[PAGE_WORDS];
+} vm_page;
+
+typedef struct {
+    vm_page* pages[PAGE_COUNT];
+    uint8_t page_owned[PAGE_COUNT];     // the pages this template allocated, the others it shares
+    uint16_t reg[R_COUNT];
+    uint16_t cond_value;
+} vm_template;
+
+//the machine----------------------------------------------------------------------------------
+
+/*
+All the state of one LC-3 machine lives in a VM, so a process can run as many programs as it likes side by side
+(see lc3_batch.c). The compiled JIT code addresses everything relative to the start of the struct (see lc3_jit.c).
+*/
+
+enum {
+    VM_RUNNING = 0,     // vm_run() used up its instruction budget, calling it again carries on
+    VM_HALTED,          // the program executed TRAP HALT
+    VM_STOPPED,         // PC reached vm->stop_at or a breakpoint, or a watchpoint was hit, see vm->stop_reason
+    VM_WAITING_INPUT    // GETC or IN found no input and vm->in_can_wait is set, the TRAP runs again next time
+};
+
+enum { VM_NO_STOP = MAX_MEMORY };  // stop_at for a VM that runs through, no PC can be equal to it
+
+enum {                  // vm->stop_reason, why vm_run() returned VM_STOPPED
+    STOP_NONE = 0,
+    STOP_AT,            // PC reached vm->stop_at
+    STOP_BREAKPOINT,    // PC reached a breakpoint
+    STOP_WATCH_READ,    // an LD, LDR or LDI read a watched address (vm->stop_address), that instruction has run
+    STOP_WATCH_WRITE    // an ST, STR or STI wrote one
+};
+
+enum { VM_WATCH_READ = 1, VM_WATCH_WRITE = 2 };    // for vm_set_watchpoint()
+
+struct jit_state;
+typedef struct vm_profile vm_profile;  // see lc3_profile.c
+typedef struct vm_journal vm_journal;  // see lc3_journal.c
+typedef struct vm_trace vm_trace;      // see lc3_trace.c
+typedef struct vm_analysis vm_analysis;  // see lc3_analysis.c
+typedef struct vm_metrics vm_metrics;    // see lc3_metrics.c
+typedef struct vm_block vm_block;        // see lc3_block.c
+struct trace_reader;
+
+struct VM {
+    vm_page* pages[PAGE_COUNT];         // memory is stored in 128 pages of 512 words, where each location can store 16 bits
+    uint8_t page_owned[PAGE_COUNT];     // 1 for pages this VM has its own copy of, the others belong to the template
+    uint8_t page_dirty[PAGE_COUNT];     // 1 for pages written since lc3_take_dirty_pages() last looked, for the debugger
+    const vm_template* base;            // where the shared pages come from, NULL for an empty machine
+    vm_page* spare_pages[PAGE_COUNT];   // pages a reset took back, there are never more than a VM can own
+    int spare_count;
+
+    uint16_t reg[R_COUNT];  // creating an array called reg, that has 11 locations, each able to store 16 bits of data
+    uint16_t cond_value;    // the value the condition codes come from, see above
+    int status;             // VM_RUNNING, VM_HALTED, VM_STOPPED or VM_WAITING_INPUT
+    int engine;             // ENGINE_SWITCH, ENGINE_THREADED or ENGINE_JIT
+    uint64_t steps;         // instructions executed so far
+    uint64_t budget;        // instructions the current vm_run() may still execute, compiled blocks count it down too
+    uint64_t clock_end;     // steps + budget when the current vm_run() started, see vm_clock()
+    uint32_t stop_at;       // vm_run() stops before executing this address, VM_NO_STOP to run through. Runs without the JIT
+    uint64_t* breakpoints;  // a bit for every address vm_run() stops before executing (like stop_at), NULL for none
+    uint64_t* watch_read;   // a bit for every address vm_run() stops after a load from, NULL for none
+    uint64_t* watch_write;  // and after a store to. Traps (PUTS reading its string) do not count
+    int stop_reason;        // STOP_NONE unless the last vm_run() returned VM_STOPPED
+    uint16_t stop_address;  // the PC it stopped at, or the address a watchpoint caught
+    trap_handler* traps;    // the 256 trap handlers, NULL for standard_traps (see vm_set_trap())
+
+    vm_profile* profile;    // NULL unless vm_profile_start() was called. Runs without the JIT
+    vm_journal* journal;    // NULL unless vm_journal_start() was called, for vm_step_back(). Runs without the JIT too
+    vm_trace* trace;        // NULL unless vm_trace_start() was called (--trace). Also runs without the JIT
+    vm_metrics* metrics;    // NULL unless the --metrics endpoint is up, the JIT is fine with it
+
+    struct jit_state* jit;  // NULL until the JIT engine first runs
+    uint16_t* jit_counts;   // how many times execution entered a block at each address, only with the JIT
+    uint8_t* jit_code_map;  // number of compiled blocks covering each word, only with the JIT
+
+    vm_analysis* analysis;  // NULL unless vm_analyze() proved stores never write code and the proof still holds
+    uint64_t* data_words;   // a bit for every word an image said is data (see lc3_image.c), NULL if none did
+    const uint64_t* code_words; // a bit for every word the analysis found is code, NULL without vm->analysis
+
+    // input, see lc3_io.c
+    const io_backend* io;
+    const unsigned char* in_data;
+    size_t in_pos, in_len;
+    int in_eof;
+    int in_never_blocks;
+    unsigned char* in_owned;    // copy made by vm_set_input()
+    int in_can_wait;            // 1 if more input can come (vm_add_input()), GETC then stops the VM instead of reading EOF
+    uint64_t in_consumed;       // characters the program has read so far, a snapshot records it
+    uint64_t in_empty_polls;    // KBSR reads that found no key, how lc3_serve.c tells a program polling for one
+    uint64_t in_skip;           // characters to throw away before the next read, they went in before the snapshot was taken
+    struct trace_reader* replay;    // where io_replay gets the input from, see vm_replay()
+    vm_input_event* in_events;      // io_virtual: when each piece of in_data arrives
+    size_t in_event_count, in_event_cap;
+    size_t in_event_next;           // the first one that has not all been read
+
+    // output
+    char* out_buf;              // OUT_BUF_SIZE bytes, the OS only hands out the part the program prints into
+    size_t out_len;
+    long long out_last_flush;
+    int out_flush_ms;
+    int out_puts_write;
+    char* output;               // everything the program printed, for io_memory
+    size_t output_len, output_cap;
+
+    // the rest of the ISA, see the interrupts section below
+    int interrupts;         // 1 for working RTI, the PSR and the keyboard interrupt (--interrupts, and every core of --cores)
+    uint16_t psr;           // user mode in bit 15 and the priority in bits 10 to 8, the condition codes are in cond_value
+    uint16_t saved_ssp;     // R6 of supervisor mode while the program runs in user mode
+    uint16_t saved_usp;     // and R6 of user mode while a handler runs
+
+    vm_block* block;        // the file behind the block device, NULL unless vm_block_open() gave it one (--block)
+};
+
+// the word at address, without the side effects of mem_read()
+static inline uint16_t vm_peek(const VM* vm, uint16_t address){
+    return vm->pages[address >> PAGE_SHIFT]->words[address & (PAGE_WORDS - 1)];
+}
+
+// the device page always belongs to the VM itself, so its words can be written without going through mem_write()
+#define device_word(vm, address) ((vm)->pages[DEVICE_PAGE >> PAGE_SHIFT]->words[(address) & (PAGE_WORDS - 1)])
+
+// instructions executed so far, including the one running, while it runs. Engines that keep the budget in a local
+// write it back to vm->budget before anything that can look (see the timed loads in run_threaded())
+static inline uint64_t vm_clock(const VM* vm){
+    return vm->clock_end - vm->budget;
+}
+
+// the decoded slot of address
+static inline decoded_instr* vm_slot(const VM* vm, uint16_t address){
+    return &vm->pages[address >> PAGE_SHIFT]->decoded[address & (PAGE_WORDS - 1)];
+}
+
+vm_page* vm_own_page(VM* vm, int page);
+vm_page* vm_replace_page(VM* vm, int page);
+
+vm_template* vm_template_create(const VM* vm);
+void vm_template_destroy(vm_template* t);
+VM* vm_create_from(const vm_template* t);
+void vm_reset_to(VM* vm, const vm_template* t);
+
+VM* vm_create(void);
+void vm_destroy(VM* vm);
+void vm_reset(VM* vm);      // vm_reset_to() the template the VM was made from
+int vm_load_image(VM* vm, const char* path);    // .obj or native image, see lc3_image.c
+int vm_load_image_data(VM* vm, const unsigned char* data, size_t size);
+void read_image_file(VM* vm, FILE* file);
+uint16_t swap16(uint16_t x);
+void vm_set_input(VM* vm, const char* data, size_t size);
+void vm_add_input(VM* vm, const char* data, size_t size);
+int vm_run(VM* vm, uint64_t n_steps);
+void vm_set_breakpoint(VM* vm, uint16_t address, int on);
+void vm_clear_breakpoints(VM* vm);
+void vm_set_watchpoint(VM* vm, uint16_t address, int kinds);
+void vm_clear_watchpoints(VM* vm);
+
+int execute_trap(VM* vm, uint16_t instr);
+void run_switch(VM* vm);
+void run_threaded(VM* vm, int use_jit);
+
+void decode_instr(uint16_t instr, decoded_instr* d);
+const decoded_instr* decode_slot(VM* vm, uint16_t address, decoded_instr* scratch);
+void decode_page_word(vm_page* p, int i);
+const decoded_instr* unfuse(const decoded_instr* d, decoded_instr* scratch);
+void predecode_memory(VM* vm);
+
+uint16_t sign_extend(uint16_t x, int num_bits);
+uint16_t mem_read(VM* vm, uint16_t address);
+void mem_write(VM* vm, uint16_t address, uint16_t val);
+
+//interrupts----------------------------------------------------------------------------------
+
+/*
+The LC-3 has interrupts, but this VM leaves them out unless vm->interrupts is set: RTI and the reserved opcode do
+nothing, and a program that wants a key goes round a loop reading KBSR. With it set (--interrupts, and every core of
+--cores) the machine has the rest of the ISA:
+
+- the PSR, user or supervisor mode in bit 15 and the priority in bits 10 to 8. A program starts in user mode at
+  priority 0, with the supervisor stack at x3000. R6 of the mode the machine is not in is kept in saved_ssp/saved_usp
+- an interrupt or exception switches to the supervisor stack if it came in user mode, pushes the PSR (with the
+  condition codes in its low 3 bits) and then PC, and goes where the vector table entry for it says in supervisor
+  mode. The table starts at the address in MR_VECTORS, x0100 unless the program moves it
+- RTI pops PC and the PSR and goes back to the user stack if that is where they came from. In user mode it is the
+  privilege exception (vector x00) instead, and the reserved opcode is the illegal opcode exception (x01). Both keep
+  the priority the program was at
+- with KBSR_IE set in KBSR a key interrupts the program (vector x80, priority 4) whenever it is below priority 4. The
+  key is in KBDR when the handler starts, and KBSR_READY stays set (polls take no new key) until KBDR is read
+
+Interrupts come in between vm_run() slices: vm_run() looks at the keyboard when it starts, and runs INTERRUPT_SLICE
+instructions at most before it looks again, so a key waits well under a millisecond. A program with nothing to do
+but wait for the interrupt sits on a BRnzp to itself (x0FFF). When vm_run() finds it there it waits for the key
+instead of going round, or returns VM_WAITING_INPUT with vm->in_can_wait, and an RTI back to it ends the slice
+early (vm_run() returns VM_RUNNING) so the next one can do the same. At the end of the input the interrupt
+comes with xFFFF in KBDR, what GETC would read, so the program can turn it off.
+
+Memory protection (user mode reaching into system space) and the interrupts of other devices are not modelled.
+*/
+
+enum {
+    PSR_USER = 1 << 15,
+    PSR_PRIORITY = 7 << 8,
+    VECTOR_PRIVILEGE = 0x00,
+    VECTOR_ILLEGAL = 0x01,
+    VECTOR_KEYBOARD = 0x80,
+    KEYBOARD_PRIORITY = 4,
+    VECTORS_START = 0x0100,
+    SSP_START = 0x3000,         // the supervisor stack grows down from here
+    INTERRUPT_SLICE = 1 << 14   // instructions between looks at the keyboard
+};
+
+void vm_start_interrupts(VM* vm);
+int execute_system(VM* vm, uint16_t op);    // RTI and RES, the engines come here with PC past the instruction
+int take_interrupts(VM* vm);                // for vm_run(), 0 if the VM has to wait for input first
+
+//library interface (lc3_lib.c)----------------------------------------------------------------------------------
+
+/*
+Plain functions over the VM for bindings that cannot reach into the struct, like the ctypes one in lc3_debugger.py.
+Build the shared library with -DLC3_NO_MAIN, see the README.
+*/
+
+VM* lc3_create(void);
+int lc3_run_until(VM* vm, const uint16_t* breakpoints, int count, uint64_t max_steps);
+int lc3_status(const VM* vm);
+int lc3_stop_reason(const VM* vm);
+uint16_t lc3_stop_address(const VM* vm);
+uint64_t lc3_steps(const VM* vm);
+void lc3_read_regs(VM* vm, uint16_t* regs);
+void lc3_write_reg(VM* vm, int r, uint16_t val);
+void lc3_read_memory(const VM* vm, uint16_t start, uint16_t* words, uint32_t count);
+void lc3_write_memory(VM* vm, uint16_t start, const uint16_t* words, uint32_t count);
+size_t lc3_take_output(VM* vm, char* buf, size_t size);
+int lc3_take_dirty_pages(VM* vm, uint8_t* pages);
+int lc3_run_back(VM* vm, const uint16_t* breakpoints, int count, uint64_t max_steps);
+
+//snapshots (lc3_snapshot.c)----------------------------------------------------------------------------------
+
+int vm_save_snapshot(VM* vm, const char* path, const char* const* images, int image_count);
+int vm_restore_snapshot(VM* vm, const char* path);
+int vm_snapshot_images(const char* path, char*** images);
+uint64_t vm_memory_hash(const VM* vm);
+
+//profiler (lc3_profile.c)----------------------------------------------------------------------------------
+
+/*
+The engines only count control transfers (taken branches, jumps, calls and returns), each one adds to the counter
+of the address it came from and the one it went to. How often every address executed follows from those, an
+instruction runs as often as execution jumped to it plus as often as the one before it fell through, so the
+counting is off the straight-line path and the profile costs a few percent at most.
+*/
+
+enum {
+    PROFILE_STACK = 1024,   // calls deeper than this are counted but not followed in the call graph
+    PROFILE_ARCS = 1 << 13
+};
+
+struct vm_profile {
+    uint64_t taken[MAX_MEMORY];     // transfers out of each address
+    int64_t entries[MAX_MEMORY];    // transfers into each address, +1 where a vm_run() starts and -1 where it stops
+    uint64_t kbsr_polls;
+    uint64_t last_word_runs;        // executions of the word at xFFFF, from which execution falls through to x0000
+    int started;
+    uint16_t entry;                 // PC of the first vm_run(), the root of the call graph
+
+    // call graph: a shadow stack of the routines called, and how often each routine called each other one
+    struct { uint16_t routine, ret; } stack[PROFILE_STACK];
+    int depth;
+    uint64_t lost_depth;            // calls made while the shadow stack was full
+    struct { uint32_t arc; uint64_t count; } arcs[PROFILE_ARCS];  // arc: caller << 16 | callee, count 0 for a free slot
+};
+
+static inline void profile_jump(vm_profile* p, uint16_t from, uint16_t to){
+    p->taken[from]++;
+    p->entries[to]++;
+}
+
+void profile_call(vm_profile* p, uint16_t from, uint16_t to);     // JSR/JSRR
+void profile_return(vm_profile* p, uint16_t from, uint16_t to);   // JMP R7 (RET)
+
+int vm_profile_start(VM* vm);
+void vm_profile_report(VM* vm, FILE* out);
+
+//reverse execution (lc3_journal.c)----------------------------------------------------------------------------------
+
+int vm_journal_start(VM* vm, size_t bytes);
+void vm_journal_stop(VM* vm);
+void vm_journal_clear(VM* vm);
+uint64_t vm_journal_steps(const VM* vm);
+uint64_t vm_step_back(VM* vm, uint64_t n_steps);
+int vm_run_back(VM* vm, uint64_t n_steps);
+
+void journal_record(VM* vm, uint16_t pc, uint16_t cond_value, const decoded_instr* d);    // for the engines
+void journal_trap(VM* vm, uint16_t instr);                                                  // for execute_trap()
+
+//execution traces (lc3_trace.c)----------------------------------------------------------------------------------
+
+/*
+A trace is what every instruction did, written while the program runs: the value each register write left, whether
+each branch was taken and where each jump went, and all the input. The engines put it into a ring and a writer
+thread takes it out to the file, so the part that runs for every instruction is here where they can inline it.
+
+An instruction's results only show once it has run, so trace_step() writes down the last instruction's results
+before it notes down what the next one is about to do.
+*/
+
+enum {
+    TRACE_RING = 1 << 22,       // bytes between the engines and the writer thread
+    TRACE_CHUNK = 1 << 16,      // the writer gets them this many at a time
+    TRACE_MAX_RECORD = 16       // most bytes one instruction can add, with the input it reads
+};
+
+enum { TRACE_NONE = 0, TRACE_REG, TRACE_BRANCH, TRACE_JUMP };
+
+struct trace_writer;
+
+struct vm_trace {
+    unsigned char* ring;        // TRACE_RING bytes
+    uint64_t head;              // bytes put into the ring so far
+    uint64_t limit;             // the end of the chunk being filled, trace_chunk() runs when head gets there
+    uint64_t bits_at;           // the byte the taken bits of the current group of branches go into
+    int bits;                   // branches in that group so far, 0 to 7
+    uint8_t kind;               // what the last instruction left to write down, TRACE_NONE to TRACE_JUMP
+    uint8_t reg;                // the register it writes
+    uint16_t old;               // what was in it before
+    uint16_t next;              // the address after it
+    uint64_t count;             // instructions started
+    struct trace_writer* writer;
+};
+
+void trace_chunk(vm_trace* t);
+void trace_input(vm_trace* t, uint16_t value);   // for check_key() and io_getchar()
+
+// what an instruction leaves for the trace: the register it writes for ADD, AND, NOT, LEA, the loads and the traps
+// (DR, which is R0 for a TRAP), the taken bit for BR, the target for JMP/JSR/JSRR, nothing for the stores
+static inline uint8_t trace_kind(int op){
+    static const uint8_t kinds[16] = {
+        [BR] = TRACE_BRANCH, [ADD] = TRACE_REG, [LD] = TRACE_REG, [JSR] = TRACE_JUMP, [AND] = TRACE_REG,
+        [LDR] = TRACE_REG, [NOT] = TRACE_REG, [LDI] = TRACE_REG, [JMP] = TRACE_JUMP, [LEA] = TRACE_REG,
+        [TRAP] = TRACE_REG
+    };
+    return kinds[op & 15];
+}
+
+// varint, 7 bits a byte starting with the low ones
+static inline void trace_put(vm_trace* t, uint16_t v){
+    while (v >= 0x80){
+        t->ring[t->head++ & (TRACE_RING - 1)] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    t->ring[t->head++ & (TRACE_RING - 1)] = (unsigned char)v;
+}
+
+// a 16 bit difference with the sign moved to the bottom bit, so small negative ones fit in a byte too
+static inline uint16_t trace_zigzag(uint16_t delta){
+    return (uint16_t)((delta << 1) ^ (0 - (delta >> 15)));
+}
+
+// the results of the last instruction, with the registers and PC it left behind
+static inline void trace_results(vm_trace* t, const uint16_t* reg, uint16_t pc){
+    if (t->head >= t->limit){
+        trace_chunk(t);
+    }
+    switch (t->kind){
+        case TRACE_REG:
+            trace_put(t, trace_zigzag(reg[t->reg] - t->old));
+            break;
+        case TRACE_JUMP:
+            trace_put(t, trace_zigzag(pc - t->next));
+            break;
+        case TRACE_BRANCH:
+            if (!t->bits){
+                t->bits_at = t->head++;
+                t->ring[t->bits_at & (TRACE_RING - 1)] = 0;
+            }
+            t->ring[t->bits_at & (TRACE_RING - 1)] |= (unsigned char)((pc != t->next) << t->bits);
+            t->bits = (t->bits + 1) & 7;
+            break;
+    }
+}
+
+// for the engines, before the instruction d at pc runs
+static inline void trace_step(vm_trace* t, const uint16_t* reg, uint16_t pc, const decoded_instr* d){
+    trace_results(t, reg, pc);
+    t->kind = trace_kind(d->op);
+    t->reg = d->r0 & 7;
+    t->old = reg[d->r0 & 7];
+    t->next = pc + 1;
+    t->count++;
+}
+
+int vm_trace_start(VM* vm, const char* path, const char* const* images, int image_count);
+int vm_trace_stop(VM* vm, int complete);
+int vm_trace_images(const char* path, char*** images);
+int vm_replay(VM* vm, const char* path, FILE* report);
+
+//store analysis (lc3_analysis.c)----------------------------------------------------------------------------------
+
+int vm_analyze(VM* vm, int* stores);    // proves stores safe for the run from PC, returns how many
+void vm_analysis_stop(VM* vm);
+int vm_analysis_follow(VM* vm, const uint64_t* code);          // proves nothing, for lc3_aot.c
+void analysis_reached(VM* vm, uint32_t start, uint32_t end);   // for decode_slot() and jit_compile()
+void analysis_page_owned(VM* vm, int page);                     // for vm_own_page()
+int analysis_is_code(const VM* vm, uint16_t address);
+void analysis_jit_started(VM* vm);                              // for jit_init()
+
+// for everything that writes memory but the proved stores, before it writes the word at address (see lc3_analysis.c)
+static inline void analysis_written(VM* vm, uint16_t address){
+    if (vm->code_words && (vm->code_words[address >> 6] >> (address & 63)) & 1){
+        vm_analysis_stop(vm);
+    }
+}
+
+// a store vm_analyze() proved never writes code, to a page the VM has its own copy of: only the word changes
+static inline void mem_write_data(VM* vm, uint16_t address, uint16_t val){
+    vm->page_dirty[address >> PAGE_SHIFT] = 1;
+    vm->pages[address >> PAGE_SHIFT]->words[address & (PAGE_WORDS - 1)] = val;
+}
+
+//jit compiler (lc3_jit.c)----------------------------------------------------------------------------------
+
+enum { JIT_THRESHOLD = 64 };  // a block gets compiled the 64th time execution enters it
+
+int jit_init(VM* vm);
+void jit_free(VM* vm);
+void jit_flush(VM* vm);
+void jit_compile(VM* vm, uint16_t start);
+uint16_t jit_execute(VM* vm, uint16_t block);      // runs a block, counting vm->budget down
+uint16_t jit_block_len(VM* vm, uint16_t block);    // most instructions one pass through the block can execute
+const decoded_instr* jit_entry_instr(VM* vm, uint16_t block);
+void jit_invalidate(VM* vm, uint16_t address);
+
+//batch runner (lc3_batch.c)----------------------------------------------------------------------------------
+
+typedef struct {
+    const char* image_path;
+    const char* input;      // what the program reads, NULL for no input
+    size_t input_len;
+
+    // filled in by batch_run()
+    int loaded;             // 0 if the image could not be read, nothing below is set then
+    int status;             // VM_HALTED, or VM_RUNNING if max_steps ran out first
+    uint64_t steps;
+    char* output;           // everything the program printed, malloc'ed, the caller frees it
+    size_t output_len;
+} batch_job;
+
+int batch_run(batch_job* jobs, int job_count, int threads, int engine, uint64_t max_steps);
+int batch_main(const char* job_list, const char* const* images, int image_count, int threads, int engine, uint64_t max_steps);
+int cpu_count(void);    // processors online, at least 1
+
+//differential fuzzer (lc3_fuzz.c)----------------------------------------------------------------------------------
+
+enum { FUZZ_INPUT_MAX = 8 };
+
+void fuzz_case(VM* vm, uint32_t seed, char* input, size_t* input_len);  // the random program of case seed
+int fuzz_main(uint64_t cases, uint32_t seed, int threads, uint64_t max_steps, const char* snapshot_path);
+
+//session server (lc3_serve.c)----------------------------------------------------------------------------------
+
+int serve_main(VM* vm, const char* address, int threads, uint64_t max_steps, int host_traps);
+
+//block device (lc3_block.c)----------------------------------------------------------------------------------
+
+/*
+Reading a big input through GETC or KBDR costs a trap (or a load and a poll) for every byte. With a file opened by
+vm_block_open() (--block=FILE) the registers from MR_BLOCK_BUFFER to MR_BLOCK_SIZE_HIGH are a block device instead:
+the program says where the words go, how many and where in the file they come from, and one store to
+MR_BLOCK_CONTROL copies them out of the mapped file into memory, without the program running an instruction for
+any of them.
+
+    BLOCK_READ          a byte of the file to every word, zero extended, the way GETC reads them
+    BLOCK_READ_PACKED   two bytes to every word, the first in the low half, the way PUTSP packs them
+
+The transfer is done when the store is, so BLOCK_DONE is already set when the next instruction reads MR_BLOCK_STATUS
+(a program written for a device that takes its time polls it anyway). It stops short at the end of the file, with
+BLOCK_END set and the words it got to in MR_BLOCK_COUNT. A command it does not know, or a buffer that would run into
+the device page, fills nothing and sets BLOCK_FAILED. Only the first 4GB of a file can be reached.
+
+Without a file the registers are ordinary words and MR_BLOCK_STATUS reads 0, which is how a program tells there is
+no device. The words a transfer fills are written the way mem_write() writes them, so it can load code as well.
+*/
+enum {
+    BLOCK_READ = 1,
+    BLOCK_READ_PACKED = 2
+};
+
+enum {
+    BLOCK_DONE = 1 << 15,   // the device has a file and is not busy, the last transfer (if any) is done
+    BLOCK_END = 1 << 1,     // the last transfer got to the end of the file
+    BLOCK_FAILED = 1 << 0   // and it did nothing, see above
+};
+
+int vm_block_open(VM* vm, const char* path);    // 0 if it cannot be read
+void vm_block_close(VM* vm);
+void block_reset(VM* vm);                       // for vm_reset_to(), the registers a file starts with
+void block_control(VM* vm, uint16_t command);   // for mem_write(), a store to MR_BLOCK_CONTROL
+
+//multi-core machine (lc3_cores.c)----------------------------------------------------------------------------------
+
+int cores_main(VM* vm, int cores, uint64_t max_steps, int stats);
+
+//live metrics (lc3_metrics.c)----------------------------------------------------------------------------------
+
+enum { METRICS_SLICE = 1 << 20 };   // instructions between updates of the count while a VM with metrics runs
+
+int metrics_serve(int port);        // the endpoint on 127.0.0.1:port, every VM created afterwards counts
+int vm_metrics_start(VM* vm);       // counts a VM made before that
+void vm_metrics_stop(VM* vm);
+int metrics_run(VM* vm, uint64_t n_steps);  // for vm_run()
+
+// for the VM's own thread, with vm->metrics set
+void metrics_instructions(vm_metrics* m, uint64_t n);
+void metrics_trap(vm_metrics* m, uint8_t vector);
+void metrics_kbsr_poll(vm_metrics* m);
+void metrics_output(vm_metrics* m, size_t bytes);
+uint64_t metrics_wait_start(vm_metrics* m);
+void metrics_wait_end(vm_metrics* m, uint64_t started);
+
+//ahead of time translation (lc3_aot.c)----------------------------------------------------------------------------------
+
+/*
+lc3 --aot=FILE.c writes a program out as C, and built with the VM sources that C is a program of its own. What the
+translator writes is an aot_program for aot_main(): the words of the image, the registers it starts with and run(),
+the translated code.
+*/
+
+typedef struct {
+    uint16_t start;
+    uint16_t count;
+    const uint16_t* words;
+} aot_segment;
+
+typedef struct {
+    const aot_segment* segments;    // the memory the program starts with, zero everywhere else
+    int segment_count;
+    const uint64_t* code;           // a bit for every word run() has a translation of, MAX_MEMORY / 64 of them
+    const uint16_t* entries;        // the addresses run() can start at, the rest is left to the interpreter
+    int entry_count;
+    uint16_t reg[R_COUNT];
+    uint16_t cond_value;
+    int host_traps;                 // translated with --host-traps, so it runs with them
+    int (*run)(VM* vm);             // from PC in vm->reg, one of entries. Returns AOT_LEFT or AOT_REWRITTEN
+} aot_program;
+
+enum {
+    AOT_LEFT = 0,       // the program halted, or went somewhere run() cannot follow it (PC is there)
+    AOT_REWRITTEN       // it wrote over translated code, from now on the interpreter runs it
+};
+
+int aot_translate(VM* vm, const char* path, const char* const* images, int image_count);
+int aot_main(const aot_program* p, int argc, const char* argv[]);
+int aot_code_changed(VM* vm);   // for run(), after a trap that can write memory
+
+static inline int aot_is_code(const uint64_t* code, uint16_t address){
+    return (code[address >> 6] >> (address & 63)) & 1;
+}
+
+// mem_read() for run(), inline for the words where it does nothing but read one
+static inline uint16_t aot_load(VM* vm, uint16_t address){
+    return address == MR_KBSR ? mem_read(vm, address) : vm_peek(vm, address);
+}
+
+/*
+mem_write() for run(), for words it knows are not translated code. A translated program runs without the JIT and
+without the store analysis, so all that is left to do is the word and its decoded slot (for the interpreter). The
+dirty bit is left alone, aot_code_changed() goes by it
+*/
+static inline void aot_store(VM* vm, uint16_t address, uint16_t val){
+    int page = address >> PAGE_SHIFT;
+    if (!vm->page_owned[page]){
+        mem_write(vm, address, val);  // the first write to it, the VM gets its own copy
+        return;
+    }
+    vm->pages[page]->words[address & (PAGE_WORDS - 1)] = val;
+    vm->pages[page]->decoded[address & (PAGE_WORDS - 1)].op = OP_DECODE;
+}
+
+#endif
@@ -0,0 +1,277 @@
+#!/usr/bin/env python3
+"""
+LC-3 Linker
+Links modules from assemble.py --relocatable into one image for the VM.
+
+    python assemble.py --relocatable main.asm main.lo
+    python assemble.py --relocatable strings.asm strings.lo
+    python link.py main.lo strings.lo program.obj
+
+The first section of the first module is the entry point and goes at the origin (x3000, or --origin), everything
+else goes wherever the layout puts it. Labels resolve to the module's own labels first and then to the .GLOBAL
+labels of all the modules, a .GLOBAL label defined twice is an error.
+
+Sections nothing refers to are left out: starting from the entry section, the linker keeps every section a kept one
+refers to (or carries on into, see "open" in assemble.py), so a module of library routines can be linked into every
+program and only the routines a program calls end up in it. --keep-all keeps everything.
+
+The layout then puts sections that refer to each other close together, so the 9 bit offsets of BR, LD, ST, LDI,
+STI and LEA (256 words either way) and the 11 bit one of JSR (1024) reach, and a program does not need LDI or JSRR
+through a pointer to get to a routine far away. It works like Pettis and Hansen's: every section starts as a chain
+of its own, and going through the pairs of sections from the most references between them down, the two chains get
+joined in the order that puts the pair nearest (the entry stays in front, with the other chain after it or right
+behind the entry section). PC-relative references count four times as much as .FILLs of a
+label, and 9 bit ones twice as much as JSR's. If a reference does not reach in that layout the one the modules came
+in gets tried too, and if that does not do it either the linker says which references are too far apart.
+"""
+
+import sys
+import os
+import json
+import struct
+from typing import Dict, List, Optional, Tuple
+
+from assemble import LC3Assembler
+
+DEFAULT_ORIGIN = 0x3000
+BITS = {'pc9': 9, 'pc11': 11, 'abs16': 16}
+WEIGHT = {'pc9': 8, 'pc11': 4, 'abs16': 1}
+
+
+def fail(message: str) -> None:
+    print(f"Error: {message}", file=sys.stderr)
+    sys.exit(1)
+
+
+class Section:
+    """One section of one module"""
+
+    def __init__(self, module: 'Module', index: int, name: str, words: List[int], open_end: bool):
+        self.module, self.index, self.name = module, index, name
+        self.words, self.open_end = words, open_end
+        self.relocations: List[Tuple[int, str, 'Section', int]] = []  # offset, kind, target section and offset there
+        self.address = 0
+        self.atom: Optional['Atom'] = None
+
+    def label(self) -> str:
+        return f"{self.module.name}:{self.name}"
+
+
+class Module:
+    """A module from assemble.py --relocatable"""
+
+    def __init__(self, path: str):
+        self.path = path
+        self.name = os.path.splitext(os.path.basename(path))[0]
+        try:
+            with open(path) as f:
+                data = json.load(f)
+        except (OSError, ValueError) as e:
+            fail(f"cannot read module {path}: {e}")
+        if not isinstance(data, dict) or data.get('format') != 'lc3-relocatable' or data.get('version') != 1:
+            fail(f"not a relocatable module: {path} (assemble it with assemble.py --relocatable)")
+        self.data = data
+        self.sections = []
+        for i, s in enumerate(data['sections']):
+            words = bytes.fromhex(s['words'])
+            self.sections.append(Section(self, i, s['name'], list(struct.unpack(f'>{len(words) // 2}H', words)),
+                                         bool(s['open'])))
+        self.symbols: Dict[str, Tuple[int, int]] = {label: (at[0], at[1]) for label, at in data['symbols'].items()}
+        self.externals = set(data['externals'])
+
+
+class Atom:
+    """Sections that have to stay together in this order: each one but the last carries on into the next"""
+
+    def __init__(self, sections: List[Section]):
+        self.sections = sections
+        self.size = sum(len(s.words) for s in sections)
+        for s in sections:
+            s.atom = self
+
+
+def resolve(modules: List[Module]) -> None:
+    """Works out which section and offset every relocation refers to"""
+    global_symbols: Dict[str, Tuple[Module, int, int]] = {}
+    for m in modules:
+        for label in m.data['globals']:
+            if label in global_symbols:
+                fail(f"{label} is defined in {global_symbols[label][0].path} and in {m.path}")
+            section, offset = m.symbols[label]
+            global_symbols[label] = (m, section, offset)
+    for m in modules:
+        for section, offset, kind, label in m.data['relocations']:
+            if label in m.symbols and label not in m.externals:
+                target, target_offset = m, m.symbols[label]
+            elif label in global_symbols:
+                target, *target_offset = global_symbols[label]
+            else:
+                fail(f"undefined label {label}, used in {m.path}")
+            m.sections[section].relocations.append(
+                (offset, kind, target.sections[target_offset[0]], target_offset[1]))
+
+
+def make_atoms(modules: List[Module]) -> List[Atom]:
+    atoms = []
+    for m in modules:
+        run: List[Section] = []
+        for s in m.sections:
+            run.append(s)
+            if not s.open_end:
+                atoms.append(Atom(run))
+                run = []
+        if run:
+            atoms.append(Atom(run))  # the module ends in code that carries on into whatever comes next
+    return atoms
+
+
+def reachable(entry: Atom) -> List[Atom]:
+    """The atoms the entry atom refers to, and the ones they refer to, and so on"""
+    seen = {id(entry): entry}
+    todo = [entry]
+    while todo:
+        atom = todo.pop()
+        for s in atom.sections:
+            for _, _, target, _ in s.relocations:
+                if id(target.atom) not in seen:
+                    seen[id(target.atom)] = target.atom
+                    todo.append(target.atom)
+    return list(seen.values())
+
+
+def chain_layout(atoms: List[Atom], entry: Atom) -> List[Atom]:
+    """Pettis-Hansen style: joins chains of atoms along the heaviest references first, the entry atom stays first"""
+    weights: Dict[Tuple[int, int], int] = {}
+    index = {id(a): i for i, a in enumerate(atoms)}
+    for a in atoms:
+        for s in a.sections:
+            for _, kind, target, _ in s.relocations:
+                b = target.atom
+                if b is not a:
+                    pair = (min(index[id(a)], index[id(b)]), max(index[id(a)], index[id(b)]))
+                    weights[pair] = weights.get(pair, 0) + WEIGHT[kind]
+
+    chains: Dict[int, List[Atom]] = {i: [a] for i, a in enumerate(atoms)}
+    chain_of = {i: i for i in range(len(atoms))}
+
+    def gap(order: List[Atom], x: Atom, y: Atom) -> int:
+        """Words between the middles of x and y in order"""
+        at, middle = 0, {}
+        for a in order:
+            middle[id(a)] = at + a.size // 2
+            at += a.size
+        return abs(middle[id(x)] - middle[id(y)])
+
+    for (i, j), _ in sorted(weights.items(), key=lambda item: (-item[1], item[0])):
+        ci, cj = chain_of[i], chain_of[j]
+        if ci == cj:
+            continue
+        if entry in chains[cj]:
+            ci, cj = cj, ci
+        a, b = chains[ci], chains[cj]
+        candidates = [a + b, a + b[::-1], a[::-1] + b, a[::-1] + b[::-1], b + a, b[::-1] + a, b + a[::-1]]
+        if a[0] is entry:
+            # the entry cannot move from the front, but what comes after it can go further back
+            candidates = [c for c in candidates if c[0] is entry] + [a[:1] + b + a[1:], a[:1] + b[::-1] + a[1:]]
+        best = min(candidates, key=lambda c: gap(c, atoms[i], atoms[j]))
+        chains[ci] = best
+        del chains[cj]
+        for atom in b:
+            chain_of[index[id(atom)]] = ci
+
+    # the entry chain first, then the others the way the modules had them
+    ordered = sorted(chains.values(), key=lambda c: (entry not in c, min(index[id(a)] for a in c)))
+    return [a for c in ordered for a in c]
+
+
+def place(order: List[Atom], origin: int) -> int:
+    at = origin
+    for atom in order:
+        for s in atom.sections:
+            s.address = at
+            at += len(s.words)
+    return at - origin
+
+
+def patch(order: List[Atom]) -> Tuple[List[int], List[str]]:
+    """The words of the image, and a message for every reference that does not reach"""
+    words: List[int] = []
+    too_far = []
+    for atom in order:
+        for s in atom.sections:
+            patched = list(s.words)
+            for offset, kind, target, target_offset in s.relocations:
+                value = target.address + target_offset
+                bits = BITS[kind]
+                if bits == 16:
+                    patched[offset] = (patched[offset] | value) & 0xFFFF
+                    continue
+                delta = value - (s.address + offset + 1)
+                limit = 1 << (bits - 1)
+                if not -limit <= delta < limit:
+                    too_far.append(f"{s.label()}+{offset} ({kind}) cannot reach {target.label()}+{target_offset}: "
+                                   f"{delta} words away, at most {limit - 1 if delta > 0 else limit}")
+                    continue
+                patched[offset] |= delta & ((1 << bits) - 1)
+            words.extend(patched)
+    return words, too_far
+
+
+def main() -> None:
+    args = sys.argv[1:]
+    native = '--native' in args  # write a native image instead of a .obj file
+    if native:
+        args.remove('--native')
+    keep_all = '--keep-all' in args
+    if keep_all:
+        args.remove('--keep-all')
+    origin = DEFAULT_ORIGIN
+    for arg in [arg for arg in args if arg.startswith('--origin=')]:
+        origin = LC3Assembler().parse_number(arg[9:])
+        args.remove(arg)
+    if len(args) < 2:
+        print("Usage: python link.py [--native] [--origin=ADDR] [--keep-all] <module.lo> ... <output.obj>",
+              file=sys.stderr)
+        sys.exit(1)
+    output_file = args[-1]
+
+    modules = [Module(path) for path in args[:-1]]
+    resolve(modules)
+    atoms = make_atoms(modules)
+    entry = modules[0].sections[0].atom
+    used = {id(a) for a in reachable(entry)}
+    kept = [a for a in atoms if keep_all or id(a) in used]  # in the order the modules had them
+
+    layout = chain_layout(kept, entry)
+    size = place(layout, origin)
+    words, too_far = patch(layout)
+    if too_far:
+        layout = kept
+        size = place(layout, origin)
+        words, also_too_far = patch(layout)
+        if also_too_far:
+            fail("references out of range:\n    " + "\n    ".join(too_far))
+    if origin + size > 0x10000:
+        fail(f"the program is {size} words, it does not fit from x{origin:04X} on")
+
+    writer = LC3Assembler()
+    writer.segments = [(origin, words)]
+    writer.code_words = set(range(origin, origin + size))  # modules do not say which words are data, so none are
+    if native:
+        writer.write_native_file(output_file)
+    else:
+        writer.write_obj_file(output_file)
+
+    sections = [s for a in atoms for s in a.sections]
+    left_out = [s.label() for a in atoms if a not in kept for s in a.sections]
+    print(f"Link successful: {len(modules)} modules -> {output_file} ({size} words at x{origin:04X})")
+    print(f"\nSections: {len(sections) - len(left_out)} of {len(sections)} kept")
+    for atom in layout:
+        for s in atom.sections:
+            print(f"  x{s.address:04X}  {len(s.words):5} words  {s.label()}")
+    if left_out:
+        print("Left out: " + ", ".join(left_out))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+"""
+Checks lc3 --aot on the programs in this directory.
+
+Every aot_*.asm gets assembled to a native image, run on the switch interpreter, translated to C and built with the
+VM sources, and the translated binary has to print what the interpreter did. The programs are the ones translated
+code got wrong once: each says at the top what it does to run().
+
+    gcc -O2 -o lc3_vm lc3_vm.c lc3_io.c ... -lpthread   (see README.md)
+    python3 tests/aot.py                              all the programs, exits 1 if one prints something else
+    python3 tests/aot.py --vm=PATH --cc=clang         another VM or C compiler
+"""
+
+import argparse
+import glob
+import os
+import subprocess
+import sys
+import tempfile
+
+TESTS_DIR = os.path.dirname(os.path.abspath(__file__))
+REPO_DIR = os.path.dirname(TESTS_DIR)
+
+SOURCES = ['lc3_vm.c', 'lc3_io.c', 'lc3_jit.c', 'lc3_batch.c', 'lc3_image.c', 'lc3_snapshot.c', 'lc3_profile.c',
+           'lc3_journal.c', 'lc3_trace.c', 'lc3_traps.c', 'lc3_analysis.c', 'lc3_fuzz.c', 'lc3_metrics.c',
+           'lc3_serve.c', 'lc3_aot.c', 'lc3_cores.c', 'lc3_block.c']
+
+
+def run(command, what: str) -> bytes:
+    """Runs command with no input and returns what it printed, exits if it failed"""
+    done = subprocess.run(command, stdin=subprocess.DEVNULL, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                          timeout=120)
+    if done.returncode != 0:
+        sys.exit(f"failed to {what}: {done.stdout.decode(errors='replace').strip()}")
+    return done.stdout
+
+
+def check(source: str, args: argparse.Namespace, out_dir: str) -> bool:
+    name = os.path.splitext(os.path.basename(source))[0]
+    image = os.path.join(out_dir, name + '.img')
+    c_file = os.path.join(out_dir, name + '.c')
+    binary = os.path.join(out_dir, name)
+    run([sys.executable, os.path.join(REPO_DIR, 'assemble.py'), '--native', source, image], f"assemble {source}")
+    expected = run([args.vm, '--engine=switch', '--io=headless', image], f"run {name}")
+    run([args.vm, f'--aot={c_file}', image], f"translate {name}")
+    run([args.cc, '-O2', '-DLC3_NO_MAIN', '-I', REPO_DIR, '-o', binary, c_file]
+        + [os.path.join(REPO_DIR, s) for s in SOURCES] + ['-lpthread'], f"build {name}")
+    got = run([binary, '--io=headless'], f"run the translated {name}")
+    if got != expected:
+        print(f"{name}: the translated binary printed {got!r}, the interpreter {expected!r}")
+        return False
+    print(f"{name}: ok")
+    return True
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description="lc3 --aot on the programs in tests/")
+    parser.add_argument('--vm', default=os.path.join(REPO_DIR, 'lc3_vm'), help="the C VM (default: ./lc3_vm)")
+    parser.add_argument('--cc', default='gcc', help="the C compiler the translations get built with")
+    args = parser.parse_args()
+    if not os.access(args.vm, os.X_OK):
+        parser.error(f"no VM at {args.vm} (build it as README.md says, or pass --vm=PATH)")
+
+    failed = 0
+    with tempfile.TemporaryDirectory() as out_dir:
+        for source in sorted(glob.glob(os.path.join(TESTS_DIR, 'aot_*.asm'))):
+            failed += not check(source, args, out_dir)
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,18 @@
+; run() leaves to a word the analysis never saw (the .FILL, which the native image says is data), and the
+; interpreter runs it: ADD R1,R1,#-12 moves the pointer the STR at L was proved with onto the PUTS, which it
+; overwrites with a HALT. The translated binary has to stop trusting the proof and print nothing but HALT
+.ORIG x3000
+        LEA R1,BUF
+        LEA R3,L
+        LD R0,NEWI
+        AND R2,R2,#0
+        BRnp L
+        .FILL x1274         ; ADD R1,R1,#-12
+L:      STR R0,R1,#0
+        LEA R0,MSG
+        PUTS
+        HALT
+MSG:    .STRINGZ "printed\n"
+NEWI:   .FILL xF025         ; HALT
+BUF:    .BLKW 1
+.END